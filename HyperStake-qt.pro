@@ -159,15 +159,21 @@ HEADERS += src/qt/bitcoingui.h \
     src/bip38.h \
     src/bignum.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
+    src/coins.h \
+    src/headerssync.h \
     src/sync.h \
     src/util.h \
     src/uint256.h \
     src/kernel.h \
+    src/kernelhash.h \
     src/scrypt_mine.h \
     src/pbkdf2.h \
     src/serialize.h \
+    src/sha256.h \
+    src/sigcache.h \
     src/main.h \
     src/net.h \
     src/key.h \
@@ -201,6 +207,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/transactionview.h \
     src/qt/walletmodel.h \
     src/bitcoinrpc.h \
+    src/blockverifier.h \
+    src/kvstore.h \
+    src/lsm.h \
     src/qt/blockbrowser.h \
     src/qt/charitydialog.h \
     src/qt/overviewpage.h \
@@ -294,6 +303,10 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/key.cpp \
     src/scrypt.cpp \
     src/script.cpp \
+    src/sha256.cpp \
+    src/sigcache.cpp \
+    src/coins.cpp \
+    src/headerssync.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
@@ -304,6 +317,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/wallet.cpp \
     src/keystore.cpp \
     src/bitcoinrpc.cpp \
+    src/blockverifier.cpp \
+    src/lsm.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
@@ -314,6 +329,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/protocol.cpp \
     src/noui.cpp \
     src/kernel.cpp \
+    src/kernelhash.cpp \
+    src/hashblock.cpp \
     src/pbkdf2.cpp \
     src/blake.c \
     src/bmw.c \
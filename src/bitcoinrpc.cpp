@@ -237,6 +237,9 @@ static const CRPCCommand vRPCCommands[] =
     { "sendmany",               &sendmany,               false,  false },
     { "addmultisigaddress",     &addmultisigaddress,     false,  false },
     { "getrawmempool",          &getrawmempool,          true,   false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,   true  },
+    { "gettxindexcacheinfo",    &gettxindexcacheinfo,    true,   true  },
+    { "getcheckblocksinfo",     &getcheckblocksinfo,     true,   true  },
     { "getblock",               &getblock,               false,  false },
     { "getblockbynumber",       &getblockbynumber,       false,  false },
     { "getblockhash",           &getblockhash,           false,  false },
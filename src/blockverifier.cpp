@@ -0,0 +1,296 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockverifier.h"
+#include "db.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+using namespace std;
+
+CBlockVerifier blockVerifier;
+
+CBlockVerifier::CBlockVerifier()
+{
+    nNext = 0;
+    nChecked = 0;
+    nLevel = 0;
+    nThreads = 0;
+    nRunning = 0;
+    fInterrupt = false;
+    nStartTime = 0;
+    nEndTime = 0;
+    fCorrupt = false;
+}
+
+bool CBlockVerifier::Start(int nDepth, int nLevelIn, int nThreadsIn)
+{
+    LOCK(cs);
+    if (nRunning > 0)
+        return false;
+
+    if (nDepth <= 0 || nDepth > nBestHeight)
+        nDepth = nBestHeight;
+    vBlocks.clear();
+    vBad.clear();
+    mapBlockPos.clear();
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    {
+        if (pindex->nHeight < nBestHeight - nDepth)
+            break;
+        vBlocks.push_back(pindex);
+        mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
+    }
+    nNext = 0;
+    nChecked = 0;
+    nLevel = nLevelIn;
+    nThreads = max(1, min(nThreadsIn, (int)vBlocks.size()));
+    fInterrupt = false;
+    fCorrupt = false;
+    nStartTime = nEndTime = GetTimeMillis();
+    printf("Verifying last %u blocks at level %i on %d threads\n", (unsigned int)vBlocks.size(), nLevel, nThreads);
+    if (vBlocks.empty())
+        return true;
+
+    nRunning = nThreads;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockVerifier::ThreadVerify, this));
+    return true;
+}
+
+void CBlockVerifier::Interrupt()
+{
+    LOCK(cs);
+    fInterrupt = true;
+}
+
+void CBlockVerifier::Wait()
+{
+    threadGroup.join_all();
+}
+
+bool CBlockVerifier::IsCorrupt() const
+{
+    LOCK(cs);
+    return fCorrupt;
+}
+
+CBlockVerifierStatus CBlockVerifier::GetStatus() const
+{
+    LOCK(cs);
+    CBlockVerifierStatus status;
+    status.fRunning = nRunning > 0;
+    status.nLevel = nLevel;
+    status.nThreads = nThreads;
+    status.nBlocks = vBlocks.size();
+    status.nChecked = nChecked;
+    status.nBad = vBad.size();
+    status.fCorrupt = fCorrupt;
+    status.nElapsed = (nRunning > 0 ? GetTimeMillis() : nEndTime) - nStartTime;
+    return status;
+}
+
+CBlockIndex* CBlockVerifier::GetNext()
+{
+    LOCK(cs);
+    if (fInterrupt || fShutdown || nNext >= vBlocks.size())
+        return NULL;
+    return vBlocks[nNext++];
+}
+
+bool CBlockVerifier::IsInMainChain(const CDiskTxPos& txpos)
+{
+    // pick up blocks connected since the check started
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        if (!mapBlockPos.insert(make_pair(make_pair(pindex->nFile, pindex->nBlockPos), pindex)).second)
+            break;
+
+    map<pair<unsigned int, unsigned int>, CBlockIndex*>::iterator mi = mapBlockPos.find(make_pair(txpos.nFile, txpos.nBlockPos));
+    return mi != mapBlockPos.end() && mi->second->IsInMainChain();
+}
+
+bool CBlockVerifier::CheckTxIndex(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex)
+{
+    bool fOk = true;
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex))
+        {
+            // check level 3: checker transaction hashes
+            if (nLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+            {
+                // either an error or a duplicate transaction
+                CTransaction txFound;
+                if (!txFound.ReadFromDisk(txindex.pos))
+                {
+                    printf("CBlockVerifier : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
+                    fOk = false;
+                }
+                else
+                    if (txFound.GetHash() != hashTx) // not a duplicate tx
+                    {
+                        printf("CBlockVerifier : *** invalid tx position for %s\n", hashTx.ToString().c_str());
+                        fOk = false;
+                    }
+            }
+            // check level 4: check whether spent txouts were spent within the main chain
+            unsigned int nOutput = 0;
+            if (nLevel>3)
+            {
+                BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                {
+                    if (!txpos.IsNull())
+                    {
+                        if (!IsInMainChain(txpos))
+                        {
+                            printf("CBlockVerifier : *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
+                            fOk = false;
+                        }
+                        // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                        if (nLevel>5)
+                        {
+                            CTransaction txSpend;
+                            if (!txSpend.ReadFromDisk(txpos))
+                            {
+                                printf("CBlockVerifier : *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
+                                fOk = false;
+                            }
+                            else if (!txSpend.CheckTransaction())
+                            {
+                                printf("CBlockVerifier : *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
+                                fOk = false;
+                            }
+                            else
+                            {
+                                bool fFound = false;
+                                BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                    if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                        fFound = true;
+                                if (!fFound)
+                                {
+                                    printf("CBlockVerifier : *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
+                                    fOk = false;
+                                }
+                            }
+                        }
+                    }
+                    nOutput++;
+                }
+            }
+        }
+        // check level 5: check whether all prevouts are marked spent
+        if (nLevel>4)
+        {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            {
+                CTxIndex txindex;
+                if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                    if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                    {
+                        printf("CBlockVerifier : *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                        fOk = false;
+                    }
+            }
+        }
+    }
+    return fOk;
+}
+
+void CBlockVerifier::ThreadVerify()
+{
+    RenameThread("hyperstake-verify");
+    try
+    {
+        CTxDB txdb("r");
+        while (CBlockIndex* pindex = GetNext())
+        {
+            bool fBad = false;
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+            {
+                printf("CBlockVerifier : *** cannot read block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                fBad = true;
+            }
+            // check level 1: verify block validity
+            else if (nLevel>0 && !block.CheckBlock())
+            {
+                printf("CBlockVerifier : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                fBad = true;
+            }
+            // check level 2: verify transaction index validity, as long as
+            // the block is still in the best chain
+            else if (nLevel>1)
+            {
+                LOCK(cs_main);
+                if (pindex->IsInMainChain() && !CheckTxIndex(txdb, block, pindex))
+                    fBad = true;
+            }
+
+            LOCK(cs);
+            nChecked++;
+            if (fBad)
+            {
+                vBad.push_back(pindex);
+                fCorrupt = true;
+            }
+        }
+        txdb.Close();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadVerify()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadVerify()");
+    }
+
+    bool fLast;
+    {
+        LOCK(cs);
+        fLast = (--nRunning == 0);
+    }
+    if (fLast)
+        Finish();
+}
+
+void CBlockVerifier::Finish()
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexFork = NULL;
+    {
+        LOCK(cs);
+        nEndTime = GetTimeMillis();
+        printf(" verify blocks %19lldms (%u of %u checked, %u bad)\n", nEndTime - nStartTime, nChecked, (unsigned int)vBlocks.size(), (unsigned int)vBad.size());
+
+        // Bad blocks reorganized away meanwhile need nothing done
+        BOOST_FOREACH(CBlockIndex* pindex, vBad)
+            if (pindex->IsInMainChain() && (!pindexFork || pindex->pprev->nHeight < pindexFork->nHeight))
+                pindexFork = pindex->pprev;
+        if (!pindexFork)
+            fCorrupt = false;
+        if (!pindexFork || fInterrupt || fShutdown)
+            return;
+    }
+
+    // Reorg back to the fork
+    printf("CBlockVerifier : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+    CBlock block;
+    if (!block.ReadFromDisk(pindexFork))
+    {
+        error("CBlockVerifier : block.ReadFromDisk failed");
+        return;
+    }
+    CTxDB txdb;
+    if (!block.SetBestChain(txdb, pindexFork))
+    {
+        error("CBlockVerifier : SetBestChain failed");
+        return;
+    }
+
+    {
+        LOCK(cs);
+        fCorrupt = false;
+    }
+}
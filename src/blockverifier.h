@@ -0,0 +1,83 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_BLOCKVERIFIER_H
+#define HYPERSTAKE_BLOCKVERIFIER_H
+
+#include <map>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "sync.h"
+
+static const int DEFAULT_CHECKBLOCKS = 2500;
+static const int DEFAULT_CHECKLEVEL = 1;
+
+struct CBlockVerifierStatus
+{
+    bool fRunning;
+    int nLevel;
+    int nThreads;
+    unsigned int nBlocks;   // blocks to check
+    unsigned int nChecked;
+    unsigned int nBad;      // found bad so far
+    bool fCorrupt;
+    int64 nElapsed;         // milliseconds
+};
+
+/** Check of the last -checkblocks blocks of the best chain, run once the
+ * node is up. A pool of threads reads the blocks back from disk and runs
+ * them through CheckBlock; from -checklevel 2 on their transaction index
+ * entries are checked too, a block at a time under cs_main. Staking and
+ * RPC carry on meanwhile: only once a bad block turns up are they held
+ * (safe mode), until the best chain has been moved back to before it.
+ */
+class CBlockVerifier
+{
+private:
+    mutable CCriticalSection cs;
+    boost::thread_group threadGroup;
+
+    std::vector<CBlockIndex*> vBlocks; // tip first
+    unsigned int nNext;                // next block to hand out
+    unsigned int nChecked;
+    int nLevel;
+    int nThreads;
+    int nRunning;                      // threads not finished yet
+    bool fInterrupt;
+    int64 nStartTime;
+    int64 nEndTime;
+    std::vector<CBlockIndex*> vBad;
+    bool fCorrupt;
+
+    // (nFile, nBlockPos) of the best chain blocks from those being checked
+    // up; guarded by cs_main
+    std::map<std::pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+
+    CBlockIndex* GetNext();
+    bool IsInMainChain(const CDiskTxPos& txpos);
+    bool CheckTxIndex(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex);
+    void ThreadVerify();
+    void Finish();
+
+public:
+    CBlockVerifier();
+
+    // Check the last nDepth blocks of the best chain (0 = all) at nLevel on
+    // nThreads threads. Callers hold cs_main.
+    bool Start(int nDepth, int nLevelIn, int nThreadsIn);
+    // Have the threads stop after the blocks they are on
+    void Interrupt();
+    // Wait for the threads to finish. Callers must not hold cs_main.
+    void Wait();
+
+    // Whether bad blocks were found and the best chain not moved back yet
+    bool IsCorrupt() const;
+    CBlockVerifierStatus GetStatus() const;
+};
+
+extern CBlockVerifier blockVerifier;
+
+#endif
@@ -0,0 +1,211 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_CHECKQUEUE_H
+#define HYPERSTAKE_CHECKQUEUE_H
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+template<typename T> class CCheckQueueControl;
+
+/** Queue of checks run by a pool of worker threads.
+ * A check is any T with a bool operator()() and a swap(). One thread at a
+ * time (the master, through a CCheckQueueControl) adds checks as it finds
+ * them, then joins the workers in Wait() until the queue is drained. Wait()
+ * returns false if any check failed; once one has, the rest are skipped.
+ */
+template<typename T>
+class CCheckQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    std::vector<T> queue;
+    int nIdle;              // threads waiting for work
+    int nTotal;             // threads inside Loop(), the master included
+    bool fAllOk;            // no check has failed since the last Wait()
+    unsigned int nTodo;     // checks added but not finished yet
+    bool fQuit;
+    unsigned int nBatchSize; // most checks a thread takes at a time
+
+    // serializes masters, and masters against StartThreads/StopThreads
+    boost::mutex controlMutex;
+    boost::thread_group threadGroup;
+    int nThreads;
+
+    bool Loop(bool fMaster)
+    {
+        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        unsigned int nNow = 0;
+        bool fOk = true;
+        bool fFirst = true;
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fFirst)
+                {
+                    nTotal++;
+                    fFirst = false;
+                }
+                else
+                {
+                    // report the batch just run
+                    fAllOk &= fOk;
+                    nTodo -= nNow;
+                    if (nTodo == 0 && !fMaster)
+                        condMaster.notify_one();
+                }
+                while (queue.empty())
+                {
+                    if (fMaster && nTodo == 0)
+                    {
+                        nTotal--;
+                        bool fRet = fAllOk;
+                        fAllOk = true;
+                        return fRet;
+                    }
+                    if (!fMaster && fQuit)
+                    {
+                        nTotal--;
+                        return false;
+                    }
+                    nIdle++;
+                    cond.wait(lock);
+                    nIdle--;
+                }
+                // small shares while there are idle threads to hand work to,
+                // up to nBatchSize once everybody is busy
+                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++)
+                {
+                    vChecks[i].swap(queue.back());
+                    queue.pop_back();
+                }
+                fOk = fAllOk;
+            }
+            BOOST_FOREACH(T& check, vChecks)
+                if (fOk)
+                    fOk = check();
+            vChecks.clear();
+        }
+    }
+
+    void Thread()
+    {
+        Loop(false);
+    }
+
+    bool Wait()
+    {
+        return Loop(true);
+    }
+
+    void Add(std::vector<T>& vChecks)
+    {
+        if (vChecks.empty())
+            return;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(T& check, vChecks)
+        {
+            queue.push_back(T());
+            check.swap(queue.back());
+        }
+        nTodo += vChecks.size();
+        if (vChecks.size() == 1)
+            condWorker.notify_one();
+        else
+            condWorker.notify_all();
+    }
+
+    friend class CCheckQueueControl<T>;
+
+public:
+    CCheckQueue(unsigned int nBatchSizeIn) :
+        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn), nThreads(0) {}
+
+    ~CCheckQueue()
+    {
+        StopThreads();
+    }
+
+    // Start nWorkers threads next to the master
+    void StartThreads(int nWorkers)
+    {
+        boost::lock_guard<boost::mutex> control(controlMutex);
+        for (int i = 0; i < nWorkers; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<T>::Thread, this));
+        nThreads += std::max(nWorkers, 0);
+    }
+
+    void StopThreads()
+    {
+        boost::lock_guard<boost::mutex> control(controlMutex);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+        fQuit = false;
+        nThreads = 0;
+    }
+
+    int GetThreadCount() const
+    {
+        return nThreads;
+    }
+};
+
+/** Adds checks to a CCheckQueue for one master and waits for them.
+ * Without a queue the checks are expected to have been run inline. The
+ * destructor waits if Wait() was not called, so no check outlives the data
+ * it points into.
+ */
+template<typename T>
+class CCheckQueueControl
+{
+private:
+    CCheckQueue<T>* pqueue;
+    bool fDone;
+
+public:
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
+    {
+        if (pqueue)
+            pqueue->controlMutex.lock();
+    }
+
+    ~CCheckQueueControl()
+    {
+        if (!fDone)
+            Wait();
+        if (pqueue)
+            pqueue->controlMutex.unlock();
+    }
+
+    bool Wait()
+    {
+        fDone = true;
+        if (!pqueue)
+            return true;
+        return pqueue->Wait();
+    }
+
+    void Add(std::vector<T>& vChecks)
+    {
+        if (pqueue)
+            pqueue->Add(vChecks);
+    }
+};
+
+#endif
@@ -0,0 +1,285 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+
+using namespace std;
+
+CCoinsViewCache* pcoinsTip = NULL;
+
+bool CCoinsView::GetTxIndex(const uint256& hash, CTxIndex& txindex) { return false; }
+bool CCoinsView::HaveTxIndex(const uint256& hash) { CTxIndex txindex; return GetTxIndex(hash, txindex); }
+uint256 CCoinsView::GetBestBlock() { return 0; }
+bool CCoinsView::BatchWrite(const CTxIndexMap& mapEntries, const uint256& hashBestBlock) { return false; }
+
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView* pbaseIn) : pbase(pbaseIn), hashBestBlock(0), nUsage(0), nDirty(0)
+{
+}
+
+uint64 CCoinsViewCache::EntryUsage(const CTxIndex& txindex)
+{
+    // key, entry and the map node around them, plus the spent vector
+    return sizeof(uint256) + sizeof(CTxIndexCacheEntry) + 4 * sizeof(void*) +
+           txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+}
+
+void CCoinsViewCache::Store(const uint256& hash, const CTxIndex& txindex, unsigned char nFlags)
+{
+    CTxIndexMap::iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end())
+        it = mapEntries.insert(make_pair(hash, CTxIndexCacheEntry())).first;
+    else
+    {
+        if (it->second.nFlags & CTxIndexCacheEntry::DIRTY)
+            nDirty--;
+        nUsage -= EntryUsage(it->second.txindex);
+    }
+    CTxIndexCacheEntry& entry = it->second;
+    entry.txindex = txindex;
+    entry.nFlags = nFlags;
+    nUsage += EntryUsage(entry.txindex);
+    if (nFlags & CTxIndexCacheEntry::DIRTY)
+        nDirty++;
+}
+
+bool CCoinsViewCache::GetCachedTxIndex(const uint256& hash, CTxIndex& txindex, bool& fFound) const
+{
+    LOCK(cs);
+    CTxIndexMap::const_iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end())
+        return false;
+    fFound = !(it->second.nFlags & CTxIndexCacheEntry::ERASED);
+    if (fFound)
+        txindex = it->second.txindex;
+    return true;
+}
+
+bool CCoinsViewCache::GetTxIndex(const uint256& hash, CTxIndex& txindex)
+{
+    bool fFound;
+    if (GetCachedTxIndex(hash, txindex, fFound))
+        return fFound;
+    return pbase && pbase->GetTxIndex(hash, txindex);
+}
+
+bool CCoinsViewCache::HaveTxIndex(const uint256& hash)
+{
+    CTxIndex txindex;
+    bool fFound;
+    if (GetCachedTxIndex(hash, txindex, fFound))
+        return fFound;
+    return pbase && pbase->HaveTxIndex(hash);
+}
+
+uint256 CCoinsViewCache::GetBestBlock()
+{
+    {
+        LOCK(cs);
+        if (hashBestBlock != 0)
+            return hashBestBlock;
+    }
+    return pbase ? pbase->GetBestBlock() : 0;
+}
+
+bool CCoinsViewCache::BatchWrite(const CTxIndexMap& mapEntriesIn, const uint256& hashBestBlockIn)
+{
+    LOCK(cs);
+    for (CTxIndexMap::const_iterator it = mapEntriesIn.begin(); it != mapEntriesIn.end(); ++it)
+        if (it->second.nFlags & CTxIndexCacheEntry::DIRTY)
+            Store(it->first, it->second.txindex, it->second.nFlags);
+    if (hashBestBlockIn != 0)
+        hashBestBlock = hashBestBlockIn;
+    return true;
+}
+
+void CCoinsViewCache::SetTxIndex(const uint256& hash, const CTxIndex& txindex)
+{
+    LOCK(cs);
+    Store(hash, txindex, CTxIndexCacheEntry::DIRTY);
+}
+
+void CCoinsViewCache::EraseTxIndex(const uint256& hash)
+{
+    LOCK(cs);
+    Store(hash, CTxIndex(), CTxIndexCacheEntry::DIRTY | CTxIndexCacheEntry::ERASED);
+}
+
+void CCoinsViewCache::SetBestBlock(const uint256& hashBestBlockIn)
+{
+    LOCK(cs);
+    hashBestBlock = hashBestBlockIn;
+}
+
+bool CCoinsViewCache::Flush()
+{
+    LOCK(cs);
+    if (!pbase)
+        return false;
+    if (!pbase->BatchWrite(mapEntries, hashBestBlock))
+        return false;
+    for (CTxIndexMap::iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+        it->second.nFlags &= ~CTxIndexCacheEntry::DIRTY;
+    nDirty = 0;
+    return true;
+}
+
+void CCoinsViewCache::Trim()
+{
+    LOCK(cs);
+    for (CTxIndexMap::iterator it = mapEntries.begin(); it != mapEntries.end(); )
+    {
+        if (it->second.nFlags & CTxIndexCacheEntry::DIRTY)
+            ++it;
+        else
+        {
+            nUsage -= EntryUsage(it->second.txindex);
+            mapEntries.erase(it++);
+        }
+    }
+}
+
+uint64 CCoinsViewCache::GetCacheUsage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+unsigned int CCoinsViewCache::GetCacheSize() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+unsigned int CCoinsViewCache::GetDirtyCount() const
+{
+    LOCK(cs);
+    return nDirty;
+}
+
+
+CTxIndexReadCache txindexCache;
+
+CTxIndexReadCache::CTxIndexReadCache() : nMaxBytes(0), nUsage(0), nGeneration(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0)
+{
+    Resize(DEFAULT_MAX_TXINDEX_CACHE_SIZE << 20);
+}
+
+uint64 CTxIndexReadCache::EntryUsage(const CTxIndex& txindex)
+{
+    // the entry, its list node and the map node pointing at it
+    return sizeof(CEntry) + 2 * sizeof(void*) + sizeof(uint256) + sizeof(void*) + 4 * sizeof(void*) +
+           txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+}
+
+void CTxIndexReadCache::Evict()
+{
+    while (nUsage > nMaxBytes && !lruEntries.empty())
+    {
+        CEntry& entry = lruEntries.back();
+        nUsage -= EntryUsage(entry.txindex);
+        mapEntries.erase(entry.hash);
+        lruEntries.pop_back();
+        nEvictions++;
+    }
+}
+
+void CTxIndexReadCache::Store(const uint256& hash, const CTxIndex& txindex, bool fFound)
+{
+    map<uint256, list<CEntry>::iterator>::iterator mi = mapEntries.find(hash);
+    if (mi != mapEntries.end())
+    {
+        nUsage -= EntryUsage(mi->second->txindex);
+        lruEntries.erase(mi->second);
+        mapEntries.erase(mi);
+    }
+    if (nMaxBytes == 0)
+        return;
+
+    CEntry entry;
+    entry.hash = hash;
+    entry.fFound = fFound;
+    if (fFound)
+        entry.txindex = txindex;
+    lruEntries.push_front(entry);
+    mapEntries[hash] = lruEntries.begin();
+    nUsage += EntryUsage(entry.txindex);
+    nInserts++;
+    Evict();
+}
+
+void CTxIndexReadCache::Resize(uint64 nBytes)
+{
+    LOCK(cs);
+    lruEntries.clear();
+    mapEntries.clear();
+    nUsage = 0;
+    nMaxBytes = nBytes;
+    nGeneration++;
+}
+
+uint64 CTxIndexReadCache::GetMaxBytes() const
+{
+    LOCK(cs);
+    return nMaxBytes;
+}
+
+bool CTxIndexReadCache::Get(const uint256& hash, CTxIndex& txindex, bool& fFound)
+{
+    LOCK(cs);
+    map<uint256, list<CEntry>::iterator>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+    {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    lruEntries.splice(lruEntries.begin(), lruEntries, mi->second);
+    fFound = mi->second->fFound;
+    if (fFound)
+        txindex = mi->second->txindex;
+    return true;
+}
+
+uint64 CTxIndexReadCache::GetGeneration() const
+{
+    LOCK(cs);
+    return nGeneration;
+}
+
+void CTxIndexReadCache::Add(const uint256& hash, const CTxIndex& txindex, bool fFound, uint64 nGenerationRead)
+{
+    LOCK(cs);
+    if (nGenerationRead != nGeneration)
+        return;
+    Store(hash, txindex, fFound);
+}
+
+void CTxIndexReadCache::Write(const uint256& hash, const CTxIndex& txindex)
+{
+    LOCK(cs);
+    nGeneration++;
+    Store(hash, txindex, true);
+}
+
+void CTxIndexReadCache::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    nGeneration++;
+    Store(hash, CTxIndex(), false);
+}
+
+CTxIndexReadCacheStats CTxIndexReadCache::GetStats() const
+{
+    LOCK(cs);
+    CTxIndexReadCacheStats stats;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nUsage = nUsage;
+    stats.nEntries = mapEntries.size();
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nInserts = nInserts;
+    stats.nEvictions = nEvictions;
+    return stats;
+}
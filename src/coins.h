@@ -0,0 +1,164 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_COINS_H
+#define HYPERSTAKE_COINS_H
+
+#include <list>
+#include <map>
+
+#include "main.h"
+#include "sync.h"
+
+/** A transaction index record held in a CCoinsViewCache */
+struct CTxIndexCacheEntry
+{
+    enum
+    {
+        DIRTY  = (1 << 0), // differs from the view below
+        ERASED = (1 << 1), // the transaction is not in the index
+    };
+
+    CTxIndex txindex;
+    unsigned char nFlags;
+
+    CTxIndexCacheEntry() : nFlags(0) {}
+};
+
+typedef std::map<uint256, CTxIndexCacheEntry> CTxIndexMap;
+
+/** View on the transaction index: which transactions are in the best chain,
+ * where they are on disk and which of their outputs are spent. */
+class CCoinsView
+{
+public:
+    virtual bool GetTxIndex(const uint256& hash, CTxIndex& txindex);
+    virtual bool HaveTxIndex(const uint256& hash);
+    // Best block the view is at, 0 if not known
+    virtual uint256 GetBestBlock();
+    // Apply the dirty entries of mapEntries, and hashBestBlock if not 0
+    virtual bool BatchWrite(const CTxIndexMap& mapEntries, const uint256& hashBestBlock);
+    virtual ~CCoinsView() {}
+};
+
+/** Write-back cache of transaction index records over another view.
+ * Spending outputs changes only the cached record; the base view sees the
+ * result once per Flush(), not once per input. Records are never read in
+ * from the base, so everything held is something written through the
+ * cache, and Trim() forgets what has already been flushed.
+ */
+class CCoinsViewCache : public CCoinsView
+{
+private:
+    mutable CCriticalSection cs;
+    CCoinsView* pbase;
+    CTxIndexMap mapEntries;
+    uint256 hashBestBlock;
+    uint64 nUsage;
+    unsigned int nDirty;
+
+    static uint64 EntryUsage(const CTxIndex& txindex);
+    void Store(const uint256& hash, const CTxIndex& txindex, unsigned char nFlags);
+
+public:
+    CCoinsViewCache(CCoinsView* pbaseIn);
+
+    // What the cache knows about hash: true if it holds an entry, and then
+    // fFound tells whether the transaction is in the index
+    bool GetCachedTxIndex(const uint256& hash, CTxIndex& txindex, bool& fFound) const;
+
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex);
+    bool HaveTxIndex(const uint256& hash);
+    uint256 GetBestBlock();
+    bool BatchWrite(const CTxIndexMap& mapEntriesIn, const uint256& hashBestBlockIn);
+
+    void SetTxIndex(const uint256& hash, const CTxIndex& txindex);
+    void EraseTxIndex(const uint256& hash);
+    void SetBestBlock(const uint256& hashBestBlockIn);
+
+    // Push the dirty entries and the best block down to the base view
+    bool Flush();
+    // Forget the entries the base view already has
+    void Trim();
+
+    // Approximate memory held by the entries, in bytes
+    uint64 GetCacheUsage() const;
+    unsigned int GetCacheSize() const;
+    unsigned int GetDirtyCount() const;
+};
+
+extern CCoinsViewCache* pcoinsTip;
+
+static const int64 DEFAULT_MAX_TXINDEX_CACHE_SIZE = 16; // megabytes
+static const int64 MAX_MAX_TXINDEX_CACHE_SIZE = 16384;  // megabytes
+
+struct CTxIndexReadCacheStats
+{
+    uint64 nMaxBytes;
+    uint64 nUsage;
+    uint64 nEntries;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nInserts;
+    uint64 nEvictions;
+};
+
+/** Transaction index records as they are on disk, least recently used
+ * dropped first once they take more than the size limit. Lookups that
+ * miss pcoinsTip go here before the database, and that a transaction is
+ * not in the index is kept too. The records pcoinsTip writes to disk are
+ * written through, so whatever it trims stays at hand. Changes not
+ * flushed yet are only in pcoinsTip, over this, so a reorganization that
+ * is aborted never reaches it.
+ *
+ * A lookup that missed reads the disk unlocked; Add() drops what it read
+ * if anything was written since it started (GetGeneration()), so a record
+ * read just before a flush cannot go in after that flush's.
+ */
+class CTxIndexReadCache
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        CTxIndex txindex;
+        bool fFound;
+    };
+
+    mutable CCriticalSection cs;
+    std::list<CEntry> lruEntries; // most recently used first
+    std::map<uint256, std::list<CEntry>::iterator> mapEntries;
+    uint64 nMaxBytes;
+    uint64 nUsage;
+    uint64 nGeneration;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nInserts;
+    uint64 nEvictions;
+
+    static uint64 EntryUsage(const CTxIndex& txindex);
+    void Store(const uint256& hash, const CTxIndex& txindex, bool fFound);
+    void Evict();
+
+public:
+    CTxIndexReadCache();
+
+    // Drop every entry and hold up to nBytes of them, 0 disables
+    void Resize(uint64 nBytes);
+    uint64 GetMaxBytes() const;
+
+    // As CCoinsViewCache::GetCachedTxIndex
+    bool Get(const uint256& hash, CTxIndex& txindex, bool& fFound);
+    uint64 GetGeneration() const;
+    // A record read from disk after GetGeneration() returned nGenerationRead
+    void Add(const uint256& hash, const CTxIndex& txindex, bool fFound, uint64 nGenerationRead);
+    // The record on disk has been written or erased
+    void Write(const uint256& hash, const CTxIndex& txindex);
+    void Erase(const uint256& hash);
+
+    CTxIndexReadCacheStats GetStats() const;
+};
+
+extern CTxIndexReadCache txindexCache;
+
+#endif
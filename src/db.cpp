@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "db.h"
+#include "lsm.h"
 #include "net.h"
 #include "checkpoints.h"
 #include "util.h"
@@ -25,6 +26,171 @@ unsigned int nWalletDBUpdated;
 
 
 
+//
+// CBerkeleyStore
+//
+
+class CBerkeleyTxn : public CKVTxn
+{
+public:
+    DbEnv* pdbenv;
+    DbTxn* ptxn;
+
+    CBerkeleyTxn(DbEnv* pdbenvIn, DbTxn* ptxnIn) : pdbenv(pdbenvIn), ptxn(ptxnIn) {}
+    ~CBerkeleyTxn() { Abort(); }
+
+    bool Commit()
+    {
+        if (!ptxn)
+            return false;
+        int ret = ptxn->commit(0);
+        ptxn = NULL;
+        return (ret == 0);
+    }
+
+    bool Abort()
+    {
+        if (!ptxn)
+            return false;
+        int ret = ptxn->abort();
+        ptxn = NULL;
+        return (ret == 0);
+    }
+};
+
+class CBerkeleyCursor : public CKVCursor
+{
+private:
+    Dbc* pcursor;
+
+public:
+    explicit CBerkeleyCursor(Dbc* pcursorIn) : pcursor(pcursorIn) {}
+    ~CBerkeleyCursor() { pcursor->close(); }
+
+    int Read(CDataStream& ssKey, CDataStream& ssValue, bool fSeek)
+    {
+        // Read at cursor
+        Dbt datKey;
+        if (fSeek)
+        {
+            datKey.set_data(&ssKey[0]);
+            datKey.set_size(ssKey.size());
+        }
+        Dbt datValue;
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pcursor->get(&datKey, &datValue, fSeek ? DB_SET_RANGE : DB_NEXT);
+        if (ret == DB_NOTFOUND)
+            return KV_NOTFOUND;
+        else if (ret != 0 || datKey.get_data() == NULL || datValue.get_data() == NULL)
+            return KV_ERROR;
+
+        // Convert to streams
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)datKey.get_data(), datKey.get_size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+        // Clear and free memory
+        memset(datKey.get_data(), 0, datKey.get_size());
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+        return 0;
+    }
+};
+
+bool CBerkeleyStore::GetTxn(CKVTxn* ptxn, DbTxn*& pdbtxn) const
+{
+    pdbtxn = NULL;
+    if (!ptxn)
+        return true;
+    CBerkeleyTxn* pberkeleytxn = dynamic_cast<CBerkeleyTxn*>(ptxn);
+    if (!pberkeleytxn || pberkeleytxn->pdbenv != pdbenv || !pberkeleytxn->ptxn)
+        return error("CBerkeleyStore : transaction of another store");
+    pdbtxn = pberkeleytxn->ptxn;
+    return true;
+}
+
+bool CBerkeleyStore::Read(const CDataStream& ssKey, CDataStream& ssValue, CKVTxn* ptxn)
+{
+    DbTxn* pdbtxn;
+    if (!GetTxn(ptxn, pdbtxn))
+        return false;
+
+    Dbt datKey((void*)&ssKey[0], ssKey.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(pdbtxn, &datKey, &datValue, 0);
+    if (datValue.get_data() == NULL)
+        return false;
+
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+    // Clear and free memory
+    memset(datValue.get_data(), 0, datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0);
+}
+
+bool CBerkeleyStore::Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite, CKVTxn* ptxn)
+{
+    DbTxn* pdbtxn;
+    if (!GetTxn(ptxn, pdbtxn))
+        return false;
+
+    Dbt datKey((void*)&ssKey[0], ssKey.size());
+    Dbt datValue((void*)&ssValue[0], ssValue.size());
+    int ret = pdb->put(pdbtxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+    return (ret == 0);
+}
+
+bool CBerkeleyStore::Erase(const CDataStream& ssKey, CKVTxn* ptxn)
+{
+    DbTxn* pdbtxn;
+    if (!GetTxn(ptxn, pdbtxn))
+        return false;
+
+    Dbt datKey((void*)&ssKey[0], ssKey.size());
+    int ret = pdb->del(pdbtxn, &datKey, 0);
+    return (ret == 0 || ret == DB_NOTFOUND);
+}
+
+bool CBerkeleyStore::Exists(const CDataStream& ssKey, CKVTxn* ptxn)
+{
+    DbTxn* pdbtxn;
+    if (!GetTxn(ptxn, pdbtxn))
+        return false;
+
+    Dbt datKey((void*)&ssKey[0], ssKey.size());
+    int ret = pdb->exists(pdbtxn, &datKey, 0);
+    return (ret == 0);
+}
+
+CKVCursor* CBerkeleyStore::NewCursor()
+{
+    Dbc* pcursor = NULL;
+    int ret = pdb->cursor(NULL, &pcursor, 0);
+    if (ret != 0)
+        return NULL;
+    return new CBerkeleyCursor(pcursor);
+}
+
+CKVTxn* CBerkeleyStore::TxnBegin()
+{
+    DbTxn* ptxn = NULL;
+    int ret = pdbenv->txn_begin(NULL, &ptxn, DB_TXN_WRITE_NOSYNC);
+    if (!ptxn || ret != 0)
+        return NULL;
+    return new CBerkeleyTxn(pdbenv, ptxn);
+}
+
+
+
 //
 // CDB
 //
@@ -48,10 +214,12 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    plsm = NULL;
 }
 
 CDBEnv::~CDBEnv()
 {
+    CloseLSM();
     EnvShutdown();
 }
 
@@ -80,7 +248,7 @@ bool CDBEnv::Open(boost::filesystem::path pathEnv_)
     if (GetBoolArg("-privdb", true))
         nEnvFlags |= DB_PRIVATE;
 
-    int nDbCache = GetArg("-dbcache", 25);
+    int nDbCache = max(GetArg("-dbcache", DEFAULT_DB_CACHE), MIN_DB_CACHE) / 4;
     dbenv.set_lg_dir(pathLogDir.string().c_str());
     dbenv.set_cachesize(nDbCache / 1024, (nDbCache % 1024)*1048576, 1);
     dbenv.set_lg_bsize(1048576);
@@ -223,8 +391,81 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 }
 
 
+//
+// CDBBatch
+//
+
+CDBBatch::~CDBBatch()
+{
+    LOCK(bitdb.cs_db);
+    BOOST_FOREACH(const string& strFile, vFiles)
+        --bitdb.mapFileUseCount[strFile];
+}
+
+void CDBBatch::Use(const string& strFile)
+{
+    // Held like an open handle, so the file is not closed under the batch
+    LOCK(bitdb.cs_db);
+    ++bitdb.mapFileUseCount[strFile];
+    vFiles.push_back(strFile);
+}
+
+void CDBBatch::Add(const COp& op)
+{
+    mapLastOp[make_pair(op.pstore, string(op.ssKey.begin(), op.ssKey.end()))] = vOps.size();
+    vOps.push_back(op);
+}
+
+void CDBBatch::Write(CKVStore* pstore, const CDataStream& ssKey, const CDataStream& ssValue)
+{
+    Add(COp(pstore, ssKey, ssValue, false));
+}
+
+void CDBBatch::Erase(CKVStore* pstore, const CDataStream& ssKey)
+{
+    Add(COp(pstore, ssKey, CDataStream(SER_DISK, CLIENT_VERSION), true));
+}
+
+bool CDBBatch::Read(CKVStore* pstore, const CDataStream& ssKey, CDataStream& ssValue, bool& fErased) const
+{
+    map<pair<CKVStore*, string>, unsigned int>::const_iterator mi = mapLastOp.find(make_pair(pstore, string(ssKey.begin(), ssKey.end())));
+    if (mi == mapLastOp.end())
+        return false;
+    const COp& op = vOps[mi->second];
+    fErased = op.fErase;
+    if (!fErased)
+        ssValue = op.ssValue;
+    return true;
+}
+
+bool CDBBatch::Commit()
+{
+    if (vOps.empty())
+        return true;
+
+    CKVTxn* ptxn = vOps[0].pstore->TxnBegin();
+    if (!ptxn)
+        return error("CDBBatch::Commit() : TxnBegin failed");
+    BOOST_FOREACH(COp& op, vOps)
+    {
+        bool fOk = op.fErase ? op.pstore->Erase(op.ssKey, ptxn) : op.pstore->Write(op.ssKey, op.ssValue, true, ptxn);
+        if (!fOk)
+        {
+            ptxn->Abort();
+            delete ptxn;
+            return error("CDBBatch::Commit() : %s failed", op.fErase ? "erase" : "write");
+        }
+    }
+    bool fRet = ptxn->Commit();
+    delete ptxn;
+    if (!fRet)
+        return error("CDBBatch::Commit() : commit failed");
+    return true;
+}
+
+
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pstore(NULL), fBerkeley(false), activeTxn(NULL), pbatch(NULL), fOwnBatch(false)
 {
     int ret;
     if (pszFile == NULL)
@@ -238,12 +479,26 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
     {
         LOCK(bitdb.cs_db);
+        strFile = pszFile;
+        if (bitdb.IsLSM(strFile))
+        {
+            pstore = bitdb.mapLSMStore[strFile];
+            if (fCreate && !Exists(string("version")))
+            {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         if (!bitdb.Open(GetDataDir()))
             throw runtime_error("env open failed");
 
-        strFile = pszFile;
+        fBerkeley = true;
         ++bitdb.mapFileUseCount[strFile];
-        pdb = bitdb.mapDb[strFile];
+        Db* pdb = bitdb.mapDb[strFile];
         if (pdb == NULL)
         {
             pdb = new Db(&bitdb.dbenv, 0);
@@ -267,12 +522,16 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
             if (ret != 0)
             {
                 delete pdb;
-                pdb = NULL;
                 --bitdb.mapFileUseCount[strFile];
                 strFile = "";
+                fBerkeley = false;
                 throw runtime_error(strprintf("CDB() : can't open database file %s, error %d", pszFile, ret));
             }
 
+            bitdb.mapDb[strFile] = pdb;
+            bitdb.mapStore[strFile] = new CBerkeleyStore(&bitdb.dbenv, pdb);
+            pstore = bitdb.mapStore[strFile];
+
             if (fCreate && !Exists(string("version")))
             {
                 bool fTmp = fReadOnly;
@@ -280,9 +539,8 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
                 WriteVersion(CLIENT_VERSION);
                 fReadOnly = fTmp;
             }
-
-            bitdb.mapDb[strFile] = pdb;
         }
+        pstore = bitdb.mapStore[strFile];
     }
 }
 
@@ -296,12 +554,17 @@ static bool IsChainFile(std::string strFile)
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pstore)
         return;
-    if (activeTxn)
-        activeTxn->abort();
+    delete activeTxn;
     activeTxn = NULL;
-    pdb = NULL;
+    if (fOwnBatch)
+        delete pbatch;
+    pbatch = NULL;
+    fOwnBatch = false;
+    pstore = NULL;
+    if (!fBerkeley)
+        return;
 
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
@@ -331,6 +594,8 @@ void CDBEnv::CloseDb(const string& strFile)
             pdb->close(0);
             delete pdb;
             mapDb[strFile] = NULL;
+            delete mapStore[strFile];
+            mapStore.erase(strFile);
         }
     }
 }
@@ -344,6 +609,94 @@ bool CDBEnv::RemoveDb(const string& strFile)
     return (rc == 0);
 }
 
+// The files kept in chaindb, and the key prefix of each
+static const struct
+{
+    const char* pszFile;
+    unsigned char chPrefix;
+} lsmFiles[] = {
+    { "blkindex.dat", 1 },
+    { "governance.dat", 2 },
+};
+
+bool CDBEnv::OpenLSM(const boost::filesystem::path& pathDir, uint64 nCacheSize)
+{
+    if (plsm)
+        return true;
+
+    CLSMOptions options;
+    options.nCacheSize = nCacheSize;
+    CLSMDatabase* plsmNew = new CLSMDatabase();
+
+    if (!filesystem::exists(pathDir))
+    {
+        bool fMigrate = false;
+        for (unsigned int i = 0; i < ARRAYLEN(lsmFiles); i++)
+            if (filesystem::exists(pathEnv / lsmFiles[i].pszFile))
+                fMigrate = true;
+
+        if (fMigrate)
+        {
+            // Copy into a directory of its own first, so an interrupted copy
+            // is started over
+            filesystem::path pathMigrate = pathDir.string() + ".migrate";
+            filesystem::remove_all(pathMigrate);
+            if (!plsmNew->Open(pathMigrate, options))
+            {
+                delete plsmNew;
+                return error("CDBEnv::OpenLSM() : can't create %s", pathMigrate.string().c_str());
+            }
+            for (unsigned int i = 0; i < ARRAYLEN(lsmFiles); i++)
+            {
+                if (!filesystem::exists(pathEnv / lsmFiles[i].pszFile))
+                    continue;
+                printf("Copying %s to %s...\n", lsmFiles[i].pszFile, pathDir.string().c_str());
+                CLSMStore store(plsmNew, lsmFiles[i].chPrefix);
+                if (!CDB::CopyTo(lsmFiles[i].pszFile, &store))
+                {
+                    delete plsmNew;
+                    return error("CDBEnv::OpenLSM() : copying %s failed", lsmFiles[i].pszFile);
+                }
+                CloseDb(lsmFiles[i].pszFile);
+            }
+            bool fFlushed = plsmNew->Flush();
+            plsmNew->Close();
+            if (!fFlushed || !RenameOver(pathMigrate, pathDir))
+            {
+                delete plsmNew;
+                return error("CDBEnv::OpenLSM() : can't move %s into place", pathMigrate.string().c_str());
+            }
+            printf("Chain databases copied to %s; blkindex.dat and governance.dat are no longer used\n", pathDir.string().c_str());
+        }
+    }
+
+    if (!plsmNew->Open(pathDir, options))
+    {
+        delete plsmNew;
+        return error("CDBEnv::OpenLSM() : can't open %s", pathDir.string().c_str());
+    }
+
+    LOCK(cs_db);
+    plsm = plsmNew;
+    for (unsigned int i = 0; i < ARRAYLEN(lsmFiles); i++)
+        mapLSMStore[lsmFiles[i].pszFile] = new CLSMStore(plsm, lsmFiles[i].chPrefix);
+    return true;
+}
+
+void CDBEnv::CloseLSM()
+{
+    LOCK(cs_db);
+    if (!plsm)
+        return;
+    typedef pair<string, CKVStore*> StorePair;
+    BOOST_FOREACH(const StorePair& item, mapLSMStore)
+        delete item.second;
+    mapLSMStore.clear();
+    plsm->Close();
+    delete plsm;
+    plsm = NULL;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (!fShutdown)
@@ -376,7 +729,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CKVCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -385,12 +738,12 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -437,6 +790,49 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+bool CDB::CopyTo(const string& strFile, CKVStore* pstoreTo)
+{
+    CDB db(strFile.c_str(), "r");
+    if (!db.fBerkeley)
+        return error("CDB::CopyTo() : %s is not a Berkeley DB file", strFile.c_str());
+    CKVCursor* pcursor = db.GetCursor();
+    if (!pcursor)
+        return error("CDB::CopyTo() : cannot create cursor on %s", strFile.c_str());
+
+    // In transactions of a thousand records, to keep memory use down
+    bool fSuccess = true;
+    unsigned int nRecords = 0;
+    CKVTxn* ptxn = NULL;
+    while (fSuccess)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+            fSuccess = false;
+        else
+        {
+            if (!ptxn)
+                ptxn = pstoreTo->TxnBegin();
+            fSuccess = ptxn && pstoreTo->Write(ssKey, ssValue, true, ptxn);
+            if (fSuccess && ++nRecords % 1000 == 0)
+            {
+                fSuccess = ptxn->Commit();
+                delete ptxn;
+                ptxn = NULL;
+            }
+        }
+    }
+    if (fSuccess && ptxn)
+        fSuccess = ptxn->Commit();
+    delete ptxn;
+    delete pcursor;
+    printf("CDB::CopyTo() : %u records from %s\n", nRecords, strFile.c_str());
+    return fSuccess;
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
@@ -474,6 +870,7 @@ void CDBEnv::Flush(bool fShutdown)
         printf("DBFlush(%s)%s ended %15lldms\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started", GetTimeMillis() - nStart);
         if (fShutdown)
         {
+            CloseLSM();
             char** listp;
             if (mapFileUseCount.empty())
             {
@@ -493,16 +890,86 @@ void CDBEnv::Flush(bool fShutdown)
 // CTxDB
 //
 
+// A CTxDB transaction is a write batch: the block index, vote proposal and
+// other records go to disk together in TxnCommit(), then the transaction
+// index changes go into pcoinsTip
+bool CTxDB::TxnBegin()
+{
+    if (!BatchBegin())
+        return false;
+    delete pcoinsTxn;
+    pcoinsTxn = NULL;
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    bool fRet = BatchCommit();
+    if (fRet && pcoinsTxn)
+        pcoinsTxn->Flush();
+    delete pcoinsTxn;
+    pcoinsTxn = NULL;
+    return fRet;
+}
+
+bool CTxDB::TxnAbort()
+{
+    delete pcoinsTxn;
+    pcoinsTxn = NULL;
+    return BatchAbort();
+}
+
+CCoinsViewCache* CTxDB::CoinsForWrite()
+{
+    // Outside a transaction changes go straight to the shared cache
+    if (!pbatch)
+        return pcoinsTip;
+    if (!pcoinsTxn)
+        pcoinsTxn = new CCoinsViewCache(pcoinsTip);
+    return pcoinsTxn;
+}
+
+bool CTxDB::ReadTxIndexRecord(const uint256& hash, CTxIndex& txindex)
+{
+    txindex.SetNull();
+    // Without pcoinsTip records are written to disk directly, not through
+    // txindexCache
+    if (!pcoinsTip)
+        return Read(make_pair(string("tx"), hash), txindex);
+
+    bool fFound = false;
+    if (txindexCache.Get(hash, txindex, fFound))
+        return fFound;
+    uint64 nGeneration = txindexCache.GetGeneration();
+    fFound = Read(make_pair(string("tx"), hash), txindex);
+    txindexCache.Add(hash, txindex, fFound, nGeneration);
+    return fFound;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    if (pcoinsTip)
+    {
+        // Records not flushed yet, this transaction's own changes first. A
+        // miss reads through this handle rather than pcoinsTip's base view.
+        bool fFound = false;
+        if ((pcoinsTxn && pcoinsTxn->GetCachedTxIndex(hash, txindex, fFound)) ||
+            pcoinsTip->GetCachedTxIndex(hash, txindex, fFound))
+            return fFound;
+    }
+    return ReadTxIndexRecord(hash, txindex);
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
+    if (pcoinsTip)
+    {
+        CoinsForWrite()->SetTxIndex(hash, txindex);
+        return true;
+    }
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -513,20 +980,37 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
-    assert(!fClient);
-    uint256 hash = tx.GetHash();
+    return EraseTxIndex(tx.GetHash());
+}
 
+bool CTxDB::EraseTxIndex(const uint256& hash)
+{
+    assert(!fClient);
+    if (pcoinsTip)
+    {
+        CoinsForWrite()->EraseTxIndex(hash);
+        return true;
+    }
     return Erase(make_pair(string("tx"), hash));
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    if (pcoinsTip)
+    {
+        CTxIndex txindex;
+        bool fFound = false;
+        if ((pcoinsTxn && pcoinsTxn->GetCachedTxIndex(hash, txindex, fFound)) ||
+            pcoinsTip->GetCachedTxIndex(hash, txindex, fFound) ||
+            txindexCache.Get(hash, txindex, fFound))
+            return fFound;
+    }
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -558,9 +1042,47 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    // noted as changed until the next snapshot has it
+    uint256 hash = blockindex.GetBlockHash();
+    if (!Write(make_pair(string("blockindex"), hash), blockindex))
+        return false;
+    return !GetBoolArg("-blockindexsnapshot", true) || Write(make_pair(string("blockindexnew"), hash), true);
+}
+
+bool CTxDB::WriteBlockTxIndex(const uint256& hashBlock, const map<uint256, CTxIndex>& mapChanges)
+{
+    CBlockUndo undo;
+    undo.vPrior.reserve(mapChanges.size());
+    for (map<uint256, CTxIndex>::const_iterator mi = mapChanges.begin(); mi != mapChanges.end(); ++mi)
+    {
+        CTxIndex txindexPrior;
+        bool fExisted = ReadTxIndex(mi->first, txindexPrior);
+        undo.vPrior.push_back(CTxIndexUndo(mi->first, fExisted, txindexPrior));
+    }
+    for (map<uint256, CTxIndex>::const_iterator mi = mapChanges.begin(); mi != mapChanges.end(); ++mi)
+        if (!UpdateTxIndex(mi->first, mi->second))
+            return error("WriteBlockTxIndex() : UpdateTxIndex failed");
+    return WriteBlockUndo(hashBlock, undo);
+}
+
+bool CTxDB::ReadBlockUndo(const uint256& hashBlock, CBlockUndo& undo)
+{
+    undo.vPrior.clear();
+    return Read(make_pair(string("blockundo"), hashBlock), undo);
+}
+
+bool CTxDB::WriteBlockUndo(const uint256& hashBlock, const CBlockUndo& undo)
+{
+    return Write(make_pair(string("blockundo"), hashBlock), undo);
+}
+
+bool CTxDB::EraseBlockUndo(const uint256& hashBlock)
+{
+    return Erase(make_pair(string("blockundo"), hashBlock));
 }
 
+// hashBestChain is the block the transaction index on disk is at, so with
+// the cache it is written when the cache is flushed, not with every block
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -568,6 +1090,11 @@ bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
+    if (pcoinsTip)
+    {
+        CoinsForWrite()->SetBestBlock(hashBestChain);
+        return true;
+    }
     return Write(string("hashBestChain"), hashBestChain);
 }
 
@@ -581,52 +1108,174 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+bool CCoinsViewDB::GetTxIndex(const uint256& hash, CTxIndex& txindex)
+{
+    CTxDB txdb("r");
+    return txdb.ReadTxIndexRecord(hash, txindex);
+}
+
+bool CCoinsViewDB::HaveTxIndex(const uint256& hash)
+{
+    CTxDB txdb("r");
+    return txdb.Exists(make_pair(string("tx"), hash));
+}
+
+uint256 CCoinsViewDB::GetBestBlock()
+{
+    CTxDB txdb("r");
+    uint256 hashBestChain = 0;
+    txdb.Read(string("hashBestChain"), hashBestChain);
+    return hashBestChain;
+}
+
+bool CCoinsViewDB::BatchWrite(const CTxIndexMap& mapEntries, const uint256& hashBestBlock)
+{
+    CTxDB txdb;
+    if (!txdb.TxnBegin())
+        return error("CCoinsViewDB::BatchWrite() : TxnBegin failed");
+    for (CTxIndexMap::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+    {
+        const CTxIndexCacheEntry& entry = it->second;
+        if (!(entry.nFlags & CTxIndexCacheEntry::DIRTY))
+            continue;
+        bool fOk = (entry.nFlags & CTxIndexCacheEntry::ERASED) ?
+            txdb.Erase(make_pair(string("tx"), it->first)) :
+            txdb.Write(make_pair(string("tx"), it->first), entry.txindex);
+        if (!fOk)
+        {
+            txdb.TxnAbort();
+            return error("CCoinsViewDB::BatchWrite() : writing tx %s failed", it->first.ToString().substr(0,10).c_str());
+        }
+    }
+    if (hashBestBlock != 0 && !txdb.Write(string("hashBestChain"), hashBestBlock))
+    {
+        txdb.TxnAbort();
+        return error("CCoinsViewDB::BatchWrite() : writing hashBestChain failed");
+    }
+    if (!txdb.TxnCommit())
+        return error("CCoinsViewDB::BatchWrite() : TxnCommit failed");
+
+    for (CTxIndexMap::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+    {
+        const CTxIndexCacheEntry& entry = it->second;
+        if (!(entry.nFlags & CTxIndexCacheEntry::DIRTY))
+            continue;
+        if (entry.nFlags & CTxIndexCacheEntry::ERASED)
+            txindexCache.Erase(it->first);
+        else
+            txindexCache.Write(it->first, entry.txindex);
+    }
+    return true;
+}
+
 CBlockIndex static * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (blockIndexArena.Allocate()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Set up the block index entry for a record read from the database
+CBlockIndex static * LoadDiskBlockIndex(const CDiskBlockIndex& diskindex)
+{
+    uint256 blockHash = diskindex.GetBlockHash();
+
+    // Construct block index object
+    CBlockIndex* pindexNew = InsertBlockIndex(blockHash);
+    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nBlockPos      = diskindex.nBlockPos;
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nMint          = diskindex.nMint;
+    pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+    pindexNew->nFlags         = diskindex.nFlags;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    pindexNew->prevoutStake   = diskindex.prevoutStake;
+    pindexNew->nStakeTime     = diskindex.nStakeTime;
+    pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+
+//            if (fTestNet || pindexNew->nHeight >= (int)VOTING_START)
+//                pindexNew->tally          = diskindex.tally;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+        pindexGenesisBlock = pindexNew;
+
+    // ppcoin: build setStakeSeen
+    if (pindexNew->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+    return pindexNew;
+}
+
+// Whether the block index was loaded in full, and so may be snapshotted
+static bool fBlockIndexLoaded = false;
+
 bool CTxDB::LoadBlockIndex()
 {
-    if (!LoadBlockIndexGuts())
+    // Start from the snapshot if it is there and goes with this database,
+    // and read only what changed since; otherwise read the whole index
+    int64 nStart = GetTimeMillis();
+    vector<CBlockIndex*> vLoaded;
+    bool fSnapshot = GetBoolArg("-blockindexsnapshot", true) && ReadBlockIndexSnapshot();
+    if (!GetBoolArg("-blockindexsnapshot", true))
+    {
+        CTxDB txdb;
+        bool fErased = txdb.EraseBlockIndexSnapshot();
+        txdb.Close();
+        if (!fErased)
+            return false;
+    }
+    if (fSnapshot)
+    {
+        printf(" block index snapshot %12lldms (%u entries)\n", GetTimeMillis() - nStart, (unsigned int)mapBlockIndex.size());
+        nStart = GetTimeMillis();
+        if (!LoadBlockIndexChanges(vLoaded))
+            return false;
+    }
+    else if (!LoadBlockIndexGuts(vLoaded))
         return false;
+    printf(" block index %s %13lldms (%u entries)\n", fSnapshot ? "changes " : "database", GetTimeMillis() - nStart, (unsigned int)vLoaded.size());
 
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainTrust
+    // Calculate nChainTrust of what was read from the database; the
+    // snapshot has it already
+    nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
+    vSortedByHeight.reserve(vLoaded.size());
+    BOOST_FOREACH(CBlockIndex* pindex, vLoaded)
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
         // ppcoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016llx", pindex->nHeight, pindex->nStakeModifier);
     }
+    printf(" chain trust %21lldms\n", GetTimeMillis() - nStart);
+    fBlockIndexLoaded = true;
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -639,137 +1288,44 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexBest->bnChainTrust;
+    nBestChainTrust = pindexBest->nChainTrust;
+
+    // The block index links blocks as they are connected, but the
+    // transaction index, and hashBestChain with it, may not have been
+    // flushed since. Link the chain the transaction index is at, and connect
+    // the rest again below.
+    CBlockIndex* pindexConnected = pindexGenesisBlock;
+    while (pindexConnected->pnext)
+        pindexConnected = pindexConnected->pnext;
+    if (pindexConnected != pindexBest)
+    {
+        printf("LoadBlockIndex(): transaction index is at height %d, blocks were connected to height %d\n", nBestHeight, pindexConnected->nHeight);
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            item.second->pnext = NULL;
+        for (CBlockIndex* pindex = pindexBest; pindex->pprev; pindex = pindex->pprev)
+            pindex->pprev->pnext = pindex;
+    }
+    stakeModifierIndex.Rebuild(pindexGenesisBlock);
+    chainActive.Rebuild(pindexGenesisBlock);
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
-    // Load bnBestInvalidTrust, OK if it doesn't exist
-    ReadBestInvalidTrust(bnBestInvalidTrust);
-
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 2500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
-    {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        if (nCheckLevel>0 && !block.CheckBlock())
-        {
-            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
-    }
-    if (pindexFork && !fRequestShutdown)
+    // Load nBestInvalidTrust, OK if it doesn't exist
+    CBigNum bnBestInvalidTrust;
+    if (ReadBestInvalidTrust(bnBestInvalidTrust))
+        nBestInvalidTrust = bnBestInvalidTrust.getuint256();
+
+    // Connect what the transaction index is missing. The last -checkblocks
+    // blocks are checked once the node is up, by CBlockVerifier.
+    if (pindexConnected != pindexBest && !fRequestShutdown)
     {
-        // Reorg back to the fork
-        printf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+        printf("LoadBlockIndex() : connecting blocks up to height %d again\n", pindexConnected->nHeight);
         CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
+        if (!block.ReadFromDisk(pindexConnected))
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
         CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
+        block.SetBestChain(txdb, pindexConnected);
     }
 
     return true;
@@ -777,10 +1333,10 @@ bool CTxDB::LoadBlockIndex()
 
 
 
-bool CTxDB::LoadBlockIndexGuts()
+bool CTxDB::LoadBlockIndexGuts(vector<CBlockIndex*>& vLoaded)
 {
     // Get database cursor
-    Dbc* pcursor = GetCursor();
+    CKVCursor* pcursor = GetCursor();
     if (!pcursor)
         return false;
 
@@ -809,42 +1365,11 @@ bool CTxDB::LoadBlockIndexGuts()
         {
             CDiskBlockIndex diskindex;
             ssValue >> diskindex;
-			
-			uint256 blockHash = diskindex.GetBlockHash();
-
-            // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(blockHash);
-            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-            pindexNew->nFile          = diskindex.nFile;
-            pindexNew->nBlockPos      = diskindex.nBlockPos;
-            pindexNew->nHeight        = diskindex.nHeight;
-            pindexNew->nMint          = diskindex.nMint;
-            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-            pindexNew->nFlags         = diskindex.nFlags;
-            pindexNew->nStakeModifier = diskindex.nStakeModifier;
-            pindexNew->prevoutStake   = diskindex.prevoutStake;
-            pindexNew->nStakeTime     = diskindex.nStakeTime;
-            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-            pindexNew->nVersion       = diskindex.nVersion;
-            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-            pindexNew->nTime          = diskindex.nTime;
-            pindexNew->nBits          = diskindex.nBits;
-            pindexNew->nNonce         = diskindex.nNonce;
-
-//            if (fTestNet || pindexNew->nHeight >= (int)VOTING_START)
-//                pindexNew->tally          = diskindex.tally;
-
-            // Watch for genesis block
-            if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-                pindexGenesisBlock = pindexNew;
 
+            CBlockIndex* pindexNew = LoadDiskBlockIndex(diskindex);
             if (!pindexNew->CheckIndex())
                 return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-
-            // ppcoin: build setStakeSeen
-            if (pindexNew->IsProofOfStake())
-                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            vLoaded.push_back(pindexNew);
         }
         else
         {
@@ -855,15 +1380,283 @@ bool CTxDB::LoadBlockIndexGuts()
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
-    pcursor->close();
+    delete pcursor;
+
+    return true;
+}
 
+// Blocks whose index records changed since the snapshot was written
+bool CTxDB::LoadBlockIndexChanges(vector<CBlockIndex*>& vLoaded)
+{
+    vector<uint256> vChanged;
+    if (!ReadBlockIndexChanged(vChanged))
+        return false;
+
+    BOOST_FOREACH(const uint256& hash, vChanged)
+    {
+        if (fRequestShutdown)
+            break;
+        CDiskBlockIndex diskindex;
+        if (!Read(make_pair(string("blockindex"), hash), diskindex))
+            return error("LoadBlockIndexChanges() : block index for %s not found", hash.ToString().substr(0,20).c_str());
+        CBlockIndex* pindexNew = LoadDiskBlockIndex(diskindex);
+        if (!pindexNew->CheckIndex())
+            return error("LoadBlockIndexChanges() : CheckIndex failed at %d", pindexNew->nHeight);
+        vLoaded.push_back(pindexNew);
+    }
+    return true;
+}
+
+//
+// blkindex.snapshot holds the whole block index as it was at shutdown: a
+// header with the id also stored in blkindex.dat when the file was written,
+// one entry per block with the links as positions in the file, and a
+// checksum. Blocks whose records change afterwards are noted under
+// "blockindexnew" until the next snapshot.
+//
+
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+static const unsigned int SNAPSHOT_NONE = 0xffffffff;
+
+static boost::filesystem::path GetSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+bool CTxDB::ReadBlockIndexChanged(vector<uint256>& vChanged)
+{
+    CKVCursor* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    while (true)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("blockindexnew"), uint256(0));
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            delete pcursor;
+            return false;
+        }
+
+        try {
+            string strType;
+            ssKey >> strType;
+            if (strType != "blockindexnew")
+                break;
+            uint256 hash;
+            ssKey >> hash;
+            vChanged.push_back(hash);
+        }
+        catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CTxDB::EraseBlockIndexSnapshot()
+{
+    vector<uint256> vChanged;
+    if (!ReadBlockIndexChanged(vChanged))
+        return false;
+    uint256 hashSnapshot;
+    bool fHaveId = Read(string("blockindexsnapshot"), hashSnapshot);
+    boost::system::error_code ec;
+    boost::filesystem::remove(GetSnapshotPath(), ec);
+    if (vChanged.empty() && !fHaveId)
+        return true;
+
+    if (!TxnBegin())
+        return error("EraseBlockIndexSnapshot() : TxnBegin failed");
+    bool fOk = !fHaveId || Erase(string("blockindexsnapshot"));
+    BOOST_FOREACH(const uint256& hashChanged, vChanged)
+        fOk = fOk && Erase(make_pair(string("blockindexnew"), hashChanged));
+    if (!fOk)
+    {
+        TxnAbort();
+        return error("EraseBlockIndexSnapshot() : writing to the database failed");
+    }
+    if (!TxnCommit())
+        return error("EraseBlockIndexSnapshot() : TxnCommit failed");
+    printf("EraseBlockIndexSnapshot() : snapshot turned off, %u changed block notes erased\n", (unsigned int)vChanged.size());
+    return true;
+}
+
+bool CTxDB::ReadBlockIndexSnapshot()
+{
+    FILE* file = fopen(GetSnapshotPath().string().c_str(), "rb");
+    if (!file)
+        return false;
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+
+    int nFileSize = GetFilesize(filein);
+    if (nFileSize < (int)sizeof(uint256))
+        return error("ReadBlockIndexSnapshot() : file too short");
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot.resize(nFileSize - sizeof(uint256));
+    uint256 hashIn;
+    try {
+        filein.read(&ssSnapshot[0], ssSnapshot.size());
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("ReadBlockIndexSnapshot() : I/O error");
+    }
+    filein.fclose();
+
+    if (Hash(ssSnapshot.begin(), ssSnapshot.end()) != hashIn)
+        return error("ReadBlockIndexSnapshot() : checksum mismatch, reading the database instead");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    uint256 hashSnapshot, hashSnapshotDB;
+    unsigned int nEntries;
+    try {
+        ssSnapshot >> FLATDATA(pchMsgTmp) >> nVersion >> hashSnapshot >> nEntries;
+    }
+    catch (std::exception &e) {
+        return error("ReadBlockIndexSnapshot() : header corrupted");
+    }
+    if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)) || nVersion != BLOCK_INDEX_SNAPSHOT_VERSION)
+        return error("ReadBlockIndexSnapshot() : wrong network or version, reading the database instead");
+    // a snapshot the database has moved on from since, or never had
+    if (!Read(string("blockindexsnapshot"), hashSnapshotDB) || hashSnapshotDB != hashSnapshot)
+        return error("ReadBlockIndexSnapshot() : snapshot is stale, reading the database instead");
+
+    // Entries are made first and linked afterwards, by position
+    vector<CBlockIndex*> vIndex(nEntries);
+    vector<pair<unsigned int, unsigned int> > vLinks(nEntries);
+    mapBlockIndex.rehash(nEntries);
+    try {
+        for (unsigned int i = 0; i < nEntries; i++)
+        {
+            uint256 hash;
+            ssSnapshot >> hash >> vLinks[i].first >> vLinks[i].second;
+            CBlockIndex* pindex = new (blockIndexArena.Allocate()) CBlockIndex();
+            ssSnapshot >> pindex->nFile >> pindex->nBlockPos >> pindex->nHeight
+                       >> pindex->nMint >> pindex->nMoneySupply >> pindex->nFlags
+                       >> pindex->nStakeModifier >> pindex->nStakeModifierChecksum
+                       >> pindex->prevoutStake >> pindex->nStakeTime >> pindex->hashProofOfStake
+                       >> pindex->nChainTrust >> pindex->nVersion >> pindex->hashMerkleRoot
+                       >> pindex->nTime >> pindex->nBits >> pindex->nNonce;
+            if (vLinks[i].first >= nEntries && vLinks[i].first != SNAPSHOT_NONE)
+                throw runtime_error("link out of range");
+            if (vLinks[i].second >= nEntries && vLinks[i].second != SNAPSHOT_NONE)
+                throw runtime_error("link out of range");
+            BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindex)).first;
+            pindex->phashBlock = &((*mi).first);
+            vIndex[i] = pindex;
+        }
+    }
+    catch (std::exception &e) {
+        // the checksum held, so this was written wrong; start over from the
+        // database (the entries already made stay in the arena unused)
+        mapBlockIndex.clear();
+        return error("ReadBlockIndexSnapshot() : entries corrupted, reading the database instead");
+    }
+
+    const uint256& hashGenesis = (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet);
+    for (unsigned int i = 0; i < nEntries; i++)
+    {
+        CBlockIndex* pindex = vIndex[i];
+        pindex->pprev = vLinks[i].first == SNAPSHOT_NONE ? NULL : vIndex[vLinks[i].first];
+        pindex->pnext = vLinks[i].second == SNAPSHOT_NONE ? NULL : vIndex[vLinks[i].second];
+        if (pindexGenesisBlock == NULL && pindex->GetBlockHash() == hashGenesis)
+            pindexGenesisBlock = pindex;
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+    return true;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (!fBlockIndexLoaded)
+        return false;
+    int64 nStart = GetTimeMillis();
+
+    // positions in the file
+    boost::unordered_map<const CBlockIndex*, unsigned int> mapPos;
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        mapPos[item.second] = vIndex.size();
+        vIndex.push_back(item.second);
+    }
+
+    uint256 hashSnapshot = GetRandHash();
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot << FLATDATA(pchMessageStart) << BLOCK_INDEX_SNAPSHOT_VERSION << hashSnapshot << (unsigned int)vIndex.size();
+    BOOST_FOREACH(const CBlockIndex* pindex, vIndex)
+    {
+        unsigned int nPrev = pindex->pprev ? mapPos[pindex->pprev] : SNAPSHOT_NONE;
+        unsigned int nNext = pindex->pnext ? mapPos[pindex->pnext] : SNAPSHOT_NONE;
+        ssSnapshot << pindex->GetBlockHash() << nPrev << nNext;
+        ssSnapshot << pindex->nFile << pindex->nBlockPos << pindex->nHeight
+                   << pindex->nMint << pindex->nMoneySupply << pindex->nFlags
+                   << pindex->nStakeModifier << pindex->nStakeModifierChecksum
+                   << pindex->prevoutStake << pindex->nStakeTime << pindex->hashProofOfStake
+                   << pindex->nChainTrust << pindex->nVersion << pindex->hashMerkleRoot
+                   << pindex->nTime << pindex->nBits << pindex->nNonce;
+    }
+    uint256 hash = Hash(ssSnapshot.begin(), ssSnapshot.end());
+    ssSnapshot << hash;
+
+    boost::filesystem::path pathTmp = GetDataDir() / "blkindex.snapshot.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    try {
+        fileout.write(&ssSnapshot[0], ssSnapshot.size());
+    }
+    catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetSnapshotPath()))
+        return error("WriteBlockIndexSnapshot() : rename into place failed");
+
+    // The snapshot goes with this database from now on, and has everything
+    // noted as changed. Until this commits the old id makes it look stale.
+    vector<uint256> vChanged;
+    if (!ReadBlockIndexChanged(vChanged))
+        return false;
+
+    if (!TxnBegin())
+        return error("WriteBlockIndexSnapshot() : TxnBegin failed");
+    bool fOk = Write(string("blockindexsnapshot"), hashSnapshot);
+    BOOST_FOREACH(const uint256& hashChanged, vChanged)
+        fOk = fOk && Erase(make_pair(string("blockindexnew"), hashChanged));
+    if (!fOk)
+    {
+        TxnAbort();
+        return error("WriteBlockIndexSnapshot() : writing to the database failed");
+    }
+    if (!TxnCommit())
+        return error("WriteBlockIndexSnapshot() : TxnCommit failed");
+
+    printf("WriteBlockIndexSnapshot() : %u entries, %u changed since the last one, %lldms\n",
+        (unsigned int)vIndex.size(), (unsigned int)vChanged.size(), GetTimeMillis() - nStart);
     return true;
 }
 
 bool CVoteDB::Load()
 {
     // Get database cursor
-    Dbc* pcursor = GetCursor();
+    CKVCursor* pcursor = GetCursor();
     if (!pcursor)
         return false;
 
@@ -910,7 +1703,7 @@ bool CVoteDB::Load()
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
-    pcursor->close();
+    delete pcursor;
 
     return true;
 }
@@ -925,6 +1718,16 @@ bool CVoteDB::ReadProposal(const uint256 &hash, CVoteProposal &proposal)
     return Read(make_pair(string("prop"), hash), proposal);
 }
 
+bool CVoteDB::WriteTally(const uint256& hashBlock, const CVoteTally& tally)
+{
+    return Write(make_pair(string("tally"), hashBlock), tally);
+}
+
+bool CVoteDB::ReadTally(const uint256& hashBlock, CVoteTally& tally)
+{
+    return Read(make_pair(string("tally"), hashBlock), tally);
+}
+
 
 //
 // CAddrDB
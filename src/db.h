@@ -5,6 +5,8 @@
 #ifndef BITCOIN_DB_H
 #define BITCOIN_DB_H
 
+#include "coins.h"
+#include "kvstore.h"
 #include "main.h"
 #include "voteproposal.h"
 
@@ -17,6 +19,7 @@
 class CAddress;
 class CAddrMan;
 class CBlockLocator;
+class CLSMDatabase;
 class CDiskBlockIndex;
 class CDiskTxPos;
 class CMasterKey;
@@ -31,6 +34,27 @@ void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
 
+/** A Berkeley DB database as a CKVStore */
+class CBerkeleyStore : public CKVStore
+{
+private:
+    DbEnv* pdbenv;
+    Db* pdb;
+
+    bool GetTxn(CKVTxn* ptxn, DbTxn*& pdbtxn) const;
+
+public:
+    CBerkeleyStore(DbEnv* pdbenvIn, Db* pdbIn) : pdbenv(pdbenvIn), pdb(pdbIn) {}
+
+    bool Read(const CDataStream& ssKey, CDataStream& ssValue, CKVTxn* ptxn=NULL);
+    bool Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite=true, CKVTxn* ptxn=NULL);
+    bool Erase(const CDataStream& ssKey, CKVTxn* ptxn=NULL);
+    bool Exists(const CDataStream& ssKey, CKVTxn* ptxn=NULL);
+    CKVCursor* NewCursor();
+    CKVTxn* TxnBegin();
+};
+
+
 class CDBEnv
 {
 private:
@@ -47,6 +71,10 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CKVStore*> mapStore; // over the handles in mapDb
+    // With -dbbackend=lsm the chain files are kept in <datadir>/chaindb
+    CLSMDatabase* plsm;
+    std::map<std::string, CKVStore*> mapLSMStore;
 
     CDBEnv();
     ~CDBEnv();
@@ -81,6 +109,12 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    // Keep the chain files in chaindb from now on, copying them over from
+    // Berkeley DB the first time
+    bool OpenLSM(const boost::filesystem::path& pathDir, uint64 nCacheSize);
+    void CloseLSM();
+    bool IsLSM(const std::string& strFile) { return mapLSMStore.count(strFile) > 0; }
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -94,13 +128,56 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Writes and erases collected in memory, for one or more databases, and
+ * applied in a single transaction by Commit(). Nothing reaches the database
+ * before that, so an abort or a crash leaves none of it; handles writing to
+ * the batch read their keys from it first. The databases must all be kept
+ * by the same engine. */
+class CDBBatch
+{
+private:
+    struct COp
+    {
+        CKVStore* pstore;
+        CDataStream ssKey;
+        CDataStream ssValue;
+        bool fErase;
+
+        COp(CKVStore* pstoreIn, const CDataStream& ssKeyIn, const CDataStream& ssValueIn, bool fEraseIn) :
+            pstore(pstoreIn), ssKey(ssKeyIn), ssValue(ssValueIn), fErase(fEraseIn) {}
+    };
+
+    std::vector<COp> vOps;
+    // (store, key) -> its last op in vOps
+    std::map<std::pair<CKVStore*, std::string>, unsigned int> mapLastOp;
+    std::vector<std::string> vFiles; // files kept open until the batch is gone
+
+    void Add(const COp& op);
+
+public:
+    ~CDBBatch();
+    void Use(const std::string& strFile);
+    void Write(CKVStore* pstore, const CDataStream& ssKey, const CDataStream& ssValue);
+    void Erase(CKVStore* pstore, const CDataStream& ssKey);
+    // Whether the batch has the key: fErased if its last op erases it,
+    // otherwise ssValue is what it writes
+    bool Read(CKVStore* pstore, const CDataStream& ssKey, CDataStream& ssValue, bool& fErased) const;
+    bool Commit();
+    unsigned int size() const { return vOps.size(); }
+};
+
+
+/** RAII class that provides access to a database file, through the
+ * CKVStore of whichever engine keeps it */
 class CDB
 {
 protected:
-    Db* pdb;
+    CKVStore* pstore;
+    bool fBerkeley;
     std::string strFile;
-    DbTxn *activeTxn;
+    CKVTxn* activeTxn;
+    CDBBatch* pbatch;
+    bool fOwnBatch;
     bool fReadOnly;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
@@ -115,42 +192,39 @@ protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
-
-        // Read
-        Dbt datValue;
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
-        memset(datKey.get_data(), 0, datKey.get_size());
-        if (datValue.get_data() == NULL)
+
+        // Read, from the batch first: it is newer than the database
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        bool fErased = false;
+        if (pbatch && pbatch->Read(pstore, ssKey, ssValue, fErased))
+        {
+            if (fErased)
+                return false;
+        }
+        else if (!pstore->Read(ssKey, ssValue, activeTxn))
             return false;
 
         // Unserialize value
         try {
-            CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         }
         catch (std::exception &e) {
             return false;
         }
-
-        // Clear and free memory
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datValue.get_data());
-        return (ret == 0);
+        return true;
     }
 
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -159,27 +233,26 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
-        Dbt datValue(&ssValue[0], ssValue.size());
 
-        // Write
-        int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        if (pbatch)
+        {
+            pbatch->Write(pstore, ssKey, ssValue);
+            return true;
+        }
 
-        // Clear memory in case it was a private key
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        return (ret == 0);
+        // Write
+        return pstore->Write(ssKey, ssValue, fOverwrite, activeTxn);
     }
 
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -188,114 +261,123 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
-        // Erase
-        int ret = pdb->del(activeTxn, &datKey, 0);
+        if (pbatch)
+        {
+            pbatch->Erase(pstore, ssKey);
+            return true;
+        }
 
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0 || ret == DB_NOTFOUND);
+        // Erase
+        return pstore->Erase(ssKey, activeTxn);
     }
 
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
-        int ret = pdb->exists(activeTxn, &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        bool fErased = false;
+        if (pbatch && pbatch->Read(pstore, ssKey, ssValue, fErased))
+            return !fErased;
+        return pstore->Exists(ssKey, activeTxn);
     }
 
-    Dbc* GetCursor()
+    // The caller deletes it
+    CKVCursor* GetCursor()
     {
-        if (!pdb)
+        if (!pstore)
             return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
-            return NULL;
-        return pcursor;
+        return pstore->NewCursor();
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    // fFlags is DB_SET_RANGE or DB_NEXT
+    int ReadAtCursor(CKVCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
+        int ret = pcursor->Read(ssKey, ssValue, fFlags == DB_SET_RANGE);
+        if (ret == KV_NOTFOUND)
+            return DB_NOTFOUND;
+        return ret;
     }
 
 public:
     bool TxnBegin()
     {
-        if (!pdb || activeTxn)
-            return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
-        if (!ptxn)
+        if (!pstore || activeTxn)
             return false;
-        activeTxn = ptxn;
-        return true;
+        activeTxn = pstore->TxnBegin();
+        return (activeTxn != NULL);
     }
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pstore || !activeTxn)
             return false;
-        int ret = activeTxn->commit(0);
+        bool fRet = activeTxn->Commit();
+        delete activeTxn;
         activeTxn = NULL;
-        return (ret == 0);
+        return fRet;
     }
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pstore || !activeTxn)
             return false;
-        int ret = activeTxn->abort();
+        bool fRet = activeTxn->Abort();
+        delete activeTxn;
         activeTxn = NULL;
-        return (ret == 0);
+        return fRet;
+    }
+
+    // Collect writes and erases in a CDBBatch until BatchCommit(). Read and
+    // Exists see them over what is in the database; cursors do not.
+    bool BatchBegin()
+    {
+        if (!pstore || pbatch || activeTxn)
+            return false;
+        pbatch = new CDBBatch();
+        if (fBerkeley)
+            pbatch->Use(strFile);
+        fOwnBatch = true;
+        return true;
+    }
+
+    bool BatchCommit()
+    {
+        if (!pbatch || !fOwnBatch)
+            return false;
+        bool fRet = pbatch->Commit();
+        BatchAbort();
+        return fRet;
+    }
+
+    bool BatchAbort()
+    {
+        if (!pbatch || !fOwnBatch)
+            return false;
+        delete pbatch;
+        pbatch = NULL;
+        fOwnBatch = false;
+        return true;
+    }
+
+    // Have this handle's writes go into the batch db has open, if any
+    void JoinBatch(CDB& db)
+    {
+        if (!pstore || !db.pbatch || pbatch)
+            return;
+        if (fBerkeley)
+            db.pbatch->Use(strFile);
+        pbatch = db.pbatch;
+        fOwnBatch = false;
     }
 
     bool ReadVersion(int& nVersion)
@@ -310,6 +392,8 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    // Copy every record of a Berkeley DB file into pstoreTo
+    bool static CopyTo(const std::string& strFile, CKVStore* pstoreTo);
 };
 
 
@@ -322,28 +406,67 @@ public:
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode), pcoinsTxn(NULL) { }
+    ~CTxDB() { delete pcoinsTxn; }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    // Transaction index changes made inside the open transaction; they go
+    // into pcoinsTip when it commits, and on to disk when that is flushed
+    CCoinsViewCache* pcoinsTxn;
+    CCoinsViewCache* CoinsForWrite();
+
+    // The records on disk, under the cache
+    bool ReadTxIndexRecord(const uint256& hash, CTxIndex& txindex);
+    friend class CCoinsViewDB;
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
+    bool EraseTxIndex(const uint256& hash);
     bool ContainsTx(uint256 hash);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    // The tx index changes connecting a block makes, with the block's undo
+    // record of what they replace
+    bool WriteBlockTxIndex(const uint256& hashBlock, const std::map<uint256, CTxIndex>& mapChanges);
+    bool ReadBlockUndo(const uint256& hashBlock, CBlockUndo& undo);
+    bool WriteBlockUndo(const uint256& hashBlock, const CBlockUndo& undo);
+    bool EraseBlockUndo(const uint256& hashBlock);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
+    // Write blkindex.snapshot for the next start to load from
+    bool WriteBlockIndexSnapshot();
 private:
-    bool LoadBlockIndexGuts();
+    bool LoadBlockIndexGuts(std::vector<CBlockIndex*>& vLoaded);
+    bool LoadBlockIndexChanges(std::vector<CBlockIndex*>& vLoaded);
+    // Blocks noted under "blockindexnew" as changed since the snapshot
+    bool ReadBlockIndexChanged(std::vector<uint256>& vChanged);
+    bool ReadBlockIndexSnapshot();
+    // Drop the snapshot, its id and the change notes, with it turned off
+    bool EraseBlockIndexSnapshot();
+};
+
+/** The transaction index records in blkindex.dat, as the view under pcoinsTip */
+class CCoinsViewDB : public CCoinsView
+{
+public:
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex);
+    bool HaveTxIndex(const uint256& hash);
+    uint256 GetBestBlock();
+    bool BatchWrite(const CTxIndexMap& mapEntries, const uint256& hashBestBlock);
 };
 
 class CVoteDB : public CDB
@@ -357,6 +480,8 @@ public:
     bool Load();
     bool WriteProposal(const uint256& hash, const CVoteProposal& proposal);
     bool ReadProposal(const uint256& hash, CVoteProposal& proposal);
+    bool WriteTally(const uint256& hashBlock, const CVoteTally& tally);
+    bool ReadTally(const uint256& hashBlock, CVoteTally& tally);
 };
 
 
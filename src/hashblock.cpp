@@ -0,0 +1,468 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+
+#include "hashblock.h"
+#include "sph_blake.h"
+#include "sph_bmw.h"
+#include "sph_groestl.h"
+#include "sph_jh.h"
+#include "sph_keccak.h"
+#include "sph_skein.h"
+#include "sph_luffa.h"
+#include "sph_cubehash.h"
+#include "sph_shavite.h"
+#include "sph_simd.h"
+#include "sph_echo.h"
+
+using namespace std;
+
+// Every stage after blake hashes a 64 byte digest into a 64 byte digest
+static const size_t HASH9_DIGEST_SIZE = 64;
+
+static void Groestl512Generic(const unsigned char* pin, unsigned char* pout)
+{
+    sph_groestl512_context ctx;
+    sph_groestl512_init(&ctx);
+    sph_groestl512(&ctx, pin, HASH9_DIGEST_SIZE);
+    sph_groestl512_close(&ctx, pout);
+}
+
+static void Shavite512Generic(const unsigned char* pin, unsigned char* pout)
+{
+    sph_shavite512_context ctx;
+    sph_shavite512_init(&ctx);
+    sph_shavite512(&ctx, pin, HASH9_DIGEST_SIZE);
+    sph_shavite512_close(&ctx, pout);
+}
+
+static void Echo512Generic(const unsigned char* pin, unsigned char* pout)
+{
+    sph_echo512_context ctx;
+    sph_echo512_init(&ctx);
+    sph_echo512(&ctx, pin, HASH9_DIGEST_SIZE);
+    sph_echo512_close(&ctx, pout);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_HASH9_AESNI
+#endif
+
+#ifdef USE_HASH9_AESNI
+#include <immintrin.h>
+
+namespace
+{
+// The sph code keeps an AES state as four little endian column words, which
+// is byte for byte the layout aesenc works on, so each table driven
+// AES_ROUND_LE is a single aesenc.
+#define AESNI_INLINE inline __attribute__((always_inline, target("aes,ssse3")))
+#define AESNI_FUNC __attribute__((target("aes,ssse3")))
+
+// Multiply each byte by x in GF(2^8) modulo the AES polynomial
+AESNI_INLINE __m128i XTime(__m128i x)
+{
+    __m128i hi = _mm_cmplt_epi8(x, _mm_setzero_si128());
+    return _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(hi, _mm_set1_epi8(0x1b)));
+}
+
+// Groestl-512 works on an 8x16 byte matrix; here each row is one register.
+// aesenclast with a zero key is SubBytes after the AES ShiftRows, so the
+// row rotation of ShiftBytes is applied together with the inverse of
+// ShiftRows in one pshufb. Row rotations of the P permutation are
+// 0,1,2,3,4,5,6,11.
+const unsigned char GROESTL_SHIFT_MASK[8][16] __attribute__((aligned(16))) = {
+    {0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03},
+    {0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04},
+    {0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05},
+    {0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06},
+    {0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07},
+    {0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08},
+    {0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09},
+    {0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e}};
+
+// Q rotates its rows by 1,3,5,11,0,2,4,6: the same masks in another order
+const int GROESTL_Q_SHIFT_ROW[8] = {1, 3, 5, 7, 0, 2, 4, 6};
+
+// Column j of the round constant row: (j << 4) ^ round
+const unsigned char GROESTL_RC_BASE[16] __attribute__((aligned(16))) = {
+    0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80, 0x90, 0xa0, 0xb0, 0xc0, 0xd0, 0xe0, 0xf0};
+
+// Each loop over the eight rows is spelled out so the rows stay in registers
+#define GROESTL_ROWS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+
+AESNI_INLINE void GroestlMixBytes(__m128i* x)
+{
+    // The circulant (02, 02, 03, 04, 05, 03, 05, 07) gives, for row i and
+    // a(j) = x[(i + j) & 7],
+    // y = a2^a4^a5^a6^a7 ^ 2*(a0^a1^a2^a5^a7) ^ 4*(a3^a4^a6^a7)
+    __m128i t[8], y[8];
+#define GROESTL_T(i) t[i] = _mm_xor_si128(x[i], x[(i + 1) & 7]);
+    GROESTL_ROWS(GROESTL_T)
+#undef GROESTL_T
+#define GROESTL_Y(i) { \
+        __m128i a = _mm_xor_si128(x[(i + 2) & 7], _mm_xor_si128(t[(i + 4) & 7], t[(i + 6) & 7])); \
+        __m128i b = _mm_xor_si128(_mm_xor_si128(t[i], x[(i + 2) & 7]), _mm_xor_si128(x[(i + 5) & 7], x[(i + 7) & 7])); \
+        __m128i c = _mm_xor_si128(t[(i + 3) & 7], t[(i + 6) & 7]); \
+        y[i] = _mm_xor_si128(a, XTime(_mm_xor_si128(b, XTime(c)))); \
+    }
+    GROESTL_ROWS(GROESTL_Y)
+#undef GROESTL_Y
+#define GROESTL_COPY(i) x[i] = y[i];
+    GROESTL_ROWS(GROESTL_COPY)
+#undef GROESTL_COPY
+}
+
+AESNI_INLINE void GroestlRoundP(__m128i* x, int r)
+{
+    const __m128i zero = _mm_setzero_si128();
+    x[0] = _mm_xor_si128(x[0], _mm_xor_si128(_mm_load_si128((const __m128i*)GROESTL_RC_BASE), _mm_set1_epi8(r)));
+#define GROESTL_SUB_SHIFT(i) x[i] = _mm_aesenclast_si128(_mm_shuffle_epi8(x[i], _mm_load_si128((const __m128i*)GROESTL_SHIFT_MASK[i])), zero);
+    GROESTL_ROWS(GROESTL_SUB_SHIFT)
+#undef GROESTL_SUB_SHIFT
+    GroestlMixBytes(x);
+}
+
+AESNI_INLINE void GroestlRoundQ(__m128i* x, int r)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    // complement every row, the round constant goes into the last one
+    x[7] = _mm_xor_si128(x[7], _mm_xor_si128(_mm_load_si128((const __m128i*)GROESTL_RC_BASE), _mm_set1_epi8(r)));
+#define GROESTL_SUB_SHIFT(i) x[i] = _mm_aesenclast_si128(_mm_shuffle_epi8(_mm_xor_si128(x[i], ones), _mm_load_si128((const __m128i*)GROESTL_SHIFT_MASK[GROESTL_Q_SHIFT_ROW[i]])), zero);
+    GROESTL_ROWS(GROESTL_SUB_SHIFT)
+#undef GROESTL_SUB_SHIFT
+    GroestlMixBytes(x);
+}
+
+// Groestl-512 of a 64 byte message: one padded block, h' = P(h ^ m) ^ Q(m) ^ h
+// and the output is the second half of P(h') ^ h'. Message bytes fill the
+// matrix column by column.
+AESNI_FUNC void Groestl512AESNI(const unsigned char* pin, unsigned char* pout)
+{
+    unsigned char rows[8][16] __attribute__((aligned(16)));
+    for (int j = 0; j < 8; j++)
+        for (int i = 0; i < 8; i++)
+            rows[i][j] = pin[8 * j + i];
+    for (int i = 0; i < 8; i++)
+        memset(&rows[i][8], 0, 8);
+    rows[0][8] = 0x80;  // padding bit
+    rows[7][15] = 1;    // block count
+
+    __m128i h[8], p[8], q[8];
+    for (int i = 0; i < 8; i++)
+    {
+        q[i] = _mm_load_si128((const __m128i*)rows[i]);
+        h[i] = _mm_setzero_si128();
+    }
+    // iv: the output size in bits, big endian in the last column
+    h[6] = _mm_insert_epi16(h[6], 0x0200, 7);
+    for (int i = 0; i < 8; i++)
+        p[i] = _mm_xor_si128(h[i], q[i]);
+    // P and Q are independent, interleaving them keeps the aes unit busy
+    for (int r = 0; r < 14; r++)
+    {
+        GroestlRoundP(p, r);
+        GroestlRoundQ(q, r);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p[i], q[i]));
+        p[i] = h[i];
+    }
+    for (int r = 0; r < 14; r++)
+        GroestlRoundP(p, r);
+    for (int i = 0; i < 8; i++)
+        _mm_store_si128((__m128i*)rows[i], _mm_xor_si128(p[i], h[i]));
+    for (int j = 0; j < 8; j++)
+        for (int i = 0; i < 8; i++)
+            pout[8 * j + i] = rows[i][8 + j];
+}
+
+// SHAvite-3-512 of a 64 byte message. The key schedule is expanded 128 bits
+// at a time, with the bit count (512) mixed into words 8, 41, 79 and 110.
+AESNI_FUNC void Shavite512AESNI(const unsigned char* pin, unsigned char* pout)
+{
+    static const unsigned int IV[16] __attribute__((aligned(16))) = {
+        0x72FCCDD8, 0x79CA4727, 0x128A077B, 0x40D55AEC,
+        0xD1901A06, 0x430AE307, 0xB29F5CD1, 0xDF07FBFC,
+        0x8E45D73D, 0x681AB538, 0xBDE86578, 0xDD577E47,
+        0xE275EADE, 0x502D9FCD, 0xB9357178, 0x022A4B9A};
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i rk[112];
+    for (int i = 0; i < 4; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)(pin + 16 * i));
+    // padding bit, bit count at byte 110 and the digest size at byte 126
+    rk[4] = _mm_set_epi32(0, 0, 0, 0x80);
+    rk[5] = zero;
+    rk[6] = _mm_set_epi32(0x02000000, 0, 0, 0);
+    rk[7] = _mm_set_epi32(0x02000000, 0, 0, 0);
+
+    int n = 8;
+    while (true)
+    {
+        for (int s = 0; s < 8; s++, n++)
+        {
+            __m128i x = _mm_aesenc_si128(_mm_shuffle_epi32(rk[n - 8], 0x39), zero);
+            rk[n] = _mm_xor_si128(x, rk[n - 1]);
+            if (n == 8)
+                rk[n] = _mm_xor_si128(rk[n], _mm_set_epi32(-1, 0, 0, 512));
+            else if (n == 41)
+                rk[n] = _mm_xor_si128(rk[n], _mm_set_epi32(~512, 0, 0, 0));
+            else if (n == 79)
+                rk[n] = _mm_xor_si128(rk[n], _mm_set_epi32(-1, 512, 0, 0));
+            else if (n == 110)
+                rk[n] = _mm_xor_si128(rk[n], _mm_set_epi32(-1, 0, 512, 0));
+        }
+        if (n == 112)
+            break;
+        for (int s = 0; s < 8; s++, n++)
+            rk[n] = _mm_xor_si128(rk[n - 8], _mm_alignr_epi8(rk[n - 1], rk[n - 2], 4));
+    }
+
+    __m128i p0 = _mm_load_si128((const __m128i*)&IV[0]);
+    __m128i p1 = _mm_load_si128((const __m128i*)&IV[4]);
+    __m128i p2 = _mm_load_si128((const __m128i*)&IV[8]);
+    __m128i p3 = _mm_load_si128((const __m128i*)&IV[12]);
+    for (int r = 0, u = 0; r < 14; r++, u += 8)
+    {
+        __m128i x = _mm_xor_si128(p1, rk[u]);
+        x = _mm_aesenc_si128(x, rk[u + 1]);
+        x = _mm_aesenc_si128(x, rk[u + 2]);
+        x = _mm_aesenc_si128(x, rk[u + 3]);
+        p0 = _mm_xor_si128(p0, _mm_aesenc_si128(x, zero));
+        x = _mm_xor_si128(p3, rk[u + 4]);
+        x = _mm_aesenc_si128(x, rk[u + 5]);
+        x = _mm_aesenc_si128(x, rk[u + 6]);
+        x = _mm_aesenc_si128(x, rk[u + 7]);
+        p2 = _mm_xor_si128(p2, _mm_aesenc_si128(x, zero));
+
+        __m128i t = p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = p0;
+        p0 = t;
+    }
+    _mm_storeu_si128((__m128i*)(pout), _mm_xor_si128(p0, _mm_load_si128((const __m128i*)&IV[0])));
+    _mm_storeu_si128((__m128i*)(pout + 16), _mm_xor_si128(p1, _mm_load_si128((const __m128i*)&IV[4])));
+    _mm_storeu_si128((__m128i*)(pout + 32), _mm_xor_si128(p2, _mm_load_si128((const __m128i*)&IV[8])));
+    _mm_storeu_si128((__m128i*)(pout + 48), _mm_xor_si128(p3, _mm_load_si128((const __m128i*)&IV[12])));
+}
+
+AESNI_INLINE void EchoMixColumn(__m128i* w, int a, int b, int c, int d)
+{
+    __m128i ab = _mm_xor_si128(w[a], w[b]);
+    __m128i bc = _mm_xor_si128(w[b], w[c]);
+    __m128i cd = _mm_xor_si128(w[c], w[d]);
+    __m128i abx = XTime(ab);
+    __m128i bcx = XTime(bc);
+    __m128i cdx = XTime(cd);
+    __m128i wa = w[a], wc = w[c], wd = w[d];
+    w[a] = _mm_xor_si128(abx, _mm_xor_si128(bc, wd));
+    w[b] = _mm_xor_si128(bcx, _mm_xor_si128(wa, cd));
+    w[c] = _mm_xor_si128(cdx, _mm_xor_si128(ab, wd));
+    w[d] = _mm_xor_si128(_mm_xor_si128(abx, bcx), _mm_xor_si128(_mm_xor_si128(cdx, ab), wc));
+}
+
+// ECHO-512 of a 64 byte message: a single 1024 bit block after the 512 bit
+// chaining value, ten rounds of BIG.SubWords, BIG.ShiftRows, BIG.MixColumns.
+AESNI_FUNC void Echo512AESNI(const unsigned char* pin, unsigned char* pout)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i w[16], m[4];
+    for (int i = 0; i < 8; i++)
+        w[i] = _mm_set_epi32(0, 0, 0, 512);
+    for (int i = 0; i < 4; i++)
+        w[8 + i] = m[i] = _mm_loadu_si128((const __m128i*)(pin + 16 * i));
+    // padding bit, digest size at byte 110 and the bit count at byte 112
+    w[12] = _mm_set_epi32(0, 0, 0, 0x80);
+    w[13] = zero;
+    w[14] = _mm_set_epi32(0x02000000, 0, 0, 0);
+    w[15] = _mm_set_epi32(0, 0, 0, 512);
+
+    // the salt is the bit count, incremented for every word
+    __m128i k = _mm_set_epi32(0, 0, 0, 512);
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    for (int r = 0; r < 10; r++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = _mm_aesenc_si128(_mm_aesenc_si128(w[i], k), zero);
+            k = _mm_add_epi32(k, one);
+        }
+
+        __m128i t = w[1];
+        w[1] = w[5]; w[5] = w[9]; w[9] = w[13]; w[13] = t;
+        t = w[2]; w[2] = w[10]; w[10] = t;
+        t = w[6]; w[6] = w[14]; w[14] = t;
+        t = w[15];
+        w[15] = w[11]; w[11] = w[7]; w[7] = w[3]; w[3] = t;
+
+        EchoMixColumn(w, 0, 1, 2, 3);
+        EchoMixColumn(w, 4, 5, 6, 7);
+        EchoMixColumn(w, 8, 9, 10, 11);
+        EchoMixColumn(w, 12, 13, 14, 15);
+    }
+
+    // the digest is the first half of the new chaining value
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_xor_si128(_mm_set_epi32(0, 0, 0, 512), m[i]);
+        v = _mm_xor_si128(v, _mm_xor_si128(w[i], w[i + 8]));
+        _mm_storeu_si128((__m128i*)(pout + 16 * i), v);
+    }
+}
+}
+#endif
+
+bool Hash9BackendSupported(Hash9Backend backend)
+{
+    switch (backend)
+    {
+    case HASH9_GENERIC:
+        return true;
+#ifdef USE_HASH9_AESNI
+    case HASH9_AESNI:
+        return __builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3");
+#endif
+    default:
+        return false;
+    }
+}
+
+static Hash9Backend SelectHash9Backend()
+{
+    if (Hash9BackendSupported(HASH9_AESNI))
+        return HASH9_AESNI;
+    return HASH9_GENERIC;
+}
+
+Hash9Backend GetHash9Backend()
+{
+    static Hash9Backend backend = SelectHash9Backend();
+    return backend;
+}
+
+const char* Hash9BackendName(Hash9Backend backend)
+{
+    switch (backend)
+    {
+    case HASH9_GENERIC: return "generic";
+    case HASH9_AESNI: return "aes-ni";
+    }
+    return "unknown";
+}
+
+namespace
+{
+typedef void (*DigestFunc)(const unsigned char* pin, unsigned char* pout);
+
+/** Hashing state for one thread. The sph contexts are set up once and
+ * copied for every digest instead of being re-initialised.
+ */
+struct CHash9Context
+{
+    sph_blake512_context     blake;
+    sph_bmw512_context       bmw;
+    sph_skein512_context     skein;
+    sph_jh512_context        jh;
+    sph_keccak512_context    keccak;
+    sph_luffa512_context     luffa;
+    sph_cubehash512_context  cubehash;
+    sph_simd512_context      simd;
+    DigestFunc               groestl;
+    DigestFunc               shavite;
+    DigestFunc               echo;
+
+    CHash9Context(Hash9Backend backend)
+    {
+        sph_blake512_init(&blake);
+        sph_bmw512_init(&bmw);
+        sph_skein512_init(&skein);
+        sph_jh512_init(&jh);
+        sph_keccak512_init(&keccak);
+        sph_luffa512_init(&luffa);
+        sph_cubehash512_init(&cubehash);
+        sph_simd512_init(&simd);
+        groestl = Groestl512Generic;
+        shavite = Shavite512Generic;
+        echo = Echo512Generic;
+#ifdef USE_HASH9_AESNI
+        if (backend == HASH9_AESNI)
+        {
+            groestl = Groestl512AESNI;
+            shavite = Shavite512AESNI;
+            echo = Echo512AESNI;
+        }
+#endif
+    }
+};
+
+#define HASH9_SPH_STAGE(name, ctx, pin, pout, nSize) do { \
+    sph_##name##512_context c = (ctx); \
+    sph_##name##512(&c, (pin), (nSize)); \
+    sph_##name##512_close(&c, (pout)); \
+} while (0)
+
+// Run every stage over nCount inputs, ping-ponging between two buffers
+void Hash9Stages(const CHash9Context& ctx, const unsigned char* pdata, size_t nSize, unsigned int nCount, uint256* phashOut)
+{
+    uint512 buf[2][HASH9_BATCH];
+    unsigned char* a[HASH9_BATCH];
+    unsigned char* b[HASH9_BATCH];
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        a[i] = buf[0][i].begin();
+        b[i] = buf[1][i].begin();
+    }
+
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(blake, ctx.blake, pdata + i * nSize, a[i], nSize);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(bmw, ctx.bmw, a[i], b[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        ctx.groestl(b[i], a[i]);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(skein, ctx.skein, a[i], b[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(jh, ctx.jh, b[i], a[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(keccak, ctx.keccak, a[i], b[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(luffa, ctx.luffa, b[i], a[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(cubehash, ctx.cubehash, a[i], b[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        ctx.shavite(b[i], a[i]);
+    for (unsigned int i = 0; i < nCount; i++)
+        HASH9_SPH_STAGE(simd, ctx.simd, a[i], b[i], HASH9_DIGEST_SIZE);
+    for (unsigned int i = 0; i < nCount; i++)
+        ctx.echo(b[i], a[i]);
+
+    for (unsigned int i = 0; i < nCount; i++)
+        phashOut[i] = buf[0][i].trim256();
+}
+}
+
+uint256 Hash9(Hash9Backend backend, const void* pdata, size_t nSize)
+{
+    CHash9Context ctx(backend);
+    uint256 hash;
+    Hash9Stages(ctx, (const unsigned char*)pdata, nSize, 1, &hash);
+    return hash;
+}
+
+void Hash9Batch(Hash9Backend backend, const unsigned char* pdata, size_t nSize, unsigned int nCount, uint256* phashOut)
+{
+    CHash9Context ctx(backend);
+    for (unsigned int i = 0; i < nCount; i += HASH9_BATCH)
+        Hash9Stages(ctx, pdata + i * nSize, nSize, min(nCount - i, HASH9_BATCH), phashOut + i);
+}
+
+void Hash9Batch(const unsigned char* pdata, size_t nSize, unsigned int nCount, uint256* phashOut)
+{
+    Hash9Batch(GetHash9Backend(), pdata, nSize, nCount, phashOut);
+}
@@ -0,0 +1,481 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headerssync.h"
+#include "checkpoints.h"
+
+using namespace std;
+
+CHeadersSync headersSync;
+
+static int64 MedianTime(const deque<int64>& vTimes)
+{
+    vector<int64> vSorted(vTimes.begin(), vTimes.end());
+    sort(vSorted.begin(), vSorted.end());
+    return vSorted[vSorted.size() / 2];
+}
+
+CHeadersSync::CHeadersSync() : fEnabled(true), nLastBlockReceived(0), nSyncPeer(-1), nHeadersRequested(0), fMoreHeaders(false)
+{
+}
+
+void CHeadersSync::SetEnabled(bool fEnabledIn)
+{
+    LOCK(cs);
+    fEnabled = fEnabledIn;
+}
+
+bool CHeadersSync::IsEnabled() const
+{
+    LOCK(cs);
+    return fEnabled;
+}
+
+bool CHeadersSync::IsActive() const
+{
+    LOCK(cs);
+    return fEnabled && (!vChain.empty() || nHeadersRequested != 0);
+}
+
+int CHeadersSync::GetBestHeaderHeight() const
+{
+    if (vChain.empty())
+        return nBestHeight;
+    return max(nBestHeight, vChain.back().nHeight);
+}
+
+bool CHeadersSync::CanServe(const CNode* pnode) const
+{
+    return pnode->nVersion != 0 && !pnode->fClient && !pnode->fOneShot && !pnode->fDisconnect;
+}
+
+void CHeadersSync::Prune()
+{
+    // Drop the headers of blocks that made it into the block index
+    while (!vChain.empty() && mapBlockIndex.count(vChain.front().hash))
+    {
+        nLastBlockReceived = GetTime();
+        MarkReceived(vChain.front().hash);
+        mapChainHeight.erase(vChain.front().hash);
+        vChain.pop_front();
+    }
+}
+
+void CHeadersSync::Truncate(unsigned int nSize)
+{
+    while (vChain.size() > nSize)
+    {
+        const CHeaderEntry& entry = vChain.back();
+        MarkReceived(entry.hash);
+        if (setHeld.erase(entry.hash))
+            mapHeld.erase(entry.hashPrev);
+        mapChainHeight.erase(entry.hash);
+        vChain.pop_back();
+    }
+}
+
+void CHeadersSync::DropPeerHeaders(int nodeid)
+{
+    // Everything from its first header on runs on from it
+    for (unsigned int i = 0; i < vChain.size(); i++)
+        if (vChain[i].nPeer == nodeid)
+        {
+            printf("headers sync: dropping %u headers from peer %d\n", (unsigned int)vChain.size() - i, nodeid);
+            Truncate(i);
+            nSyncPeer = -1;
+            nHeadersRequested = 0;
+            fMoreHeaders = false;
+            break;
+        }
+}
+
+void CHeadersSync::MarkReceived(const uint256& hash)
+{
+    map<uint256, pair<int, int64> >::iterator mi = mapInFlight.find(hash);
+    if (mi == mapInFlight.end())
+        return;
+    if (--mapPeerInFlight[mi->second.first] <= 0)
+        mapPeerInFlight.erase(mi->second.first);
+    mapInFlight.erase(mi);
+}
+
+vector<uint256> CHeadersSync::GetLocator() const
+{
+    // Exponentially larger steps back through the header chain, then on
+    // through the block index as CBlockLocator does
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vChain.size() - 1; i >= 0; i -= nStep)
+    {
+        vHave.push_back(vChain[i].hash);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+
+    CBlockIndex* pindex = pindexBest;
+    if (!vChain.empty())
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(vChain.front().hashPrev);
+        if (mi != mapBlockIndex.end())
+            pindex = mi->second;
+    }
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return vHave;
+}
+
+void CHeadersSync::PushGetHeaders(CNode* pnode)
+{
+    nSyncPeer = pnode->id;
+    nHeadersRequested = GetTime();
+    if (fDebugNet)
+        printf("headers sync: getheaders past %d from %s\n", GetBestHeaderHeight(), pnode->addr.ToString().c_str());
+    pnode->PushMessage("getheaders", CBlockLocator(GetLocator()), uint256(0));
+}
+
+bool CHeadersSync::AddHeaders(const vector<CBlock>& vHeaders, int& nDoS, int nPeer)
+{
+    LOCK(cs);
+    nDoS = 0;
+    Prune();
+
+    // Skip the headers already known, the rest has to run on from a block
+    // in the index or in the header chain
+    unsigned int nFirst = 0;
+    while (nFirst < vHeaders.size() &&
+           (mapBlockIndex.count(vHeaders[nFirst].GetHash()) || mapChainHeight.count(vHeaders[nFirst].GetHash())))
+        nFirst++;
+    if (nFirst == vHeaders.size())
+        return true;
+
+    const uint256 hashAnchor = vHeaders[nFirst].hashPrevBlock;
+    unsigned int nKeep = 0;
+    int nHeight;
+    unsigned int nBitsLastWork = 0, nBitsLastStake = 0;
+    deque<int64> vTimes; // newest first
+    CBlockIndex* pindex = NULL;
+    map<uint256, int>::iterator mi = mapChainHeight.find(hashAnchor);
+    if (mi != mapChainHeight.end())
+    {
+        nHeight = mi->second;
+        nKeep = nHeight - vChain.front().nHeight + 1;
+        nBitsLastWork = vChain[nKeep - 1].nBitsLastWork;
+        nBitsLastStake = vChain[nKeep - 1].nBitsLastStake;
+        for (int i = nKeep - 1; i >= 0 && vTimes.size() < CBlockIndex::nMedianTimeSpan; i--)
+            vTimes.push_back(vChain[i].nTime);
+        pindex = mapBlockIndex[vChain.front().hashPrev];
+    }
+    else
+    {
+        BlockMap::iterator mbi = mapBlockIndex.find(hashAnchor);
+        if (mbi == mapBlockIndex.end())
+        {
+            nDoS = 10;
+            return error("AddHeaders() : headers do not connect to a known block");
+        }
+        pindex = mbi->second;
+        nHeight = pindex->nHeight;
+        // proof-of-work ended at POW_CUTOFF_HEIGHT, no need to look for it past there
+        nBitsLastStake = GetLastBlockIndex(pindex, true)->nBits;
+        if (nHeight < POW_CUTOFF_HEIGHT)
+            nBitsLastWork = GetLastBlockIndex(pindex, false)->nBits;
+    }
+    for (; pindex && vTimes.size() < CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+        vTimes.push_back(pindex->GetBlockTime());
+
+    // A branch off the header chain or the index has to end up higher
+    if (nHeight + (int)(vHeaders.size() - nFirst) <= GetBestHeaderHeight())
+        return true;
+
+    vector<CHeaderEntry> vNew;
+    uint256 hashPrev = hashAnchor;
+    for (unsigned int i = nFirst; i < vHeaders.size() && nKeep + vNew.size() < MAX_HEADERS_AHEAD + MAX_HEADERS_RESULTS; i++)
+    {
+        const CBlock& header = vHeaders[i];
+        uint256 hash = header.GetHash();
+        if (header.hashPrevBlock != hashPrev)
+        {
+            nDoS = 20;
+            return error("AddHeaders() : non-continuous headers sequence");
+        }
+        nHeight++;
+
+        if (!Checkpoints::CheckHardened(nHeight, hash))
+        {
+            nDoS = 100;
+            return error("AddHeaders() : rejected by hardened checkpoint lock-in at %d", nHeight);
+        }
+
+        bool fProofOfStake;
+        if (!CheckHeaderTarget(hash, header.nBits, nHeight, nBitsLastWork, nBitsLastStake, fProofOfStake))
+        {
+            nDoS = 100;
+            return error("AddHeaders() : incorrect target at %d", nHeight);
+        }
+        (fProofOfStake ? nBitsLastStake : nBitsLastWork) = header.nBits;
+
+        // Timestamps as AcceptBlock and CheckBlock have them
+        if (header.GetBlockTime() <= MedianTime(vTimes) || header.GetBlockTime() + GetClockDrift(header.GetBlockTime()) < vTimes.front())
+            return error("AddHeaders() : header's timestamp is too early at %d", nHeight);
+        if (header.GetBlockTime() > GetAdjustedTime() + GetClockDrift(header.GetBlockTime()))
+            return error("AddHeaders() : header timestamp too far in the future at %d", nHeight);
+
+        CHeaderEntry entry;
+        entry.hash = hash;
+        entry.hashPrev = hashPrev;
+        entry.nHeight = nHeight;
+        entry.nTime = header.nTime;
+        entry.nBits = header.nBits;
+        entry.nBitsLastWork = nBitsLastWork;
+        entry.nBitsLastStake = nBitsLastStake;
+        entry.nPeer = nPeer;
+        vNew.push_back(entry);
+
+        vTimes.push_front(header.GetBlockTime());
+        if (vTimes.size() > CBlockIndex::nMedianTimeSpan)
+            vTimes.pop_back();
+        hashPrev = hash;
+    }
+
+    Truncate(nKeep);
+    if (vChain.empty())
+        nLastBlockReceived = GetTime();
+    BOOST_FOREACH(const CHeaderEntry& entry, vNew)
+    {
+        vChain.push_back(entry);
+        mapChainHeight[entry.hash] = entry.nHeight;
+    }
+    return true;
+}
+
+bool CHeadersSync::ProcessHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    LOCK(cs);
+    if (pfrom->id == nSyncPeer)
+        nHeadersRequested = 0;
+
+    int nDoS = 0;
+    if (!AddHeaders(vHeaders, nDoS, pfrom->id))
+    {
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+        return false;
+    }
+    printf("headers sync: %u headers from %s, header chain at %d\n", (unsigned int)vHeaders.size(), pfrom->addr.ToString().c_str(), GetBestHeaderHeight());
+
+    // A full answer means the peer has more
+    if (pfrom->id == nSyncPeer)
+    {
+        fMoreHeaders = (vHeaders.size() == MAX_HEADERS_RESULTS);
+        if (fMoreHeaders && vChain.size() < MAX_HEADERS_AHEAD)
+            PushGetHeaders(pfrom);
+    }
+    return true;
+}
+
+bool CHeadersSync::RequestHeaders(CNode* pnode)
+{
+    LOCK(cs);
+    if (!fEnabled || !CanServe(pnode) || setNoHeaders.count(pnode->id))
+        return false;
+    if (nHeadersRequested != 0 || pnode->nStartingHeight <= GetBestHeaderHeight())
+        return false;
+    // Stay with the peer the header chain is coming from until it is done
+    if (nSyncPeer != -1 && nSyncPeer != pnode->id && fMoreHeaders)
+        return false;
+    PushGetHeaders(pnode);
+    return true;
+}
+
+void CHeadersSync::RequestBlocks(CNode* pto)
+{
+    LOCK(cs);
+    if (!fEnabled || !CanServe(pto))
+        return;
+    int64 nNow = GetTime();
+    setPeers.insert(pto->id);
+    Prune();
+
+    if (!vChain.empty() && nNow - nLastBlockReceived > HEADER_CHAIN_TIMEOUT)
+    {
+        // The headers may have no blocks behind them at all: drop them and
+        // leave their sender to getblocks
+        int nPeer = vChain.front().nPeer;
+        printf("headers sync: no blocks along the header chain for %d seconds\n", (int)(nNow - nLastBlockReceived));
+        setNoHeaders.insert(nPeer);
+        DropPeerHeaders(nPeer);
+        nLastBlockReceived = nNow;
+        if (pto->id != nPeer)
+            pto->PushGetBlocks(pindexBest, uint256(0));
+    }
+
+    if (pto->id == nSyncPeer)
+    {
+        if (nHeadersRequested != 0 && nNow - nHeadersRequested > HEADERS_RESPONSE_TIMEOUT)
+        {
+            // Leave a peer that does not answer getheaders to getblocks
+            printf("headers sync: no headers from %s, asking for blocks instead\n", pto->addr.ToString().c_str());
+            setNoHeaders.insert(pto->id);
+            nSyncPeer = -1;
+            nHeadersRequested = 0;
+            fMoreHeaders = false;
+            pto->PushGetBlocks(pindexBest, uint256(0));
+        }
+        else if (nHeadersRequested == 0 && fMoreHeaders && vChain.size() < MAX_HEADERS_AHEAD)
+            PushGetHeaders(pto);
+    }
+    else
+        RequestHeaders(pto);
+
+    // Fill the peer's share of the download window
+    vector<CInv> vGetData;
+    int nInFlight = mapPeerInFlight.count(pto->id) ? mapPeerInFlight[pto->id] : 0;
+    bool fFront = true;
+    unsigned int nWindow = min((unsigned int)vChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; i < nWindow; i++)
+    {
+        const CHeaderEntry& entry = vChain[i];
+        if (setHeld.count(entry.hash) || mapBlockIndex.count(entry.hash))
+            continue;
+        bool fFrontBlock = fFront;
+        fFront = false;
+
+        map<uint256, pair<int, int64> >::iterator mi = mapInFlight.find(entry.hash);
+        if (mi != mapInFlight.end())
+        {
+            if (mi->second.first != pto->id)
+                continue;
+            int64 nWaited = nNow - mi->second.second;
+            if (fFrontBlock && nWaited > BLOCK_STALL_TIMEOUT && setPeers.size() > 1)
+            {
+                // Everything else waits on this one, let the others have it
+                printf("headers sync: %s stalled the download at %d, disconnecting\n", pto->addr.ToString().c_str(), entry.nHeight);
+                pto->fDisconnect = true;
+                FinalizeNode(pto->id);
+                return;
+            }
+            if (nWaited <= (fFrontBlock ? BLOCK_STALL_TIMEOUT : BLOCK_DOWNLOAD_TIMEOUT))
+                continue;
+            MarkReceived(entry.hash);
+            nInFlight--;
+        }
+
+        if (nInFlight >= MAX_BLOCKS_IN_FLIGHT_PER_PEER)
+            break;
+        if (pto->nStartingHeight < entry.nHeight && pto->id != nSyncPeer)
+            break;
+
+        vGetData.push_back(CInv(MSG_BLOCK, entry.hash));
+        mapInFlight[entry.hash] = make_pair(pto->id, nNow);
+        mapPeerInFlight[pto->id]++;
+        nInFlight++;
+    }
+
+    if (!vGetData.empty())
+    {
+        if (fDebugNet)
+            printf("headers sync: getdata %u blocks from %s\n", (unsigned int)vGetData.size(), pto->addr.ToString().c_str());
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
+bool CHeadersSync::BlockReceived(const CBlock& block)
+{
+    LOCK(cs);
+    uint256 hash = block.GetHash();
+    MarkReceived(hash);
+    if (!fEnabled || !mapChainHeight.count(hash))
+        return false;
+    nLastBlockReceived = GetTime();
+    if (mapBlockIndex.count(block.hashPrevBlock))
+        return false;
+    if (setHeld.count(hash))
+        return true;
+
+    // Only hold on to what the header promised, anything else goes the
+    // usual way and is rejected there
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return false;
+    mapHeld[block.hashPrevBlock] = block;
+    setHeld.insert(hash);
+    return true;
+}
+
+void CHeadersSync::BlockFailed(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, int>::iterator mi = mapChainHeight.find(hash);
+    if (mi == mapChainHeight.end() || vChain.empty() || mapBlockIndex.count(hash))
+        return;
+    unsigned int nPos = mi->second - vChain.front().nHeight;
+    if (!mapBlockIndex.count(vChain[nPos].hashPrev))
+        return;
+
+    // The headers from here on lead nowhere, start over from whoever has
+    // the best chain
+    printf("headers sync: block %s at %d rejected, dropping %u headers\n", hash.ToString().substr(0,20).c_str(), mi->second, (unsigned int)vChain.size() - nPos);
+    Truncate(nPos);
+    nSyncPeer = -1;
+    nHeadersRequested = 0;
+    fMoreHeaders = false;
+}
+
+bool CHeadersSync::PopHeldBlock(const uint256& hashPrev, CBlock& block)
+{
+    LOCK(cs);
+    map<uint256, CBlock>::iterator mi = mapHeld.find(hashPrev);
+    if (mi == mapHeld.end())
+        return false;
+    block = mi->second;
+    setHeld.erase(block.GetHash());
+    mapHeld.erase(mi);
+    return true;
+}
+
+void CHeadersSync::FinalizeNode(int nodeid)
+{
+    LOCK(cs);
+    for (map<uint256, pair<int, int64> >::iterator mi = mapInFlight.begin(); mi != mapInFlight.end(); )
+    {
+        if (mi->second.first == nodeid)
+            mapInFlight.erase(mi++);
+        else
+            ++mi;
+    }
+    mapPeerInFlight.erase(nodeid);
+    setPeers.erase(nodeid);
+    setNoHeaders.erase(nodeid);
+    DropPeerHeaders(nodeid);
+    if (nSyncPeer == nodeid)
+    {
+        nSyncPeer = -1;
+        nHeadersRequested = 0;
+        fMoreHeaders = false;
+    }
+}
+
+unsigned int CHeadersSync::GetChainSize() const
+{
+    LOCK(cs);
+    return vChain.size();
+}
+
+unsigned int CHeadersSync::GetInFlightCount() const
+{
+    LOCK(cs);
+    return mapInFlight.size();
+}
+
+unsigned int CHeadersSync::GetHeldCount() const
+{
+    LOCK(cs);
+    return mapHeld.size();
+}
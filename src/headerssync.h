@@ -0,0 +1,127 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_HEADERSSYNC_H
+#define HYPERSTAKE_HEADERSSYNC_H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "main.h"
+#include "sync.h"
+
+static const unsigned int MAX_HEADERS_AHEAD = 20000;          // headers held past the block index
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;       // how far past the first missing block to fetch
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+static const int64 HEADERS_RESPONSE_TIMEOUT = 60;             // seconds
+static const int64 BLOCK_STALL_TIMEOUT = 30;                  // seconds the first missing block may hold up the window
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 2 * 60;           // seconds before any other block is asked for again
+static const int64 HEADER_CHAIN_TIMEOUT = 5 * 60;             // seconds without a block along the header chain before it is dropped
+
+/** A block header accepted into the header chain */
+struct CHeaderEntry
+{
+    uint256 hash;
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    unsigned int nBits;
+    // targets of the last proof-of-work and proof-of-stake headers up to
+    // this one, 0 if not known
+    unsigned int nBitsLastWork;
+    unsigned int nBitsLastStake;
+    // the peer that sent it
+    int nPeer;
+};
+
+/** Headers-first initial block download.
+ * One peer at a time is asked for headers, which are checked on their own
+ * (linkage, timestamps, target and hardened checkpoints) and kept in a
+ * chain running on from the block index. Blocks along that chain are then
+ * fetched from every peer that can serve them, a window at a time, and
+ * those arriving ahead of their parent are held here until it is accepted
+ * instead of going to mapOrphanBlocks. A peer holding up the front of the
+ * window is disconnected and its blocks asked of the others. Headers are
+ * dropped with the peer that sent them, and when no block along them has
+ * come for a while, leaving the download to getblocks.
+ *
+ * Its own lock guards everything here. Calls that look at the block index
+ * as well (AddHeaders, ProcessHeaders, RequestHeaders, RequestBlocks,
+ * BlockReceived and BlockFailed) are made holding cs_main, taken first;
+ * FinalizeNode, PopHeldBlock and the getters need no more than their own.
+ */
+class CHeadersSync
+{
+private:
+    mutable CCriticalSection cs;
+    bool fEnabled;
+
+    std::deque<CHeaderEntry> vChain;
+    std::map<uint256, int> mapChainHeight;
+    // when a block along the header chain last came in
+    int64 nLastBlockReceived;
+
+    // peer the headers come from, and when it was last asked for them
+    int nSyncPeer;
+    int64 nHeadersRequested;
+    bool fMoreHeaders;
+    std::set<int> setNoHeaders;
+
+    // peers blocks can be asked of
+    std::set<int> setPeers;
+    // block hash -> (peer, time asked)
+    std::map<uint256, std::pair<int, int64> > mapInFlight;
+    std::map<int, int> mapPeerInFlight;
+    // blocks received before their parent, by parent hash
+    std::map<uint256, CBlock> mapHeld;
+    std::set<uint256> setHeld;
+
+    int GetBestHeaderHeight() const;
+    bool CanServe(const CNode* pnode) const;
+    void Prune();
+    void Truncate(unsigned int nSize);
+    void DropPeerHeaders(int nodeid);
+    void MarkReceived(const uint256& hash);
+    void PushGetHeaders(CNode* pnode);
+    std::vector<uint256> GetLocator() const;
+
+public:
+    CHeadersSync();
+
+    void SetEnabled(bool fEnabledIn);
+    bool IsEnabled() const;
+    // Whether blocks are being fetched by headers: getblocks and block
+    // inventory are left alone meanwhile
+    bool IsActive() const;
+
+    // Check headers and add them to the header chain; nDoS is set when
+    // the sender should be punished
+    bool AddHeaders(const std::vector<CBlock>& vHeaders, int& nDoS, int nPeer = -1);
+    bool ProcessHeaders(CNode* pfrom, const std::vector<CBlock>& vHeaders);
+
+    // Take pnode as the header source if it is ahead of us and nobody is
+    bool RequestHeaders(CNode* pnode);
+    // Ask pto for headers and blocks it can serve, and deal with it if it
+    // has been holding up the download
+    void RequestBlocks(CNode* pto);
+
+    // A block came in: true if it was held until its parent is accepted
+    bool BlockReceived(const CBlock& block);
+    // A block the header chain leads through was rejected: drop the
+    // headers from it on
+    void BlockFailed(const uint256& hash);
+    // Hand over the held block following hashPrev, if there is one
+    bool PopHeldBlock(const uint256& hashPrev, CBlock& block);
+
+    void FinalizeNode(int nodeid);
+
+    unsigned int GetChainSize() const;
+    unsigned int GetInFlightCount() const;
+    unsigned int GetHeldCount() const;
+};
+
+extern CHeadersSync headersSync;
+
+#endif
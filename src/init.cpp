@@ -10,6 +10,12 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "kernelhash.h"
+#include "hashblock.h"
+#include "sha256.h"
+#include "sigcache.h"
+#include "headerssync.h"
+#include "blockverifier.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -78,6 +84,18 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        blockVerifier.Interrupt();
+        blockVerifier.Wait();
+        {
+            LOCK(cs_main);
+            FlushCoinsCache(true);
+            if (GetBoolArg("-blockindexsnapshot", true))
+            {
+                CTxDB txdb;
+                txdb.WriteBlockIndexSnapshot();
+                txdb.Close();
+            }
+        }
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -148,8 +166,11 @@ std::string HelpMessage()
     strUsage += "  -gen                   " + _("Generate coins") + "\n";
     strUsage += "  -gen=0                 " + _("Don't generate coins") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + _("Set signature cache size in megabytes (default: 32)") + "\n";
+    strUsage += "  -maxtxindexcachesize=<n> " + _("Set the cache of transaction index records read from disk in megabytes (default: 16)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -dbbackend=<engine>    " + _("Keep the block index in bdb (blkindex.dat) or lsm (chaindb, copied from blkindex.dat the first time) (default: bdb)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
     strUsage += "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n";
@@ -172,7 +193,10 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -headersfirst          " + _("Download block headers first, then blocks from several peers at once (default: 1)") + "\n";
     strUsage += "  -stakeaddress=<address>" + _("Restrict the wallet to only stake inputs from one address") + "\n";
+    strUsage += "  -par=<n>               " + _("Number of script verification threads, 0 for one per core, -n to leave n cores free (default: 0, at most 16)") + "\n";
+    strUsage += "  -stakethreads=<n>      " + _("Number of threads searching for stake kernels, <= 0 for one per core (default: 1)") + "\n";
 	strUsage += "  -strictprotocol=<n>     " + _("Only connect to peers using the same protocol version. Warning this will cause low peer count.") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -193,6 +217,7 @@ std::string HelpMessage()
     strUsage += "  -testnet               " + _("Use the test network") + "\n";
     strUsage += "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n";
     strUsage += "  -debugnet              " + _("Output extra network debugging information") + "\n";
+    strUsage += "  -checkhashcache        " + _("Check every cached transaction hash against a fresh one (slow)") + "\n";
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n";
     strUsage += "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n";
     strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
@@ -210,8 +235,9 @@ std::string HelpMessage()
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
-    strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n";
+    strUsage += "  -checkblocks=<n>       " + _("How many blocks to check in the background after startup (default: 2500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -blockindexsnapshot    " + _("Keep a snapshot of the block index to start from (default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     
     strUsage += "\n" + _("Block creation options:") + "\n";
@@ -234,6 +260,9 @@ std::string HelpMessage()
 bool AppInit2()
 {
     // ********************************************************* Step 1: setup
+    // before any other thread can be hashing
+    SHA256AutoDetect();
+
 #ifdef _MSC_VER
     // Turn off Microsoft heap dump noise
     _CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_FILE);
@@ -321,6 +350,7 @@ bool AppInit2()
         fDebugNet = true;
     else
         fDebugNet = GetBoolArg("-debugnet");
+    fCheckHashCache = GetBoolArg("-checkhashcache");
 
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
 
@@ -343,6 +373,22 @@ bool AppInit2()
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps");
 
+    // -par=0 means one thread per core, -par=-n leaves n cores free
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+
+    // a quarter of -dbcache goes to the database engine, the rest holds
+    // transaction index changes until they are flushed
+    int64 nTotalCache = max(GetArg("-dbcache", DEFAULT_DB_CACHE), MIN_DB_CACHE) << 20;
+    nCoinCacheBytes = nTotalCache - nTotalCache / 4;
+
+    if (mapArgs.count("-maxsigcachesize"))
+        signatureCache.Resize(max((int64)0, min(GetArg("-maxsigcachesize", DEFAULT_MAX_SIGCACHE_SIZE), MAX_MAX_SIGCACHE_SIZE)) << 20);
+
+    if (mapArgs.count("-maxtxindexcachesize"))
+        txindexCache.Resize(max((int64)0, min(GetArg("-maxtxindexcachesize", DEFAULT_MAX_TXINDEX_CACHE_SIZE), MAX_MAX_TXINDEX_CACHE_SIZE)) << 20);
+
     if (mapArgs.count("-timeout"))
     {
         int nNewTimeout = GetArg("-timeout", 5000);
@@ -404,6 +450,13 @@ bool AppInit2()
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("HyperStake version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using %s stake kernel hashing\n", StakeHashBackendName(GetStakeHashBackend()));
+    printf("Using %s X11 block hashing\n", Hash9BackendName(GetHash9Backend()));
+    printf("Using %s SHA-256 hashing\n", SHA256BackendName(GetSHA256Backend()));
+
+    // started here rather than in Step 3 so they survive -daemon forking
+    SetScriptCheckThreads(nScriptCheckThreads);
+    printf("Using %d threads for script verification\n", nScriptCheckThreads);
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -513,6 +566,7 @@ bool AppInit2()
     fNoListen = !GetBoolArg("-listen", true);
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
+    headersSync.SetEnabled(GetBoolArg("-headersfirst", true));
 #ifdef USE_UPNP
     fUseUPnP = GetBoolArg("-upnp", USE_UPNP);
 #endif
@@ -578,6 +632,20 @@ bool AppInit2()
         return InitError(msg);
     }
 
+    string strBackend = GetArg("-dbbackend", "bdb");
+    if (strBackend == "lsm")
+    {
+        uiInterface.InitMessage(_("Opening chaindb..."));
+        if (!bitdb.OpenLSM(GetDataDir() / "chaindb", nTotalCache / 4))
+            return InitError(_("Error opening chaindb"));
+    }
+    else if (strBackend != "bdb")
+        return InitError(strprintf(_("Unknown -dbbackend engine: '%s'"), strBackend.c_str()));
+    else if (filesystem::exists(GetDataDir() / "chaindb"))
+        printf("Warning: chaindb is not used with -dbbackend=bdb, blkindex.dat is as it was before it was copied there\n");
+
+    pcoinsTip = new CCoinsViewCache(new CCoinsViewDB());
+
     if (GetBoolArg("-loadblockindextest"))
     {
         CTxDB txdb("r");
@@ -601,6 +669,7 @@ bool AppInit2()
         return false;
     }
     printf(" block index %15lldms\n", GetTimeMillis() - nStart);
+    printf(" block index entries %u, %lukB\n", (unsigned int)mapBlockIndex.size(), (unsigned long)(GetBlockIndexMemoryUsage() / 1024));
 
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
@@ -612,7 +681,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -775,6 +844,11 @@ bool AppInit2()
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
+    {
+        LOCK(cs_main);
+        blockVerifier.Start(GetArg("-checkblocks", DEFAULT_CHECKBLOCKS), GetArg("-checklevel", DEFAULT_CHECKLEVEL), nScriptCheckThreads);
+    }
+
     // ********************************************************* Step 12: finished
 
     uiInterface.InitMessage(_("Done loading"));
@@ -3,8 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
+#include "kernelhash.h"
 #include "db.h"
 
 using namespace std;
@@ -226,6 +229,56 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
     return true;
 }
 
+CStakeModifierIndex stakeModifierIndex;
+
+void CStakeModifierIndex::Connect(const CBlockIndex* pindex)
+{
+    DisconnectAbove(pindex->nHeight - 1);
+    if (!pindex->GeneratedStakeModifier())
+        return;
+    vBlocks.push_back(pindex);
+    vMaxTime.push_back(vMaxTime.empty() ? pindex->GetBlockTime() : max(vMaxTime.back(), pindex->GetBlockTime()));
+}
+
+void CStakeModifierIndex::DisconnectAbove(int nHeight)
+{
+    while (!vBlocks.empty() && vBlocks.back()->nHeight > nHeight)
+    {
+        vBlocks.pop_back();
+        vMaxTime.pop_back();
+    }
+}
+
+void CStakeModifierIndex::Rebuild(const CBlockIndex* pindexGenesis)
+{
+    clear();
+    for (const CBlockIndex* pindex = pindexGenesis; pindex; pindex = pindex->pnext)
+        Connect(pindex);
+}
+
+const CBlockIndex* CStakeModifierIndex::FindFirst(int nHeightFrom, int64 nTimeMin) const
+{
+    // skip the blocks at or below nHeightFrom
+    unsigned int nStart = 0, nEnd = vBlocks.size();
+    while (nStart < nEnd)
+    {
+        unsigned int nMid = (nStart + nEnd) / 2;
+        if (vBlocks[nMid]->nHeight <= nHeightFrom)
+            nStart = nMid + 1;
+        else
+            nEnd = nMid;
+    }
+
+    // vMaxTime is sorted, so the first candidate is found by bisection. Block
+    // times are not strictly increasing though, and an earlier block may have
+    // pushed the running maximum past nTimeMin; walk on to the real match.
+    vector<int64>::const_iterator it = lower_bound(vMaxTime.begin() + nStart, vMaxTime.end(), nTimeMin);
+    for (unsigned int i = it - vMaxTime.begin(); i < vBlocks.size(); i++)
+        if (vBlocks[i]->GetBlockTime() >= nTimeMin)
+            return vBlocks[i];
+    return NULL;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
@@ -237,30 +290,22 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
-    const CBlockIndex* pindex = pindexFrom;
 
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    // find the first modifier generated a selection interval after the coin
+    const CBlockIndex* pindex = NULL;
+    if (pindexFrom->IsInMainChain())
+        pindex = stakeModifierIndex.FindFirst(pindexFrom->nHeight, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+    if (!pindex)
     {
-        if (!pindex->pnext)
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
-                return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
-            else
-			{
-				//printf("FAILED BECAUSE no pindexnext\n");
-				return false;
-			}
-                
-        }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
-        {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
-        }
+        // reached best block; may happen if node is behind on block chain
+        const CBlockIndex* pindexLast = pindexFrom->IsInMainChain() ? pindexBest : pindexFrom;
+        if (fPrintProofOfStake || (pindexLast->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
+            return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
+                pindexLast->GetBlockHash().ToString().c_str(), pindexLast->nHeight, hashBlockFrom.ToString().c_str());
+        return false;
     }
+    nStakeModifierHeight = pindex->nHeight;
+    nStakeModifierTime = pindex->GetBlockTime();
     nStakeModifier = pindex->nStakeModifier;
     return true;
 }
@@ -318,16 +363,58 @@ bool stakeTargetHit(uint256 hashProofOfStake, unsigned int nAge, int64 nValueIn,
 	return (CBigNum(hashProofOfStake) < bnCoinWeight * bnTargetPerCoinDay);
 }
 
+void CStakeTarget::Set(unsigned int nAge, int64 nValueIn, const CBigNum& bnTargetPerCoinDay)
+{
+	int64 nTimeWeight = min((int64)nAge, (int64)nStakeMaxAge) - nStakeMinAge;
+	bnCoinWeight = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+
+	CBigNum bnTarget = bnCoinWeight * bnTargetPerCoinDay;
+	fAlwaysHit = (bnTarget > CBigNum(~uint256(0)));
+	hashTarget = (fAlwaysHit || bnTarget <= 0) ? 0 : bnTarget.getuint256();
+}
+
+// Collect the per-output kernel inputs, resolving the stake modifier once
+bool GetStakeKernelContext(const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev,
+    const COutPoint& prevout, CStakeKernelContext& context, bool fPrintProofOfStake)
+{
+    if (prevout.n >= txPrev.vout.size())
+        return error("GetStakeKernelContext() : prevout.n out of range");
+
+    context.hashBlockFrom = blockFrom.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(context.hashBlockFrom);
+    context.nHeightBlockFrom = (mi != mapBlockIndex.end() ? mi->second->nHeight : -1);
+    context.nTimeBlockFrom = blockFrom.GetBlockTime();
+    context.nTxPrevOffset = nTxPrevOffset;
+    context.nTxPrevTime = txPrev.nTime;
+    context.nValue = txPrev.vout[prevout.n].nValue;
+
+    //grab stake modifier - HyperStake improves hashing by only grabbing this once per utxo
+    return GetKernelStakeModifier(context.hashBlockFrom, context.nStakeModifier, context.nStakeModifierHeight,
+        context.nStakeModifierTime, fPrintProofOfStake);
+}
+
 //instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, 
 	const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, CBigNum& bnCoinWeight, bool fPrintProofOfStake)
+{
+	CStakeKernelContext context;
+	if (!GetStakeKernelContext(blockFrom, nTxPrevOffset, txPrev, prevout, context, fPrintProofOfStake))
+		return false;
+
+	return CheckStakeKernelHash(nBits, context, prevout, nTimeTx, nHashDrift, fCheck, hashProofOfStake, bnCoinWeight, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernelContext& context, const COutPoint& prevout, unsigned int& nTimeTx,
+    unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, CBigNum& bnCoinWeight, bool fPrintProofOfStake)
 {
     //assign new variables to make it easier to read
-	int64 nValueIn = txPrev.vout[prevout.n].nValue;
-	unsigned int nTxPrevTime = txPrev.nTime;
-	unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+	int64 nValueIn = context.nValue;
+	unsigned int nTxPrevTime = context.nTxPrevTime;
+	unsigned int nTimeBlockFrom = context.nTimeBlockFrom;
+	unsigned int nTxPrevOffset = context.nTxPrevOffset;
+	uint64 nStakeModifier = context.nStakeModifier;
 	
-	if (nTimeTx  < txPrev.nTime)  // Transaction timestamp violation
+	if (nTimeTx  < nTxPrevTime)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 	
 	if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
@@ -336,62 +423,228 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
 	//grab difficulty
 	CBigNum bnTargetPerCoinDay;
 	bnTargetPerCoinDay.SetCompact(nBits);
-	
-	//grab stake modifier - HyperStake improves hashing by only grabbing this once per utxo
-	uint64 nStakeModifier = 0;
-	int nStakeModifierHeight = 0;
-	int64 nStakeModifierTime = 0;
-	if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
-		return false;
 		
-	//create data stream once instead of repeating it in the loop
-	CDataStream ss(SER_GETHASH, 0);
-	ss << nStakeModifier;
-	
 	//if wallet is simply checking to make sure a hash is valid
 	if(fCheck)
 	{
+		CDataStream ss(SER_GETHASH, 0);
+		ss << nStakeModifier;
 		hashProofOfStake = stakeHash(nTimeTx, nTxPrevTime, ss, prevout.n, nTxPrevOffset, nTimeBlockFrom); 
 		return stakeTargetHit(hashProofOfStake, (int64)nTimeTx - nTxPrevTime, nValueIn, bnTargetPerCoinDay, bnCoinWeight);
 	}
 	
+	//the target only depends on the coin age, so it is worked out again only when nTimeTx moves
+	CStakeTarget target;
+	bool fRetarget = true;
+
     bool fSuccess = false;
 	unsigned int nTryTime = 0;
-	unsigned int i;
-	for(i = 0; i < (nHashDrift); i++) //iterate the hashing
+	unsigned int vTryTime[STAKEHASH_LANES];
+	uint256 vHashProof[STAKEHASH_LANES];
+	unsigned int i = 0;
+	while (i < nHashDrift) //iterate the hashing
 	{
-        fWalletStaking = true;
+		//hash the next batch of timestamps side by side
+		unsigned int nBatch = min(nHashDrift - i, STAKEHASH_LANES);
+		for (unsigned int j = 0; j < nBatch; j++)
+			vTryTime[j] = nTimeTx + nHashDrift - (i + j);
+		StakeHashBatch(nStakeModifier, nTimeBlockFrom, nTxPrevOffset, nTxPrevTime, prevout.n, vTryTime, vHashProof, nBatch);
+
+		unsigned int j;
+		for (j = 0; j < nBatch; j++)
+		{
+			nTryTime = vTryTime[j];
+			hashProofOfStake = vHashProof[j];
 
-        //hash this iteration
-		nTryTime = nTimeTx + nHashDrift - i;
-		hashProofOfStake = stakeHash(nTryTime, nTxPrevTime, ss, prevout.n, nTxPrevOffset, nTimeBlockFrom); 
+			if (fRetarget)
+			{
+				target.Set((int64)nTimeTx - nTxPrevTime, nValueIn, bnTargetPerCoinDay);
+				fRetarget = false;
+			}
 
-		// if stake hash does not meet the target then continue to next iteration
-		if(!stakeTargetHit(hashProofOfStake, (int64)nTimeTx - nTxPrevTime, nValueIn, bnTargetPerCoinDay, bnCoinWeight))
-			continue;
-		
-		fSuccess = true; // if we make it this far then we have successfully created a stake hash 
-		nTimeTx = nTryTime;
-		
-		if (fDebug || fPrintProofOfStake)
-		{
-			printf("CheckStakeKernelHash() : using modifier 0x%016llu at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
-				nStakeModifier, nStakeModifierHeight, 
-				DateTimeStrFormat(nStakeModifierTime).c_str(),
-				mapBlockIndex[blockFrom.GetHash()]->nHeight,
-				DateTimeStrFormat(blockFrom.GetBlockTime()).c_str());
-			printf("CheckStakeKernelHash() : pass protocol=%s modifier=0x%016llu nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-				"0.3",
-				nStakeModifier,
-				nTimeBlockFrom, nTxPrevOffset, nTxPrevTime, prevout.n, nTryTime,
-				hashProofOfStake.ToString().c_str());
+			// if stake hash does not meet the target then continue to next iteration
+			if(!target.Hit(hashProofOfStake))
+				continue;
+			
+			fSuccess = true; // if we make it this far then we have successfully created a stake hash 
+			nTimeTx = nTryTime;
+			fRetarget = true;
+			
+			if (fDebug || fPrintProofOfStake)
+			{
+				printf("CheckStakeKernelHash() : using modifier 0x%016llu at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
+					nStakeModifier, context.nStakeModifierHeight, 
+					DateTimeStrFormat(context.nStakeModifierTime).c_str(),
+					context.nHeightBlockFrom,
+					DateTimeStrFormat(nTimeBlockFrom).c_str());
+				printf("CheckStakeKernelHash() : pass protocol=%s modifier=0x%016llu nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
+					"0.3",
+					nStakeModifier,
+					nTimeBlockFrom, nTxPrevOffset, nTxPrevTime, prevout.n, nTryTime,
+					hashProofOfStake.ToString().c_str());
+			}
+
+			//the remaining timestamps are relative to the new nTimeTx, so hash them again
+			break;
 		}
+		i += (j < nBatch ? j + 1 : nBatch);
 	}
-	mapHashedBlocks.clear();
-	mapHashedBlocks[nBestHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+	if (nHashDrift)
+		bnCoinWeight = target.bnCoinWeight;
     return fSuccess;
 }
 
+// coins a worker claims at a time
+static const unsigned int STAKE_SEARCH_CHUNK = 8;
+
+void CStakeKernelSearch::Work(int nWorker)
+{
+    uint64 nHashes = 0;
+    while (!fShutdown)
+    {
+        unsigned int nBegin;
+        {
+            LOCK(cs);
+            nBegin = nNextChunk;
+            nNextChunk += STAKE_SEARCH_CHUNK;
+        }
+        unsigned int nEnd = min(nBegin + STAKE_SEARCH_CHUNK, size());
+
+        unsigned int i;
+        for (i = nBegin; i < nEnd && !fShutdown; i++)
+        {
+            {
+                // a kernel earlier in the list has already won
+                LOCK(cs);
+                if (nKernel >= 0 && i > (unsigned int)nKernel)
+                    break;
+            }
+
+            uint256 hashProofOfStake = 0;
+            vTimeTx[i] = nTimeTx;
+            bool fKernel = CheckStakeKernelHash(nBits, vContext[i], vPrevout[i], vTimeTx[i], nHashDrift, false, hashProofOfStake, vWeight[i]);
+            nHashes += nHashDrift;
+            if (fKernel)
+            {
+                LOCK(cs);
+                if (nKernel < 0 || i < (unsigned int)nKernel)
+                    nKernel = i;
+                break;
+            }
+        }
+        if (i < nEnd || nEnd == size())
+            break;
+    }
+
+    LOCK(cs);
+    vHashes[nWorker] = nHashes;
+}
+
+bool CStakeKernelSearch::Run(int nThreads)
+{
+    nThreads = max(1, min(nThreads, (int)((size() + STAKE_SEARCH_CHUNK - 1) / STAKE_SEARCH_CHUNK)));
+    nThreads = min(nThreads, 1 + stakeSearchThreads.GetThreadCount());
+    nNextChunk = 0;
+    nKernel = -1;
+    vTimeTx.assign(size(), nTimeTx);
+    vWeight.assign(size(), CBigNum(0));
+    vHashes.assign(nThreads, 0);
+
+    // shared state is only touched here, the workers just hash
+    if (size() && nHashDrift)
+        fWalletStaking = true;
+    stakeSearchThreads.Run(*this, nThreads - 1);
+
+    // every coin before the kernel was searched, whichever worker found it
+    unsigned int nSearched = (nKernel >= 0 ? nKernel + 1 : size());
+    bnWeight = 0;
+    for (unsigned int i = 0; i < nSearched; i++)
+        bnWeight += vWeight[i];
+
+    if (nKernel < 0)
+        return false;
+    nTimeKernel = vTimeTx[nKernel];
+    return true;
+}
+
+CStakeSearchThreads stakeSearchThreads;
+
+int GetStakeSearchThreads()
+{
+    int nThreads = GetArg("-stakethreads", 1);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    return max(nThreads, 1);
+}
+
+void CStakeSearchThreads::Thread(int nWorker, unsigned int nRoundDone)
+{
+    while (true)
+    {
+        CStakeKernelSearch* psearchNow;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && nRoundDone == nRound)
+                condWorker.wait(lock);
+            if (fQuit)
+                return;
+            nRoundDone = nRound;
+            if (nWorker > nActive)
+                continue;
+            psearchNow = psearch;
+        }
+
+        psearchNow->Work(nWorker);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (--nBusy == 0)
+            condMaster.notify_one();
+    }
+}
+
+void CStakeSearchThreads::Start(int nWorkers)
+{
+    boost::lock_guard<boost::mutex> control(controlMutex);
+    for (int i = 0; i < nWorkers; i++)
+    {
+        nThreads++;
+        threadGroup.create_thread(boost::bind(&CStakeSearchThreads::Thread, this, nThreads, nRound));
+    }
+}
+
+void CStakeSearchThreads::Stop()
+{
+    boost::lock_guard<boost::mutex> control(controlMutex);
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condWorker.notify_all();
+    threadGroup.join_all();
+    fQuit = false;
+    nThreads = 0;
+}
+
+void CStakeSearchThreads::Run(CStakeKernelSearch& search, int nWorkers)
+{
+    boost::lock_guard<boost::mutex> control(controlMutex);
+    nWorkers = max(0, min(nWorkers, nThreads));
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        psearch = &search;
+        nActive = nBusy = nWorkers;
+        nRound++;
+    }
+    condWorker.notify_all();
+
+    search.Work(0);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (nBusy > 0)
+        condMaster.wait(lock);
+    psearch = NULL;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake)
 {
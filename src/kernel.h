@@ -4,6 +4,8 @@
 #ifndef PPCOIN_KERNEL_H
 #define PPCOIN_KERNEL_H
 
+#include <boost/thread.hpp>
+
 #include "main.h"
 
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
@@ -16,16 +18,223 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+/** Main chain blocks that generated a stake modifier, in height order.
+ * Lets the kernel find the modifier a selection interval after a coin's
+ * block with a binary search instead of walking pnext. Mirrors the pnext
+ * links, so it is only touched where they are, under cs_main.
+ */
+class CStakeModifierIndex
+{
+private:
+    std::vector<const CBlockIndex*> vBlocks;
+    std::vector<int64> vMaxTime; // running maximum of the block times in vBlocks
+
+public:
+    // pindex has become the new tip of the main chain
+    void Connect(const CBlockIndex* pindex);
+    // drop the blocks above nHeight, which have left the main chain
+    void DisconnectAbove(int nHeight);
+    // reload from the pnext links starting at pindexGenesis
+    void Rebuild(const CBlockIndex* pindexGenesis);
+    // first block above nHeightFrom with a timestamp of at least nTimeMin
+    const CBlockIndex* FindFirst(int nHeightFrom, int64 nTimeMin) const;
+
+    void clear()
+    {
+        vBlocks.clear();
+        vMaxTime.clear();
+    }
+
+    unsigned int size() const
+    {
+        return vBlocks.size();
+    }
+};
+
+extern CStakeModifierIndex stakeModifierIndex;
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+/** Everything the kernel hash needs to know about a staked output, besides
+ * the candidate timestamp. None of it changes until the output is spent or
+ * the chain after the output's block is reorganized, so stakers may cache it.
+ */
+class CStakeKernelContext
+{
+public:
+    uint256 hashBlockFrom;
+    int nHeightBlockFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTxPrevTime;
+    int64 nValue;
+    uint64 nStakeModifier;
+    int nStakeModifierHeight;
+    int64 nStakeModifierTime;
+
+    CStakeKernelContext()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        hashBlockFrom = 0;
+        nHeightBlockFrom = -1;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTxPrevTime = 0;
+        nValue = 0;
+        nStakeModifier = 0;
+        nStakeModifierHeight = 0;
+        nStakeModifierTime = 0;
+    }
+};
+
+// Resolve the kernel context of prevout, including its stake modifier
+bool GetStakeKernelContext(const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev,
+    const COutPoint& prevout, CStakeKernelContext& context, bool fPrintProofOfStake=false);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, 
 	const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nInterval, bool fCheck, uint256& hashProofOfStake, CBigNum& bnCoinWeight, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernelContext& context, const COutPoint& prevout, unsigned int& nTimeTx,
+    unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, CBigNum& bnCoinWeight, bool fPrintProofOfStake=false);
+/** Hash target of one coin, worked out once for a whole drift window so each
+ * attempt is a plain 256 bit compare instead of CBigNum arithmetic.
+ */
+class CStakeTarget
+{
+public:
+    CBigNum bnCoinWeight;
+    uint256 hashTarget;
+    bool fAlwaysHit; // target is at least 2^256, every hash meets it
+
+    CStakeTarget()
+    {
+        hashTarget = 0;
+        fAlwaysHit = false;
+    }
+
+    void Set(unsigned int nAge, int64 nValueIn, const CBigNum& bnTargetPerCoinDay);
+
+    // same answer as stakeTargetHit() with the arguments given to Set()
+    bool Hit(const uint256& hashProofOfStake) const
+    {
+        return fAlwaysHit || hashProofOfStake < hashTarget;
+    }
+};
+
 uint256 stakeHash(unsigned int nTimeTx, unsigned int nTxPrevTime, CDataStream ss, unsigned int prevoutIndex, unsigned int nTxPrevOffset, unsigned int nTimeBlockFrom);
 bool stakeTargetHit(uint256 hashProofOfStake, unsigned int nAge, int64 nValueIn, CBigNum bnTargetPerCoinDay, CBigNum& bnCoinWeight);
 
+class CStakeKernelSearch;
+
+/** The worker threads stake kernel searches are shared with, kept for the
+ * life of the stake minter so a search does not start threads of its own.
+ * One search runs on them at a time.
+ */
+class CStakeSearchThreads
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    CStakeKernelSearch* psearch; // the search running, if any
+    unsigned int nRound;         // bumped for every search
+    int nActive;                 // workers taking part in this round
+    int nBusy;                   // of those, the ones not done yet
+    bool fQuit;
+
+    // serializes searches, and searches against Start/Stop
+    boost::mutex controlMutex;
+    boost::thread_group threadGroup;
+    int nThreads;
+
+    void Thread(int nWorker, unsigned int nRoundDone);
+
+public:
+    CStakeSearchThreads() : psearch(NULL), nRound(0), nActive(0), nBusy(0), fQuit(false), nThreads(0) {}
+    ~CStakeSearchThreads() { Stop(); }
+
+    // Start nWorkers threads next to the searching one
+    void Start(int nWorkers);
+    void Stop();
+    // Run search.Work() on nWorkers of the threads and the calling one
+    void Run(CStakeKernelSearch& search, int nWorkers);
+
+    int GetThreadCount()
+    {
+        boost::lock_guard<boost::mutex> control(controlMutex);
+        return nThreads;
+    }
+};
+
+extern CStakeSearchThreads stakeSearchThreads;
+
+// Threads a kernel search should use, from -stakethreads
+int GetStakeSearchThreads();
+
+/** Searches a list of coins for the first stake kernel that meets the target,
+ * sharing the work with stakeSearchThreads. Workers claim small chunks of
+ * the list in order and stop starting coins past the lowest kernel found, so
+ * the result is the same as a single thread searching the list in order.
+ */
+class CStakeKernelSearch
+{
+    friend class CStakeSearchThreads;
+
+private:
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nHashDrift;
+    std::vector<COutPoint> vPrevout;
+    std::vector<CStakeKernelContext> vContext;
+
+    // per coin results, filled in by the workers
+    std::vector<unsigned int> vTimeTx;
+    std::vector<CBigNum> vWeight;
+
+    CCriticalSection cs;
+    unsigned int nNextChunk;
+
+    void Work(int nWorker);
+
+public:
+    // result of Run()
+    int nKernel; // index of the coin that found a kernel, -1 if none
+    unsigned int nTimeKernel;
+    CBigNum bnWeight; // weight of the coins searched, up to the kernel
+    std::vector<uint64> vHashes; // hashes tried by each worker
+
+    CStakeKernelSearch(unsigned int nBitsIn, unsigned int nTimeTxIn, unsigned int nHashDriftIn)
+    {
+        nBits = nBitsIn;
+        nTimeTx = nTimeTxIn;
+        nHashDrift = nHashDriftIn;
+        nNextChunk = 0;
+        nKernel = -1;
+        nTimeKernel = 0;
+    }
+
+    void Add(const COutPoint& prevout, const CStakeKernelContext& context)
+    {
+        vPrevout.push_back(prevout);
+        vContext.push_back(context);
+    }
+
+    unsigned int size() const
+    {
+        return vPrevout.size();
+    }
+
+    // search with up to nThreads workers, the calling thread being one of
+    // them and the rest taken from stakeSearchThreads
+    bool Run(int nThreads);
+};
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake);
@@ -0,0 +1,235 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+
+#include "kernelhash.h"
+#include "util.h"
+
+using namespace std;
+
+// The kernel is serialized as nStakeModifier, nTimeBlockFrom, nTxPrevOffset,
+// nTxPrevTime, prevout.n and nTimeTx: 28 bytes, a single sha256 block, with
+// nTimeTx in the last four bytes.
+static const unsigned int STAKEHASH_MESSAGE_SIZE = 28;
+static const unsigned int STAKEHASH_TIME_OFFSET = 24;
+
+static void StakeHashScalar(unsigned char* pchMessage, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount)
+{
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        memcpy(pchMessage + STAKEHASH_TIME_OFFSET, &pnTimeTx[i], sizeof(pnTimeTx[i]));
+        phashOut[i] = Hash(pchMessage, pchMessage + STAKEHASH_MESSAGE_SIZE);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_STAKEHASH_SIMD
+#endif
+
+#ifdef USE_STAKEHASH_SIMD
+namespace
+{
+// Eight lanes of sha256 state. Built for sse2 the compiler splits each
+// operation over two xmm registers, built for avx2 it uses one ymm register.
+typedef unsigned int v8u __attribute__((vector_size(32)));
+
+const unsigned int K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const unsigned int H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) ((((y) ^ (z)) & (x)) ^ (z))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SIGMA0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define sigma0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define sigma1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+// Apply rounds nBegin..nEnd-1 to s. w holds the sixteen message words and is
+// expanded in place, so rounds past 15 must run in order.
+template<typename T>
+inline __attribute__((always_inline)) void Rounds(T* s, T* w, int nBegin, int nEnd)
+{
+    T a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = nBegin; i < nEnd; i++)
+    {
+        if (i >= 16)
+            w[i & 15] += sigma1(w[(i - 2) & 15]) + w[(i - 7) & 15] + sigma0(w[(i - 15) & 15]);
+        T t1 = h + SIGMA1(e) + CH(e, f, g) + K[i] + w[i & 15];
+        T t2 = SIGMA0(a) + MAJ(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] = a; s[1] = b; s[2] = c; s[3] = d; s[4] = e; s[5] = f; s[6] = g; s[7] = h;
+}
+
+inline unsigned int ReadBE32(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+inline __attribute__((always_inline)) void Broadcast(v8u& v, unsigned int x)
+{
+    v8u r = {x, x, x, x, x, x, x, x};
+    v = r;
+}
+
+inline __attribute__((always_inline)) void StakeHash8(const unsigned char* pchMessage, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount)
+{
+    // message words, with the padding for a 28 byte message
+    unsigned int w[16];
+    for (int i = 0; i < 6; i++)
+        w[i] = ReadBE32(pchMessage + 4 * i);
+    w[6] = 0;
+    w[7] = 0x80000000;
+    for (int i = 8; i < 15; i++)
+        w[i] = 0;
+    w[15] = STAKEHASH_MESSAGE_SIZE * 8;
+
+    // the first six rounds only see the shared words; run them once
+    unsigned int mid[8];
+    memcpy(mid, H0, sizeof(mid));
+    Rounds(mid, w, 0, 6);
+
+    v8u s[8], wv[16];
+    for (int i = 0; i < 8; i++)
+        Broadcast(s[i], mid[i]);
+    for (int i = 0; i < 16; i++)
+        Broadcast(wv[i], w[i]);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        unsigned char pchTime[4];
+        memcpy(pchTime, &pnTimeTx[i], sizeof(pchTime));
+        wv[6][i] = ReadBE32(pchTime);
+    }
+    Rounds(s, wv, 6, 64);
+
+    // second sha256 over the 32 byte digest
+    v8u s2[8];
+    for (int i = 0; i < 8; i++)
+    {
+        wv[i] = s[i] + H0[i];
+        Broadcast(s2[i], H0[i]);
+    }
+    Broadcast(wv[8], 0x80000000);
+    for (int i = 9; i < 15; i++)
+        Broadcast(wv[i], 0);
+    Broadcast(wv[15], 256);
+    Rounds(s2, wv, 0, 64);
+
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        unsigned char* p = phashOut[i].begin();
+        for (int j = 0; j < 8; j++)
+        {
+            unsigned int x = s2[j][i] + H0[j];
+            p[4 * j] = x >> 24;
+            p[4 * j + 1] = x >> 16;
+            p[4 * j + 2] = x >> 8;
+            p[4 * j + 3] = x;
+        }
+    }
+}
+
+__attribute__((target("sse2"))) void StakeHash8SSE2(const unsigned char* pchMessage, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount)
+{
+    StakeHash8(pchMessage, pnTimeTx, phashOut, nCount);
+}
+
+__attribute__((target("avx2"))) void StakeHash8AVX2(const unsigned char* pchMessage, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount)
+{
+    StakeHash8(pchMessage, pnTimeTx, phashOut, nCount);
+}
+}
+#endif
+
+bool StakeHashBackendSupported(StakeHashBackend backend)
+{
+    switch (backend)
+    {
+    case STAKEHASH_SCALAR:
+        return true;
+#ifdef USE_STAKEHASH_SIMD
+    case STAKEHASH_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case STAKEHASH_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+static StakeHashBackend SelectStakeHashBackend()
+{
+    if (StakeHashBackendSupported(STAKEHASH_AVX2))
+        return STAKEHASH_AVX2;
+    if (StakeHashBackendSupported(STAKEHASH_SSE2))
+        return STAKEHASH_SSE2;
+    return STAKEHASH_SCALAR;
+}
+
+StakeHashBackend GetStakeHashBackend()
+{
+    static StakeHashBackend backend = SelectStakeHashBackend();
+    return backend;
+}
+
+const char* StakeHashBackendName(StakeHashBackend backend)
+{
+    switch (backend)
+    {
+    case STAKEHASH_SCALAR: return "scalar";
+    case STAKEHASH_SSE2: return "sse2";
+    case STAKEHASH_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+void StakeHashBatch(StakeHashBackend backend, uint64 nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+    unsigned int nTxPrevTime, unsigned int nPrevout, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount)
+{
+    // same bytes CDataStream would produce for the kernel
+    unsigned char pchMessage[STAKEHASH_MESSAGE_SIZE];
+    memcpy(pchMessage, &nStakeModifier, 8);
+    memcpy(pchMessage + 8, &nTimeBlockFrom, 4);
+    memcpy(pchMessage + 12, &nTxPrevOffset, 4);
+    memcpy(pchMessage + 16, &nTxPrevTime, 4);
+    memcpy(pchMessage + 20, &nPrevout, 4);
+
+    for (unsigned int i = 0; i < nCount; i += STAKEHASH_LANES)
+    {
+        unsigned int nLanes = min(nCount - i, STAKEHASH_LANES);
+        switch (backend)
+        {
+#ifdef USE_STAKEHASH_SIMD
+        case STAKEHASH_SSE2:
+            StakeHash8SSE2(pchMessage, pnTimeTx + i, phashOut + i, nLanes);
+            break;
+        case STAKEHASH_AVX2:
+            StakeHash8AVX2(pchMessage, pnTimeTx + i, phashOut + i, nLanes);
+            break;
+#endif
+        default:
+            StakeHashScalar(pchMessage, pnTimeTx + i, phashOut + i, nLanes);
+            break;
+        }
+    }
+}
+
+void StakeHashBatch(uint64 nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+    unsigned int nTxPrevTime, unsigned int nPrevout, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount)
+{
+    StakeHashBatch(GetStakeHashBackend(), nStakeModifier, nTimeBlockFrom, nTxPrevOffset, nTxPrevTime, nPrevout, pnTimeTx, phashOut, nCount);
+}
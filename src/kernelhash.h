@@ -0,0 +1,35 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_KERNELHASH_H
+#define HYPERSTAKE_KERNELHASH_H
+
+#include "uint256.h"
+
+/** Batched proof-of-stake kernel hashing.
+ * The drift loop in CheckStakeKernelHash hashes the same 28 byte message
+ * with only nTimeTx changing, so the candidates are hashed side by side in
+ * SIMD lanes. Every backend returns exactly what stakeHash() would.
+ */
+enum StakeHashBackend
+{
+    STAKEHASH_SCALAR,
+    STAKEHASH_SSE2,
+    STAKEHASH_AVX2,
+};
+
+// Number of kernel hashes the vector backends compute per pass
+static const unsigned int STAKEHASH_LANES = 8;
+
+bool StakeHashBackendSupported(StakeHashBackend backend);
+// Fastest backend the running cpu supports
+StakeHashBackend GetStakeHashBackend();
+const char* StakeHashBackendName(StakeHashBackend backend);
+
+// Hash nCount kernels that differ only in their timestamp pnTimeTx[i]
+void StakeHashBatch(StakeHashBackend backend, uint64 nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+    unsigned int nTxPrevTime, unsigned int nPrevout, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount);
+void StakeHashBatch(uint64 nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+    unsigned int nTxPrevTime, unsigned int nPrevout, const unsigned int* pnTimeTx, uint256* phashOut, unsigned int nCount);
+
+#endif
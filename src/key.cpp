@@ -14,6 +14,31 @@
 #include "key.h"
 #include "bignum.h"
 
+// The curve with its generator multiples precomputed, built once. Keys get
+// a copy of it, which shares the table, instead of constructing the curve
+// again for every public key a signature is checked against.
+static EC_GROUP* NewPrecomputedGroup()
+{
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    if (group != NULL)
+        EC_GROUP_precompute_mult(group, NULL);
+    return group;
+}
+
+static EC_KEY* NewSecp256k1Key()
+{
+    static EC_GROUP* const group = NewPrecomputedGroup();
+    if (group == NULL)
+        return NULL;
+    EC_KEY* pkey = EC_KEY_new();
+    if (pkey != NULL && !EC_KEY_set_group(pkey, group))
+    {
+        EC_KEY_free(pkey);
+        return NULL;
+    }
+    return pkey;
+}
+
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
 {
@@ -144,9 +169,9 @@ void CKey::Reset()
     fCompressedPubKey = false;
     if (pkey != NULL)
         EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
     if (pkey == NULL)
-        throw key_error("CKey::CKey() : EC_KEY_new_by_curve_name failed");
+        throw key_error("CKey::CKey() : NewSecp256k1Key failed");
     fSet = false;
 }
 
@@ -226,9 +251,9 @@ bool CKey::SetPrivKey(const CPrivKey& vchPrivKey)
 bool CKey::SetSecret(const CSecret& vchSecret, bool fCompressed)
 {
     EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
     if (pkey == NULL)
-        throw key_error("CKey::SetSecret() : EC_KEY_new_by_curve_name failed");
+        throw key_error("CKey::SetSecret() : NewSecp256k1Key failed");
     if (vchSecret.size() != 32)
         throw key_error("CKey::SetSecret() : secret must be 32 bytes");
     BIGNUM *bn = BN_bin2bn(&vchSecret[0],32,BN_new());
@@ -291,9 +316,9 @@ bool CKey::SetPrivKey_Raw(const uint256& privKey, bool fCompressed)
     BIGNUM* bn = (BIGNUM*)vp;
 
     EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
     if (pkey == NULL)
-        throw key_error("CKey::SetSecret() : EC_KEY_new_by_curve_name failed");
+        throw key_error("CKey::SetSecret() : NewSecp256k1Key failed");
     if (bn == NULL)
         throw key_error("CKey::SetSecret() : BN_bin2bn failed");
     if (!EC_KEY_regenerate_key(pkey,bn))
@@ -430,7 +455,7 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     #endif
 
     EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
     if (nV >= 31)
     {
         SetCompressedPubKey();
@@ -471,8 +496,7 @@ bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSigParam)
 	if (vchSig.empty())
         return false;
 
-    // New versions of OpenSSL will reject non-canonical DER signatures. de/re-serialize first.
-    unsigned char *norm_der = NULL;
+    // New versions of OpenSSL will reject non-canonical DER signatures, so parse it leniently first.
     ECDSA_SIG *norm_sig = ECDSA_SIG_new();
     const unsigned char* sigptr = &vchSig[0];
     assert(norm_sig);
@@ -487,14 +511,12 @@ bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSigParam)
         ECDSA_SIG_free(norm_sig);
         return false;
     }
-    int derlen = i2d_ECDSA_SIG(norm_sig, &norm_der);
-    ECDSA_SIG_free(norm_sig);
-    if (derlen <= 0)
-        return false;
 
+    // Verify the parsed signature directly: ECDSA_verify would only encode
+    // it again and parse that a second time
     // -1 = error, 0 = bad sig, 1 = good
-    bool ret = ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), norm_der, derlen, pkey) == 1;
-    OPENSSL_free(norm_der);
+    bool ret = ECDSA_do_verify((unsigned char*)&hash, sizeof(hash), norm_sig, pkey) == 1;
+    ECDSA_SIG_free(norm_sig);
     return ret;
 }
 
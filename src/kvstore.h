@@ -0,0 +1,50 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_KVSTORE_H
+#define HYPERSTAKE_KVSTORE_H
+
+#include "serialize.h"
+
+// CKVCursor::Read results besides 0
+static const int KV_NOTFOUND = -1;
+static const int KV_ERROR = -2;
+
+/** Changes made to a CKVStore that take effect together on Commit() */
+class CKVTxn
+{
+public:
+    virtual ~CKVTxn() {}
+    virtual bool Commit() = 0;
+    virtual bool Abort() = 0;
+};
+
+/** The keys of a CKVStore in order */
+class CKVCursor
+{
+public:
+    virtual ~CKVCursor() {}
+    // The first key not below ssKey if fSeek, else the key after the last
+    // one read (the first key if none was). Returns 0, KV_NOTFOUND past the
+    // last key, or KV_ERROR.
+    virtual int Read(CDataStream& ssKey, CDataStream& ssValue, bool fSeek) = 0;
+};
+
+/** The records of one database file, whatever engine keeps them. Keys and
+ * values stay in CDataStreams so wallet secrets are wiped when freed.
+ * Writes and erases given a ptxn are made in it; it must have come from
+ * TxnBegin() of a store of the same engine. */
+class CKVStore
+{
+public:
+    virtual ~CKVStore() {}
+    virtual bool Read(const CDataStream& ssKey, CDataStream& ssValue, CKVTxn* ptxn=NULL) = 0;
+    virtual bool Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite=true, CKVTxn* ptxn=NULL) = 0;
+    virtual bool Erase(const CDataStream& ssKey, CKVTxn* ptxn=NULL) = 0;
+    virtual bool Exists(const CDataStream& ssKey, CKVTxn* ptxn=NULL) = 0;
+    // The caller deletes these
+    virtual CKVCursor* NewCursor() = 0;
+    virtual CKVTxn* TxnBegin() = 0;
+};
+
+#endif
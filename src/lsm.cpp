@@ -0,0 +1,1315 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lsm.h"
+#include "util.h"
+
+#include <algorithm>
+#include <set>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+
+using namespace std;
+using namespace boost;
+
+static const unsigned int LSM_MAGIC = 0x314d534c; // "LSM1"
+static const int LSM_VERSION = 1;
+static const unsigned int LSM_FOOTER_SIZE = 16;
+
+static uint64 Checksum(const CDataStream& ss, unsigned int nSize)
+{
+    return Hash(ss.begin(), ss.begin() + nSize).Get64();
+}
+
+static bool ReadAt(FILE* file, uint64 nPos, unsigned int nSize, CDataStream& ss)
+{
+    ss.resize(nSize);
+    if (fseek(file, nPos, SEEK_SET) != 0)
+        return false;
+    return nSize == 0 || fread(&ss[0], 1, nSize, file) == nSize;
+}
+
+// Append ss and its checksum
+static bool WriteChecked(FILE* file, const CDataStream& ss)
+{
+    CDataStream ssChecksum(SER_DISK, CLIENT_VERSION);
+    ssChecksum << Checksum(ss, ss.size());
+    return (ss.empty() || fwrite(&ss[0], 1, ss.size(), file) == ss.size()) &&
+           fwrite(&ssChecksum[0], 1, ssChecksum.size(), file) == ssChecksum.size();
+}
+
+static bool CheckChecksum(CDataStream& ss)
+{
+    if (ss.size() < sizeof(uint64))
+        return false;
+    unsigned int nSize = ss.size() - sizeof(uint64);
+    uint64 nChecksum;
+    memcpy(&nChecksum, &ss[nSize], sizeof(nChecksum));
+    if (nChecksum != Checksum(ss, nSize))
+        return false;
+    ss.resize(nSize);
+    return true;
+}
+
+
+//
+// Tables
+//
+
+struct CLSMBlockHandle
+{
+    std::string strFirstKey;
+    uint64 nOffset;
+    unsigned int nSize;     // without the checksum
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(strFirstKey);
+        READWRITE(nOffset);
+        READWRITE(nSize);
+    )
+};
+
+/** A sorted table file: blocks of records, each with a checksum, then the
+ * first key of every block, then a footer saying where that index is. */
+class CLSMTable
+{
+public:
+    unsigned int nNumber;
+    boost::filesystem::path path;
+    FILE* file;
+    uint64 nSize;
+    std::string strSmallest;
+    std::string strLargest;
+    std::vector<CLSMBlockHandle> vIndex;
+    bool fObsolete;         // remove the file once nothing reads it
+
+    CLSMTable(unsigned int nNumberIn, const boost::filesystem::path& pathIn) :
+        nNumber(nNumberIn), path(pathIn), file(NULL), nSize(0), fObsolete(false) {}
+
+    ~CLSMTable()
+    {
+        if (file)
+            fclose(file);
+        if (fObsolete)
+        {
+            boost::system::error_code ec;
+            filesystem::remove(path, ec);
+        }
+    }
+
+    bool Open()
+    {
+        file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return error("CLSMTable::Open() : cannot open %s", path.string().c_str());
+        int nFileSize = GetFilesize(file);
+        if (nFileSize < (int)LSM_FOOTER_SIZE)
+            return error("CLSMTable::Open() : %s too short", path.string().c_str());
+        nSize = nFileSize;
+
+        CDataStream ssFooter(SER_DISK, CLIENT_VERSION);
+        uint64 nIndexOffset;
+        unsigned int nIndexSize, nMagic;
+        if (!ReadAt(file, nSize - LSM_FOOTER_SIZE, LSM_FOOTER_SIZE, ssFooter))
+            return error("CLSMTable::Open() : cannot read %s", path.string().c_str());
+        ssFooter >> nIndexOffset >> nIndexSize >> nMagic;
+        if (nMagic != LSM_MAGIC || nIndexOffset + nIndexSize + sizeof(uint64) + LSM_FOOTER_SIZE != nSize)
+            return error("CLSMTable::Open() : %s is not a table", path.string().c_str());
+
+        CDataStream ssIndex(SER_DISK, CLIENT_VERSION);
+        if (!ReadAt(file, nIndexOffset, nIndexSize + sizeof(uint64), ssIndex) || !CheckChecksum(ssIndex))
+            return error("CLSMTable::Open() : index of %s corrupted", path.string().c_str());
+        try {
+            ssIndex >> vIndex >> strLargest;
+        }
+        catch (std::exception &e) {
+            return error("CLSMTable::Open() : index of %s corrupted", path.string().c_str());
+        }
+        if (vIndex.empty())
+            return error("CLSMTable::Open() : %s is empty", path.string().c_str());
+        strSmallest = vIndex[0].strFirstKey;
+        return true;
+    }
+
+    // The block strKey would be in
+    unsigned int FindBlock(const std::string& strKey) const
+    {
+        unsigned int nLow = 0, nHigh = vIndex.size();
+        while (nHigh - nLow > 1)
+        {
+            unsigned int nMid = (nLow + nHigh) / 2;
+            if (vIndex[nMid].strFirstKey <= strKey)
+                nLow = nMid;
+            else
+                nHigh = nMid;
+        }
+        return nLow;
+    }
+
+    bool Contains(const std::string& strKey) const
+    {
+        return strSmallest <= strKey && strKey <= strLargest;
+    }
+
+    bool Overlaps(const std::string& strBegin, const std::string& strEnd) const
+    {
+        return !(strLargest < strBegin || strEnd < strSmallest);
+    }
+};
+
+typedef boost::shared_ptr<CLSMTable> TablePtr;
+
+static bool CompareSmallest(const TablePtr& a, const TablePtr& b)
+{
+    return a->strSmallest < b->strSmallest;
+}
+
+static bool RecordKeyLess(const CLSMRecord& record, const std::string& strKey)
+{
+    return record.strKey < strKey;
+}
+
+// Writes records out as table files of about nTableSize
+class CLSMTableWriter
+{
+private:
+    const CLSMOptions& options;
+    FILE* file;
+    boost::filesystem::path path;
+    uint64 nOffset;
+    std::vector<CLSMRecord> vBlock;
+    uint64 nBlockSize;
+    std::vector<CLSMBlockHandle> vIndex;
+    std::string strLast;
+
+    bool WriteBlock()
+    {
+        if (vBlock.empty())
+            return true;
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vBlock;
+        CLSMBlockHandle handle;
+        handle.strFirstKey = vBlock[0].strKey;
+        handle.nOffset = nOffset;
+        handle.nSize = ss.size();
+        if (!WriteChecked(file, ss))
+            return false;
+        vIndex.push_back(handle);
+        nOffset += ss.size() + sizeof(uint64);
+        vBlock.clear();
+        nBlockSize = 0;
+        return true;
+    }
+
+public:
+    explicit CLSMTableWriter(const CLSMOptions& optionsIn) : options(optionsIn), file(NULL), nOffset(0), nBlockSize(0) {}
+
+    ~CLSMTableWriter()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    bool IsOpen() const { return file != NULL; }
+
+    bool Open(const boost::filesystem::path& pathIn)
+    {
+        path = pathIn;
+        file = fopen(path.string().c_str(), "wb");
+        nOffset = 0;
+        vIndex.clear();
+        return file != NULL;
+    }
+
+    bool Add(const CLSMRecord& record)
+    {
+        vBlock.push_back(record);
+        nBlockSize += record.strKey.size() + record.strValue.size() + 8;
+        strLast = record.strKey;
+        return nBlockSize < options.nBlockSize || WriteBlock();
+    }
+
+    bool IsFull() const
+    {
+        return nOffset + nBlockSize >= options.nTableSize;
+    }
+
+    bool Finish()
+    {
+        if (!WriteBlock())
+            return false;
+        CDataStream ssIndex(SER_DISK, CLIENT_VERSION);
+        ssIndex << vIndex << strLast;
+        CDataStream ssFooter(SER_DISK, CLIENT_VERSION);
+        ssFooter << nOffset << (unsigned int)ssIndex.size() << LSM_MAGIC;
+        if (!WriteChecked(file, ssIndex) || fwrite(&ssFooter[0], 1, ssFooter.size(), file) != ssFooter.size())
+            return false;
+        fflush(file);
+        FileCommit(file);
+        fclose(file);
+        file = NULL;
+        return true;
+    }
+};
+
+
+//
+// Sources: records in key order, deletions included
+//
+
+class CLSMSource
+{
+public:
+    virtual ~CLSMSource() {}
+    virtual bool Valid() const = 0;
+    virtual void SeekToFirst() = 0;
+    virtual void Seek(const std::string& strKey) = 0;
+    virtual void Next() = 0;
+    virtual const CLSMRecord& Record() const = 0;
+    virtual bool Failed() const { return false; }
+};
+
+class CLSMMemSource : public CLSMSource
+{
+private:
+    boost::shared_ptr<const LSMMemTable> pmem;
+    LSMMemTable::const_iterator it;
+
+public:
+    explicit CLSMMemSource(const boost::shared_ptr<const LSMMemTable>& pmemIn) : pmem(pmemIn), it(pmem->end()) {}
+    bool Valid() const { return it != pmem->end(); }
+    void SeekToFirst() { it = pmem->begin(); }
+    void Seek(const std::string& strKey) { it = pmem->lower_bound(strKey); }
+    void Next() { ++it; }
+    const CLSMRecord& Record() const { return it->second; }
+};
+
+class CLSMTableSource : public CLSMSource
+{
+private:
+    CLSMDatabase* pdb;
+    TablePtr ptable;
+    unsigned int nBlock;
+    CLSMDatabase::BlockPtr pblock;
+    unsigned int nRecord;
+    bool fFailed;
+
+    void LoadBlock(unsigned int n)
+    {
+        pblock.reset();
+        nBlock = n;
+        nRecord = 0;
+        if (n < ptable->vIndex.size() && !pdb->ReadBlock(*ptable, n, pblock))
+            fFailed = true;
+    }
+
+public:
+    CLSMTableSource(CLSMDatabase* pdbIn, const TablePtr& ptableIn) : pdb(pdbIn), ptable(ptableIn), nBlock(0), nRecord(0), fFailed(false) {}
+    bool Valid() const { return pblock && nRecord < pblock->size(); }
+    void SeekToFirst() { LoadBlock(0); }
+
+    void Seek(const std::string& strKey)
+    {
+        LoadBlock(ptable->FindBlock(strKey));
+        if (!pblock)
+            return;
+        nRecord = lower_bound(pblock->begin(), pblock->end(), strKey, RecordKeyLess) - pblock->begin();
+        if (nRecord >= pblock->size())
+            LoadBlock(nBlock + 1);
+    }
+
+    void Next()
+    {
+        if (++nRecord >= pblock->size())
+            LoadBlock(nBlock + 1);
+    }
+
+    const CLSMRecord& Record() const { return (*pblock)[nRecord]; }
+    bool Failed() const { return fFailed; }
+};
+
+// The tables of a level from 1 on, one after the other
+class CLSMLevelSource : public CLSMSource
+{
+private:
+    CLSMDatabase* pdb;
+    std::vector<TablePtr> vTables;
+    unsigned int nTable;
+    boost::scoped_ptr<CLSMTableSource> pcurrent;
+
+    void OpenTable(unsigned int n, const std::string* pstrKey)
+    {
+        for (nTable = n; nTable < vTables.size(); nTable++)
+        {
+            pcurrent.reset(new CLSMTableSource(pdb, vTables[nTable]));
+            if (pstrKey)
+                pcurrent->Seek(*pstrKey);
+            else
+                pcurrent->SeekToFirst();
+            if (pcurrent->Valid() || pcurrent->Failed())
+                return;
+            pstrKey = NULL;
+        }
+        pcurrent.reset();
+    }
+
+public:
+    CLSMLevelSource(CLSMDatabase* pdbIn, const std::vector<TablePtr>& vTablesIn) : pdb(pdbIn), vTables(vTablesIn), nTable(0) {}
+    bool Valid() const { return pcurrent && pcurrent->Valid(); }
+    void SeekToFirst() { OpenTable(0, NULL); }
+
+    void Seek(const std::string& strKey)
+    {
+        unsigned int n = 0;
+        while (n < vTables.size() && vTables[n]->strLargest < strKey)
+            n++;
+        OpenTable(n, &strKey);
+    }
+
+    void Next()
+    {
+        pcurrent->Next();
+        if (!pcurrent->Valid() && !pcurrent->Failed())
+            OpenTable(nTable + 1, NULL);
+    }
+
+    const CLSMRecord& Record() const { return pcurrent->Record(); }
+    bool Failed() const { return pcurrent && pcurrent->Failed(); }
+};
+
+// The newest record of each key, from sources given newest first
+class CLSMMergeSource : public CLSMSource
+{
+private:
+    std::vector<CLSMSource*> vSources;
+    int nCurrent;
+
+    void FindSmallest()
+    {
+        nCurrent = -1;
+        for (unsigned int i = 0; i < vSources.size(); i++)
+            if (vSources[i]->Valid() && (nCurrent < 0 || vSources[i]->Record().strKey < vSources[nCurrent]->Record().strKey))
+                nCurrent = i;
+    }
+
+public:
+    CLSMMergeSource() : nCurrent(-1) {}
+
+    ~CLSMMergeSource()
+    {
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            delete psource;
+    }
+
+    void Add(CLSMSource* psource) { vSources.push_back(psource); }
+    bool Valid() const { return nCurrent >= 0; }
+
+    void SeekToFirst()
+    {
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            psource->SeekToFirst();
+        FindSmallest();
+    }
+
+    void Seek(const std::string& strKey)
+    {
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            psource->Seek(strKey);
+        FindSmallest();
+    }
+
+    void Next()
+    {
+        // older records of the same key go too
+        std::string strKey = Record().strKey;
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            if (psource->Valid() && psource->Record().strKey == strKey)
+                psource->Next();
+        FindSmallest();
+    }
+
+    const CLSMRecord& Record() const { return vSources[nCurrent]->Record(); }
+
+    bool Failed() const
+    {
+        BOOST_FOREACH(const CLSMSource* psource, vSources)
+            if (psource->Failed())
+                return true;
+        return false;
+    }
+};
+
+
+//
+// CLSMIterator
+//
+
+CLSMIterator::CLSMIterator(CLSMSource* psourceIn) : psource(psourceIn)
+{
+}
+
+CLSMIterator::~CLSMIterator()
+{
+    delete psource;
+}
+
+void CLSMIterator::SkipDeleted()
+{
+    while (psource->Valid() && psource->Record().fDeleted)
+        psource->Next();
+}
+
+bool CLSMIterator::Valid() const
+{
+    return psource->Valid();
+}
+
+void CLSMIterator::SeekToFirst()
+{
+    psource->SeekToFirst();
+    SkipDeleted();
+}
+
+void CLSMIterator::Seek(const std::string& strKey)
+{
+    psource->Seek(strKey);
+    SkipDeleted();
+}
+
+void CLSMIterator::Next()
+{
+    psource->Next();
+    SkipDeleted();
+}
+
+const std::string& CLSMIterator::Key() const
+{
+    return psource->Record().strKey;
+}
+
+const std::string& CLSMIterator::Value() const
+{
+    return psource->Record().strValue;
+}
+
+bool CLSMIterator::Failed() const
+{
+    return psource->Failed();
+}
+
+
+//
+// CLSMDatabase
+//
+
+CLSMDatabase::CLSMDatabase()
+{
+    fOpen = false;
+    fFailed = false;
+    fileLog = NULL;
+    nLogNumber = 0;
+    nNextFile = 1;
+    nMemSize = 0;
+    nCacheUsed = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+CLSMDatabase::~CLSMDatabase()
+{
+    Close();
+}
+
+boost::filesystem::path CLSMDatabase::FilePath(unsigned int nNumber, const char* pszSuffix) const
+{
+    return pathDir / strprintf("%06u.%s", nNumber, pszSuffix);
+}
+
+bool CLSMDatabase::Open(const boost::filesystem::path& pathDirIn, const CLSMOptions& optionsIn)
+{
+    LOCK(cs);
+    if (fOpen)
+        return true;
+    pathDir = pathDirIn;
+    options = optionsIn;
+    fFailed = false;
+    memset(&stats, 0, sizeof(stats));
+    pmem.reset(new LSMMemTable());
+    nMemSize = 0;
+    try {
+        filesystem::create_directories(pathDir);
+    }
+    catch (filesystem::filesystem_error &e) {
+        return error("CLSMDatabase::Open() : cannot create %s", pathDir.string().c_str());
+    }
+
+    nNextFile = 1;
+    nLogNumber = 0;
+    if (filesystem::exists(pathDir / "MANIFEST"))
+    {
+        if (!ReadManifest() || !ReplayLog(nLogNumber))
+        {
+            for (unsigned int n = 0; n < LSM_LEVELS; n++)
+                vLevels[n].clear();
+            return false;
+        }
+    }
+
+    // What the log held goes to a table, and a new log is started
+    fOpen = true;
+    unsigned int nOldLog = nLogNumber;
+    bool fOk = pmem->empty() ? (NewLog() && WriteManifest()) : FlushMemTable();
+    if (!fOk)
+    {
+        Close();
+        return error("CLSMDatabase::Open() : cannot start a new log in %s", pathDir.string().c_str());
+    }
+    if (nOldLog)
+    {
+        boost::system::error_code ec;
+        filesystem::remove(FilePath(nOldLog, "log"), ec);
+    }
+    RemoveStrayFiles();
+    MaybeCompact();
+    return true;
+}
+
+void CLSMDatabase::Close()
+{
+    LOCK(cs);
+    if (!fOpen)
+        return;
+    if (fileLog)
+    {
+        fflush(fileLog);
+        FileCommit(fileLog);
+        fclose(fileLog);
+        fileLog = NULL;
+    }
+    for (unsigned int n = 0; n < LSM_LEVELS; n++)
+        vLevels[n].clear();
+    lruBlocks.clear();
+    mapBlocks.clear();
+    nCacheUsed = 0;
+    pmem.reset();
+    fOpen = false;
+}
+
+bool CLSMDatabase::IsOpen() const
+{
+    LOCK(cs);
+    return fOpen;
+}
+
+bool CLSMDatabase::WriteManifest()
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << LSM_MAGIC << LSM_VERSION << nNextFile << nLogNumber;
+    for (unsigned int n = 0; n < LSM_LEVELS; n++)
+    {
+        std::vector<unsigned int> vNumbers;
+        BOOST_FOREACH(const TablePtr& ptable, vLevels[n])
+            vNumbers.push_back(ptable->nNumber);
+        ss << vNumbers << strCompactPointer[n];
+    }
+
+    boost::filesystem::path pathTmp = pathDir / "MANIFEST.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("CLSMDatabase::WriteManifest() : cannot open %s", pathTmp.string().c_str());
+    bool fOk = WriteChecked(file, ss);
+    fflush(file);
+    FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, pathDir / "MANIFEST"))
+        return error("CLSMDatabase::WriteManifest() : cannot write %s", pathTmp.string().c_str());
+    return true;
+}
+
+bool CLSMDatabase::ReadManifest()
+{
+    boost::filesystem::path path = pathDir / "MANIFEST";
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("CLSMDatabase::ReadManifest() : cannot open %s", path.string().c_str());
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    int nSize = GetFilesize(file);
+    bool fRead = nSize > 0 && ReadAt(file, 0, nSize, ss);
+    fclose(file);
+    if (!fRead || !CheckChecksum(ss))
+        return error("CLSMDatabase::ReadManifest() : %s corrupted", path.string().c_str());
+
+    try {
+        unsigned int nMagic;
+        int nVersion;
+        ss >> nMagic >> nVersion;
+        if (nMagic != LSM_MAGIC || nVersion > LSM_VERSION)
+            return error("CLSMDatabase::ReadManifest() : %s has the wrong version", path.string().c_str());
+        ss >> nNextFile >> nLogNumber;
+        for (unsigned int n = 0; n < LSM_LEVELS; n++)
+        {
+            std::vector<unsigned int> vNumbers;
+            ss >> vNumbers >> strCompactPointer[n];
+            BOOST_FOREACH(unsigned int nNumber, vNumbers)
+            {
+                TablePtr ptable(new CLSMTable(nNumber, FilePath(nNumber, "tbl")));
+                if (!ptable->Open())
+                    return false;
+                vLevels[n].push_back(ptable);
+            }
+        }
+    }
+    catch (std::exception &e) {
+        return error("CLSMDatabase::ReadManifest() : %s corrupted", path.string().c_str());
+    }
+    return true;
+}
+
+bool CLSMDatabase::ReplayLog(unsigned int nNumber)
+{
+    boost::filesystem::path path = FilePath(nNumber, "log");
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return true;
+
+    unsigned int nRecords = 0;
+    int nFileSize = GetFilesize(file);
+    while (true)
+    {
+        // size, then the batch and its checksum; a torn write at the end
+        // is a batch that never finished, its size possibly garbage
+        unsigned int nSize;
+        if (fread(&nSize, sizeof(nSize), 1, file) != 1)
+            break;
+        long nPos = ftell(file);
+        if (nFileSize < 0 || nPos < 0 || (uint64)nSize + sizeof(uint64) > (uint64)(nFileSize - nPos))
+        {
+            printf("CLSMDatabase::ReplayLog() : discarding a torn batch at the end of %s\n", path.string().c_str());
+            break;
+        }
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss.resize(nSize + sizeof(uint64));
+        if (fread(&ss[0], 1, ss.size(), file) != ss.size() || !CheckChecksum(ss))
+        {
+            printf("CLSMDatabase::ReplayLog() : discarding a torn batch at the end of %s\n", path.string().c_str());
+            break;
+        }
+        std::vector<CLSMRecord> vRecords;
+        try {
+            ss >> vRecords;
+        }
+        catch (std::exception &e) {
+            fclose(file);
+            return error("CLSMDatabase::ReplayLog() : %s corrupted", path.string().c_str());
+        }
+        Apply(vRecords);
+        nRecords += vRecords.size();
+    }
+    fclose(file);
+    printf("CLSMDatabase::ReplayLog() : %u records from %s\n", nRecords, path.string().c_str());
+    return true;
+}
+
+bool CLSMDatabase::NewLog()
+{
+    if (fileLog)
+    {
+        fflush(fileLog);
+        FileCommit(fileLog);
+        fclose(fileLog);
+    }
+    nLogNumber = nNextFile++;
+    fileLog = fopen(FilePath(nLogNumber, "log").string().c_str(), "wb");
+    return fileLog != NULL;
+}
+
+void CLSMDatabase::RemoveStrayFiles()
+{
+    // Tables and logs left by a flush or compaction that did not finish
+    std::set<std::string> setLive;
+    for (unsigned int n = 0; n < LSM_LEVELS; n++)
+        BOOST_FOREACH(const TablePtr& ptable, vLevels[n])
+            setLive.insert(ptable->path.filename().string());
+    setLive.insert(FilePath(nLogNumber, "log").filename().string());
+
+    try {
+        filesystem::directory_iterator itEnd;
+        for (filesystem::directory_iterator it(pathDir); it != itEnd; ++it)
+        {
+            std::string strName = it->path().filename().string();
+            if ((boost::algorithm::ends_with(strName, ".tbl") || boost::algorithm::ends_with(strName, ".log")) && !setLive.count(strName))
+            {
+                printf("CLSMDatabase : removing stray file %s\n", strName.c_str());
+                filesystem::remove(it->path());
+            }
+        }
+    }
+    catch (filesystem::filesystem_error &e) {
+        printf("CLSMDatabase::RemoveStrayFiles() : %s\n", e.what());
+    }
+}
+
+void CLSMDatabase::Apply(const std::vector<CLSMRecord>& vRecords)
+{
+    // An iterator may be reading the memory table: leave that one to it
+    if (!pmem.unique())
+        pmem.reset(new LSMMemTable(*pmem));
+    LSMMemTable& mem = const_cast<LSMMemTable&>(*pmem);
+    BOOST_FOREACH(const CLSMRecord& record, vRecords)
+    {
+        mem[record.strKey] = record;
+        nMemSize += 2 * record.strKey.size() + record.strValue.size() + 64;
+    }
+}
+
+void CLSMDatabase::CutLog(long nLogSize)
+{
+    fclose(fileLog);
+    fileLog = NULL;
+    filesystem::path path = FilePath(nLogNumber, "log");
+    boost::system::error_code ec;
+    if (nLogSize >= 0)
+        filesystem::resize_file(path, nLogSize, ec);
+    if (nLogSize >= 0 && !ec)
+        fileLog = fopen(path.string().c_str(), "ab");
+    if (!fileLog)
+    {
+        fFailed = true;
+        error("CLSMDatabase::CutLog() : cannot cut %s back, taking no more writes", path.string().c_str());
+    }
+}
+
+bool CLSMDatabase::Write(const CLSMBatch& batch, bool fSync)
+{
+    LOCK(cs);
+    if (!fOpen || fFailed)
+        return false;
+    if (batch.vRecords.empty())
+        return true;
+
+    // checked under the same lock as the write, so no one can slip in between
+    BOOST_FOREACH(const string& strKey, batch.vNew)
+    {
+        CLSMRecord record;
+        bool fFound;
+        if (!GetRecord(strKey, record, fFound))
+            return error("CLSMDatabase::Write() : cannot read %s, the database is corrupted", pathDir.string().c_str());
+        if (fFound && !record.fDeleted)
+            return false;
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << batch.vRecords;
+    unsigned int nSize = ss.size();
+    long nLogSize = ftell(fileLog);
+    if (nLogSize < 0 || fwrite(&nSize, sizeof(nSize), 1, fileLog) != 1 || !WriteChecked(fileLog, ss) || fflush(fileLog) != 0)
+    {
+        // Replay stops at the first bad batch, so what made it of this one
+        // would hide every batch after it
+        CutLog(nLogSize);
+        return error("CLSMDatabase::Write() : cannot write the log");
+    }
+    if (fSync)
+        FileCommit(fileLog);
+
+    Apply(batch.vRecords);
+    if (nMemSize >= options.nMemTableSize)
+        return FlushMemTable() && MaybeCompact();
+    return true;
+}
+
+bool CLSMDatabase::WriteTables(CLSMSource& source, unsigned int nLevelOut, std::vector<TablePtr>& vOut)
+{
+    // deletions have nothing left to hide once they reach the last level
+    // holding their key; a level 0 table may still hide one in level 0
+    bool fDropDeleted = nLevelOut > 0;
+    CLSMTableWriter writer(options);
+    std::vector<unsigned int> vNumbers;
+    bool fOk = true;
+    for (; source.Valid() && fOk; source.Next())
+    {
+        const CLSMRecord& record = source.Record();
+        if (record.fDeleted && fDropDeleted && IsBaseLevelFor(record.strKey, nLevelOut))
+            continue;
+        if (!writer.IsOpen())
+        {
+            vNumbers.push_back(nNextFile++);
+            fOk = writer.Open(FilePath(vNumbers.back(), "tbl"));
+            if (!fOk)
+                break;
+        }
+        fOk = writer.Add(record);
+        if (fOk && writer.IsFull())
+            fOk = writer.Finish();
+    }
+    if (fOk && writer.IsOpen())
+        fOk = writer.Finish();
+    if (source.Failed())
+        fOk = false;
+
+    BOOST_FOREACH(unsigned int nNumber, vNumbers)
+    {
+        TablePtr ptable(new CLSMTable(nNumber, FilePath(nNumber, "tbl")));
+        if (fOk)
+            fOk = ptable->Open();
+        if (!fOk)
+            ptable->fObsolete = true;
+        vOut.push_back(ptable);
+    }
+    if (!fOk)
+    {
+        vOut.clear();
+        return error("CLSMDatabase::WriteTables() : cannot write level %u tables", nLevelOut);
+    }
+    return true;
+}
+
+bool CLSMDatabase::FlushMemTable()
+{
+    if (pmem->empty())
+        return true;
+
+    std::vector<TablePtr> vOut;
+    {
+        CLSMMemSource source(pmem);
+        source.SeekToFirst();
+        if (!WriteTables(source, 0, vOut))
+            return false;
+    }
+    vLevels[0].insert(vLevels[0].begin(), vOut.begin(), vOut.end());
+
+    unsigned int nOldLog = nLogNumber;
+    if (!NewLog())
+        return error("CLSMDatabase::FlushMemTable() : cannot start a new log");
+    pmem.reset(new LSMMemTable());
+    nMemSize = 0;
+    if (!WriteManifest())
+        return false;
+    boost::system::error_code ec;
+    filesystem::remove(FilePath(nOldLog, "log"), ec);
+    stats.nFlushes++;
+    return true;
+}
+
+uint64 CLSMDatabase::LevelSize(unsigned int nLevel) const
+{
+    uint64 nSize = 0;
+    BOOST_FOREACH(const TablePtr& ptable, vLevels[nLevel])
+        nSize += ptable->nSize;
+    return nSize;
+}
+
+bool CLSMDatabase::IsBaseLevelFor(const std::string& strKey, unsigned int nLevel) const
+{
+    for (unsigned int n = nLevel + 1; n < LSM_LEVELS; n++)
+        BOOST_FOREACH(const TablePtr& ptable, vLevels[n])
+            if (ptable->Contains(strKey))
+                return false;
+    return true;
+}
+
+bool CLSMDatabase::MaybeCompact()
+{
+    while (true)
+    {
+        if (vLevels[0].size() >= options.nLevel0Tables)
+        {
+            if (!CompactLevel(0))
+                return false;
+            continue;
+        }
+        uint64 nLimit = options.nLevel1Size;
+        unsigned int nLevel = 1;
+        for (; nLevel < LSM_LEVELS - 1; nLevel++, nLimit *= 10)
+            if (LevelSize(nLevel) > nLimit)
+                break;
+        if (nLevel >= LSM_LEVELS - 1)
+            return true;
+        if (!CompactLevel(nLevel))
+            return false;
+    }
+}
+
+bool CLSMDatabase::CompactLevel(unsigned int nLevel)
+{
+    // Level 0 tables may overlap, so they all go at once; from level 1 on
+    // one table at a time, taking turns through the keys
+    std::vector<TablePtr> vInputs;
+    if (nLevel == 0)
+        vInputs = vLevels[0];
+    else
+    {
+        BOOST_FOREACH(const TablePtr& ptable, vLevels[nLevel])
+            if (ptable->strSmallest > strCompactPointer[nLevel])
+            {
+                vInputs.push_back(ptable);
+                break;
+            }
+        if (vInputs.empty())
+            vInputs.push_back(vLevels[nLevel].front());
+    }
+    std::string strBegin = vInputs[0]->strSmallest, strEnd = vInputs[0]->strLargest;
+    BOOST_FOREACH(const TablePtr& ptable, vInputs)
+    {
+        strBegin = min(strBegin, ptable->strSmallest);
+        strEnd = max(strEnd, ptable->strLargest);
+    }
+    std::vector<TablePtr> vNext, vKeep;
+    BOOST_FOREACH(const TablePtr& ptable, vLevels[nLevel + 1])
+        (ptable->Overlaps(strBegin, strEnd) ? vNext : vKeep).push_back(ptable);
+
+    uint64 nStart = GetTimeMillis();
+    std::vector<TablePtr> vOut;
+    {
+        CLSMMergeSource source;
+        BOOST_FOREACH(const TablePtr& ptable, vInputs)
+            source.Add(new CLSMTableSource(this, ptable));
+        source.Add(new CLSMLevelSource(this, vNext));
+        source.SeekToFirst();
+        if (!WriteTables(source, nLevel + 1, vOut))
+            return false;
+    }
+
+    uint64 nBytes = 0;
+    BOOST_FOREACH(const TablePtr& ptable, vOut)
+        nBytes += ptable->nSize;
+    vKeep.insert(vKeep.end(), vOut.begin(), vOut.end());
+    sort(vKeep.begin(), vKeep.end(), CompareSmallest);
+    vLevels[nLevel + 1] = vKeep;
+    std::vector<TablePtr> vRest;
+    BOOST_FOREACH(const TablePtr& ptable, vLevels[nLevel])
+        if (find(vInputs.begin(), vInputs.end(), ptable) == vInputs.end())
+            vRest.push_back(ptable);
+    vLevels[nLevel] = vRest;
+    strCompactPointer[nLevel] = strEnd;
+    if (!WriteManifest())
+        return false;
+
+    // the files go once the iterators reading them are done
+    BOOST_FOREACH(const TablePtr& ptable, vInputs)
+        ptable->fObsolete = true;
+    BOOST_FOREACH(const TablePtr& ptable, vNext)
+        ptable->fObsolete = true;
+    stats.nCompactions++;
+    stats.nCompactedBytes += nBytes;
+    if (fDebug)
+        printf("CLSMDatabase : compacted %u+%u tables of level %u into %u, %" PRI64u " bytes, %" PRI64d "ms\n",
+            (unsigned int)vInputs.size(), (unsigned int)vNext.size(), nLevel, (unsigned int)vOut.size(), nBytes, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CLSMDatabase::ReadBlock(const CLSMTable& table, unsigned int nBlock, BlockPtr& pblock)
+{
+    LOCK(cs);
+    const CLSMBlockHandle& handle = table.vIndex[nBlock];
+    BlockKey key(table.nNumber, handle.nOffset);
+    std::map<BlockKey, std::list<CCachedBlock>::iterator>::iterator mi = mapBlocks.find(key);
+    if (mi != mapBlocks.end())
+    {
+        lruBlocks.splice(lruBlocks.begin(), lruBlocks, mi->second);
+        pblock = mi->second->pblock;
+        stats.nCacheHits++;
+        return true;
+    }
+    stats.nCacheMisses++;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    if (!ReadAt(table.file, handle.nOffset, handle.nSize + sizeof(uint64), ss) || !CheckChecksum(ss))
+        return error("CLSMDatabase::ReadBlock() : block at %" PRI64u " of %s corrupted", handle.nOffset, table.path.string().c_str());
+    boost::shared_ptr<std::vector<CLSMRecord> > pblockNew(new std::vector<CLSMRecord>());
+    try {
+        ss >> *pblockNew;
+    }
+    catch (std::exception &e) {
+        return error("CLSMDatabase::ReadBlock() : block at %" PRI64u " of %s corrupted", handle.nOffset, table.path.string().c_str());
+    }
+    pblock = pblockNew;
+
+    CCachedBlock cached;
+    cached.key = key;
+    cached.pblock = pblock;
+    cached.nSize = handle.nSize;
+    lruBlocks.push_front(cached);
+    mapBlocks[key] = lruBlocks.begin();
+    nCacheUsed += cached.nSize;
+    while (nCacheUsed > options.nCacheSize && lruBlocks.size() > 1)
+    {
+        nCacheUsed -= lruBlocks.back().nSize;
+        mapBlocks.erase(lruBlocks.back().key);
+        lruBlocks.pop_back();
+    }
+    return true;
+}
+
+bool CLSMDatabase::GetRecord(const std::string& strKey, CLSMRecord& record, bool& fFound)
+{
+    fFound = false;
+    LSMMemTable::const_iterator it = pmem->find(strKey);
+    if (it != pmem->end())
+    {
+        record = it->second;
+        fFound = true;
+        return true;
+    }
+
+    for (unsigned int n = 0; n < LSM_LEVELS; n++)
+    {
+        const std::vector<TablePtr>& vTables = vLevels[n];
+        for (unsigned int i = 0; i < vTables.size(); i++)
+        {
+            const CLSMTable& table = *vTables[i];
+            if (!table.Contains(strKey))
+                continue;
+            // an older table may hold an older record of the key: that is
+            // no answer, the newest one is lost
+            BlockPtr pblock;
+            if (!ReadBlock(table, table.FindBlock(strKey), pblock))
+                return false;
+            std::vector<CLSMRecord>::const_iterator mi = lower_bound(pblock->begin(), pblock->end(), strKey, RecordKeyLess);
+            if (mi != pblock->end() && mi->strKey == strKey)
+            {
+                record = *mi;
+                fFound = true;
+                return true;
+            }
+            // from level 1 on no other table of the level has it
+            if (n > 0)
+                break;
+        }
+    }
+    return true;
+}
+
+bool CLSMDatabase::Get(const std::string& strKey, std::string& strValue)
+{
+    LOCK(cs);
+    if (!fOpen)
+        return false;
+    CLSMRecord record;
+    bool fFound;
+    if (!GetRecord(strKey, record, fFound))
+        throw runtime_error(strprintf("CLSMDatabase::Get() : cannot read %s, the database is corrupted", pathDir.string().c_str()));
+    if (!fFound || record.fDeleted)
+        return false;
+    strValue = record.strValue;
+    return true;
+}
+
+bool CLSMDatabase::Exists(const std::string& strKey)
+{
+    LOCK(cs);
+    if (!fOpen)
+        return false;
+    CLSMRecord record;
+    bool fFound;
+    if (!GetRecord(strKey, record, fFound))
+        throw runtime_error(strprintf("CLSMDatabase::Exists() : cannot read %s, the database is corrupted", pathDir.string().c_str()));
+    return fFound && !record.fDeleted;
+}
+
+CLSMIterator* CLSMDatabase::NewIterator()
+{
+    LOCK(cs);
+    if (!fOpen)
+        return NULL;
+    CLSMMergeSource* psource = new CLSMMergeSource();
+    psource->Add(new CLSMMemSource(pmem));
+    BOOST_FOREACH(const TablePtr& ptable, vLevels[0])
+        psource->Add(new CLSMTableSource(this, ptable));
+    for (unsigned int n = 1; n < LSM_LEVELS; n++)
+        if (!vLevels[n].empty())
+            psource->Add(new CLSMLevelSource(this, vLevels[n]));
+    return new CLSMIterator(psource);
+}
+
+bool CLSMDatabase::Flush()
+{
+    LOCK(cs);
+    if (!fOpen)
+        return false;
+    return FlushMemTable() && MaybeCompact();
+}
+
+CLSMStats CLSMDatabase::GetStats() const
+{
+    LOCK(cs);
+    CLSMStats ret = stats;
+    ret.nMemTableSize = nMemSize;
+    for (unsigned int n = 0; n < LSM_LEVELS; n++)
+    {
+        ret.nTables[n] = vLevels[n].size();
+        ret.nLevelSize[n] = LevelSize(n);
+    }
+    ret.nCacheSize = nCacheUsed;
+    return ret;
+}
+
+
+//
+// CLSMStore
+//
+
+class CLSMTxn : public CKVTxn
+{
+public:
+    CLSMDatabase* plsm;
+    CLSMBatch batch;
+    bool fDone;
+
+    explicit CLSMTxn(CLSMDatabase* plsmIn) : plsm(plsmIn), fDone(false) {}
+
+    bool Commit()
+    {
+        if (fDone)
+            return false;
+        fDone = true;
+        return plsm->Write(batch);
+    }
+
+    bool Abort()
+    {
+        if (fDone)
+            return false;
+        fDone = true;
+        batch.clear();
+        return true;
+    }
+};
+
+class CLSMCursor : public CKVCursor
+{
+private:
+    scoped_ptr<CLSMIterator> pit;
+    std::string strPrefix;
+    bool fStarted;
+
+public:
+    CLSMCursor(CLSMIterator* pitIn, const std::string& strPrefixIn) : pit(pitIn), strPrefix(strPrefixIn), fStarted(false) {}
+
+    int Read(CDataStream& ssKey, CDataStream& ssValue, bool fSeek)
+    {
+        if (fSeek)
+            pit->Seek(strPrefix + string(ssKey.begin(), ssKey.end()));
+        else if (!fStarted)
+            pit->Seek(strPrefix);
+        else if (pit->Valid())
+            pit->Next();
+        fStarted = true;
+
+        if (pit->Failed())
+            return KV_ERROR;
+        if (!pit->Valid() || !starts_with(pit->Key(), strPrefix))
+            return KV_NOTFOUND;
+
+        const string& strKey = pit->Key();
+        const string& strValue = pit->Value();
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write(strKey.data() + strPrefix.size(), strKey.size() - strPrefix.size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write(strValue.data(), strValue.size());
+        return 0;
+    }
+};
+
+std::string CLSMStore::MakeKey(const CDataStream& ssKey) const
+{
+    return strPrefix + string(ssKey.begin(), ssKey.end());
+}
+
+CLSMBatch* CLSMStore::GetBatch(CKVTxn* ptxn) const
+{
+    CLSMTxn* plsmtxn = dynamic_cast<CLSMTxn*>(ptxn);
+    if (!plsmtxn || plsmtxn->plsm != plsm || plsmtxn->fDone)
+        return NULL;
+    return &plsmtxn->batch;
+}
+
+bool CLSMStore::Read(const CDataStream& ssKey, CDataStream& ssValue, CKVTxn* ptxn)
+{
+    string strKey = MakeKey(ssKey);
+    string strValue;
+    CLSMBatch* pbatch = ptxn ? GetBatch(ptxn) : NULL;
+    const CLSMRecord* precord = pbatch ? pbatch->Find(strKey) : NULL;
+    if (precord)
+    {
+        if (precord->fDeleted)
+            return false;
+        strValue = precord->strValue;
+    }
+    else if (!plsm->Get(strKey, strValue))
+        return false;
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(strValue.data(), strValue.size());
+    return true;
+}
+
+bool CLSMStore::Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite, CKVTxn* ptxn)
+{
+    string strKey = MakeKey(ssKey);
+    string strValue(ssValue.begin(), ssValue.end());
+    CLSMBatch batch;
+    CLSMBatch* pbatch = &batch;
+    if (ptxn)
+    {
+        pbatch = GetBatch(ptxn);
+        if (!pbatch)
+            return error("CLSMStore::Write() : transaction of another store");
+    }
+
+    // Without overwrite the key is checked again when the batch is written,
+    // so a transaction holding such a write fails to commit if the key has
+    // appeared in the meantime. A key the transaction already wrote or
+    // erased is judged by that record instead.
+    const CLSMRecord* precord = pbatch->Find(strKey);
+    if (fOverwrite || (precord && precord->fDeleted))
+        pbatch->Put(strKey, strValue);
+    else if (precord || plsm->Exists(strKey))
+        return false;
+    else
+        pbatch->Insert(strKey, strValue);
+    return ptxn ? true : plsm->Write(batch);
+}
+
+bool CLSMStore::Erase(const CDataStream& ssKey, CKVTxn* ptxn)
+{
+    if (ptxn)
+    {
+        CLSMBatch* pbatch = GetBatch(ptxn);
+        if (!pbatch)
+            return error("CLSMStore::Erase() : transaction of another store");
+        pbatch->Delete(MakeKey(ssKey));
+        return true;
+    }
+    CLSMBatch batch;
+    batch.Delete(MakeKey(ssKey));
+    return plsm->Write(batch);
+}
+
+bool CLSMStore::Exists(const CDataStream& ssKey, CKVTxn* ptxn)
+{
+    string strKey = MakeKey(ssKey);
+    CLSMBatch* pbatch = ptxn ? GetBatch(ptxn) : NULL;
+    if (const CLSMRecord* precord = pbatch ? pbatch->Find(strKey) : NULL)
+        return !precord->fDeleted;
+    return plsm->Exists(strKey);
+}
+
+CKVCursor* CLSMStore::NewCursor()
+{
+    CLSMIterator* pit = plsm->NewIterator();
+    if (!pit)
+        return NULL;
+    return new CLSMCursor(pit, strPrefix);
+}
+
+CKVTxn* CLSMStore::TxnBegin()
+{
+    return new CLSMTxn(plsm);
+}
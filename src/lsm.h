@@ -0,0 +1,258 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_LSM_H
+#define HYPERSTAKE_LSM_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "kvstore.h"
+#include "serialize.h"
+#include "sync.h"
+
+static const unsigned int LSM_LEVELS = 7;
+
+struct CLSMOptions
+{
+    uint64 nMemTableSize;   // bytes of writes held before they go to a table
+    uint64 nTableSize;      // bytes a compaction writes per table
+    uint64 nBlockSize;      // bytes of records read from a table at a time
+    uint64 nCacheSize;      // bytes of blocks kept in memory
+    unsigned int nLevel0Tables; // tables level 0 holds before it is compacted
+    uint64 nLevel1Size;     // bytes level 1 holds; each level after holds ten times more
+
+    CLSMOptions()
+    {
+        nMemTableSize = 4 << 20;
+        nTableSize = 2 << 20;
+        nBlockSize = 4096;
+        nCacheSize = 8 << 20;
+        nLevel0Tables = 4;
+        nLevel1Size = 10 << 20;
+    }
+};
+
+struct CLSMStats
+{
+    uint64 nMemTableSize;
+    unsigned int nTables[LSM_LEVELS];
+    uint64 nLevelSize[LSM_LEVELS];
+    uint64 nCacheSize;
+    uint64 nCacheHits;
+    uint64 nCacheMisses;
+    uint64 nFlushes;
+    uint64 nCompactions;
+    uint64 nCompactedBytes;     // written by compactions
+};
+
+/** A key's value, or its deletion, as the log and the tables hold it */
+struct CLSMRecord
+{
+    std::string strKey;
+    bool fDeleted;
+    std::string strValue;
+
+    CLSMRecord() : fDeleted(false) {}
+    CLSMRecord(const std::string& strKeyIn, bool fDeletedIn, const std::string& strValueIn) :
+        strKey(strKeyIn), fDeleted(fDeletedIn), strValue(strValueIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(strKey);
+        READWRITE(fDeleted);
+        READWRITE(strValue);
+    )
+};
+
+/** Writes and deletions applied together by CLSMDatabase::Write */
+class CLSMBatch
+{
+private:
+    std::vector<CLSMRecord> vRecords;
+    std::vector<std::string> vNew;
+    // key -> its last record in vRecords
+    std::map<std::string, unsigned int> mapLast;
+    friend class CLSMDatabase;
+
+public:
+    void Put(const std::string& strKey, const std::string& strValue)
+    {
+        mapLast[strKey] = vRecords.size();
+        vRecords.push_back(CLSMRecord(strKey, false, strValue));
+    }
+
+    // Put, but the whole batch is refused if strKey already exists
+    void Insert(const std::string& strKey, const std::string& strValue)
+    {
+        vNew.push_back(strKey);
+        Put(strKey, strValue);
+    }
+
+    void Delete(const std::string& strKey)
+    {
+        mapLast[strKey] = vRecords.size();
+        vRecords.push_back(CLSMRecord(strKey, true, ""));
+    }
+
+    // The batch's last record of strKey, if it has one
+    const CLSMRecord* Find(const std::string& strKey) const
+    {
+        std::map<std::string, unsigned int>::const_iterator mi = mapLast.find(strKey);
+        return mi == mapLast.end() ? NULL : &vRecords[mi->second];
+    }
+
+    void clear() { vRecords.clear(); vNew.clear(); mapLast.clear(); }
+    unsigned int size() const { return vRecords.size(); }
+};
+
+class CLSMDatabase;
+class CLSMTable;
+class CLSMSource;
+typedef std::map<std::string, CLSMRecord> LSMMemTable;
+
+/** The keys of a CLSMDatabase in order, as they were when it was made */
+class CLSMIterator
+{
+private:
+    CLSMSource* psource;
+    void SkipDeleted();
+
+public:
+    explicit CLSMIterator(CLSMSource* psourceIn);
+    ~CLSMIterator();
+
+    bool Valid() const;
+    void SeekToFirst();
+    // first key not below strKey
+    void Seek(const std::string& strKey);
+    void Next();
+    const std::string& Key() const;
+    const std::string& Value() const;
+    // whether a table could not be read
+    bool Failed() const;
+};
+
+/** A log-structured merge tree key-value store in a directory of its own.
+ *
+ * Writes are appended to a log and held in a sorted memory table. When that
+ * grows past nMemTableSize it is written out as a sorted table in level 0
+ * and the log started over. Tables are split in blocks with an index of
+ * their first keys, and the blocks read are kept in an LRU cache. Once
+ * level 0 has nLevel0Tables tables they are merged into level 1, and a
+ * level past its size has one table at a time merged into the next, so
+ * from level 1 on each level is one sorted run. Deletions are records of
+ * their own until they reach the last level holding the key.
+ *
+ * MANIFEST lists the tables of each level and the current log; it is
+ * replaced whole, so a crash leaves either the old set of tables or the
+ * new one. Opening replays the log and writes it to a table.
+ */
+class CLSMDatabase
+{
+private:
+    mutable CCriticalSection cs;
+    boost::filesystem::path pathDir;
+    CLSMOptions options;
+    bool fOpen;
+    // the log could not be put right after a failed write
+    bool fFailed;
+
+    boost::shared_ptr<const LSMMemTable> pmem;
+    uint64 nMemSize;
+    FILE* fileLog;
+    unsigned int nLogNumber;
+    unsigned int nNextFile;
+
+    // level 0 newest first, the others by key
+    std::vector<boost::shared_ptr<CLSMTable> > vLevels[LSM_LEVELS];
+    // where the next compaction of each level starts
+    std::string strCompactPointer[LSM_LEVELS];
+
+    // block cache: (table, offset) -> block, most recently used first
+    typedef std::pair<unsigned int, uint64> BlockKey;
+    typedef boost::shared_ptr<const std::vector<CLSMRecord> > BlockPtr;
+    struct CCachedBlock
+    {
+        BlockKey key;
+        BlockPtr pblock;
+        unsigned int nSize;
+    };
+    std::list<CCachedBlock> lruBlocks;
+    std::map<BlockKey, std::list<CCachedBlock>::iterator> mapBlocks;
+    uint64 nCacheUsed;
+
+    CLSMStats stats;
+
+    boost::filesystem::path FilePath(unsigned int nNumber, const char* pszSuffix) const;
+    bool WriteManifest();
+    bool ReadManifest();
+    bool ReplayLog(unsigned int nNumber);
+    bool NewLog();
+    // Drop the end of a batch that failed to write from the log
+    void CutLog(long nLogSize);
+    bool FlushMemTable();
+    bool WriteTables(CLSMSource& source, unsigned int nLevelOut, std::vector<boost::shared_ptr<CLSMTable> >& vOut);
+    bool MaybeCompact();
+    bool CompactLevel(unsigned int nLevel);
+    bool IsBaseLevelFor(const std::string& strKey, unsigned int nLevel) const;
+    uint64 LevelSize(unsigned int nLevel) const;
+    void RemoveStrayFiles();
+    void Apply(const std::vector<CLSMRecord>& vRecords);
+    // false if a table could not be read; fFound whether strKey has a record
+    bool GetRecord(const std::string& strKey, CLSMRecord& record, bool& fFound);
+
+    friend class CLSMTable;
+    friend class CLSMTableSource;
+    bool ReadBlock(const CLSMTable& table, unsigned int nBlock, BlockPtr& pblock);
+
+public:
+    CLSMDatabase();
+    ~CLSMDatabase();
+
+    bool Open(const boost::filesystem::path& pathDirIn, const CLSMOptions& optionsIn);
+    void Close();
+    bool IsOpen() const;
+
+    // These throw if a table the key may be in cannot be read, rather than
+    // answer from an older record of it
+    bool Get(const std::string& strKey, std::string& strValue);
+    bool Exists(const std::string& strKey);
+    bool Write(const CLSMBatch& batch, bool fSync=false);
+    // The caller deletes it
+    CLSMIterator* NewIterator();
+
+    // Write the memory table out and compact whatever is due
+    bool Flush();
+    CLSMStats GetStats() const;
+};
+
+/** One database file's records in a CLSMDatabase, kept apart from the
+ * others sharing it by a prefix byte on their keys. Transactions are write
+ * batches; reads made in one look in the batch before the database. */
+class CLSMStore : public CKVStore
+{
+private:
+    CLSMDatabase* plsm;
+    std::string strPrefix;
+
+    std::string MakeKey(const CDataStream& ssKey) const;
+    CLSMBatch* GetBatch(CKVTxn* ptxn) const;
+
+public:
+    CLSMStore(CLSMDatabase* plsmIn, unsigned char chPrefix) : plsm(plsmIn), strPrefix(1, chPrefix) {}
+
+    bool Read(const CDataStream& ssKey, CDataStream& ssValue, CKVTxn* ptxn=NULL);
+    bool Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite=true, CKVTxn* ptxn=NULL);
+    bool Erase(const CDataStream& ssKey, CKVTxn* ptxn=NULL);
+    bool Exists(const CDataStream& ssKey, CKVTxn* ptxn=NULL);
+    CKVCursor* NewCursor();
+    CKVTxn* TxnBegin();
+};
+
+#endif
@@ -10,9 +10,14 @@
 #include "init.h" 
 #include "ui_interface.h"
 #include "kernel.h"
+#include "miner.h"
 #include "scrypt_mine.h"
 #include "votetally.h"
 #include "voteproposalmanager.h"
+#include "checkqueue.h"
+#include "coins.h"
+#include "headerssync.h"
+#include "blockverifier.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -36,7 +41,8 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+CBlockIndexArena blockIndexArena;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
@@ -54,8 +60,8 @@ int64 nChainStartTime = 1399495660;
 int nCoinbaseMaturity = 10;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainTrust = 0;
-CBigNum bnBestInvalidTrust = 0;
+uint256 nBestChainTrust = 0;
+uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
@@ -80,6 +86,11 @@ bool fStrictIncoming = false;
 bool fWalletStaking = false;
 
 CVoteProposalManager proposalManager;
+thread_local CHashCacheStats hashCacheStats;
+bool fCheckHashCache = false;
+int nScriptCheckThreads = 0;
+int64 nCoinCacheBytes = (DEFAULT_DB_CACHE - DEFAULT_DB_CACHE / 4) << 20;
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -161,6 +172,13 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
         pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
 }
 
+// stake kernel contexts depend on the chain, so drop them when it is rewound
+void static ClearStakeKernelCaches()
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->ClearStakeKernelCache();
+}
+
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
@@ -467,7 +485,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -791,7 +809,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -876,7 +894,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -917,24 +935,32 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+CActiveChain chainActive;
+
+void CActiveChain::Connect(CBlockIndex* pindex)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    // usually one block on from the tip; otherwise fill in from pprev back
+    // to where the chains meet
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
 }
 
+void CActiveChain::DisconnectAbove(int nHeight)
+{
+    if (nHeight + 1 < (int)vChain.size())
+        vChain.resize(max(nHeight + 1, 0));
+}
+
+void CActiveChain::Rebuild(CBlockIndex* pindexGenesis)
+{
+    clear();
+    for (CBlockIndex* pindex = pindexGenesis; pindex; pindex = pindex->pnext)
+        vChain.push_back(pindex);
+}
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 {
@@ -958,7 +984,18 @@ uint256 CBlock::GetHash() const
     if (hashBlock != 0)
         return hashBlock;
 
-    return Hash9(BEGIN(nVersion), END(nNonce));
+    hashCacheStats.nBlockLookups++;
+    const unsigned int nHeaderSize = END(nNonce) - BEGIN(nVersion);
+    assert(nHeaderSize == sizeof(pchHeaderCached));
+    if (fHeaderCached && memcmp(pchHeaderCached, BEGIN(nVersion), nHeaderSize) == 0)
+        return hashHeaderCached;
+
+    hashCacheStats.nBlockHashed++;
+    uint256 hash = Hash9(BEGIN(nVersion), END(nNonce));
+    memcpy(pchHeaderCached, BEGIN(nVersion), nHeaderSize);
+    hashHeaderCached = hash;
+    fHeaderCached = true;
+    return hash;
 }
 
 
@@ -1178,6 +1215,36 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits)
     return true;
 }
 
+// A target can move less than threefold from the last one of its kind, as
+// nActualSpacing is capped at nTargetTimespan in GetNextTargetRequired
+static bool TargetFollows(const CBigNum& bnTarget, unsigned int nBitsLast)
+{
+    if (nBitsLast == 0)
+        return true;
+    CBigNum bnLast;
+    bnLast.SetCompact(nBitsLast);
+    return bnTarget <= bnLast * 3 && bnTarget * 3 >= bnLast;
+}
+
+// Check what a header alone can tell of its target, given the targets of
+// the last proof-of-work and proof-of-stake blocks before it (0 if not
+// known). Proof-of-work has to meet its target; a header that does not is
+// taken for proof-of-stake, which is only known once the block and its
+// coinstake arrive, so until then its target has to follow the last one.
+bool CheckHeaderTarget(const uint256& hash, unsigned int nBits, int nHeight, unsigned int nBitsLastWork, unsigned int nBitsLastStake, bool& fProofOfStake)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (bnTarget <= 0)
+        return false;
+
+    fProofOfStake = false;
+    if (nHeight <= POW_CUTOFF_HEIGHT && bnTarget <= bnProofOfWorkLimit && hash <= bnTarget.getuint256() && TargetFollows(bnTarget, nBitsLastWork))
+        return true;
+    fProofOfStake = true;
+    return bnTarget <= bnProofOfStakeLimit && TargetFollows(bnTarget, nBitsLastStake);
+}
+
 // Return maximum amount of blocks that other nodes claim to have
 int GetNumBlocksOfPeers()
 {
@@ -1202,19 +1269,19 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainTrust > bnBestInvalidTrust)
+    if (pindexNew->nChainTrust > nBestInvalidTrust)
     {
-        bnBestInvalidTrust = pindexNew->bnChainTrust;
-        CTxDB().WriteBestInvalidTrust(bnBestInvalidTrust);
+        nBestInvalidTrust = pindexNew->nChainTrust;
+        CTxDB().WriteBestInvalidTrust(CBigNum(nBestInvalidTrust));
         uiInterface.NotifyBlocksChanged();
     }
 
     printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s  date=%s\n",
       pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
-      pindexNew->bnChainTrust.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
+      CBigNum(pindexNew->nChainTrust).ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
       pindexNew->GetBlockTime()).c_str());
     printf("InvalidChainFound:  current best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 }
 
@@ -1383,7 +1450,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1440,8 +1508,17 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                if (pvChecks)
+                {
+                    // Leave the script for the caller to verify with the rest of the block
+                    if (prevout.hash != txPrev.GetHash())
+                        return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
+                    pvChecks->push_back(CScriptCheck());
+                    CScriptCheck check(txPrev, *this, i, fStrictPayToScriptHash, 0);
+                    pvChecks->back().swap(check);
+                }
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                else if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
@@ -1544,10 +1621,28 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
+    uint256 hashBlock = pindex->GetBlockHash();
+    CBlockUndo undo;
+    if (txdb.ReadBlockUndo(hashBlock, undo))
+    {
+        // Put back the records connecting it changed
+        BOOST_FOREACH(const CTxIndexUndo& prior, undo.vPrior)
+        {
+            bool fOk = prior.fExisted ? txdb.UpdateTxIndex(prior.hash, prior.txindex) : txdb.EraseTxIndex(prior.hash);
+            if (!fOk)
+                return error("DisconnectBlock() : restoring tx index %s failed", prior.hash.ToString().substr(0,10).c_str());
+        }
+        if (!txdb.EraseBlockUndo(hashBlock))
+            return error("DisconnectBlock() : EraseBlockUndo failed");
+    }
+    else
+    {
+        // Connected before undo records were kept, or too long ago:
+        // disconnect in reverse order
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!vtx[i].DisconnectInputs(txdb))
+                return false;
+    }
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1562,10 +1657,45 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     // ppcoin: clean up wallet after disconnecting coinstake
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
+    ClearStakeKernelCaches();
 
     return true;
 }
 
+// Verify block scripts on nThreads threads, the one connecting the block included
+void SetScriptCheckThreads(int nThreads)
+{
+    scriptcheckqueue.StopThreads();
+    nScriptCheckThreads = max(1, min(nThreads, MAX_SCRIPTCHECK_THREADS));
+    scriptcheckqueue.StartThreads(nScriptCheckThreads - 1);
+}
+
+// Write the transaction index changes held in pcoinsTip to disk when they
+// outgrow their share of -dbcache, every few minutes, and when forced
+bool FlushCoinsCache(bool fForce)
+{
+    static int64 nLastFlush = GetTime();
+    if (!pcoinsTip)
+        return true;
+
+    bool fFull = pcoinsTip->GetCacheUsage() > (uint64)nCoinCacheBytes;
+    int64 nInterval = IsInitialBlockDownload() ? 10 * 60 : 60;
+    if (!fForce && !fFull && GetTime() - nLastFlush < nInterval)
+        return true;
+
+    int64 nStart = GetTimeMicros();
+    unsigned int nDirty = pcoinsTip->GetDirtyCount();
+    if (!pcoinsTip->Flush())
+        return error("FlushCoinsCache() : writing the transaction index failed");
+    if (fFull)
+        pcoinsTip->Trim();
+    nLastFlush = GetTime();
+    if (fDebug)
+        printf("FlushCoinsCache() : wrote %u tx index records in %.2fms, %u cached (%llukB)\n", nDirty,
+            (GetTimeMicros() - nStart) * 0.001, pcoinsTip->GetCacheSize(), pcoinsTip->GetCacheUsage() >> 10);
+    return true;
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in
@@ -1597,6 +1727,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Scripts are verified on the -par threads while the rest of the block
+    // is connected, and all of them must pass before anything is written
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads > 1 ? &scriptcheckqueue : NULL);
+    vector<CScriptCheck> vChecks;
+
     vector<uint256> vQueuedProposals;
     map<uint256, CTxIndex> mapQueuedChanges;
     int64 nFees = 0;
@@ -1649,8 +1784,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash,
+                                  nScriptCheckThreads > 1 ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
+            vChecks.clear();
 
             //Track vote proposals
             if (tx.IsProposal()) {
@@ -1663,6 +1801,32 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    if (!control.Wait())
+    {
+        // Find the input that failed and treat it as ConnectInputs would
+        // have: only during transition phase for P2SH, do not invoke anti-DoS
+        // code for potentially old clients relaying bad P2SH transactions
+        BOOST_FOREACH(CTransaction& tx, vtx)
+        {
+            if (tx.IsCoinBase())
+                continue;
+            MapPrevTx mapInputs;
+            bool fInvalid;
+            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+                break;
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            {
+                const CTransaction& txPrev = mapInputs[tx.vin[i].prevout.hash].second;
+                if (VerifySignature(txPrev, tx, i, fStrictPayToScriptHash, 0))
+                    continue;
+                if (fStrictPayToScriptHash && VerifySignature(txPrev, tx, i, false, 0))
+                    return error("ConnectBlock() : %s P2SH VerifySignature failed", tx.GetHash().ToString().substr(0,10).c_str());
+                return DoS(100, error("ConnectBlock() : %s VerifySignature failed", tx.GetHash().ToString().substr(0,10).c_str()));
+            }
+        }
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+    }
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1675,8 +1839,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (fJustCheck)
         return true;
 
-    // Keep track of any vote proposals that were added to the blockchain
+    // Keep track of any vote proposals that were added to the blockchain,
+    // written with the rest of the block
     CVoteDB voteDB;
+    voteDB.JoinBatch(txdb);
     if (vQueuedProposals.size()) {
         for (const CTransaction& tx : vtx) {
             uint256 txid = tx.GetHash();
@@ -1694,23 +1860,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     //Record new votes to the tally
-    if (pindex->pprev) {
-        if (fTestNet || pindex->nHeight >= (int)VOTING_START)
-            pindex->tally = CVoteTally(pindex->pprev->tally);
-        std::map<uint256, VoteLocation> mapActive = proposalManager.GetActive(pindex->nHeight);
-        pindex->tally.SetNewPositions(mapActive);
-        pindex->tally.ProcessNewVotes(static_cast<uint32_t>(pindex->nVersion));
-    }
+    if (!voteTallyIndex.Connect(pindex, voteDB))
+        return error("ConnectBlock() : WriteTally failed");
 
     //Write index to disk
     if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
         return error("Connect() : WriteBlockIndex for pindex failed");
 
     // Write queued txindex changes
-    for (auto mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi) {
-        if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
-            return error("ConnectBlock() : UpdateTxIndex failed");
-    }
+    if (!txdb.WriteBlockTxIndex(pindex->GetBlockHash(), mapQueuedChanges))
+        return error("ConnectBlock() : WriteBlockTxIndex failed");
+    if (CBlockIndex* pindexOld = chainActive[pindex->nHeight - BLOCK_UNDO_DEPTH])
+        txdb.EraseBlockUndo(pindexOld->GetBlockHash());
 
 	uint256 prevHash = 0;
 	if(pindex->pprev)
@@ -1819,6 +1980,16 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
 
+    // Keep the stake modifier index and the chain by height in step with
+    // the pnext links
+    stakeModifierIndex.DisconnectAbove(pfork->nHeight);
+    chainActive.DisconnectAbove(pfork->nHeight);
+    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+    {
+        stakeModifierIndex.Connect(pindex);
+        chainActive.Connect(pindex);
+    }
+
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         tx.AcceptToMemoryPool(txdb, false);
@@ -1874,6 +2045,8 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    stakeModifierIndex.Connect(pindexNew);
+    chainActive.Connect(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1896,6 +2069,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        stakeModifierIndex.Connect(pindexNew);
+        chainActive.Connect(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1912,7 +2087,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Reorganize is costly in terms of db load, as it works in a single db transaction.
         // Try to limit how much needs to be done inside
-        while (pindexIntermediate->pprev && pindexIntermediate->pprev->bnChainTrust > pindexBest->bnChainTrust)
+        while (pindexIntermediate->pprev && pindexIntermediate->pprev->nChainTrust > pindexBest->nChainTrust)
         {
             vpindexSecondary.push_back(pindexIntermediate);
             pindexIntermediate = pindexIntermediate->pprev;
@@ -1959,17 +2134,22 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexNew->bnChainTrust;
+    nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
     printf("SetBestChain: new best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
 	printf("Stake checkpoint: %x\n", pindexBest->nStakeModifierChecksum);
 
+    if (!FlushCoinsCache(false))
+        return error("SetBestChain() : FlushCoinsCache failed");
+
+    // start hashing on the new tip right away
+    NotifyStakeMinter();
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
 //    if (!fIsInitialDownload)
 //    {
@@ -2078,11 +2258,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (blockIndexArena.Allocate()) CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2090,7 +2268,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     }
 
     // ppcoin: compute chain trust score
-    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
 
     // ppcoin: compute stake entropy bit for stake modifier
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit(pindexNew->nHeight)))
@@ -2115,7 +2293,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016llu", pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2129,7 +2307,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return false;
 
     // New best
-    if (pindexNew->bnChainTrust > bnBestChainTrust)
+    if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -2234,7 +2412,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2293,7 +2471,7 @@ bool CBlock::AcceptBlock()
 }
 
 
-CBigNum CBlockIndex::GetBlockTrust() const
+uint256 CBlockIndex::GetBlockTrust() const
 {
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
@@ -2303,15 +2481,48 @@ CBigNum CBlockIndex::GetBlockTrust() const
     if (IsProofOfStake())
     {
         // Return trust score as usual
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        CBigNum bnPoSTrust = (CBigNum(1)<<256) / (bnTarget+1);
+        return bnPoSTrust.getuint256();
     }
     else
     {
         // Calculate work amount for block
         CBigNum bnPoWTrust = (bnProofOfWorkLimit / (bnTarget+1));
-        return bnPoWTrust > 1 ? bnPoWTrust : 1;
+        return bnPoWTrust > 1 ? bnPoWTrust.getuint256() : uint256(1);
     }
-} 
+}
+
+CVoteTally CBlockIndex::GetTally() const
+{
+    return voteTallyIndex.Get(this);
+}
+
+CBlockIndexArena::~CBlockIndexArena()
+{
+    // CBlockIndex has nothing to destroy
+    BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+        ::operator delete(pchunk);
+}
+
+void* CBlockIndexArena::Allocate()
+{
+    if (nUsed == CHUNK_SIZE)
+    {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(CHUNK_SIZE * sizeof(CBlockIndex))));
+        nUsed = 0;
+    }
+    return vChunks.back() + nUsed++;
+}
+
+size_t GetBlockIndexMemoryUsage()
+{
+    // a hash table node holds the entry and a link, and each bucket a pointer
+    size_t nBytes = blockIndexArena.GetMemoryUsage();
+    nBytes += mapBlockIndex.size() * (sizeof(BlockMap::value_type) + sizeof(void*));
+    nBytes += mapBlockIndex.bucket_count() * sizeof(void*);
+    nBytes += voteTallyIndex.size() * (sizeof(CVoteTally) + 4 * sizeof(void*));
+    return nBytes;
+}
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
@@ -2403,8 +2614,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, std::string& strErr)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless headers sync
+        // is already on it
+        if (pfrom && !headersSync.IsActive())
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // ppcoin: getblocks may not obtain the ancestor block rejected
@@ -2792,7 +3004,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2865,6 +3077,8 @@ void PrintBlockTree()
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64 nStart = GetTimeMillis();
+    uint64 nTxLookupsStart = hashCacheStats.nTxLookups, nTxSerializedStart = hashCacheStats.nTxSerialized;
+    uint64 nBlockLookupsStart = hashCacheStats.nBlockLookups, nBlockHashedStart = hashCacheStats.nBlockHashed;
 
     int nLoaded = 0;
 	int nStartHeight = nBestHeight;
@@ -2942,6 +3156,10 @@ bool LoadExternalBlockFile(FILE* fileIn)
         }
     }
     printf("Loaded %i blocks from external file in %lldms\n", nLoaded, GetTimeMillis() - nStart);
+    uint64 nTxLookups = hashCacheStats.nTxLookups - nTxLookupsStart, nTxSerialized = hashCacheStats.nTxSerialized - nTxSerializedStart;
+    uint64 nBlockLookups = hashCacheStats.nBlockLookups - nBlockLookupsStart, nBlockHashed = hashCacheStats.nBlockHashed - nBlockHashedStart;
+    printf("Hash cache: %" PRI64u " transaction hashes, %" PRI64u " serialized, %" PRI64u " block hashes, %" PRI64u " computed\n",
+        nTxLookups, nTxSerialized, nBlockLookups, nBlockHashed);
     return nLoaded > 0;
 }
 
@@ -3028,6 +3246,14 @@ string GetWarnings(string strFor)
         strStatusBar = strMiscWarning;
     }
 
+    // Bad blocks found by the check after startup: safe mode until the best
+    // chain is moved back to before them
+    if (blockVerifier.IsCorrupt())
+    {
+        nPriority = 2000;
+        strStatusBar = strRPC = _("Warning: Corrupt blocks were found in the best chain, moving back to before them.");
+    }
+
     // Alerts
     {
         LOCK(cs_mapAlerts);
@@ -3207,9 +3433,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
 
-        // Ask the first connected node for block updates
+        // Ask the first connected node for block updates, by headers if
+        // it is ahead of us
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        bool fHeadersSync = headersSync.RequestHeaders(pfrom) || headersSync.IsActive();
+        if (!fHeadersSync && !pfrom->fClient && !pfrom->fOneShot &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
@@ -3235,7 +3463,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         // Be more aggressive with blockchain download. Send new getblocks() message after connection
         // to new node if waited longer than MAX_TIME_SINCE_BEST_BLOCK.
         int64 TimeSinceBestBlock = GetTime() - nTimeBestReceived;
-        if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK)
+        if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK && !fHeadersSync)
         {
             printf("INFO: Waiting %lld sec which is too long. Sending GetBlocks(0)\n", TimeSinceBestBlock);
             pfrom->PushGetBlocks(pindexBest, uint256(0));
@@ -3343,6 +3571,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
         CTxDB txdb("r");
+        bool fHeadersSync = headersSync.IsActive();
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -3351,6 +3580,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 return true;
             pfrom->AddInventoryKnown(inv);
 
+            // Blocks come through the download window while headers sync runs
+            if (inv.type == MSG_BLOCK && fHeadersSync)
+                continue;
+
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
@@ -3397,7 +3630,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
@@ -3522,7 +3755,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3536,7 +3769,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3548,6 +3781,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %lu", vHeaders.size());
+        }
+        headersSync.ProcessHeaders(pfrom, vHeaders);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3628,10 +3874,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (ProcessBlock(pfrom, &block)) 
+        // Blocks fetched ahead of their parent wait for it in the download
+        // window rather than in mapOrphanBlocks
+        if (headersSync.BlockReceived(block))
+            return true;
+
+        if (ProcessBlock(pfrom, &block))
+        {
             mapAlreadyAskedFor.erase(inv);
+
+            // and can follow it now
+            CBlock blockHeld;
+            for (uint256 hashPrev = inv.hash; headersSync.PopHeldBlock(hashPrev, blockHeld); hashPrev = blockHeld.GetHash())
+            {
+                if (!ProcessBlock(NULL, &blockHeld))
+                {
+                    headersSync.BlockFailed(blockHeld.GetHash());
+                    break;
+                }
+            }
+        }
 		else 
 		{
+			headersSync.BlockFailed(inv.hash);
 			if(fStrictIncoming)
 			{
 				string strFrom = pfrom->addrName; 
@@ -3649,7 +3914,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 			// Be more aggressive with blockchain download. Send getblocks() message after
 			// an error related to new block download
             int64 TimeSinceBestBlock = GetTime() - nTimeBestReceived;
-            if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK)
+            if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK && !headersSync.IsActive())
 			{
 				printf("INFO: Waiting %lld sec which is too long. Sending GetBlocks(0)\n", TimeSinceBestBlock);
                 pfrom->PushGetBlocks(pindexBest, uint256(0));
@@ -4067,6 +4332,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        // Headers first: more headers, and blocks along them
+        headersSync.RequestBlocks(pto);
     }
     return true;
 }
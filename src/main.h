@@ -15,6 +15,8 @@
 #include "voteproposalmanager.h"
 #include <iostream>
 #include <list>
+#include <atomic>
+#include <boost/unordered_map.hpp>
 
 class CWallet;
 class CBlock;
@@ -27,7 +29,15 @@ class CAddress;
 class CInv;
 class CRequestTracker;
 class CNode;
+class CScriptCheck;
 
+/** Block hashes are already uniformly distributed, so any 64 bits of one make
+ * a good bucket hash */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 #define POW_CUTOFF_HEIGHT 21000
 
@@ -68,9 +78,13 @@ inline int64 GetClockDrift(int64 nTime)
 		return 60;
 }
 static const int64 MAX_TIME_SINCE_BEST_BLOCK = 10; // how many seconds to wait before sending next PushGetBlocks()
+static const unsigned int MAX_HEADERS_RESULTS = 2000; // headers sent in answer to one getheaders
+static const int MAX_SCRIPTCHECK_THREADS = 16; // most threads -par may verify scripts on
+static const int64 DEFAULT_DB_CACHE = 100; // megabytes, a quarter of it for Berkeley DB
+static const int64 MIN_DB_CACHE = 4; // megabytes
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -78,8 +92,8 @@ extern unsigned int nStakeMinAge;
 extern unsigned int nStakeMinAgeV2;
 extern int nCoinbaseMaturity;
 extern int nBestHeight;
-extern CBigNum bnBestChainTrust;
-extern CBigNum bnBestInvalidTrust;
+extern uint256 nBestChainTrust;
+extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
@@ -105,6 +119,22 @@ extern bool fStrictIncoming;
 extern bool fGenerateBitcoins;
 extern bool fWalletStaking;
 extern CVoteProposalManager proposalManager;
+extern int nScriptCheckThreads;
+extern int64 nCoinCacheBytes;
+
+/** How often transaction and block hashes were asked for and how often they
+ * actually had to be computed, by the current thread. Kept per thread so
+ * counting does not bounce a cache line between the -par threads. */
+struct CHashCacheStats
+{
+    uint64 nTxLookups;
+    uint64 nTxSerialized;
+    uint64 nBlockLookups;
+    uint64 nBlockHashed;
+};
+extern thread_local CHashCacheStats hashCacheStats;
+// -checkhashcache: check every cached transaction hash against a fresh one
+extern bool fCheckHashCache;
 
 // Settings
 extern int64 nTransactionFee;
@@ -126,16 +156,18 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
-CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
+void SetScriptCheckThreads(int nThreads);
+bool FlushCoinsCache(bool fForce);
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
+bool CheckHeaderTarget(const uint256& hash, unsigned int nBits, int nHeight, unsigned int nBitsLastWork, unsigned int nBitsLastStake, bool& fProofOfStake);
 int64 GetProofOfWorkReward(int nHeight, int64 nFees, uint256 prevHash);
 int64 GetProofOfStakeReward(int64 nCoinAge, unsigned int nBits, unsigned int nTime, int nHeight);
 int64 GetProofOfStakeRewardV1(int64 nCoinAge, unsigned int nBits, unsigned int nTime, int nHeight);
@@ -430,6 +462,59 @@ enum GetMinFee_mode
 
 typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
 
+/** Cached hash of an object that is not modified after it was read from a
+ * stream. Copies start out empty and never cache, as copies are what gets
+ * changed afterwards (the wallet and rpc edit theirs). Any number of threads may
+ * read the object and fill in the hash at once; the first one to finish
+ * hashing stores it, and the others only read it once it is complete.
+ */
+class CHashCache
+{
+private:
+    enum
+    {
+        HASH_EMPTY,
+        HASH_STORING,
+        HASH_VALID,
+    };
+
+    mutable uint256 hash;
+    mutable std::atomic<int> nState;
+    bool fEnabled;
+
+public:
+    CHashCache() : nState(HASH_EMPTY), fEnabled(false) {}
+    CHashCache(const CHashCache& other) : nState(HASH_EMPTY), fEnabled(false) {}
+
+    CHashCache& operator=(const CHashCache& other)
+    {
+        Disable();
+        return *this;
+    }
+
+    // Start caching, the object was just read from a stream
+    void Enable() { nState = HASH_EMPTY; fEnabled = true; }
+    // The object is being modified: drop the hash and stop caching it
+    void Disable() { nState = HASH_EMPTY; fEnabled = false; }
+
+    bool Get(uint256& hashOut) const
+    {
+        if (nState.load(std::memory_order_acquire) != HASH_VALID)
+            return false;
+        hashOut = hash;
+        return true;
+    }
+
+    void Set(const uint256& hashIn) const
+    {
+        int nExpected = HASH_EMPTY;
+        if (!fEnabled || !nState.compare_exchange_strong(nExpected, HASH_STORING, std::memory_order_acquire))
+            return;
+        hash = hashIn;
+        nState.store(HASH_VALID, std::memory_order_release);
+    }
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
  */
@@ -448,6 +533,13 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // Transactions from the network or disk are only read after they are
+    // deserialized, so their hash is kept. The wallet, miner and rpc build
+    // transactions field by field or change copies; those are hashed on
+    // every call, and code that changes a deserialized transaction in place
+    // must call InvalidateHash().
+    CHashCache hashCache;
+
     CTransaction()
     {
         SetNull();
@@ -461,6 +553,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            const_cast<CTransaction*>(this)->hashCache.Enable();
 	)
 
     void SetNull()
@@ -471,6 +565,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        hashCache.Disable();
     }
 
     bool IsNull() const
@@ -480,7 +575,23 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        hashCacheStats.nTxLookups++;
+        uint256 hash;
+        if (hashCache.Get(hash))
+        {
+            // a mismatch is a change made without InvalidateHash()
+            assert(!fCheckHashCache || hash == SerializeHash(*this));
+            return hash;
+        }
+        hashCacheStats.nTxSerialized++;
+        hash = SerializeHash(*this);
+        hashCache.Set(hash);
+        return hash;
+    }
+
+    void InvalidateHash()
+    {
+        hashCache.Disable();
     }
 
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
@@ -709,11 +820,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[out] pvChecks	if given, script checks are appended here to run later instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       std::vector<CScriptCheck>* pvChecks=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -723,6 +836,40 @@ protected:
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** One input's script verification, queued by ConnectBlock to run on the
+ * -par threads. Keeps a copy of the output script it spends but only a
+ * pointer to the spending transaction, which must outlive the check.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    bool fValidatePayToScriptHash;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), fValidatePayToScriptHash(false), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nInIn, bool fValidatePayToScriptHashIn, int nHashTypeIn) :
+        scriptPubKey(txFrom.vout[txTo.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txTo), nIn(nInIn), fValidatePayToScriptHash(fValidatePayToScriptHashIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const
+    {
+        return VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, fValidatePayToScriptHash, nHashType);
+    }
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fValidatePayToScriptHash, check.fValidatePayToScriptHash);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -826,6 +973,47 @@ public:
 
 };
 
+
+// Blocks this far below the tip have their undo records dropped
+static const int BLOCK_UNDO_DEPTH = 500;
+
+/** A transaction index record as it was before a block was connected */
+class CTxIndexUndo
+{
+public:
+    uint256 hash;
+    bool fExisted;
+    CTxIndex txindex;
+
+    CTxIndexUndo() : fExisted(false) {}
+    CTxIndexUndo(const uint256& hashIn, bool fExistedIn, const CTxIndex& txindexIn) :
+        hash(hashIn), fExisted(fExistedIn), txindex(txindexIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(fExisted);
+        if (fExisted)
+            READWRITE(txindex);
+    )
+};
+
+/** Everything connecting a block changed in the transaction index: the
+ * records of the transactions it spends from and of those it adds, as they
+ * were before. Written with the block's connection and used by
+ * DisconnectBlock to put them back without reading them first.
+ */
+class CBlockUndo
+{
+public:
+    std::vector<CTxIndexUndo> vPrior;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vPrior);
+    )
+};
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -863,6 +1051,12 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // Last header hashed and its hash; the miner changes the header between
+    // calls, so the cached hash is only used while the header bytes match
+    mutable unsigned char pchHeaderCached[80];
+    mutable uint256 hashHeaderCached;
+    mutable bool fHeaderCached;
+
     CBlock()
     {
         SetNull();
@@ -903,6 +1097,7 @@ public:
         vchBlockSig.clear();
         vMerkleTree.clear();
         nDoS = 0;
+        fHeaderCached = false;
     }
 
     bool IsNull() const
@@ -964,12 +1159,13 @@ public:
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            // each pair of hashes sits back to back, so a whole level is
+            // hashed in one call and several pairs at a time
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            SHA256D64((unsigned char*)&vMerkleTree[j + nSize], (const unsigned char*)&vMerkleTree[j], nSize / 2);
+            if (nSize & 1)
+                vMerkleTree.back() = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                          BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
@@ -1087,17 +1283,11 @@ private:
 class CBlockIndex
 {
 public:
+    // what walking the chain touches comes first, within 64 bytes
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    CBigNum bnChainTrust; // ppcoin: trust score of block chain
     int nHeight;
-
-    int64 nMint;
-    int64 nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum  
     {
@@ -1105,18 +1295,22 @@ public:
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+
+    unsigned int nFile;
+    unsigned int nBlockPos;
+
+    int64 nMint;
+    int64 nMoneySupply;
 
     uint64 nStakeModifier; // hash modifier for proof-of-stake
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
 
     // proof-of-stake specific fields
-    COutPoint prevoutStake;
     unsigned int nStakeTime;
+    COutPoint prevoutStake;
     uint256 hashProofOfStake;
 
-    //Voting
-    CVoteTally tally;
-
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -1132,7 +1326,7 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1141,7 +1335,6 @@ public:
         hashProofOfStake = 0;
         prevoutStake.SetNull();
         nStakeTime = 0;
-        tally.SetNull();
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1158,14 +1351,13 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
         hashProofOfStake = 0;
-        tally.SetNull();
         if (block.IsProofOfStake())
         {
             SetProofOfStake();
@@ -1208,7 +1400,10 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockTrust() const;
+    uint256 GetBlockTrust() const;
+
+    // Vote tally as of this block; empty before voting starts
+    CVoteTally GetTally() const;
 
     bool IsInMainChain() const
     {
@@ -1324,6 +1519,7 @@ private:
 public:
     uint256 hashPrev;
     uint256 hashNext;
+    CVoteTally tally;
 
     CDiskBlockIndex()
     {
@@ -1336,6 +1532,8 @@ public:
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        if (nVersion >= CBlock::VOTING_VERSION && (fTestNet || nHeight >= (int)VOTING_START))
+            voteTallyIndex.Find(pindex, tally);
     }
 
     IMPLEMENT_SERIALIZE
@@ -1413,6 +1611,84 @@ public:
     }
 };
 
+/** The main chain by height, so a block at a given height is found without
+ * walking pprev or pnext. Mirrors the pnext links like CStakeModifierIndex,
+ * so it is only touched where they are, under cs_main.
+ */
+class CActiveChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    // pindex has become the new tip of the main chain
+    void Connect(CBlockIndex* pindex);
+    // drop the blocks above nHeight, which have left the main chain
+    void DisconnectAbove(int nHeight);
+    // reload from the pnext links starting at pindexGenesis
+    void Rebuild(CBlockIndex* pindexGenesis);
+
+    // main chain block at nHeight, NULL if there is none
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    CBlockIndex* Tip() const
+    {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    int Height() const
+    {
+        return (int)vChain.size() - 1;
+    }
+
+    void clear()
+    {
+        vChain.clear();
+    }
+};
+
+extern CActiveChain chainActive;
+
+/** Memory for CBlockIndex entries, handed out from large chunks instead of
+ * one allocation each. Entries stay for as long as the block index does, so
+ * none is ever given back on its own.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed; // entries taken from the last chunk
+
+public:
+    static const unsigned int CHUNK_SIZE = 4096;
+
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena();
+
+    // room for one CBlockIndex, to be constructed with placement new
+    void* Allocate();
+
+    unsigned int size() const
+    {
+        return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_SIZE + nUsed;
+    }
+
+    size_t GetMemoryUsage() const
+    {
+        return vChunks.size() * CHUNK_SIZE * sizeof(CBlockIndex);
+    }
+};
+
+extern CBlockIndexArena blockIndexArena;
+
+// Bytes taken by the block index: its entries, mapBlockIndex and the tallies
+size_t GetBlockIndexMemoryUsage();
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1434,7 +1710,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1485,7 +1761,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1504,7 +1780,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1520,7 +1796,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
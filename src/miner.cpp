@@ -1,4 +1,5 @@
 #include "miner.h"
+#include "blockverifier.h"
 #include "hashblock.h"
 #include "init.h"
 #include "main.h"
@@ -192,6 +193,7 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
 
     // ppcoin: if coinstake available add coinstake tx
     static int64 nLastCoinStakeSearchTime = GetAdjustedTime();  // only initialized at startup
+    static uint256 hashLastCoinStakeSearchPrev = 0;
     CBlockIndex* pindexPrev = pindexBest;
 
     if (fProofOfStake && !pwalletMain->fDisableStake)  // attempt to find a coinstake && make sure settings allow PoS (presstab HyperStake)
@@ -199,7 +201,9 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
         pblock->nBits = GetNextTargetRequired(pindexPrev, true);
         CTransaction txCoinStake;
         int64 nSearchTime = txCoinStake.nTime; // search to current time
-        if (nSearchTime > nLastCoinStakeSearchTime)
+        // a new tip is searched on at once, even within the second of the
+        // last search: the minter only wakes again nHashInterval later
+        if (nSearchTime > nLastCoinStakeSearchTime || pindexPrev->GetBlockHash() != hashLastCoinStakeSearchPrev)
         {
             // printf(">>> OK1\n");
             if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime-nLastCoinStakeSearchTime, txCoinStake))
@@ -207,13 +211,16 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
                 if (txCoinStake.nTime >= std::max(pindexPrev->GetMedianTimePast()+1, pindexPrev->GetBlockTime() - GetClockDrift(pindexPrev->GetBlockTime())))
                 {   // make sure coinstake would meet timestamp protocol
                     // as it would be the same as the block timestamp
+                    pblock->vtx[0].InvalidateHash();
                     pblock->vtx[0].vout[0].SetEmpty();
                     pblock->vtx[0].nTime = txCoinStake.nTime;
                     pblock->vtx.push_back(txCoinStake);
                 }
             }
-            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+            if (nSearchTime > nLastCoinStakeSearchTime)
+                nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
             nLastCoinStakeSearchTime = nSearchTime;
+            hashLastCoinStakeSearchPrev = pindexPrev->GetBlockHash();
         }
     }
 
@@ -440,6 +447,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].InvalidateHash();
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
@@ -537,6 +545,53 @@ static int nLimitProcessors = -1;
 bool fMintableCoins = false;
 int nMintableLastCheck = 0;
 
+// The stake minter sleeps until a new best block arrives or new coinstake
+// timestamps have come into its drift window since the last search
+static boost::mutex mutexStakeMinter;
+static boost::condition_variable condStakeMinter;
+static bool fStakeMinterNotified = false;
+
+void NotifyStakeMinter()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexStakeMinter);
+        fStakeMinterNotified = true;
+    }
+    condStakeMinter.notify_all();
+}
+
+// Wait for the next stake attempt. nLastSearch is the adjusted time of the
+// previous search, which covered the timestamps up to nLastSearch + nHashDrift;
+// searching again before nHashInterval more seconds have passed finds little new.
+static void WaitForStakeSlot(CWallet* pwallet, int nLastHeight, int64 nLastSearch)
+{
+    boost::unique_lock<boost::mutex> lock(mutexStakeMinter);
+    while (!fShutdown && !fStakeMinterNotified && nLastHeight == nBestHeight)
+    {
+        int64 nNextSearch = nLastSearch + std::max(pwallet->nHashInterval, (unsigned int)1);
+        int64 nWait = nNextSearch * 1000 - (GetAdjustedTime() - GetTime()) * 1000 - GetTimeMillis();
+        if (nWait <= 0)
+            break;
+        condStakeMinter.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+    }
+    fStakeMinterNotified = false;
+}
+
+std::string GetMinerWaitReason(CWallet* pwallet)
+{
+    if (blockVerifier.IsCorrupt())
+        return "corrupt blocks in the best chain";
+    if (vNodes.empty())
+        return "no peers";
+    if (IsInitialBlockDownload())
+        return "initial block download";
+    if (pwallet->IsLocked())
+        return "wallet locked";
+    if (!fMintableCoins)
+        return "no mintable coins";
+    return "";
+}
+
 void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
 {
     printf("CPUMiner started for proof-of-%s\n", fProofOfStake? "stake" : "work");
@@ -552,6 +607,8 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
     // Each thread has its own key and counter
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
+    int nLastStakeHeight = -1;
+    int64 nLastStakeSearch = 0;
 
     while (fGenerateBitcoins || fProofOfStake)
     {
@@ -560,7 +617,7 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
 
         fWalletStaking = false;
 
-        while (vNodes.empty() || IsInitialBlockDownload() || pwallet->IsLocked()  ||  !fMintableCoins)
+        while (!GetMinerWaitReason(pwallet).empty())
         {
             nLastCoinStakeSearchInterval = 0;
             Sleep(1000);
@@ -578,14 +635,16 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 return;
         }
 
-        if(mapHashedBlocks.count(nBestHeight)) //search our map of hashed blocks, see if bestblock has been hashed yet
+        if (fProofOfStake)
         {
-            fWalletStaking = true;
-            if(GetTime() - mapHashedBlocks[nBestHeight] < std::max(pwallet->nHashInterval, (unsigned int)1)) // wait a 'hash interval' until trying to hash again
-            {
-                Sleep(1000); // 2.5 second sleep for this thread
-                continue;
-            }
+            // sleep until a new block or a fresh stake slot instead of polling
+            if (nLastStakeHeight == nBestHeight)
+                fWalletStaking = true;
+            WaitForStakeSlot(pwallet, nLastStakeHeight, nLastStakeSearch);
+            if (fShutdown)
+                return;
+            nLastStakeHeight = nBestHeight;
+            nLastStakeSearch = GetAdjustedTime();
         }
 
         //
@@ -640,31 +699,35 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
         int64 nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
+        // Headers for the nonces up to the next multiple of 256, hashed as one batch
+        const unsigned int nHeaderSize = END(pblock->nNonce) - BEGIN(pblock->nVersion);
+        std::vector<unsigned char> vHeaders(0x100 * nHeaderSize);
+        std::vector<uint256> vHashes(0x100);
+
         while (true)
         {
             unsigned int nHashesDone = 0;
 
-            uint256 thash;
-            while (true)
+            unsigned int nCount = 0x100 - (pblock->nNonce & 0xFF);
+            for (unsigned int i = 0; i < nCount; i++)
             {
-                thash = pblock->GetHash();
-                if (thash <= hashTarget)
-                {
-
-                    if (!pblock->SignBlock(*pwalletMain))
-                    {
-                        break;
-                    }
-
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock.get(), *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
-                }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
-                    break;
+                unsigned char* pheader = &vHeaders[i * nHeaderSize];
+                unsigned int nNonce = pblock->nNonce + i;
+                memcpy(pheader, BEGIN(pblock->nVersion), nHeaderSize);
+                memcpy(pheader + nHeaderSize - sizeof(nNonce), &nNonce, sizeof(nNonce));
+            }
+            Hash9Batch(&vHeaders[0], nHeaderSize, nCount, &vHashes[0]);
+
+            unsigned int nFound = 0;
+            while (nFound < nCount && vHashes[nFound] > hashTarget)
+                nFound++;
+            pblock->nNonce += nFound;
+            nHashesDone += nFound;
+            if (nFound < nCount && pblock->SignBlock(*pwalletMain))
+            {
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                CheckWork(pblock.get(), *pwallet, reservekey);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
             }
 
             // Meter hashes/sec
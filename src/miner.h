@@ -1,11 +1,17 @@
 #ifndef HYPERSTAKE_MINER_H
 #define HYPERSTAKE_MINER_H
 
+#include <string>
+
 class CBlock;
 class CWallet;
 
 void BitcoinMiner(CWallet *pwallet, bool fProofOfStake);
+// Why the miner has to wait before making a block, empty if it need not
+std::string GetMinerWaitReason(CWallet* pwallet);
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake);
 void ThreadBitcoinMiner(void* parg);
+// Wake the stake minter: a new best block arrived or the node is shutting down
+void NotifyStakeMinter();
 
 #endif //HYPERSTAKE_MINER_H
@@ -8,6 +8,8 @@
 #include "init.h"
 #include "miner.h"
 #include "addrman.h"
+#include "headerssync.h"
+#include "kernel.h"
 #include "ui_interface.h"
 
 #ifdef WIN32
@@ -550,6 +552,8 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+int CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
@@ -727,6 +731,9 @@ void ThreadSocketHandler2(void* parg)
                     pnode->CloseSocketDisconnect();
                     pnode->Cleanup();
 
+                    // blocks asked of it are up for grabs again
+                    headersSync.FinalizeNode(pnode->id);
+
                     // hold in disconnected pool until all refs are released
                     pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
                     if (pnode->fNetworkNode || pnode->fInbound)
@@ -1344,6 +1351,8 @@ void static ThreadStakeMinter(void* parg)
 {
     printf("ThreadStakeMinter started\n");
     CWallet* pwallet = (CWallet*)parg;
+    // the kernel search workers live as long as the minter
+    stakeSearchThreads.Start(GetStakeSearchThreads() - 1);
     try
     {
         vnThreadsRunning[THREAD_MINTER]++;
@@ -1357,6 +1366,7 @@ void static ThreadStakeMinter(void* parg)
         vnThreadsRunning[THREAD_MINTER]--;
         PrintException(NULL, "ThreadStakeMinter()");
     }
+    stakeSearchThreads.Stop();
     printf("ThreadStakeMinter exiting, %d threads remaining\n", vnThreadsRunning[THREAD_MINTER]);
 }
 
@@ -1939,6 +1949,7 @@ bool StopNode()
 {
     printf("StopNode()\n");
     fShutdown = true;
+    NotifyStakeMinter();
     nTransactionsUpdated++;
     int64 nStart = GetTime();
     if (semOutbound)
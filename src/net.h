@@ -205,9 +205,13 @@ public:
     bool fSuccessfullyConnected;
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
+    int id;
 protected:
     int nRefCount;
 
+    static int nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
     static std::map<CNetAddr, int64> setBanned;
@@ -258,6 +262,10 @@ public:
         fSuccessfullyConnected = false;
         fDisconnect = false;
         nRefCount = 0;
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
         nReleaseTime = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
@@ -22,16 +22,11 @@ std::string getBlockHash(int64 Height)
 {
     if(Height > pindexBest->nHeight) { return ""; }
     if(Height < 0) { return ""; }
-    int64 desiredheight;
-    desiredheight = Height;
-    if (desiredheight < 0 || desiredheight > nBestHeight)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > desiredheight)
-        pblockindex = pblockindex->pprev;
-    return  pblockindex->GetBlockHash().GetHex(); // pblockindex->phashBlock->GetHex();
+    LOCK(cs_main);
+    CBlockIndex* pblockindex = chainActive[Height];
+    if (!pblockindex)
+        return "";
+    return pblockindex->GetBlockHash().GetHex();
 }
 
 int64 getBlockTime(int64 Height)
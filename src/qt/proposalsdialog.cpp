@@ -75,7 +75,11 @@ void ProposalsDialog::UpdateTable()
             else
                 nHeightTally = nBestHeight;
 
-            CVoteTally tally = FindBlockByHeight(nHeightTally)->tally;
+            CVoteTally tally;
+            {
+                LOCK(cs_main);
+                tally = chainActive[nHeightTally]->GetTally();
+            }
             CVoteSummary summary;
             bool fTallySet = true;
             if (!tally.GetSummary(proposal.GetHash(), summary))
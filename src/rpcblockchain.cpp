@@ -10,6 +10,8 @@
 #include "voteobject.h"
 #include "votetally.h"
 #include "db.h"
+#include "sigcache.h"
+#include "blockverifier.h"
 
 #include <iostream>
 #include <fstream>
@@ -184,6 +186,69 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns the size and hit rate of the signature cache.");
+
+    CSignatureCacheStats stats = signatureCache.GetStats();
+    Object obj;
+    obj.push_back(Pair("maxbytes",  (boost::uint64_t)stats.nMaxBytes));
+    obj.push_back(Pair("capacity",  (boost::uint64_t)stats.nCapacity));
+    obj.push_back(Pair("entries",   (boost::uint64_t)stats.nUsed));
+    obj.push_back(Pair("hits",      (boost::uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",    (boost::uint64_t)stats.nMisses));
+    obj.push_back(Pair("inserts",   (boost::uint64_t)stats.nInserts));
+    obj.push_back(Pair("evictions", (boost::uint64_t)stats.nEvictions));
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",   nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return obj;
+}
+
+Value gettxindexcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettxindexcacheinfo\n"
+            "Returns the size and hit rate of the cache of transaction index records read from disk.");
+
+    CTxIndexReadCacheStats stats = txindexCache.GetStats();
+    Object obj;
+    obj.push_back(Pair("maxbytes",  (boost::uint64_t)stats.nMaxBytes));
+    obj.push_back(Pair("bytes",     (boost::uint64_t)stats.nUsage));
+    obj.push_back(Pair("entries",   (boost::uint64_t)stats.nEntries));
+    obj.push_back(Pair("hits",      (boost::uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",    (boost::uint64_t)stats.nMisses));
+    obj.push_back(Pair("inserts",   (boost::uint64_t)stats.nInserts));
+    obj.push_back(Pair("evictions", (boost::uint64_t)stats.nEvictions));
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",   nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return obj;
+}
+
+Value getcheckblocksinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcheckblocksinfo\n"
+            "Returns the progress of the -checkblocks verification run after startup.");
+
+    CBlockVerifierStatus status = blockVerifier.GetStatus();
+    Object obj;
+    obj.push_back(Pair("running",  status.fRunning));
+    obj.push_back(Pair("level",    status.nLevel));
+    obj.push_back(Pair("threads",  status.nThreads));
+    obj.push_back(Pair("blocks",   (boost::uint64_t)status.nBlocks));
+    obj.push_back(Pair("checked",  (boost::uint64_t)status.nChecked));
+    obj.push_back(Pair("progress", status.nBlocks ? (double)status.nChecked / status.nBlocks : 1.0));
+    obj.push_back(Pair("bad",      (boost::uint64_t)status.nBad));
+    obj.push_back(Pair("corrupt",  status.fCorrupt));
+    obj.push_back(Pair("elapsed",  (boost::int64_t)status.nElapsed));
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -195,7 +260,7 @@ Value getblockhash(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -233,13 +298,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = chainActive[nHeight];
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -257,15 +316,20 @@ Value exportdifficulty(const Array& params, bool fHelp)
 	int nInterval = params[0].get_int();		
 	std::string strDir = params[1].get_str();
     
+	if (nInterval < 1)
+		throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid interval");
+
 	ofstream File; 
 	
+	// chainActive changes under cs_main, which the caller may not hold
+	LOCK(cs_main);
 	File.open(strDir.c_str()); 
 	File << "Block, Difficulty" << endl;
-	for(int i = 0; i < nBestHeight; i += nInterval)
+	for(int i = 0; i < chainActive.Height(); i += nInterval)
 	{
 		File << i;
 		File << ",";		
-		File << GetDifficulty(FindBlockByHeight(i)) << endl; 
+		File << GetDifficulty(chainActive[i]) << endl; 
 	}
 	File.close(); 
     return "succesfully exported";
@@ -286,7 +350,9 @@ Value listblocks(const Array& params, bool fHelp)
     {
         Object blk;
         unsigned int nBlockNumber = nTopBlock - i;
-        CBlockIndex* pindex = FindBlockByHeight(nBlockNumber);
+        CBlockIndex* pindex = chainActive[nBlockNumber];
+        if (!pindex)
+            continue;
         blk.push_back(Pair("height", pindex->nHeight));
         blk.push_back(Pair("hash", pindex->GetBlockHash().GetHex()));
         blk.push_back(Pair("time", (boost::int64_t)pindex->GetBlockTime()));
@@ -404,7 +470,7 @@ Value getproposalstatus(const Array& params, bool fHelp)
     else
         nHeightTally = nBestHeight;
 
-    CVoteTally tally = FindBlockByHeight(nHeightTally)->tally;
+    CVoteTally tally = chainActive[nHeightTally]->GetTally();
     CVoteSummary summary;
     if (!tally.GetSummary(proposal.GetHash(), summary))
         throw JSONRPCError(RPC_DATABASE_ERROR, "failed to find proposal in vote tally");
@@ -87,6 +87,7 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("newmint",       ValueFromAmount(pwalletMain->GetNewMint())));
     obj.push_back(Pair("stake",         ValueFromAmount(pwalletMain->GetStake())));
     obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blockindexmemory", (boost::int64_t)GetBlockIndexMemoryUsage()));
     obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->nMoneySupply)));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
@@ -1298,7 +1299,7 @@ Value getconfs(const Array& params, bool fHelp)
 			entry.push_back(Pair("confirmations", 0));
 		else
 		{
-			map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+			BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 			if (mi != mapBlockIndex.end() && (*mi).second)
 			{
 				CBlockIndex* pindex = (*mi).second;
@@ -1361,7 +1362,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -1829,7 +1830,7 @@ Value makekeypair(const Array& params, bool fHelp)
 //presstab
 double GetMoneySupply(int nHeight)
 {
-	CBlockIndex* pindex = FindBlockByHeight(nHeight);
+	CBlockIndex* pindex = chainActive[nHeight];
 	double nSupply = pindex->nMoneySupply;	
 	return nSupply / COIN;	
 }
@@ -1845,8 +1846,8 @@ double GetSupplyChange(int nHeight, int pHeight)
 //presstab
 double GetBlockSpeed(int nHeight, int pHeight)
 {
-	CBlockIndex* pIndex = FindBlockByHeight(nHeight);
-	CBlockIndex* ppIndex = FindBlockByHeight(pHeight);
+	CBlockIndex* pIndex = chainActive[nHeight];
+	CBlockIndex* ppIndex = chainActive[pHeight];
 	double nTime = pIndex->nTime;
 	double pTime = ppIndex->nTime;
 	double nTimeChange = (nTime - pTime) / 60 / 60 / 24; //in days
@@ -2020,7 +2021,7 @@ double getWeight()
 	BOOST_FOREACH(const COutput& out, vCoins)
     {
 		int64 nHeight = nBestHeight - out.nDepth;
-		CBlockIndex* pindex = FindBlockByHeight(nHeight);
+		CBlockIndex* pindex = chainActive[nHeight];
 		uint64 nWeight = 0;
 		pwalletMain->GetStakeWeightFromValue(out.tx->GetTxTime(), out.tx->vout[out.i].nValue, nWeight);
 		int64 nAge = int64(GetTime() - pindex->nTime);
@@ -2064,7 +2065,7 @@ Value getpotentialstake(const Array& params, bool fHelp)
 	BOOST_FOREACH(const COutput& out, vCoins)
     {
 		int64 nHeight = nBestHeight - out.nDepth;
-		CBlockIndex* pindex = FindBlockByHeight(nHeight);
+		CBlockIndex* pindex = chainActive[nHeight];
 		uint64 nAmount = out.tx->vout[out.i].nValue;
 		double dAge = double(GetTime() - pindex->nTime) / (60*60*24);
 		double nReward = 7.5 / 365 * dAge * (double)nAmount;
@@ -2183,7 +2184,7 @@ Value rescanfromblock(const Array& params, bool fHelp)
 	if (nHeight > int(nBestHeight) || nHeight < 0)
 		return "out of range";
 		
-	pwalletMain->ScanForWalletTransactions(FindBlockByHeight(nHeight), true);
+	pwalletMain->ScanForWalletTransactions(chainActive[nHeight], true);
 	return "done";
 }
 
@@ -2204,7 +2205,7 @@ Value cclistcoins(const Array& params, bool fHelp)
     {
 		Object coutput;
 		int64 nHeight = nBestHeight - out.nDepth;
-		CBlockIndex* pindex = FindBlockByHeight(nHeight);
+		CBlockIndex* pindex = chainActive[nHeight];
 		
 		CTxDestination outputAddress;
 		ExtractDestination(out.tx->vout[out.i].scriptPubKey, outputAddress);
@@ -2769,6 +2770,9 @@ Value getstakingstatus(const Array& params, bool fHelp)
                         "  \"mintablecoins\": true|false,      (boolean) if the wallet has mintable coins\n"
                         "  \"enoughcoins\": true|false,        (boolean) if available coins are greater than reserve balance\n"
                         "  \"staking status\": true|false,     (boolean) if the wallet is staking or not\n"
+                        "  \"stakethreads\": [                   (array) kernel hashes tried by each -stakethreads worker\n"
+                        "    n,                                (numeric)\n"
+                        "  ]\n"
                         "}\n");
 
     Object obj;
@@ -2793,6 +2797,14 @@ Value getstakingstatus(const Array& params, bool fHelp)
         fStaking = true;
     obj.push_back(Pair("staking status", fStaking));
 
+    if (pwalletMain) {
+        Array threads;
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_FOREACH(uint64 nHashes, pwalletMain->vStakeThreadHashes)
+            threads.push_back((boost::int64_t)nHashes);
+        obj.push_back(Pair("stakethreads", threads));
+    }
+
     return obj;
 }
 
@@ -2832,6 +2844,7 @@ Value sendproposal(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds");
 
     //! Fill vin
+    wtx.InvalidateHash();
     for (pair<const CWalletTx*,unsigned int> coin : setCoins)
         wtx.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
@@ -0,0 +1,360 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+#include <algorithm>
+
+#include "sha256.h"
+
+namespace
+{
+const uint32_t K[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// Second block of the first hash in a 64 byte double hash: padding and the
+// 512 bit length. The second hash pads its 32 byte input to 256 bits.
+const unsigned char PAD64[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00};
+const unsigned char PAD32[32] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x00};
+
+inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) ((((y) ^ (z)) & (x)) ^ (z))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SIGMA0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define sigma0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define sigma1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+// All 64 rounds on state s, adding the old state back in. w holds the
+// sixteen message words and is expanded in place. T is uint32_t for the
+// generic transform or a vector of lanes for the multi-message ones.
+template<typename T>
+inline __attribute__((always_inline)) void Compress(T* s, T* w)
+{
+    T a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+            w[i & 15] += sigma1(w[(i - 2) & 15]) + w[(i - 7) & 15] + sigma0(w[(i - 15) & 15]);
+        T t1 = h + SIGMA1(e) + CH(e, f, g) + K[i] + w[i & 15];
+        T t2 = SIGMA0(a) + MAJ(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+void TransformGeneric(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    for (; nBlocks > 0; nBlocks--, chunk += 64)
+    {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++)
+            w[i] = ReadBE32(chunk + 4 * i);
+        Compress(s, w);
+    }
+}
+
+typedef void (*TransformFunc)(uint32_t* s, const unsigned char* chunk, size_t nBlocks);
+typedef void (*D64Func)(unsigned char* out, const unsigned char* in, size_t nBlocks);
+
+TransformFunc transform = TransformGeneric;
+
+// One input at a time through whichever compression function is in use
+void D64Transform(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+    for (; nBlocks > 0; nBlocks--, in += 64, out += 32)
+    {
+        uint32_t s[8];
+        memcpy(s, H0, sizeof(s));
+        transform(s, in, 1);
+        transform(s, PAD64, 1);
+
+        unsigned char buf[64];
+        for (int i = 0; i < 8; i++)
+            WriteBE32(buf + 4 * i, s[i]);
+        memcpy(buf + 32, PAD32, sizeof(PAD32));
+        memcpy(s, H0, sizeof(s));
+        transform(s, buf, 1);
+        for (int i = 0; i < 8; i++)
+            WriteBE32(out + 4 * i, s[i]);
+    }
+}
+
+D64Func transformD64 = D64Transform;
+SHA256Backend backendSelected = SHA256_BACKEND_GENERIC;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SHA256_X86
+#endif
+
+#ifdef USE_SHA256_X86
+}
+#include <cpuid.h>
+#include <immintrin.h>
+namespace
+{
+// The SHA extensions keep the state as ABEF and CDGH and run two rounds per
+// sha256rnds2, taking the round constants already added to the message.
+#define SHANI_ROUNDS(k, m) \
+    msg = _mm_add_epi32(m, _mm_load_si128((const __m128i*)&K[k])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+// m0 = next four message words, from the previous sixteen in m0..m3
+#define SHANI_SCHEDULE(m0, m1, m2, m3) \
+    m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3);
+
+__attribute__((target("sha,sse4.1"))) void TransformSHANI(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; nBlocks > 0; nBlocks--, chunk += 64)
+    {
+        __m128i abef = state0, cdgh = state1, msg;
+        __m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 0)), bswap);
+        __m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16)), bswap);
+        __m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 32)), bswap);
+        __m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 48)), bswap);
+        SHANI_ROUNDS(0, m0)
+        SHANI_ROUNDS(4, m1)
+        SHANI_ROUNDS(8, m2)
+        SHANI_ROUNDS(12, m3)
+        for (int k = 16; k < 64; k += 16)
+        {
+            SHANI_SCHEDULE(m0, m1, m2, m3)
+            SHANI_ROUNDS(k, m0)
+            SHANI_SCHEDULE(m1, m2, m3, m0)
+            SHANI_ROUNDS(k + 4, m1)
+            SHANI_SCHEDULE(m2, m3, m0, m1)
+            SHANI_ROUNDS(k + 8, m2)
+            SHANI_SCHEDULE(m3, m0, m1, m2)
+            SHANI_ROUNDS(k + 12, m3)
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&s[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&s[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+// Several 64 byte double hashes side by side, one per vector lane
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+
+template<typename V, int N>
+inline __attribute__((always_inline)) void D64Lanes(unsigned char* out, const unsigned char* in, size_t nLanes)
+{
+    V w[16], s[8], s1[8];
+    memset(w, 0, sizeof(w));
+    for (int i = 0; i < 16; i++)
+        for (size_t l = 0; l < nLanes; l++)
+            w[i][l] = ReadBE32(in + 64 * l + 4 * i);
+    for (int i = 0; i < 8; i++)
+        for (int l = 0; l < N; l++)
+            s[i][l] = H0[i];
+    Compress(s, w);
+
+    for (int i = 0; i < 16; i++)
+        for (int l = 0; l < N; l++)
+            w[i][l] = ReadBE32(PAD64 + 4 * i);
+    Compress(s, w);
+
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = s[i];
+        for (int l = 0; l < N; l++)
+        {
+            w[8 + i][l] = ReadBE32(PAD32 + 4 * i);
+            s1[i][l] = H0[i];
+        }
+    }
+    Compress(s1, w);
+
+    for (size_t l = 0; l < nLanes; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE32(out + 32 * l + 4 * i, s1[i][l]);
+}
+
+__attribute__((target("sse4.1"))) void D64SSE4(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+    for (; nBlocks > 0; nBlocks -= std::min(nBlocks, (size_t)4), in += 4 * 64, out += 4 * 32)
+        D64Lanes<v4u, 4>(out, in, std::min(nBlocks, (size_t)4));
+}
+
+__attribute__((target("avx2"))) void D64AVX2(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+    for (; nBlocks > 0; nBlocks -= std::min(nBlocks, (size_t)8), in += 8 * 64, out += 8 * 32)
+        D64Lanes<v8u, 8>(out, in, std::min(nBlocks, (size_t)8));
+}
+
+bool HaveSHANI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1");
+}
+#endif
+}
+
+CSHA256::CSHA256()
+{
+    Reset();
+}
+
+CSHA256& CSHA256::Reset()
+{
+    memcpy(s, H0, sizeof(s));
+    nBytes = 0;
+    return *this;
+}
+
+CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
+{
+    const unsigned char* end = data + len;
+    size_t nBufSize = nBytes % 64;
+    if (nBufSize && nBufSize + len >= 64)
+    {
+        // complete the buffered block
+        memcpy(buf + nBufSize, data, 64 - nBufSize);
+        nBytes += 64 - nBufSize;
+        data += 64 - nBufSize;
+        transform(s, buf, 1);
+        nBufSize = 0;
+    }
+    if (end - data >= 64)
+    {
+        size_t nBlocks = (end - data) / 64;
+        transform(s, data, nBlocks);
+        data += 64 * nBlocks;
+        nBytes += 64 * nBlocks;
+    }
+    if (end > data)
+    {
+        memcpy(buf + nBufSize, data, end - data);
+        nBytes += end - data;
+    }
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    unsigned char pchSize[8];
+    uint64_t nBits = nBytes << 3;
+    WriteBE32(pchSize, nBits >> 32);
+    WriteBE32(pchSize + 4, nBits);
+    static const unsigned char pad[64] = {0x80};
+    Write(pad, 1 + ((119 - (nBytes % 64)) % 64));
+    Write(pchSize, 8);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(hash + 4 * i, s[i]);
+}
+
+bool SHA256BackendSupported(SHA256Backend backend)
+{
+    switch (backend)
+    {
+    case SHA256_BACKEND_GENERIC:
+        return true;
+#ifdef USE_SHA256_X86
+    case SHA256_BACKEND_SSE4:
+        return __builtin_cpu_supports("sse4.1");
+    case SHA256_BACKEND_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SHA256_BACKEND_SHANI:
+        return HaveSHANI();
+#endif
+    default:
+        return false;
+    }
+}
+
+bool SHA256SelectBackend(SHA256Backend backend)
+{
+    if (!SHA256BackendSupported(backend))
+        return false;
+    transform = TransformGeneric;
+    transformD64 = D64Transform;
+#ifdef USE_SHA256_X86
+    switch (backend)
+    {
+    case SHA256_BACKEND_SSE4:
+        transformD64 = D64SSE4;
+        break;
+    case SHA256_BACKEND_AVX2:
+        transformD64 = D64AVX2;
+        break;
+    case SHA256_BACKEND_SHANI:
+        transform = TransformSHANI;
+        break;
+    default:
+        break;
+    }
+#endif
+    backendSelected = backend;
+    return true;
+}
+
+const char* SHA256AutoDetect()
+{
+    if (!SHA256SelectBackend(SHA256_BACKEND_SHANI) && !SHA256SelectBackend(SHA256_BACKEND_AVX2) &&
+        !SHA256SelectBackend(SHA256_BACKEND_SSE4))
+        SHA256SelectBackend(SHA256_BACKEND_GENERIC);
+    return SHA256BackendName(backendSelected);
+}
+
+SHA256Backend GetSHA256Backend()
+{
+    return backendSelected;
+}
+
+const char* SHA256BackendName(SHA256Backend backend)
+{
+    switch (backend)
+    {
+    case SHA256_BACKEND_GENERIC: return "generic";
+    case SHA256_BACKEND_SSE4: return "sse4.1";
+    case SHA256_BACKEND_AVX2: return "avx2";
+    case SHA256_BACKEND_SHANI: return "sha-ni";
+    }
+    return "unknown";
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+    transformD64(out, in, nBlocks);
+}
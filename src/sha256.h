@@ -0,0 +1,53 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_SHA256_H
+#define HYPERSTAKE_SHA256_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** In-tree SHA-256, used by Hash(), CHashWriter and the merkle tree.
+ * The compression function is chosen for the running cpu when
+ * SHA256AutoDetect() is called at startup: SHA-NI if it is there, the
+ * generic one otherwise. Double hashes of 64 byte inputs, the inner nodes
+ * of a merkle tree, are also computed several at a time in AVX2 or SSE4.1
+ * lanes. Every backend returns exactly what OpenSSL does.
+ */
+class CSHA256
+{
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t nBytes;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA256& Reset();
+};
+
+enum SHA256Backend
+{
+    SHA256_BACKEND_GENERIC,
+    SHA256_BACKEND_SSE4,
+    SHA256_BACKEND_AVX2,
+    SHA256_BACKEND_SHANI,
+};
+
+bool SHA256BackendSupported(SHA256Backend backend);
+// Use the fastest backend the running cpu supports and return its name
+const char* SHA256AutoDetect();
+// Use a given backend, for tests and benchmarks. Not thread safe: only call
+// it while nothing else is hashing.
+bool SHA256SelectBackend(SHA256Backend backend);
+SHA256Backend GetSHA256Backend();
+const char* SHA256BackendName(SHA256Backend backend);
+
+// Double SHA-256 of nBlocks inputs of 64 bytes each, 32 bytes out per input
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks);
+
+#endif
@@ -0,0 +1,124 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sigcache.h"
+#include "util.h"
+
+using namespace std;
+
+CSignatureCache signatureCache;
+
+CSignatureCache::CSignatureCache() : nMaxBytes(0)
+{
+    uint256 salt = GetRandHash();
+    hasherSalted.Write((const unsigned char*)&salt, sizeof(salt));
+    Resize(DEFAULT_MAX_SIGCACHE_SIZE << 20);
+}
+
+uint256 CSignatureCache::ComputeEntry(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey) const
+{
+    // The signature length goes in too, or a signature and key could be
+    // split differently and still hit an entry
+    uint32_t nSigSize = vchSig.size();
+    unsigned char pchSize[4] = {(unsigned char)nSigSize, (unsigned char)(nSigSize >> 8),
+                                (unsigned char)(nSigSize >> 16), (unsigned char)(nSigSize >> 24)};
+
+    uint256 entry;
+    CSHA256(hasherSalted).Write((const unsigned char*)&hash, sizeof(hash))
+                         .Write(pchSize, sizeof(pchSize))
+                         .Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size())
+                         .Write(vchPubKey.empty() ? NULL : &vchPubKey[0], vchPubKey.size())
+                         .Finalize((unsigned char*)&entry);
+    // 0 marks an empty way
+    if (entry == 0)
+        entry = 1;
+    return entry;
+}
+
+void CSignatureCache::Resize(uint64 nBytes)
+{
+    uint64 nBuckets = nBytes / (SHARDS * WAYS * sizeof(uint256));
+    for (unsigned int i = 0; i < SHARDS; i++)
+    {
+        CShard& shard = shards[i];
+        boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+        vector<uint256>().swap(shard.vEntries);
+        shard.vEntries.resize(nBuckets * WAYS);
+        shard.nUsed = 0;
+    }
+    nMaxBytes = nBytes;
+}
+
+bool CSignatureCache::Get(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    uint256 entry = ComputeEntry(hash, vchSig, vchPubKey);
+    CShard& shard = shards[entry.Get64(0) % SHARDS];
+    {
+        boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+        if (!shard.vEntries.empty())
+        {
+            const uint256* pbucket = &shard.vEntries[(entry.Get64(1) % (shard.vEntries.size() / WAYS)) * WAYS];
+            for (unsigned int i = 0; i < WAYS; i++)
+            {
+                if (pbucket[i] == entry)
+                {
+                    shard.nHits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+    }
+    shard.nMisses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void CSignatureCache::Set(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    uint256 entry = ComputeEntry(hash, vchSig, vchPubKey);
+    CShard& shard = shards[entry.Get64(0) % SHARDS];
+    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+    if (shard.vEntries.empty())
+        return;
+
+    uint256* pbucket = &shard.vEntries[(entry.Get64(1) % (shard.vEntries.size() / WAYS)) * WAYS];
+    unsigned int nWay = WAYS;
+    for (unsigned int i = 0; i < WAYS; i++)
+    {
+        if (pbucket[i] == entry)
+            return;
+        if (nWay == WAYS && pbucket[i] == 0)
+            nWay = i;
+    }
+    if (nWay == WAYS)
+    {
+        nWay = shard.nNextVictim++ % WAYS;
+        shard.nEvictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+        shard.nUsed++;
+    pbucket[nWay] = entry;
+    shard.nInserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+CSignatureCacheStats CSignatureCache::GetStats()
+{
+    CSignatureCacheStats stats;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nCapacity = stats.nUsed = 0;
+    stats.nHits = stats.nMisses = stats.nInserts = stats.nEvictions = 0;
+    for (unsigned int i = 0; i < SHARDS; i++)
+    {
+        CShard& shard = shards[i];
+        {
+            boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+            stats.nCapacity += shard.vEntries.size();
+            stats.nUsed += shard.nUsed;
+        }
+        stats.nHits += shard.nHits;
+        stats.nMisses += shard.nMisses;
+        stats.nInserts += shard.nInserts;
+        stats.nEvictions += shard.nEvictions;
+    }
+    return stats;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2015 The HyperStake developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef HYPERSTAKE_SIGCACHE_H
+#define HYPERSTAKE_SIGCACHE_H
+
+#include <atomic>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include "sha256.h"
+#include "uint256.h"
+
+static const int64 DEFAULT_MAX_SIGCACHE_SIZE = 32; // megabytes
+static const int64 MAX_MAX_SIGCACHE_SIZE = 16384;  // megabytes
+
+struct CSignatureCacheStats
+{
+    uint64 nMaxBytes;
+    uint64 nCapacity;  // entries that fit in nMaxBytes
+    uint64 nUsed;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nInserts;
+    uint64 nEvictions;
+};
+
+/** Signatures already found valid, so a transaction's signatures are checked
+ * once when it enters the memory pool and not again when its block arrives.
+ * An entry is the salted SHA-256 of (signature hash, signature, public key),
+ * 32 bytes, so the size limit is a plain memory budget. The entries are
+ * split over shards by their first bits, each shard behind its own
+ * reader/writer lock, so lookups from the -par threads and the memory pool
+ * only share a lock with inserts into the same shard. Within a shard an
+ * entry may live in one of four ways of its bucket, and a full bucket
+ * evicts in turn. The salt is random per process, so nobody can aim
+ * entries at a bucket to push others out.
+ */
+class CSignatureCache
+{
+private:
+    static const unsigned int SHARDS = 16;
+    static const unsigned int WAYS = 4;
+
+    struct CShard
+    {
+        boost::shared_mutex mutex;
+        std::vector<uint256> vEntries; // WAYS per bucket, 0 = empty
+        unsigned int nNextVictim;
+        uint64 nUsed;
+        std::atomic<uint64> nHits;
+        std::atomic<uint64> nMisses;
+        std::atomic<uint64> nInserts;
+        std::atomic<uint64> nEvictions;
+
+        CShard() : nNextVictim(0), nUsed(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0) {}
+    };
+
+    CShard shards[SHARDS];
+    CSHA256 hasherSalted;
+    std::atomic<uint64> nMaxBytes;
+
+    uint256 ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& vchPubKey) const;
+
+public:
+    CSignatureCache();
+
+    // Drop every entry and make room for nBytes worth of them, 0 disables
+    void Resize(uint64 nBytes);
+    uint64 GetMaxBytes() const { return nMaxBytes; }
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& vchPubKey);
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& vchPubKey);
+
+    CSignatureCacheStats GetStats();
+};
+
+extern CSignatureCache signatureCache;
+
+#endif
@@ -11,6 +11,7 @@
 #include "main.h"
 #include "wallet.h"
 #include "net.h"
+#include "sigcache.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -298,15 +299,16 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(orphans[1], tx, 1, true, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
+    // Exercise a cache small enough to evict (one bucket per shard):
+    uint64 nMaxSigCacheBytes = signatureCache.GetMaxBytes();
+    signatureCache.Resize(2048);
     // Generate a new, different signature for vin[0] to trigger cache clear:
     CScript oldSig = tx.vin[0].scriptSig;
     BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
     BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
     for (unsigned int j = 0; j < tx.vin.size(); j++)
         BOOST_CHECK(VerifySignature(orphans[j], tx, j, true, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
+    signatureCache.Resize(nMaxSigCacheBytes);
 
     LimitOrphanTxSize(0);
 }
@@ -0,0 +1,193 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "blockverifier.h"
+#include "init.h"
+#include "miner.h"
+
+using namespace std;
+
+// nBlocks linked on from pindexFork, or a chain of its own from height 0
+static void BuildBranch(vector<CBlockIndex>& vBranch, CBlockIndex* pindexFork, unsigned int nBlocks)
+{
+    vBranch.resize(nBlocks);
+    for (unsigned int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex& index = vBranch[i];
+        index.pprev = i ? &vBranch[i - 1] : pindexFork;
+        index.nHeight = index.pprev ? index.pprev->nHeight + 1 : 0;
+        index.pnext = (i + 1 < nBlocks) ? &vBranch[i + 1] : NULL;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+BOOST_AUTO_TEST_CASE(active_chain)
+{
+    vector<CBlockIndex> vMain;
+    BuildBranch(vMain, NULL, 1000);
+
+    CActiveChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+    chain.Rebuild(&vMain[0]);
+    BOOST_CHECK_EQUAL(chain.Height(), 999);
+    BOOST_CHECK(chain.Tip() == &vMain[999]);
+    for (unsigned int i = 0; i < vMain.size(); i++)
+        BOOST_CHECK(chain[i] == &vMain[i]);
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain[1000] == NULL);
+
+    // reorganize onto a longer branch off height 700, block by block
+    vector<CBlockIndex> vFork;
+    BuildBranch(vFork, &vMain[700], 400);
+    chain.DisconnectAbove(700);
+    BOOST_CHECK(chain.Tip() == &vMain[700]);
+    for (unsigned int i = 0; i < vFork.size(); i++)
+        chain.Connect(&vFork[i]);
+    BOOST_CHECK_EQUAL(chain.Height(), 1100);
+    BOOST_CHECK(chain[700] == &vMain[700]);
+    BOOST_CHECK(chain[701] == &vFork[0]);
+    BOOST_CHECK(chain[1100] == &vFork[399]);
+
+    // and straight back to the old tip, filling in down to the fork
+    chain.Connect(&vMain[999]);
+    BOOST_CHECK_EQUAL(chain.Height(), 999);
+    for (unsigned int i = 0; i < vMain.size(); i++)
+        BOOST_CHECK(chain[i] == &vMain[i]);
+
+    chain.DisconnectAbove(-1);
+    BOOST_CHECK(chain.Tip() == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(block_index_arena)
+{
+    CBlockIndexArena arena;
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK_EQUAL(arena.GetMemoryUsage(), 0U);
+
+    // entries come one after another, a chunk at a time
+    BlockMap mapIndex;
+    vector<CBlockIndex*> vIndex;
+    for (unsigned int i = 0; i < CBlockIndexArena::CHUNK_SIZE + 10; i++)
+    {
+        CBlockIndex* pindex = new (arena.Allocate()) CBlockIndex();
+        pindex->nHeight = i;
+        pindex->pprev = vIndex.empty() ? NULL : vIndex.back();
+        BlockMap::iterator mi = mapIndex.insert(make_pair(GetRandHash(), pindex)).first;
+        pindex->phashBlock = &mi->first;
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), CBlockIndexArena::CHUNK_SIZE + 10);
+    BOOST_CHECK_EQUAL(arena.GetMemoryUsage(), 2 * CBlockIndexArena::CHUNK_SIZE * sizeof(CBlockIndex));
+    BOOST_CHECK(vIndex[1] == vIndex[0] + 1);
+    BOOST_CHECK(vIndex[CBlockIndexArena::CHUNK_SIZE + 1] == vIndex[CBlockIndexArena::CHUNK_SIZE] + 1);
+
+    // nothing moved as the arena and the hash table grew
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, (int)i);
+        BOOST_CHECK(mapIndex[vIndex[i]->GetBlockHash()] == vIndex[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_trust)
+{
+    CBlockIndex index;
+    index.nBits = CBigNum(~uint256(0) >> 24).GetCompact();
+    index.SetProofOfStake();
+    CBigNum bnTarget;
+    bnTarget.SetCompact(index.nBits);
+    BOOST_CHECK(CBigNum(index.GetBlockTrust()) == (CBigNum(1) << 256) / (bnTarget + 1));
+
+    // trust adds up in 256 bits the way it did as a bignum
+    uint256 nChainTrust = 0;
+    CBigNum bnChainTrust = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        nChainTrust += index.GetBlockTrust();
+        bnChainTrust += CBigNum(index.GetBlockTrust());
+    }
+    BOOST_CHECK(CBigNum(nChainTrust) == bnChainTrust);
+}
+
+BOOST_AUTO_TEST_CASE(block_verifier_idle)
+{
+    // the genesis block is never checked, so there is nothing to do here
+    CBlockVerifier verifier;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(verifier.Start(0, 4, 4));
+    }
+    verifier.Wait();
+    CBlockVerifierStatus status = verifier.GetStatus();
+    BOOST_CHECK(!status.fRunning);
+    BOOST_CHECK_EQUAL(status.nBlocks, 0U);
+    BOOST_CHECK_EQUAL(status.nChecked, 0U);
+    BOOST_CHECK_EQUAL(status.nThreads, 1);
+    BOOST_CHECK(!verifier.IsCorrupt());
+}
+
+BOOST_AUTO_TEST_CASE(block_verifier_bad_block)
+{
+    // a proof-of-stake block, so it reads back from disk without a proof of
+    // work, whose merkle root does not match its transactions; it is made
+    // the tip on top of genesis
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    block.nTime = pindexGenesisBlock->nTime + 60;
+    block.nBits = pindexGenesisBlock->nBits;
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].SetEmpty();
+    block.vtx[1].vin.resize(1);
+    block.vtx[1].vin[0].prevout = COutPoint(pindexGenesisBlock->hashMerkleRoot, 0);
+    block.vtx[1].vout.resize(2);
+    block.vtx[1].vout[0].SetEmpty();
+    block.vtx[1].vout[1].nValue = COIN;
+    BOOST_REQUIRE(block.IsProofOfStake());
+    unsigned int nFile = 0, nBlockPos = 0;
+    BOOST_REQUIRE(block.WriteToDisk(nFile, nBlockPos));
+    uint256 hash = block.GetHash();
+    CBlockIndex index(nFile, nBlockPos, block);
+    index.phashBlock = &hash;
+    index.pprev = pindexGenesisBlock;
+    index.nHeight = 1;
+
+    {
+        LOCK(cs_main);
+        CBlockIndex* pindexBestPrev = pindexBest;
+        int nBestHeightPrev = nBestHeight;
+        pindexBest = &index;
+        nBestHeight = 1;
+
+        // cs_main stays held, so the verifier cannot move the chain back
+        // before the checks below
+        BOOST_REQUIRE(blockVerifier.Start(1, 1, 1));
+        for (int i = 0; i < 1000 && blockVerifier.GetStatus().nChecked < 1; i++)
+            Sleep(10);
+        CBlockVerifierStatus status = blockVerifier.GetStatus();
+        BOOST_CHECK_EQUAL(status.nBlocks, 1U);
+        BOOST_CHECK_EQUAL(status.nChecked, 1U);
+        BOOST_CHECK_EQUAL(status.nBad, 1U);
+        BOOST_CHECK(blockVerifier.IsCorrupt());
+        BOOST_CHECK(GetWarnings("rpc").find("Corrupt blocks") != string::npos);
+        BOOST_CHECK_EQUAL(GetMinerWaitReason(pwalletMain), "corrupt blocks in the best chain");
+
+        // the block leaves the best chain before the verifier finishes
+        pindexBest = pindexBestPrev;
+        nBestHeight = nBestHeightPrev;
+    }
+    blockVerifier.Wait();
+
+    BOOST_CHECK(!blockVerifier.GetStatus().fRunning);
+    BOOST_CHECK(!blockVerifier.IsCorrupt());
+    BOOST_CHECK(GetWarnings("rpc").find("Corrupt blocks") == string::npos);
+    BOOST_CHECK(GetMinerWaitReason(pwalletMain) != "corrupt blocks in the best chain");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
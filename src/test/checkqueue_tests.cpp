@@ -0,0 +1,198 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "checkqueue.h"
+#include "keystore.h"
+#include "main.h"
+#include "sigcache.h"
+#include "util.h"
+
+using namespace std;
+
+// Counts how many times it ran, fails if told to
+struct CCountCheck
+{
+    static boost::mutex mutex;
+    static unsigned int nRuns;
+    bool fOk;
+
+    CCountCheck(bool fOkIn = true) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        nRuns++;
+        return fOk;
+    }
+
+    void swap(CCountCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+    }
+};
+boost::mutex CCountCheck::mutex;
+unsigned int CCountCheck::nRuns = 0;
+
+// A block of nTx transactions, each spending nIn outputs of one funding
+// transaction. The signatures are real so verifying them costs what it
+// does for a block off the network.
+static void BuildSignedBlock(CTransaction& txFund, vector<CTransaction>& vtx, unsigned int nTx, unsigned int nIn)
+{
+    CBasicKeyStore keystore;
+    vector<CKey> vKey(4);
+    for (unsigned int i = 0; i < vKey.size(); i++)
+    {
+        vKey[i].MakeNewKey(i % 2 == 0);
+        keystore.AddKey(vKey[i]);
+    }
+
+    txFund = CTransaction();
+    txFund.vin.resize(1);
+    txFund.vout.resize(nTx * nIn);
+    for (unsigned int i = 0; i < txFund.vout.size(); i++)
+    {
+        txFund.vout[i].nValue = COIN;
+        txFund.vout[i].scriptPubKey.SetDestination(vKey[i % vKey.size()].GetPubKey().GetID());
+    }
+
+    vtx.resize(nTx);
+    for (unsigned int t = 0; t < nTx; t++)
+    {
+        CTransaction& tx = vtx[t];
+        tx.nTime = txFund.nTime;
+        tx.vin.resize(nIn);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = nIn * COIN;
+        tx.vout[0].scriptPubKey.SetDestination(vKey[0].GetPubKey().GetID());
+        for (unsigned int i = 0; i < nIn; i++)
+        {
+            tx.vin[i].prevout.hash = txFund.GetHash();
+            tx.vin[i].prevout.n = t * nIn + i;
+        }
+        for (unsigned int i = 0; i < nIn; i++)
+            BOOST_CHECK(SignSignature(keystore, txFund, tx, i));
+    }
+}
+
+static bool VerifyBlockScripts(CCheckQueue<CScriptCheck>& queue, const CTransaction& txFund, const vector<CTransaction>& vtx)
+{
+    CCheckQueueControl<CScriptCheck> control(&queue);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        vector<CScriptCheck> vChecks;
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            vChecks.push_back(CScriptCheck(txFund, tx, i, true, 0));
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    CCheckQueue<CCountCheck> queue(16);
+    queue.StartThreads(3);
+    for (unsigned int nRound = 0; nRound < 50; nRound++)
+    {
+        unsigned int nChecks = GetRandInt(1000);
+        CCountCheck::nRuns = 0;
+        {
+            CCheckQueueControl<CCountCheck> control(&queue);
+            for (unsigned int nAdded = 0; nAdded < nChecks; )
+            {
+                vector<CCountCheck> vChecks(min(nChecks - nAdded, 1 + (unsigned int)GetRandInt(30)));
+                nAdded += vChecks.size();
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(CCountCheck::nRuns, nChecks);
+    }
+    queue.StopThreads();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CCountCheck> queue(16);
+    queue.StartThreads(3);
+    for (unsigned int nRound = 0; nRound < 50; nRound++)
+    {
+        // one bad check anywhere fails the lot, and the next round starts clean
+        unsigned int nBad = GetRandInt(500);
+        CCheckQueueControl<CCountCheck> control(&queue);
+        vector<CCountCheck> vChecks(500);
+        vChecks[nBad].fOk = (nRound % 2 == 1);
+        control.Add(vChecks);
+        BOOST_CHECK_EQUAL(control.Wait(), nRound % 2 == 1);
+    }
+
+    // a control going out of scope without Wait() still drains the queue
+    CCountCheck::nRuns = 0;
+    {
+        CCheckQueueControl<CCountCheck> control(&queue);
+        vector<CCountCheck> vChecks(100);
+        control.Add(vChecks);
+    }
+    BOOST_CHECK_EQUAL(CCountCheck::nRuns, 100U);
+    queue.StopThreads();
+
+    // no queue: nothing is queued and Wait() succeeds
+    CCheckQueueControl<CCountCheck> control(NULL);
+    vector<CCountCheck> vChecks(1, CCountCheck(false));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_scripts)
+{
+    CTransaction txFund;
+    vector<CTransaction> vtx;
+    BuildSignedBlock(txFund, vtx, 10, 3);
+
+    CCheckQueue<CScriptCheck> queue(128);
+    queue.StartThreads(3);
+    BOOST_CHECK(VerifyBlockScripts(queue, txFund, vtx));
+
+    // a single bad signature fails the block
+    vtx[7].vin[1].scriptSig[5] ^= 1;
+    BOOST_CHECK(!VerifyBlockScripts(queue, txFund, vtx));
+    vtx[7].vin[1].scriptSig[5] ^= 1;
+    BOOST_CHECK(VerifyBlockScripts(queue, txFund, vtx));
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_bench)
+{
+    // measures rather than checks; only runs when HYPERSTAKE_BENCH is set
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    CTransaction txFund;
+    vector<CTransaction> vtx;
+    BuildSignedBlock(txFund, vtx, 100, 4);
+
+    // keep the signature cache out of it, so every run verifies everything
+    uint64 nMaxSigCacheBytes = signatureCache.GetMaxBytes();
+    signatureCache.Resize(0);
+
+    int64 nSerialTime = 0;
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2)
+    {
+        CCheckQueue<CScriptCheck> queue(128);
+        queue.StartThreads(nThreads - 1);
+
+        int64 nStart = GetTimeMicros();
+        BOOST_CHECK(VerifyBlockScripts(queue, txFund, vtx));
+        int64 nTime = max(GetTimeMicros() - nStart, (int64)1);
+        if (nThreads == 1)
+            nSerialTime = nTime;
+
+        printf("script checks, %d threads: %.0f inputs/s, %.2fx\n", nThreads,
+            vtx.size() * vtx[0].vin.size() * 1000000.0 / nTime, (double)nSerialTime / nTime);
+        queue.StopThreads();
+    }
+
+    signatureCache.Resize(nMaxSigCacheBytes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,284 @@
+#include <map>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "coins.h"
+#include "util.h"
+
+using namespace std;
+
+// Keeps what it is given, like the transaction index on disk
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    map<uint256, CTxIndex> mapTxIndex;
+    uint256 hashBestBlock;
+    unsigned int nBatches;
+
+    CCoinsViewTest() : hashBestBlock(0), nBatches(0) {}
+
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex)
+    {
+        map<uint256, CTxIndex>::const_iterator it = mapTxIndex.find(hash);
+        if (it == mapTxIndex.end())
+            return false;
+        txindex = it->second;
+        return true;
+    }
+
+    uint256 GetBestBlock() { return hashBestBlock; }
+
+    bool BatchWrite(const CTxIndexMap& mapEntries, const uint256& hashBestBlockIn)
+    {
+        for (CTxIndexMap::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+        {
+            if (!(it->second.nFlags & CTxIndexCacheEntry::DIRTY))
+                continue;
+            if (it->second.nFlags & CTxIndexCacheEntry::ERASED)
+                mapTxIndex.erase(it->first);
+            else
+                mapTxIndex[it->first] = it->second.txindex;
+        }
+        if (hashBestBlockIn != 0)
+            hashBestBlock = hashBestBlockIn;
+        nBatches++;
+        return true;
+    }
+};
+
+static CTxIndex RandTxIndex()
+{
+    CTxIndex txindex(CDiskTxPos(1, GetRandInt(1000000), GetRandInt(1000000)), 1 + GetRandInt(50));
+    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+        if (GetRandInt(2))
+            txindex.vSpent[i] = CDiskTxPos(1, GetRandInt(1000000), GetRandInt(1000000));
+    return txindex;
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coins_cache_writeback)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(&base);
+    uint256 hash = GetRandHash(), hashOld = GetRandHash();
+    CTxIndex txindex = RandTxIndex(), txindexOld = RandTxIndex(), txindexRead;
+    base.mapTxIndex[hashOld] = txindexOld;
+
+    // reads fall through to the base without being cached
+    BOOST_CHECK(cache.GetTxIndex(hashOld, txindexRead));
+    BOOST_CHECK(txindexRead == txindexOld);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK(!cache.HaveTxIndex(hash));
+
+    // spending an output a few times reaches the base once
+    cache.SetTxIndex(hash, txindex);
+    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+    {
+        txindex.vSpent[i] = CDiskTxPos(2, 3, i);
+        cache.SetTxIndex(hash, txindex);
+    }
+    cache.EraseTxIndex(hashOld);
+    cache.SetBestBlock(hash);
+    BOOST_CHECK(cache.GetTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead == txindex);
+    BOOST_CHECK(!cache.GetTxIndex(hashOld, txindexRead));
+    BOOST_CHECK(!cache.HaveTxIndex(hashOld));
+    BOOST_CHECK_EQUAL(cache.GetDirtyCount(), 2U);
+    BOOST_CHECK(!base.mapTxIndex.count(hash));
+    BOOST_CHECK(base.mapTxIndex.count(hashOld));
+    BOOST_CHECK(base.hashBestBlock == 0);
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nBatches, 1U);
+    BOOST_CHECK(base.mapTxIndex[hash] == txindex);
+    BOOST_CHECK(!base.mapTxIndex.count(hashOld));
+    BOOST_CHECK(base.hashBestBlock == hash);
+    BOOST_CHECK_EQUAL(cache.GetDirtyCount(), 0U);
+
+    // flushed entries stay until trimmed, and the view does not change
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+    cache.Trim();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetCacheUsage(), 0U);
+    BOOST_CHECK(cache.GetTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead == txindex);
+    BOOST_CHECK(!cache.HaveTxIndex(hashOld));
+    BOOST_CHECK(cache.GetBestBlock() == hash);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_layers)
+{
+    // a layer per database transaction: committed into the cache below it,
+    // or dropped
+    CCoinsViewTest base;
+    CCoinsViewCache tip(&base);
+    uint256 hashA = GetRandHash(), hashB = GetRandHash();
+    CTxIndex txindexA = RandTxIndex(), txindexB = RandTxIndex(), txindexRead;
+    tip.SetTxIndex(hashA, txindexA);
+
+    {
+        CCoinsViewCache layer(&tip);
+        layer.EraseTxIndex(hashA);
+        layer.SetTxIndex(hashB, txindexB);
+        layer.SetBestBlock(hashB);
+        BOOST_CHECK(!layer.HaveTxIndex(hashA));
+        BOOST_CHECK(layer.HaveTxIndex(hashB));
+        BOOST_CHECK(layer.GetBestBlock() == hashB);
+    }
+    BOOST_CHECK(tip.GetTxIndex(hashA, txindexRead));
+    BOOST_CHECK(txindexRead == txindexA);
+    BOOST_CHECK(!tip.HaveTxIndex(hashB));
+    BOOST_CHECK(tip.GetBestBlock() == 0);
+
+    {
+        CCoinsViewCache layer(&tip);
+        BOOST_CHECK(layer.GetTxIndex(hashA, txindexRead));
+        layer.EraseTxIndex(hashA);
+        layer.SetTxIndex(hashB, txindexB);
+        layer.SetBestBlock(hashB);
+        BOOST_CHECK(layer.Flush());
+    }
+    BOOST_CHECK(!tip.HaveTxIndex(hashA));
+    BOOST_CHECK(tip.GetTxIndex(hashB, txindexRead));
+    BOOST_CHECK(txindexRead == txindexB);
+    BOOST_CHECK(tip.GetBestBlock() == hashB);
+    BOOST_CHECK_EQUAL(base.nBatches, 0U);
+
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK(!base.mapTxIndex.count(hashA));
+    BOOST_CHECK(base.mapTxIndex[hashB] == txindexB);
+    BOOST_CHECK(base.hashBestBlock == hashB);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_random)
+{
+    // random changes through two layers, checked against a plain map
+    CCoinsViewTest base;
+    CCoinsViewCache tip(&base);
+    map<uint256, CTxIndex> mapExpected;
+    vector<uint256> vHash;
+    for (unsigned int i = 0; i < 100; i++)
+        vHash.push_back(GetRandHash());
+
+    for (unsigned int nRound = 0; nRound < 200; nRound++)
+    {
+        CCoinsViewCache layer(&tip);
+        map<uint256, CTxIndex> mapLayer = mapExpected;
+        for (unsigned int i = 0; i < 20; i++)
+        {
+            const uint256& hash = vHash[GetRandInt(vHash.size())];
+            if (GetRandInt(4) == 0)
+            {
+                layer.EraseTxIndex(hash);
+                mapLayer.erase(hash);
+            }
+            else
+            {
+                CTxIndex txindex = RandTxIndex();
+                layer.SetTxIndex(hash, txindex);
+                mapLayer[hash] = txindex;
+            }
+        }
+        if (GetRandInt(3) != 0)
+        {
+            BOOST_CHECK(layer.Flush());
+            mapExpected = mapLayer;
+        }
+        if (GetRandInt(10) == 0)
+            BOOST_CHECK(tip.Flush());
+        if (GetRandInt(20) == 0)
+            tip.Trim();
+    }
+
+    BOOST_FOREACH(const uint256& hash, vHash)
+    {
+        CTxIndex txindex;
+        bool fFound = tip.GetTxIndex(hash, txindex);
+        BOOST_CHECK_EQUAL(fFound, mapExpected.count(hash) == 1);
+        if (fFound)
+            BOOST_CHECK(txindex == mapExpected[hash]);
+    }
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK(base.mapTxIndex == mapExpected);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_usage)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(&base);
+    uint256 hash = GetRandHash();
+    CDiskTxPos pos(1, 2, 3);
+
+    cache.SetTxIndex(hash, CTxIndex(pos, 10));
+    uint64 nSmall = cache.GetCacheUsage();
+    BOOST_CHECK(nSmall >= 10 * sizeof(CDiskTxPos));
+
+    // rewriting a record replaces its usage rather than adding to it
+    cache.SetTxIndex(hash, CTxIndex(pos, 10));
+    BOOST_CHECK_EQUAL(cache.GetCacheUsage(), nSmall);
+    cache.SetTxIndex(hash, CTxIndex(pos, 1000));
+    BOOST_CHECK(cache.GetCacheUsage() >= nSmall + 990 * sizeof(CDiskTxPos));
+    cache.SetTxIndex(GetRandHash(), CTxIndex(pos, 10));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+
+    // dirty entries survive a trim
+    cache.Trim();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+    BOOST_CHECK(cache.Flush());
+    cache.Trim();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetCacheUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txindex_read_cache_lru)
+{
+    CTxIndexReadCache cache;
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 2), txindexRead;
+    bool fFound = false;
+
+    // room for about three records
+    vector<uint256> vHash;
+    for (int i = 0; i < 4; i++)
+        vHash.push_back(GetRandHash());
+    cache.Write(vHash[0], txindex);
+    uint64 nEntryUsage = cache.GetStats().nUsage;
+    cache.Resize(nEntryUsage * 3 + nEntryUsage / 2);
+
+    cache.Write(vHash[0], txindex);
+    cache.Erase(vHash[1]);
+    cache.Write(vHash[2], txindex);
+    BOOST_CHECK(cache.Get(vHash[0], txindexRead, fFound) && fFound && txindexRead == txindex);
+    BOOST_CHECK(cache.Get(vHash[1], txindexRead, fFound) && !fFound);
+
+    // the least recently used goes first
+    cache.Write(vHash[3], txindex);
+    BOOST_CHECK(!cache.Get(vHash[2], txindexRead, fFound));
+    BOOST_CHECK(cache.Get(vHash[0], txindexRead, fFound));
+    BOOST_CHECK(cache.Get(vHash[3], txindexRead, fFound));
+
+    CTxIndexReadCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, 3U);
+    BOOST_CHECK_EQUAL(stats.nHits, 4U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nEvictions, 1U);
+    BOOST_CHECK(stats.nUsage <= stats.nMaxBytes);
+
+    // a read from before a write is not kept
+    uint64 nGeneration = cache.GetGeneration();
+    CTxIndex txindexNew(CDiskTxPos(4, 5, 6), 1);
+    cache.Write(vHash[2], txindexNew);
+    cache.Add(vHash[2], txindex, true, nGeneration);
+    BOOST_CHECK(cache.Get(vHash[2], txindexRead, fFound) && txindexRead == txindexNew);
+    nGeneration = cache.GetGeneration();
+    cache.Add(vHash[1], txindex, true, nGeneration);
+    BOOST_CHECK(cache.Get(vHash[1], txindexRead, fFound) && fFound);
+
+    // size 0 caches nothing
+    cache.Resize(0);
+    cache.Write(vHash[0], txindex);
+    BOOST_CHECK(!cache.Get(vHash[0], txindexRead, fFound));
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsage, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,124 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "hashblock.h"
+#include "util.h"
+
+using namespace std;
+
+static CBlock GenesisHeader()
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = 0;
+    block.hashMerkleRoot = uint256("37ad323037e6e55553fadebbe60690a1bff2752f947b7af8cb6b54929f5fee3d");
+    block.nTime = 1401331380;
+    block.nBits = CBigNum(~uint256(0) >> 20).GetCompact();
+    block.nNonce = 1779291;
+    return block;
+}
+
+// Headers that differ only in their nonce, laid out back to back as the miner does
+static void BuildHeaders(vector<unsigned char>& vHeaders, const CBlock& block, unsigned int nCount)
+{
+    const unsigned int nHeaderSize = END(block.nNonce) - BEGIN(block.nVersion);
+    vHeaders.resize(nCount * nHeaderSize);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        unsigned int nNonce = block.nNonce + i;
+        memcpy(&vHeaders[i * nHeaderSize], BEGIN(block.nVersion), nHeaderSize);
+        memcpy(&vHeaders[(i + 1) * nHeaderSize - sizeof(nNonce)], &nNonce, sizeof(nNonce));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(hashblock_tests)
+
+BOOST_AUTO_TEST_CASE(hash9_genesis)
+{
+    CBlock block = GenesisHeader();
+    BOOST_CHECK(block.GetHash() == hashGenesisBlockOfficial);
+    for (int nBackend = HASH9_GENERIC; nBackend <= HASH9_AESNI; nBackend++)
+    {
+        Hash9Backend backend = (Hash9Backend)nBackend;
+        if (!Hash9BackendSupported(backend))
+            continue;
+        BOOST_CHECK_MESSAGE(Hash9(backend, BEGIN(block.nVersion), 80) == hashGenesisBlockOfficial, Hash9BackendName(backend));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hash9_backends)
+{
+    // every backend and batch size must reproduce the generic single hash
+    for (int nRound = 0; nRound < 20; nRound++)
+    {
+        CBlock block = GenesisHeader();
+        block.hashPrevBlock = GetRandHash();
+        block.nNonce = GetRandInt(2000000000);
+        unsigned int nCount = 1 + GetRandInt(3 * HASH9_BATCH);
+
+        vector<unsigned char> vHeaders;
+        BuildHeaders(vHeaders, block, nCount);
+        const unsigned int nHeaderSize = vHeaders.size() / nCount;
+        vector<uint256> vExpected(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+            vExpected[i] = Hash9(HASH9_GENERIC, &vHeaders[i * nHeaderSize], nHeaderSize);
+
+        block.nNonce += nCount - 1;
+        BOOST_CHECK(block.GetHash() == vExpected.back());
+
+        for (int nBackend = HASH9_GENERIC; nBackend <= HASH9_AESNI; nBackend++)
+        {
+            Hash9Backend backend = (Hash9Backend)nBackend;
+            if (!Hash9BackendSupported(backend))
+                continue;
+            vector<uint256> vHash(nCount);
+            Hash9Batch(backend, &vHeaders[0], nHeaderSize, nCount, &vHash[0]);
+            BOOST_CHECK_MESSAGE(vHash == vExpected, Hash9BackendName(backend));
+        }
+    }
+
+    // inputs other than a header, down to the empty one
+    vector<unsigned char> vData(200);
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = GetRandInt(256);
+    for (unsigned int nSize = 0; nSize < vData.size(); nSize += 13)
+        if (Hash9BackendSupported(HASH9_AESNI))
+            BOOST_CHECK(Hash9(HASH9_AESNI, &vData[0], nSize) == Hash9(HASH9_GENERIC, &vData[0], nSize));
+    BOOST_CHECK(Hash9(vData.begin(), vData.begin()) == Hash9(HASH9_GENERIC, &vData[0], 0));
+}
+
+BOOST_AUTO_TEST_CASE(hash9_bench)
+{
+    // timings only; run with HYPERSTAKE_BENCH set
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    vector<unsigned char> vHeaders;
+    const unsigned int nCount = 20000;
+    BuildHeaders(vHeaders, GenesisHeader(), nCount);
+    const unsigned int nHeaderSize = vHeaders.size() / nCount;
+    vector<uint256> vHash(nCount);
+
+    for (int nBackend = HASH9_GENERIC; nBackend <= HASH9_AESNI; nBackend++)
+    {
+        Hash9Backend backend = (Hash9Backend)nBackend;
+        if (!Hash9BackendSupported(backend))
+            continue;
+
+        int64 nStart = GetTimeMicros();
+        for (unsigned int i = 0; i < nCount; i++)
+            vHash[i] = Hash9(backend, &vHeaders[i * nHeaderSize], nHeaderSize);
+        int64 nSingleTime = GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        Hash9Batch(backend, &vHeaders[0], nHeaderSize, nCount, &vHash[0]);
+        int64 nBatchTime = GetTimeMicros() - nStart;
+
+        BOOST_CHECK(vHash[0] == hashGenesisBlockOfficial);
+        printf("hash9 %s: %.0f headers/s one at a time, %.0f headers/s batched\n", Hash9BackendName(backend),
+            nCount * 1000000.0 / max(nSingleTime, (int64)1), nCount * 1000000.0 / max(nBatchTime, (int64)1));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,205 @@
+#include <boost/test/unit_test.hpp>
+
+#include "headerssync.h"
+#include "util.h"
+
+using namespace std;
+
+static unsigned int LimitBits()
+{
+    return CBigNum(~uint256(0) >> 20).GetCompact();
+}
+
+// nCount headers running on from hashPrev, 90 seconds apart
+static vector<CBlock> HeaderChain(const uint256& hashPrev, unsigned int nTimePrev, int nCount, unsigned int nNonce = 0)
+{
+    vector<CBlock> vHeaders;
+    uint256 hash = hashPrev;
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlock header;
+        header.nVersion = 3;
+        header.hashPrevBlock = hash;
+        header.hashMerkleRoot = 0;
+        header.nTime = nTimePrev + 90 * (i + 1);
+        header.nBits = LimitBits();
+        header.nNonce = nNonce + i;
+        vHeaders.push_back(header);
+        hash = header.GetHash();
+    }
+    return vHeaders;
+}
+
+BOOST_AUTO_TEST_SUITE(headerssync_tests)
+
+BOOST_AUTO_TEST_CASE(headers_accept)
+{
+    CHeadersSync sync;
+    int nDoS = 0;
+    vector<CBlock> vHeaders = HeaderChain(pindexGenesisBlock->GetBlockHash(), pindexGenesisBlock->nTime, 6);
+    BOOST_CHECK(sync.AddHeaders(vHeaders, nDoS));
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 6U);
+    BOOST_CHECK(sync.IsActive());
+
+    // known headers again change nothing, and the rest can follow them
+    BOOST_CHECK(sync.AddHeaders(vector<CBlock>(vHeaders.begin(), vHeaders.begin() + 3), nDoS));
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 6U);
+
+    // a branch has to end up higher to replace what is there
+    vector<CBlock> vBranch = HeaderChain(vHeaders[2].GetHash(), vHeaders[2].nTime, 3, 100);
+    BOOST_CHECK(sync.AddHeaders(vBranch, nDoS));
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 6U);
+    vBranch = HeaderChain(vHeaders[2].GetHash(), vHeaders[2].nTime, 5, 100);
+    BOOST_CHECK(sync.AddHeaders(vBranch, nDoS));
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 8U);
+    BOOST_CHECK_EQUAL(nDoS, 0);
+
+    // and the old branch is gone for good once the new one is in
+    BOOST_CHECK(sync.AddHeaders(vector<CBlock>(vHeaders.begin() + 3, vHeaders.end()), nDoS));
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 8U);
+
+    sync.SetEnabled(false);
+    BOOST_CHECK(!sync.IsActive());
+}
+
+BOOST_AUTO_TEST_CASE(headers_reject)
+{
+    CHeadersSync sync;
+    int nDoS = 0;
+    const uint256 hashGenesis = pindexGenesisBlock->GetBlockHash();
+    unsigned int nTimeGenesis = pindexGenesisBlock->nTime;
+
+    // does not connect
+    BOOST_CHECK(!sync.AddHeaders(HeaderChain(GetRandHash(), nTimeGenesis, 3), nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 10);
+
+    // gap in the sequence
+    vector<CBlock> vHeaders = HeaderChain(hashGenesis, nTimeGenesis, 5);
+    vHeaders.erase(vHeaders.begin() + 2);
+    BOOST_CHECK(!sync.AddHeaders(vHeaders, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 20);
+
+    // hardened checkpoint at height 10
+    BOOST_CHECK(!sync.AddHeaders(HeaderChain(hashGenesis, nTimeGenesis, 12), nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+
+    // target out of range
+    vHeaders = HeaderChain(hashGenesis, nTimeGenesis, 3);
+    vHeaders[0].nBits = CBigNum(~uint256(0) >> 1).GetCompact();
+    BOOST_CHECK(!sync.AddHeaders(vHeaders, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+
+    // a target further from the last than a retarget can move it, and the
+    // peer sending it punished
+    vHeaders = HeaderChain(hashGenesis, nTimeGenesis, 3);
+    vHeaders[1].nBits = CBigNum(~uint256(0) >> 24).GetCompact();
+    BOOST_CHECK(!sync.AddHeaders(vHeaders, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    CNode::ClearBanned();
+    CAddress addr(CService("10.0.0.1", GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = PROTOCOL_VERSION;
+    BOOST_CHECK(!sync.ProcessHeaders(&node, vHeaders));
+    BOOST_CHECK(CNode::IsBanned(addr));
+    BOOST_CHECK(node.fDisconnect);
+    CNode::ClearBanned();
+
+    // timestamps: not after the median of the last blocks, or too far ahead
+    vHeaders = HeaderChain(hashGenesis, nTimeGenesis, 3);
+    vHeaders[0].nTime = nTimeGenesis;
+    BOOST_CHECK(!sync.AddHeaders(vHeaders, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    vHeaders = HeaderChain(hashGenesis, GetAdjustedTime() + 24 * 60 * 60, 1);
+    BOOST_CHECK(!sync.AddHeaders(vHeaders, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(headers_download_window)
+{
+    CHeadersSync sync;
+    int nDoS = 0;
+    vector<CBlock> vHeaders = HeaderChain(pindexGenesisBlock->GetBlockHash(), pindexGenesisBlock->nTime, 9);
+    BOOST_CHECK(sync.AddHeaders(vHeaders, nDoS));
+
+    CNode nodeA(INVALID_SOCKET, CAddress(), "", true), nodeB(INVALID_SOCKET, CAddress(), "", true);
+    nodeA.nVersion = nodeB.nVersion = PROTOCOL_VERSION;
+    nodeA.nStartingHeight = nodeB.nStartingHeight = 9;
+
+    sync.RequestBlocks(&nodeA);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 9U);
+    sync.RequestBlocks(&nodeB);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 9U);
+
+    // a block ahead of its parent is held rather than orphaned
+    BOOST_CHECK(sync.BlockReceived(vHeaders[2]));
+    BOOST_CHECK_EQUAL(sync.GetHeldCount(), 1U);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 8U);
+    CBlock block;
+    BOOST_CHECK(!sync.PopHeldBlock(vHeaders[0].GetHash(), block));
+    BOOST_CHECK(sync.PopHeldBlock(vHeaders[1].GetHash(), block));
+    BOOST_CHECK(block.GetHash() == vHeaders[2].GetHash());
+    BOOST_CHECK_EQUAL(sync.GetHeldCount(), 0U);
+
+    // one that does not match its header goes the usual way
+    block = vHeaders[3];
+    block.vtx.push_back(CTransaction());
+    BOOST_CHECK(!sync.BlockReceived(block));
+
+    // the peer holding up the front of the window is dropped, and the
+    // others get its blocks
+    SetMockTime(GetTime() + BLOCK_STALL_TIMEOUT + 1);
+    sync.RequestBlocks(&nodeA);
+    BOOST_CHECK(nodeA.fDisconnect);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 0U);
+    sync.RequestBlocks(&nodeB);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 9U);
+    SetMockTime(0);
+
+    sync.FinalizeNode(nodeB.id);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(headers_dropped)
+{
+    CHeadersSync sync;
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+    node.nStartingHeight = 9;
+    vector<CBlock> vHeaders = HeaderChain(pindexGenesisBlock->GetBlockHash(), pindexGenesisBlock->nTime, 9);
+
+    // the headers go with the peer that sent them
+    BOOST_CHECK(sync.ProcessHeaders(&node, vHeaders));
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 9U);
+    sync.FinalizeNode(node.id);
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 0U);
+    BOOST_CHECK(!sync.IsActive());
+
+    // and, when it is the only peer and none of their blocks come, after
+    // a while anyway
+    BOOST_CHECK(sync.ProcessHeaders(&node, vHeaders));
+    sync.RequestBlocks(&node);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 9U);
+    SetMockTime(GetTime() + BLOCK_STALL_TIMEOUT + 1);
+    sync.RequestBlocks(&node);
+    BOOST_CHECK(!node.fDisconnect);
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 9U);
+    SetMockTime(GetTime() + HEADER_CHAIN_TIMEOUT);
+    sync.RequestBlocks(&node);
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 0U);
+    BOOST_CHECK_EQUAL(sync.GetInFlightCount(), 0U);
+    BOOST_CHECK(!sync.IsActive());
+    SetMockTime(0);
+
+    // a block along them keeps them
+    BOOST_CHECK(sync.ProcessHeaders(&node, vHeaders));
+    SetMockTime(GetTime() + HEADER_CHAIN_TIMEOUT);
+    BOOST_CHECK(sync.BlockReceived(vHeaders[1]));
+    SetMockTime(GetTime() + HEADER_CHAIN_TIMEOUT / 2 + 1);
+    sync.RequestBlocks(&node);
+    BOOST_CHECK_EQUAL(sync.GetChainSize(), 9U);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
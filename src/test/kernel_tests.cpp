@@ -0,0 +1,237 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "kernel.h"
+#include "kernelhash.h"
+#include "util.h"
+
+using namespace std;
+
+// Reference implementation: the pnext walk GetKernelStakeModifier used to do
+static const CBlockIndex* WalkStakeModifier(const CBlockIndex* pindexFrom, int64 nTimeMin)
+{
+    for (const CBlockIndex* pindex = pindexFrom->pnext; pindex; pindex = pindex->pnext)
+        if (pindex->GeneratedStakeModifier() && pindex->GetBlockTime() >= nTimeMin)
+            return pindex;
+    return NULL;
+}
+
+// Synthetic main chain with a modifier roughly every third block and the odd
+// block timestamped before its parent
+static void BuildChain(vector<CBlockIndex>& vChain, unsigned int nBlocks)
+{
+    vChain.resize(nBlocks);
+    unsigned int nTime = 1400000000;
+    for (unsigned int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex& index = vChain[i];
+        index.nHeight = i;
+        index.nTime = (i % 97 == 0) ? nTime - 120 : nTime;
+        index.SetStakeModifier(i, i == 0 || GetRandInt(3) == 0);
+        index.pprev = i ? &vChain[i - 1] : NULL;
+        index.pnext = (i + 1 < nBlocks) ? &vChain[i + 1] : NULL;
+        nTime += 30 + GetRandInt(60);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index)
+{
+    vector<CBlockIndex> vChain;
+    BuildChain(vChain, 2000);
+
+    CStakeModifierIndex index;
+    index.Rebuild(&vChain[0]);
+
+    int64 nInterval = 4 * 60 * 60;
+    for (unsigned int i = 0; i < vChain.size(); i++)
+    {
+        int64 nTimeMin = vChain[i].GetBlockTime() + nInterval;
+        BOOST_CHECK(index.FindFirst(i, nTimeMin) == WalkStakeModifier(&vChain[i], nTimeMin));
+    }
+
+    // reorganize away the top half and reconnect it block by block
+    index.DisconnectAbove(999);
+    BOOST_CHECK(index.FindFirst(999, 0) == NULL);
+    for (unsigned int i = 1000; i < vChain.size(); i++)
+        index.Connect(&vChain[i]);
+    for (unsigned int i = 0; i < vChain.size(); i += 7)
+    {
+        int64 nTimeMin = vChain[i].GetBlockTime() + nInterval;
+        BOOST_CHECK(index.FindFirst(i, nTimeMin) == WalkStakeModifier(&vChain[i], nTimeMin));
+    }
+
+    // connecting over an existing height replaces the old branch
+    index.Connect(&vChain[500]);
+    BOOST_CHECK(index.FindFirst(499, vChain[500].GetBlockTime()) == (vChain[500].GeneratedStakeModifier() ? &vChain[500] : NULL));
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_index_bench)
+{
+    // timings over a 300,000 block chain; only with HYPERSTAKE_BENCH set
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    vector<CBlockIndex> vChain;
+    BuildChain(vChain, 300000);
+
+    CStakeModifierIndex index;
+    index.Rebuild(&vChain[0]);
+
+    // look up modifiers for coins spread over the chain, as a staking wallet does
+    int64 nInterval = 4 * 60 * 60;
+    vector<int64> vWalk, vIndex;
+    int64 nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < vChain.size(); i += 101)
+    {
+        const CBlockIndex* pindex = WalkStakeModifier(&vChain[i], vChain[i].GetBlockTime() + nInterval);
+        vWalk.push_back(pindex ? pindex->nHeight : -1);
+    }
+    int64 nWalkTime = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < vChain.size(); i += 101)
+    {
+        const CBlockIndex* pindex = index.FindFirst(i, vChain[i].GetBlockTime() + nInterval);
+        vIndex.push_back(pindex ? pindex->nHeight : -1);
+    }
+    int64 nIndexTime = GetTimeMillis() - nStart;
+
+    BOOST_CHECK(vWalk == vIndex);
+    printf("stake modifier lookup: %u lookups, pnext walk %" PRI64d "ms, index %" PRI64d "ms\n",
+        (unsigned int)vWalk.size(), nWalkTime, nIndexTime);
+}
+
+BOOST_AUTO_TEST_CASE(stake_hash_backends)
+{
+    // every backend must reproduce stakeHash() exactly, including partial batches
+    for (int nRound = 0; nRound < 200; nRound++)
+    {
+        uint64 nStakeModifier = GetRand(std::numeric_limits<uint64>::max());
+        unsigned int nTimeBlockFrom = GetRandInt(2000000000);
+        unsigned int nTxPrevOffset = GetRandInt(1000000);
+        unsigned int nTxPrevTime = GetRandInt(2000000000);
+        unsigned int nPrevout = GetRandInt(100);
+        unsigned int nCount = 1 + GetRandInt(60);
+
+        vector<unsigned int> vTimeTx(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+            vTimeTx[i] = GetRandInt(2000000000);
+
+        CDataStream ss(SER_GETHASH, 0);
+        ss << nStakeModifier;
+        vector<uint256> vExpected(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+            vExpected[i] = stakeHash(vTimeTx[i], nTxPrevTime, ss, nPrevout, nTxPrevOffset, nTimeBlockFrom);
+
+        for (int nBackend = STAKEHASH_SCALAR; nBackend <= STAKEHASH_AVX2; nBackend++)
+        {
+            StakeHashBackend backend = (StakeHashBackend)nBackend;
+            if (!StakeHashBackendSupported(backend))
+                continue;
+            vector<uint256> vHash(nCount);
+            StakeHashBatch(backend, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, nTxPrevTime, nPrevout, &vTimeTx[0], &vHash[0], nCount);
+            BOOST_CHECK_MESSAGE(vHash == vExpected, StakeHashBackendName(backend));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search_threads)
+{
+    // roughly one kernel in a few thousand hashes for a 10 day old coin
+    unsigned int nBits = (CBigNum(1) << 230).GetCompact();
+    unsigned int nTimeBlockFrom = 1400000000;
+    unsigned int nTimeTx = nTimeBlockFrom + nStakeMinAge + 10 * 24 * 60 * 60;
+
+    // the workers are kept from one search to the next
+    stakeSearchThreads.Start(3);
+    for (int nRound = 0; nRound < 10; nRound++)
+    {
+        CStakeKernelSearch serial(nBits, nTimeTx, 45), parallel(nBits, nTimeTx, 45);
+        for (int i = 0; i < 400; i++)
+        {
+            CStakeKernelContext context;
+            context.nTimeBlockFrom = nTimeBlockFrom;
+            context.nTxPrevOffset = 80 + GetRandInt(1000);
+            context.nTxPrevTime = nTimeBlockFrom;
+            context.nValue = (1 + GetRandInt(1000)) * COIN;
+            context.nStakeModifier = GetRand(std::numeric_limits<uint64>::max());
+            COutPoint prevout(GetRandHash(), GetRandInt(4));
+            serial.Add(prevout, context);
+            parallel.Add(prevout, context);
+        }
+
+        bool fSerial = serial.Run(1);
+        bool fParallel = parallel.Run(4);
+        BOOST_CHECK_EQUAL(fSerial, fParallel);
+        BOOST_CHECK_EQUAL(serial.nKernel, parallel.nKernel);
+        BOOST_CHECK_EQUAL(serial.nTimeKernel, parallel.nTimeKernel);
+        BOOST_CHECK(serial.bnWeight == parallel.bnWeight);
+        BOOST_CHECK_EQUAL(parallel.vHashes.size(), 4U);
+    }
+    stakeSearchThreads.Stop();
+    BOOST_CHECK_EQUAL(stakeSearchThreads.GetThreadCount(), 0);
+
+    // without them the calling thread searches alone
+    CStakeKernelSearch search(nBits, nTimeTx, 45);
+    for (int i = 0; i < 40; i++)
+    {
+        CStakeKernelContext context;
+        context.nTimeBlockFrom = context.nTxPrevTime = nTimeBlockFrom;
+        context.nValue = COIN;
+        search.Add(COutPoint(GetRandHash(), 0), context);
+    }
+    search.Run(4);
+    BOOST_CHECK_EQUAL(search.vHashes.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(stake_target_bench)
+{
+    // timings only; run with HYPERSTAKE_BENCH set
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    // per hash cost of the CBigNum target check against the precomputed one
+    unsigned int nBits = (CBigNum(1) << 236).GetCompact();
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    unsigned int nAge = nStakeMinAge + 10 * 24 * 60 * 60;
+    int64 nValue = 5000 * COIN;
+
+    vector<uint256> vHash(100000);
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        vHash[i] = GetRandHash() >> GetRandInt(16);
+
+    unsigned int nHitBigNum = 0, nHitTarget = 0;
+    CBigNum bnCoinWeight;
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        if (stakeTargetHit(vHash[i], nAge, nValue, bnTargetPerCoinDay, bnCoinWeight))
+            nHitBigNum++;
+    int64 nBigNumTime = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CStakeTarget target;
+    target.Set(nAge, nValue, bnTargetPerCoinDay);
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        if (target.Hit(vHash[i]))
+            nHitTarget++;
+    int64 nTargetTime = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(nHitBigNum > 0);
+    BOOST_CHECK_EQUAL(nHitBigNum, nHitTarget);
+    BOOST_CHECK(target.bnCoinWeight == bnCoinWeight);
+    printf("stake target check: %u hashes, CBigNum %.1fns/hash, uint256 %.1fns/hash\n", (unsigned int)vHash.size(),
+        nBigNumTime * 1000.0 / vHash.size(), nTargetTime * 1000.0 / vHash.size());
+
+    // targets past 2^256 and non-positive weights
+    CStakeTarget always, never;
+    always.Set(nAge, 1000000 * COIN, CBigNum(~uint256(0)));
+    never.Set(nStakeMinAge / 2, nValue, bnTargetPerCoinDay);
+    BOOST_CHECK(always.Hit(~uint256(0)) && stakeTargetHit(~uint256(0), nAge, 1000000 * COIN, CBigNum(~uint256(0)), bnCoinWeight));
+    BOOST_CHECK(!never.Hit(0) && !stakeTargetHit(0, nStakeMinAge / 2, nValue, bnTargetPerCoinDay, bnCoinWeight));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,9 @@
 #include <string>
 #include <vector>
 
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
 #include "key.h"
 #include "base58.h"
 #include "uint256.h"
@@ -144,4 +147,63 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// CKey shares one precomputed curve between its keys. Everything it
+// produces must still match a plain OpenSSL key built from the same secret.
+BOOST_AUTO_TEST_CASE(key_openssl_crosscheck)
+{
+    for (int n = 0; n < 16; n++)
+    {
+        bool fCompressed = (n % 2 == 1);
+        CKey key;
+        key.MakeNewKey(fCompressed);
+        CSecret secret = key.GetSecret(fCompressed);
+        vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+        uint256 hashMsg = GetRandHash();
+
+        EC_KEY* pkeyRaw = EC_KEY_new_by_curve_name(NID_secp256k1);
+        BIGNUM* bnSecret = BN_bin2bn(&secret[0], secret.size(), NULL);
+        EC_POINT* pointPub = EC_POINT_new(EC_KEY_get0_group(pkeyRaw));
+        BOOST_CHECK(EC_POINT_mul(EC_KEY_get0_group(pkeyRaw), pointPub, bnSecret, NULL, NULL, NULL));
+        EC_KEY_set_private_key(pkeyRaw, bnSecret);
+        EC_KEY_set_public_key(pkeyRaw, pointPub);
+        EC_KEY_set_conv_form(pkeyRaw, fCompressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED);
+
+        // same public key and private key encodings
+        vector<unsigned char> vchRaw(i2o_ECPublicKey(pkeyRaw, NULL));
+        unsigned char* pch = &vchRaw[0];
+        i2o_ECPublicKey(pkeyRaw, &pch);
+        BOOST_CHECK(vchRaw == vchPubKey);
+        CPrivKey vchPrivKey = key.GetPrivKey();
+        vchRaw.resize(i2d_ECPrivateKey(pkeyRaw, NULL));
+        pch = &vchRaw[0];
+        i2d_ECPrivateKey(pkeyRaw, &pch);
+        BOOST_CHECK(vector<unsigned char>(vchPrivKey.begin(), vchPrivKey.end()) == vchRaw);
+
+        // signatures made by either verify with the other
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hashMsg, vchSig));
+        BOOST_CHECK(ECDSA_verify(0, (unsigned char*)&hashMsg, sizeof(hashMsg), &vchSig[0], vchSig.size(), pkeyRaw) == 1);
+
+        vchRaw.resize(ECDSA_size(pkeyRaw));
+        unsigned int nSize = vchRaw.size();
+        BOOST_CHECK(ECDSA_sign(0, (unsigned char*)&hashMsg, sizeof(hashMsg), &vchRaw[0], &nSize, pkeyRaw));
+        vchRaw.resize(nSize);
+        CKey keyPub;
+        BOOST_CHECK(keyPub.SetPubKey(CPubKey(vchPubKey)));
+        BOOST_CHECK(keyPub.Verify(hashMsg, vchRaw));
+        uint256 hashOther = hashMsg + 1;
+        BOOST_CHECK(!keyPub.Verify(hashOther, vchRaw));
+
+        // and the compact signature recovers the same key
+        BOOST_CHECK(key.SignCompact(hashMsg, vchSig));
+        CKey keyRec;
+        BOOST_CHECK(keyRec.SetCompactSignature(hashMsg, vchSig));
+        BOOST_CHECK(keyRec.GetPubKey().Raw() == vchPubKey);
+
+        EC_POINT_free(pointPub);
+        BN_clear_free(bnSecret);
+        EC_KEY_free(pkeyRaw);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
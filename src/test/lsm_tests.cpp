@@ -0,0 +1,365 @@
+#include <map>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "lsm.h"
+#include "util.h"
+
+using namespace std;
+
+// A directory of its own, removed afterwards
+struct CTempDir
+{
+    boost::filesystem::path path;
+    CTempDir() : path(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("lsm-%%%%-%%%%")) {}
+    ~CTempDir() { boost::filesystem::remove_all(path); }
+};
+
+// Small enough that a few thousand keys flush and compact through the levels
+static CLSMOptions SmallOptions()
+{
+    CLSMOptions options;
+    options.nMemTableSize = 16 << 10;
+    options.nTableSize = 4 << 10;
+    options.nBlockSize = 512;
+    options.nCacheSize = 16 << 10;
+    options.nLevel0Tables = 2;
+    options.nLevel1Size = 16 << 10;
+    return options;
+}
+
+static string Key(int n)
+{
+    return strprintf("key%06d", n);
+}
+
+static void CheckContents(CLSMDatabase& db, const map<string, string>& mapExpected)
+{
+    BOOST_FOREACH(const PAIRTYPE(string, string)& item, mapExpected)
+    {
+        string strValue;
+        BOOST_CHECK(db.Get(item.first, strValue));
+        BOOST_CHECK(strValue == item.second);
+    }
+
+    CLSMIterator* pit = db.NewIterator();
+    map<string, string>::const_iterator mi = mapExpected.begin();
+    for (pit->SeekToFirst(); pit->Valid(); pit->Next(), ++mi)
+    {
+        BOOST_REQUIRE(mi != mapExpected.end());
+        BOOST_CHECK(pit->Key() == mi->first);
+        BOOST_CHECK(pit->Value() == mi->second);
+    }
+    BOOST_CHECK(mi == mapExpected.end());
+    BOOST_CHECK(!pit->Failed());
+    delete pit;
+}
+
+BOOST_AUTO_TEST_SUITE(lsm_tests)
+
+BOOST_AUTO_TEST_CASE(lsm_write_read)
+{
+    CTempDir dir;
+    CLSMDatabase db;
+    BOOST_REQUIRE(db.Open(dir.path, CLSMOptions()));
+
+    CLSMBatch batch;
+    batch.Put("b", "2");
+    batch.Put("a", "1");
+    batch.Put("c", "3");
+    batch.Delete("b");
+    BOOST_CHECK(db.Write(batch));
+
+    // the last write of a key in a batch wins
+    string strValue;
+    BOOST_CHECK(db.Get("a", strValue) && strValue == "1");
+    BOOST_CHECK(!db.Get("b", strValue));
+    BOOST_CHECK(!db.Exists("b"));
+    BOOST_CHECK(db.Exists("c"));
+
+    // an iterator sees the keys as they were when it was made
+    CLSMIterator* pit = db.NewIterator();
+    batch.clear();
+    batch.Put("b", "4");
+    BOOST_CHECK(db.Write(batch));
+    pit->Seek("b");
+    BOOST_CHECK(pit->Valid() && pit->Key() == "c");
+    pit->Next();
+    BOOST_CHECK(!pit->Valid());
+    delete pit;
+    BOOST_CHECK(db.Get("b", strValue) && strValue == "4");
+
+    // and it all comes back from the log
+    db.Close();
+    BOOST_REQUIRE(db.Open(dir.path, CLSMOptions()));
+    BOOST_CHECK(db.Get("b", strValue) && strValue == "4");
+    BOOST_CHECK(db.Get("c", strValue) && strValue == "3");
+
+    // an insert of a key that exists by the time it is written fails whole
+    CLSMBatch batchNew;
+    batchNew.Put("d", "5");
+    batchNew.Insert("e", "6");
+    batch.clear();
+    batch.Put("e", "7");
+    BOOST_CHECK(db.Write(batch));
+    BOOST_CHECK(!db.Write(batchNew));
+    BOOST_CHECK(!db.Exists("d"));
+    BOOST_CHECK(db.Get("e", strValue) && strValue == "7");
+    batchNew.clear();
+    batchNew.Insert("d", "5");
+    BOOST_CHECK(db.Write(batchNew));
+    BOOST_CHECK(db.Get("d", strValue) && strValue == "5");
+}
+
+BOOST_AUTO_TEST_CASE(lsm_compaction)
+{
+    CTempDir dir;
+    CLSMDatabase db;
+    BOOST_REQUIRE(db.Open(dir.path, SmallOptions()));
+
+    // overwrite and delete through several flushes and compactions
+    map<string, string> mapExpected;
+    for (int nRound = 0; nRound < 3; nRound++)
+    {
+        CLSMBatch batch;
+        for (int i = 0; i < 3000; i++)
+        {
+            int n = GetRandInt(2000);
+            if (GetRandInt(4) == 0)
+            {
+                batch.Delete(Key(n));
+                mapExpected.erase(Key(n));
+            }
+            else
+            {
+                string strValue = strprintf("%d-%d", nRound, i);
+                batch.Put(Key(n), strValue);
+                mapExpected[Key(n)] = strValue;
+            }
+            if (batch.size() == 50)
+            {
+                BOOST_CHECK(db.Write(batch));
+                batch.clear();
+            }
+        }
+        BOOST_CHECK(db.Write(batch));
+        CheckContents(db, mapExpected);
+    }
+
+    CLSMStats stats = db.GetStats();
+    BOOST_CHECK(stats.nFlushes > 0);
+    BOOST_CHECK(stats.nCompactions > 0);
+    BOOST_CHECK(stats.nTables[0] < 2);
+    BOOST_CHECK(stats.nCacheHits > 0);
+
+    // the tables and what the log still holds survive a restart
+    db.Close();
+    BOOST_REQUIRE(db.Open(dir.path, SmallOptions()));
+    CheckContents(db, mapExpected);
+}
+
+BOOST_AUTO_TEST_CASE(lsm_torn_log)
+{
+    CTempDir dir;
+    CLSMDatabase db;
+    BOOST_REQUIRE(db.Open(dir.path, CLSMOptions()));
+    CLSMBatch batch;
+    batch.Put("kept", "1");
+    BOOST_CHECK(db.Write(batch));
+
+    // a batch cut short by a crash is dropped, the ones before it kept,
+    // whether its size made it to the disk or is garbage
+    unsigned int vSize[] = {1000, 0xfffffff0};
+    for (int i = 0; i < 2; i++)
+    {
+        db.Close();
+        boost::filesystem::directory_iterator itEnd;
+        for (boost::filesystem::directory_iterator it(dir.path); it != itEnd; ++it)
+            if (it->path().extension() == ".log")
+            {
+                FILE* file = fopen(it->path().string().c_str(), "ab");
+                fwrite(&vSize[i], sizeof(vSize[i]), 1, file);
+                fwrite("torn", 1, 4, file);
+                fclose(file);
+            }
+        BOOST_REQUIRE(db.Open(dir.path, CLSMOptions()));
+        string strValue;
+        BOOST_CHECK(db.Get("kept", strValue) && strValue == "1");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lsm_corrupt_table)
+{
+    CTempDir dir;
+    CLSMDatabase db;
+    BOOST_REQUIRE(db.Open(dir.path, SmallOptions()));
+    CLSMBatch batch;
+    for (int i = 0; i < 2000; i++)
+    {
+        batch.Put(Key(i), "value");
+        if (batch.size() == 50)
+        {
+            BOOST_CHECK(db.Write(batch));
+            batch.clear();
+        }
+    }
+    BOOST_CHECK(db.Flush());
+    db.Close();
+
+    // damage the first block of every table
+    boost::filesystem::directory_iterator itEnd;
+    for (boost::filesystem::directory_iterator it(dir.path); it != itEnd; ++it)
+        if (it->path().extension() == ".tbl")
+        {
+            FILE* file = fopen(it->path().string().c_str(), "r+b");
+            BOOST_REQUIRE(file);
+            fseek(file, 10, SEEK_SET);
+            int c = fgetc(file);
+            fseek(file, 10, SEEK_SET);
+            fputc(c ^ 0xff, file);
+            fclose(file);
+        }
+
+    // a block that cannot be read is not taken for a missing key
+    BOOST_REQUIRE(db.Open(dir.path, SmallOptions()));
+    string strValue;
+    BOOST_CHECK_THROW(db.Get(Key(0), strValue), std::runtime_error);
+    BOOST_CHECK_THROW(db.Exists(Key(0)), std::runtime_error);
+}
+
+static CDataStream Stream(const string& str)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << str;
+    return ss;
+}
+
+BOOST_AUTO_TEST_CASE(lsm_store_txn)
+{
+    CTempDir dir;
+    CLSMDatabase db;
+    BOOST_REQUIRE(db.Open(dir.path, SmallOptions()));
+    CLSMStore store(&db, 1);
+    BOOST_CHECK(store.Write(Stream("a"), Stream("1")));
+
+    // a transaction reads its own writes, the newest for a key winning
+    CKVTxn* ptxn = store.TxnBegin();
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(store.Write(Stream("b"), Stream("2"), true, ptxn));
+    BOOST_CHECK(store.Read(Stream("b"), ssValue, ptxn));
+    BOOST_CHECK(ssValue.str() == Stream("2").str());
+    BOOST_CHECK(!store.Exists(Stream("b")));
+    BOOST_CHECK(store.Erase(Stream("a"), ptxn));
+    BOOST_CHECK(!store.Exists(Stream("a"), ptxn));
+    BOOST_CHECK(!store.Read(Stream("a"), ssValue, ptxn));
+    BOOST_CHECK(store.Exists(Stream("a")));
+
+    // and the keys it wrote or erased decide whether an insert may go ahead
+    BOOST_CHECK(!store.Write(Stream("b"), Stream("3"), false, ptxn));
+    BOOST_CHECK(store.Write(Stream("a"), Stream("4"), false, ptxn));
+    BOOST_CHECK(store.Read(Stream("a"), ssValue, ptxn));
+    BOOST_CHECK(ssValue.str() == Stream("4").str());
+
+    BOOST_CHECK(ptxn->Commit());
+    delete ptxn;
+    BOOST_CHECK(store.Read(Stream("a"), ssValue));
+    BOOST_CHECK(ssValue.str() == Stream("4").str());
+    BOOST_CHECK(store.Read(Stream("b"), ssValue));
+    BOOST_CHECK(ssValue.str() == Stream("2").str());
+}
+
+// Block index style records: a 33 byte key and a 150 byte value, written a
+// hundred to a transaction in random order, then read back at random
+static void BenchStore(const char* pszName, CKVStore& store)
+{
+    const int nRecords = 20000;
+    vector<uint256> vHash(nRecords);
+    for (int i = 0; i < nRecords; i++)
+        vHash[i] = GetRandHash();
+    std::string strValue(150, 'x');
+
+    int64 nStart = GetTimeMicros();
+    CKVTxn* ptxn = NULL;
+    for (int i = 0; i < nRecords; i++)
+    {
+        if (!ptxn)
+            ptxn = store.TxnBegin();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("tx"), vHash[i]);
+        ssValue << strValue;
+        BOOST_CHECK(store.Write(ssKey, ssValue, true, ptxn));
+        if (i % 100 == 99)
+        {
+            BOOST_CHECK(ptxn->Commit());
+            delete ptxn;
+            ptxn = NULL;
+        }
+    }
+    int64 nWriteTime = max(GetTimeMicros() - nStart, (int64)1);
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRecords; i++)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("tx"), vHash[GetRandInt(nRecords)]);
+        BOOST_CHECK(store.Read(ssKey, ssValue));
+    }
+    int64 nReadTime = max(GetTimeMicros() - nStart, (int64)1);
+
+    nStart = GetTimeMicros();
+    CKVCursor* pcursor = store.NewCursor();
+    BOOST_REQUIRE(pcursor);
+    int nScanned = 0;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION);
+    while (pcursor->Read(ssKey, ssValue, false) == 0)
+        nScanned++;
+    delete pcursor;
+    int64 nScanTime = max(GetTimeMicros() - nStart, (int64)1);
+    BOOST_CHECK_EQUAL(nScanned, nRecords);
+
+    printf("%s: %.0f writes/s, %.0f reads/s, %.0f records/s scanned\n", pszName,
+        nRecords * 1000000.0 / nWriteTime, nRecords * 1000000.0 / nReadTime, nScanned * 1000000.0 / nScanTime);
+}
+
+BOOST_AUTO_TEST_CASE(lsm_bench)
+{
+    // timings only, and slow: run with HYPERSTAKE_BENCH set in the environment
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    // Berkeley DB in an environment of its own, set up as bitdb sets up its own
+    {
+        CTempDir dir;
+        boost::filesystem::create_directories(dir.path);
+        DbEnv dbenv(DB_CXX_NO_EXCEPTIONS);
+        dbenv.set_cachesize(0, 8 << 20, 1);
+        dbenv.set_flags(DB_AUTO_COMMIT, 1);
+        dbenv.set_flags(DB_TXN_WRITE_NOSYNC, 1);
+        BOOST_REQUIRE(dbenv.open(dir.path.string().c_str(), DB_CREATE | DB_INIT_LOCK | DB_INIT_LOG |
+            DB_INIT_MPOOL | DB_INIT_TXN | DB_THREAD | DB_PRIVATE, S_IRUSR | S_IWUSR) == 0);
+        Db* pdb = new Db(&dbenv, 0);
+        BOOST_REQUIRE(pdb->open(NULL, "bench.dat", "main", DB_BTREE, DB_CREATE | DB_THREAD, 0) == 0);
+        {
+            CBerkeleyStore store(&dbenv, pdb);
+            BenchStore("bdb", store);
+        }
+        pdb->close(0);
+        delete pdb;
+        dbenv.close(0);
+    }
+
+    {
+        CTempDir dir;
+        CLSMDatabase db;
+        CLSMOptions options;
+        options.nCacheSize = 8 << 20;
+        BOOST_REQUIRE(db.Open(dir.path, options));
+        CLSMStore store(&db, 1);
+        BenchStore("lsm", store);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <openssl/sha.h>
+
+#include "main.h"
+#include "sha256.h"
+#include "util.h"
+
+using namespace std;
+
+static string SHA256Hex(const string& str)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)str.data(), str.size()).Finalize(hash);
+    return HexStr(hash, hash + sizeof(hash));
+}
+
+// Restores the backend picked at startup when a test is done with it
+struct SHA256BackendRestorer
+{
+    SHA256Backend backend;
+    SHA256BackendRestorer() : backend(GetSHA256Backend()) {}
+    ~SHA256BackendRestorer() { SHA256SelectBackend(backend); }
+};
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+BOOST_AUTO_TEST_CASE(sha256_vectors)
+{
+    SHA256BackendRestorer restore;
+    for (int nBackend = SHA256_BACKEND_GENERIC; nBackend <= SHA256_BACKEND_SHANI; nBackend++)
+    {
+        if (!SHA256SelectBackend((SHA256Backend)nBackend))
+            continue;
+        const char* pszName = SHA256BackendName((SHA256Backend)nBackend);
+        BOOST_CHECK_MESSAGE(SHA256Hex("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", pszName);
+        BOOST_CHECK_MESSAGE(SHA256Hex("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", pszName);
+        BOOST_CHECK_MESSAGE(SHA256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", pszName);
+        BOOST_CHECK_MESSAGE(SHA256Hex(string(1000000, 'a')) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", pszName);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_backends)
+{
+    SHA256BackendRestorer restore;
+    vector<unsigned char> vData(1000);
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = GetRandInt(256);
+
+    for (int nBackend = SHA256_BACKEND_GENERIC; nBackend <= SHA256_BACKEND_SHANI; nBackend++)
+    {
+        if (!SHA256SelectBackend((SHA256Backend)nBackend))
+            continue;
+        const char* pszName = SHA256BackendName((SHA256Backend)nBackend);
+
+        // every length and split of the input against OpenSSL
+        for (unsigned int nSize = 0; nSize < vData.size(); nSize += 7)
+        {
+            unsigned char hash1[32], hash2[32];
+            SHA256(&vData[0], nSize, hash1);
+            unsigned int nSplit = GetRandInt(nSize + 1);
+            CSHA256().Write(&vData[0], nSplit).Write(&vData[nSplit], nSize - nSplit).Finalize(hash2);
+            BOOST_CHECK_MESSAGE(memcmp(hash1, hash2, sizeof(hash1)) == 0, pszName);
+        }
+
+        // batched double hashes of 64 byte inputs against Hash()
+        for (unsigned int nBlocks = 0; nBlocks <= 15; nBlocks++)
+        {
+            vector<uint256> vHash(nBlocks);
+            if (nBlocks)
+                SHA256D64((unsigned char*)&vHash[0], &vData[0], nBlocks);
+            for (unsigned int i = 0; i < nBlocks; i++)
+                BOOST_CHECK_MESSAGE(vHash[i] == Hash(vData.begin() + 64 * i, vData.begin() + 64 * (i + 1)), pszName);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle_root)
+{
+    // the merkle tree built from batched pairs must match pairwise Hash()
+    for (unsigned int nTx = 1; nTx <= 17; nTx++)
+    {
+        CBlock block;
+        vector<uint256> vLevel;
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            CTransaction tx;
+            tx.nTime = i;
+            tx.vin.resize(1);
+            tx.vin[0].prevout.hash = GetRandHash();
+            block.vtx.push_back(tx);
+            vLevel.push_back(tx.GetHash());
+        }
+        while (vLevel.size() > 1)
+        {
+            vector<uint256> vNext;
+            for (unsigned int i = 0; i < vLevel.size(); i += 2)
+            {
+                const uint256& hash2 = vLevel[min(i + 1, (unsigned int)vLevel.size() - 1)];
+                vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(hash2), END(hash2)));
+            }
+            vLevel.swap(vNext);
+        }
+        BOOST_CHECK(block.BuildMerkleTree() == vLevel[0]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_bench)
+{
+    // timings of each backend; only with HYPERSTAKE_BENCH set
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    SHA256BackendRestorer restore;
+    const unsigned int nSize = 1 << 20, nRounds = 20;
+    vector<unsigned char> vData(nSize);
+    vector<unsigned char> vOut(nSize / 2);
+    unsigned char hash[32];
+
+    int64 nStart = GetTimeMicros();
+    for (unsigned int n = 0; n < nRounds; n++)
+        SHA256(&vData[0], nSize, hash);
+    int64 nTime = GetTimeMicros() - nStart;
+    printf("sha256 openssl: %.0f MB/s\n", nRounds * 1000000.0 / max(nTime, (int64)1));
+
+    for (int nBackend = SHA256_BACKEND_GENERIC; nBackend <= SHA256_BACKEND_SHANI; nBackend++)
+    {
+        if (!SHA256SelectBackend((SHA256Backend)nBackend))
+            continue;
+
+        nStart = GetTimeMicros();
+        for (unsigned int n = 0; n < nRounds; n++)
+            CSHA256().Write(&vData[0], nSize).Finalize(hash);
+        int64 nStreamTime = GetTimeMicros() - nStart;
+
+        // the merkle tree case: double hashes of 64 byte pairs
+        nStart = GetTimeMicros();
+        for (unsigned int n = 0; n < nRounds; n++)
+            SHA256D64(&vOut[0], &vData[0], nSize / 64);
+        int64 nD64Time = GetTimeMicros() - nStart;
+
+        printf("sha256 %s: %.0f MB/s, %.0f MB/s as 64 byte double hashes\n", SHA256BackendName((SHA256Backend)nBackend),
+            nRounds * 1000000.0 / max(nStreamTime, (int64)1), nRounds * 1000000.0 / max(nD64Time, (int64)1));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "sigcache.h"
+#include "util.h"
+
+using namespace std;
+
+static vector<unsigned char> RandBytes(unsigned int nSize)
+{
+    vector<unsigned char> vch(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = GetRandInt(256);
+    return vch;
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set)
+{
+    CSignatureCache cache;
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig = RandBytes(71), vchPubKey = RandBytes(33);
+
+    CSignatureCacheStats before = cache.GetStats();
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchPubKey));
+    cache.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(cache.Get(hash, vchSig, vchPubKey));
+    CSignatureCacheStats after = cache.GetStats();
+    BOOST_CHECK_EQUAL(after.nHits - before.nHits, 1U);
+    BOOST_CHECK_EQUAL(after.nMisses - before.nMisses, 1U);
+    BOOST_CHECK_EQUAL(after.nUsed, 1U);
+    BOOST_CHECK_EQUAL(after.nMaxBytes, (uint64)DEFAULT_MAX_SIGCACHE_SIZE << 20);
+    BOOST_CHECK(after.nCapacity * sizeof(uint256) <= after.nMaxBytes);
+
+    // any part of the tuple changing is a miss
+    uint256 hashOther = hash ^ 1;
+    BOOST_CHECK(!cache.Get(hashOther, vchSig, vchPubKey));
+    vector<unsigned char> vchOther = vchSig;
+    vchOther[10] ^= 1;
+    BOOST_CHECK(!cache.Get(hash, vchOther, vchPubKey));
+    vchOther = vchPubKey;
+    vchOther[0] ^= 1;
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchOther));
+
+    // the same bytes split differently between signature and key too
+    vector<unsigned char> vchSigShort(vchSig.begin(), vchSig.end() - 1);
+    vector<unsigned char> vchPubKeyLong(1, vchSig.back());
+    vchPubKeyLong.insert(vchPubKeyLong.end(), vchPubKey.begin(), vchPubKey.end());
+    BOOST_CHECK(!cache.Get(hash, vchSigShort, vchPubKeyLong));
+
+    // a resize drops everything, and size 0 caches nothing
+    cache.Resize(0);
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchPubKey));
+    cache.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchPubKey));
+    BOOST_CHECK_EQUAL(cache.GetStats().nCapacity, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    // 64 kB is 2048 entries; insert ten times that many
+    CSignatureCache cache;
+    cache.Resize(64 << 10);
+    vector<uint256> vHash;
+    vector<unsigned char> vchSig = RandBytes(72), vchPubKey = RandBytes(65);
+    for (unsigned int i = 0; i < 20480; i++)
+    {
+        vHash.push_back(GetRandHash());
+        cache.Set(vHash.back(), vchSig, vchPubKey);
+    }
+
+    CSignatureCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nCapacity, 2048U);
+    BOOST_CHECK(stats.nUsed <= stats.nCapacity);
+    BOOST_CHECK_EQUAL(stats.nInserts, 20480U);
+    BOOST_CHECK_EQUAL(stats.nUsed + stats.nEvictions, stats.nInserts);
+
+    unsigned int nFound = 0;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        if (cache.Get(hash, vchSig, vchPubKey))
+            nFound++;
+    BOOST_CHECK_EQUAL(nFound, stats.nUsed);
+    // the latest entries are the ones most likely to have stayed
+    BOOST_CHECK(cache.Get(vHash.back(), vchSig, vchPubKey));
+}
+
+static void SigCacheWorker(CSignatureCache* pcache, const vector<uint256>* pvHash, const vector<unsigned char>* pvchSig, bool* pfOk)
+{
+    for (unsigned int n = 0; n < 20; n++)
+        BOOST_FOREACH(const uint256& hash, *pvHash)
+        {
+            if (n == 0)
+                pcache->Set(hash, *pvchSig, *pvchSig);
+            else if (!pcache->Get(hash, *pvchSig, *pvchSig))
+                *pfOk = false;
+        }
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_threads)
+{
+    // each thread finds everything it put in, while the others insert
+    CSignatureCache cache;
+    vector<unsigned char> vchSig = RandBytes(70);
+    vector<vector<uint256> > vvHash(4);
+    bool fOk[4] = {true, true, true, true};
+    boost::thread_group threadGroup;
+    for (unsigned int i = 0; i < vvHash.size(); i++)
+    {
+        for (unsigned int j = 0; j < 1000; j++)
+            vvHash[i].push_back(GetRandHash());
+        threadGroup.create_thread(boost::bind(&SigCacheWorker, &cache, &vvHash[i], &vchSig, &fOk[i]));
+    }
+    threadGroup.join_all();
+    for (unsigned int i = 0; i < vvHash.size(); i++)
+        BOOST_CHECK(fOk[i]);
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsed, 4000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,72 @@
+#include <boost/test/unit_test.hpp>
+
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(stakecoinindex_tests)
+
+BOOST_AUTO_TEST_CASE(maturity_wheel)
+{
+    CStakeCoinIndex index;
+    int64 nNow = 1400000000;
+    index.Advance(nNow);
+
+    COutPoint a(GetRandHash(), 0), b(GetRandHash(), 1), c(GetRandHash(), 2);
+    index.Add(a, nNow - 10);         // already mature
+    index.Add(b, nNow + 100);        // matures within one turn of the wheel
+    index.Add(c, nNow + 10 * 4096);  // several turns away
+    BOOST_CHECK(index.GetStakeable().count(a));
+    BOOST_CHECK_EQUAL(index.GetPendingCount(), 2U);
+
+    // joins at exactly the second it matures
+    index.Advance(nNow + 99);
+    BOOST_CHECK(!index.GetStakeable().count(b));
+    index.Advance(nNow + 100);
+    BOOST_CHECK(index.GetStakeable().count(b));
+
+    // passing the slot on an earlier turn leaves it waiting
+    index.Advance(nNow + 4096 + 20);
+    BOOST_CHECK(!index.GetStakeable().count(c));
+    BOOST_CHECK_EQUAL(index.GetPendingCount(), 1U);
+
+    // a jump longer than the wheel still finds it
+    index.Advance(nNow + 20 * 4096);
+    BOOST_CHECK(index.GetStakeable().count(c));
+    BOOST_CHECK_EQUAL(index.GetPendingCount(), 0U);
+    BOOST_CHECK_EQUAL(index.GetStakeable().size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(remove_and_readd)
+{
+    CStakeCoinIndex index;
+    int64 nNow = 1400000000;
+    index.Advance(nNow);
+
+    COutPoint a(GetRandHash(), 0), b(GetRandHash(), 0);
+    index.Add(a, nNow + 50);
+    index.Add(b, nNow + 50);
+
+    // spent while waiting: its stale wheel entry must not resurrect it
+    index.Remove(a);
+    // moved to a later maturity: only the new time counts
+    index.Add(b, nNow + 80);
+
+    index.Advance(nNow + 60);
+    BOOST_CHECK(!index.GetStakeable().count(a));
+    BOOST_CHECK(!index.GetStakeable().count(b));
+    index.Advance(nNow + 80);
+    BOOST_CHECK(index.GetStakeable().count(b));
+
+    // spending a stakeable output takes it out
+    index.Remove(b);
+    BOOST_CHECK(index.GetStakeable().empty());
+
+    index.clear();
+    index.Add(a, nNow);
+    BOOST_CHECK(!index.GetStakeable().count(a));
+    index.Advance(nNow);
+    BOOST_CHECK(index.GetStakeable().count(a));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
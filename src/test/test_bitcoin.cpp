@@ -1,8 +1,10 @@
 #define BOOST_TEST_MODULE Bitcoin Test Suite
 #include <boost/test/unit_test.hpp>
 
+#include "coins.h"
 #include "db.h"
 #include "main.h"
+#include "sha256.h"
 #include "wallet.h"
 
 CWallet* pwalletMain;
@@ -14,8 +16,11 @@ extern void noui_connect();
 struct TestingSetup {
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
+        fCheckHashCache = true;
+        SHA256AutoDetect();
         noui_connect();
         bitdb.MakeMock();
+        pcoinsTip = new CCoinsViewCache(new CCoinsViewDB());
         LoadBlockIndex(true);
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
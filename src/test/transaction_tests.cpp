@@ -1,6 +1,8 @@
 #include <map>
 #include <string>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 #include "json/json_spirit_writer_template.h"
 
 #include "main.h"
@@ -13,6 +15,11 @@ using namespace json_spirit;
 extern Array read_json(const std::string& filename);
 extern CScript ParseScript(string s);
 
+static void GetTxHash(const CTransaction& tx, uint256& hash)
+{
+    hash = tx.GetHash();
+}
+
 BOOST_AUTO_TEST_SUITE(transaction_tests)
 
 BOOST_AUTO_TEST_CASE(tx_valid)
@@ -166,6 +173,113 @@ BOOST_AUTO_TEST_CASE(basic_transaction_tests)
     BOOST_CHECK_MESSAGE(!tx.CheckTransaction(), "Transaction with duplicate txins should be invalid.");
 }
 
+BOOST_AUTO_TEST_CASE(tx_hash_cache)
+{
+    CTransaction txFrom;
+    txFrom.vin.resize(1);
+    txFrom.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = 5 * CENT;
+    txFrom.vout[0].scriptPubKey << OP_1;
+
+    // a transaction built in place is hashed again after every change
+    uint256 hashBuilt = txFrom.GetHash();
+    txFrom.vout[0].nValue = 6 * CENT;
+    BOOST_CHECK(txFrom.GetHash() != hashBuilt);
+    BOOST_CHECK(txFrom.GetHash() == SerializeHash(txFrom));
+
+    // one read from a stream is serialized once
+    uint256 hashFrom = txFrom.GetHash();
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << txFrom;
+    CTransaction tx;
+    stream >> tx;
+    uint64 nSerialized = hashCacheStats.nTxSerialized;
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK(tx.GetHash() == hashFrom);
+    BOOST_CHECK_EQUAL(hashCacheStats.nTxSerialized - nSerialized, 1U);
+
+    // copies are not cached, so they may be changed freely
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.GetHash() == hashFrom);
+    txCopy.vout[0].nValue = 9 * CENT;
+    BOOST_CHECK(txCopy.GetHash() != hashFrom);
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+    CTransaction txAssigned;
+    stream << txFrom;
+    stream >> txAssigned;
+    BOOST_CHECK(txAssigned.GetHash() == hashFrom);
+    txAssigned = txCopy;
+    txAssigned.vout[0].nValue = 10 * CENT;
+    BOOST_CHECK(txAssigned.GetHash() == SerializeHash(txAssigned));
+
+    // threads racing to fill in the hash all see the same one
+    for (int nRound = 0; nRound < 20; nRound++)
+    {
+        CDataStream ssShared(SER_NETWORK, PROTOCOL_VERSION);
+        ssShared << txFrom;
+        CTransaction txShared;
+        ssShared >> txShared;
+        vector<uint256> vHash(4);
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < vHash.size(); i++)
+            threads.create_thread(boost::bind(&GetTxHash, boost::cref(txShared), boost::ref(vHash[i])));
+        threads.join_all();
+        for (unsigned int i = 0; i < vHash.size(); i++)
+            BOOST_CHECK(vHash[i] == txFrom.GetHash());
+        BOOST_CHECK(CTransaction(txShared).GetHash() == txFrom.GetHash());
+    }
+
+    // changing it requires InvalidateHash, after which it is never cached again
+    tx.InvalidateHash();
+    tx.vout[0].nValue = 7 * CENT;
+    BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+    tx.vout[0].nValue = 8 * CENT;
+    BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+
+    // signing drops the cached hash of a deserialized transaction
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CTransaction txPrev;
+    txPrev.vout.resize(1);
+    txPrev.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    txSpend.vout.resize(1);
+    CDataStream ssSpend(SER_NETWORK, PROTOCOL_VERSION);
+    ssSpend << txSpend;
+    CTransaction txSigned;
+    ssSpend >> txSigned;
+    uint256 hashUnsigned = txSigned.GetHash();
+    BOOST_CHECK(SignSignature(keystore, txPrev, txSigned, 0));
+    BOOST_CHECK(txSigned.GetHash() != hashUnsigned);
+    BOOST_CHECK(txSigned.GetHash() == SerializeHash(txSigned));
+}
+
+BOOST_AUTO_TEST_CASE(block_hash_cache)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1401331380;
+    block.nBits = 0x1e0fffff;
+
+    uint64 nHashed = hashCacheStats.nBlockHashed;
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(block.GetHash() == hash);
+    BOOST_CHECK_EQUAL(hashCacheStats.nBlockHashed - nHashed, 1U);
+
+    // any header change, as the miner makes, is hashed again
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hash);
+    BOOST_CHECK(block.GetHash() == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+    block.nNonce--;
+    BOOST_CHECK(block.GetHash() == hash);
+    BOOST_CHECK_EQUAL(hashCacheStats.nBlockHashed - nHashed, 3U);
+}
+
 //
 // Helper: create two dummy transactions, each with
 // two outputs.  The first has 11 and 50 CENT outputs
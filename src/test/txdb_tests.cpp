@@ -0,0 +1,461 @@
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "coins.h"
+#include "db.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CVoteProposal TestProposal()
+{
+    VoteLocation location;
+    location.nMostSignificantBit = 7;
+    location.nLeastSignificantBit = 4;
+    return CVoteProposal("batch", 1000, 100, "batched write", location);
+}
+
+// Blocks of transactions spending the outputs of funding transactions
+// indexed ahead of them, connected and disconnected against the tx index
+// alone as ConnectBlock and Reorganize do
+struct CTestChain
+{
+    vector<CTransaction> vFunding;
+    vector<CBlock> vBlock;
+    vector<CBlockIndex> vIndex;
+    vector<uint256> vBlockHash;
+    CBlockIndex indexRoot;
+    uint256 hashRoot;
+
+    CTestChain(int nBlocks, int nTxPerBlock)
+    {
+        // two outputs of a funding transaction spent by each block transaction
+        vFunding.resize(nBlocks * nTxPerBlock / 4 + 1);
+        for (unsigned int i = 0; i < vFunding.size(); i++)
+        {
+            vFunding[i].vin.resize(1);
+            vFunding[i].vin[0].prevout.hash = GetRandHash();
+            vFunding[i].vout.resize(8);
+        }
+
+        hashRoot = GetRandHash();
+        indexRoot.phashBlock = &hashRoot;
+        vBlock.resize(nBlocks);
+        vIndex.resize(nBlocks);
+        vBlockHash.resize(nBlocks);
+        int nSpent = 0;
+        for (int i = 0; i < nBlocks; i++)
+        {
+            CBlock& block = vBlock[i];
+            block.vtx.resize(nTxPerBlock + 1);
+            block.vtx[0].vin.resize(1);
+            block.vtx[0].vin[0].scriptSig << i;
+            block.vtx[0].vout.resize(1);
+            for (int j = 1; j <= nTxPerBlock; j++, nSpent += 2)
+            {
+                CTransaction& tx = block.vtx[j];
+                tx.vin.resize(2);
+                for (int k = 0; k < 2; k++)
+                    tx.vin[k].prevout = COutPoint(vFunding[(nSpent + k) / 8].GetHash(), (nSpent + k) % 8);
+                tx.vout.resize(2);
+            }
+            vBlockHash[i] = GetRandHash();
+            vIndex[i].phashBlock = &vBlockHash[i];
+            vIndex[i].pprev = i ? &vIndex[i-1] : &indexRoot;
+        }
+    }
+
+    bool Fund()
+    {
+        CTxDB txdb;
+        for (unsigned int i = 0; i < vFunding.size(); i++)
+            if (!txdb.AddTxIndex(vFunding[i], CDiskTxPos(1, 1, i), 0))
+                return false;
+        return true;
+    }
+
+    // The changes ConnectBlock queues for a block
+    bool Connect(CTxDB& txdb, int nBlock)
+    {
+        map<uint256, CTxIndex> mapQueuedChanges;
+        for (unsigned int j = 0; j < vBlock[nBlock].vtx.size(); j++)
+        {
+            const CTransaction& tx = vBlock[nBlock].vtx[j];
+            CDiskTxPos posThisTx(2, nBlock, j);
+            if (!tx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    CTxIndex& txindex = mapQueuedChanges[txin.prevout.hash];
+                    if (txindex.vSpent.empty() && !txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                        return false;
+                    txindex.vSpent[txin.prevout.n] = posThisTx;
+                }
+            }
+            mapQueuedChanges[tx.GetHash()] = CTxIndex(posThisTx, tx.vout.size());
+        }
+        return txdb.WriteBlockTxIndex(vBlockHash[nBlock], mapQueuedChanges);
+    }
+
+    bool ConnectAll()
+    {
+        for (unsigned int i = 0; i < vBlock.size(); i++)
+        {
+            CTxDB txdb;
+            if (!txdb.TxnBegin() || !Connect(txdb, i) || !txdb.TxnCommit())
+                return false;
+        }
+        return true;
+    }
+
+    // Tip first, in one batch, as Reorganize does
+    bool DisconnectAll()
+    {
+        CTxDB txdb;
+        if (!txdb.TxnBegin())
+            return false;
+        for (int i = vBlock.size() - 1; i >= 0; i--)
+            if (!vBlock[i].DisconnectBlock(txdb, &vIndex[i]))
+                return false;
+        return txdb.TxnCommit();
+    }
+
+    void EraseUndo()
+    {
+        CTxDB txdb;
+        for (unsigned int i = 0; i < vBlock.size(); i++)
+            BOOST_CHECK(txdb.EraseBlockUndo(vBlockHash[i]));
+    }
+
+    // The funding transactions unspent and the blocks' gone
+    void CheckDisconnected()
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        for (unsigned int i = 0; i < vFunding.size(); i++)
+        {
+            BOOST_CHECK(txdb.ReadTxIndex(vFunding[i].GetHash(), txindex));
+            BOOST_CHECK(txindex == CTxIndex(CDiskTxPos(1, 1, i), 8));
+        }
+        for (unsigned int i = 0; i < vBlock.size(); i++)
+        {
+            BOOST_FOREACH(const CTransaction& tx, vBlock[i].vtx)
+                BOOST_CHECK(!txdb.ContainsTx(tx.GetHash()));
+            CBlockUndo undo;
+            BOOST_CHECK(!txdb.ReadBlockUndo(vBlockHash[i], undo));
+        }
+    }
+};
+
+// Load the block index from scratch, as at startup, and give back the
+// genesis block's nMint as loaded, so where it came from can be told apart
+static int64 ReloadBlockIndex()
+{
+    uint256 hashBest = hashBestChain;
+    mapBlockIndex.clear();
+    pindexGenesisBlock = NULL;
+    pindexBest = NULL;
+    setStakeSeen.clear();
+    CTxDB txdb("cr");
+    bool fLoaded = txdb.LoadBlockIndex();
+    txdb.Close();
+    BOOST_CHECK(fLoaded);
+    BOOST_REQUIRE(pindexGenesisBlock && pindexBest);
+    BOOST_CHECK(hashBestChain == hashBest);
+    BOOST_CHECK(chainActive.Tip() == pindexBest);
+    return pindexGenesisBlock->nMint;
+}
+
+static bool WriteSnapshot(int64 nMint)
+{
+    pindexGenesisBlock->nMint = nMint;
+    CTxDB txdb;
+    bool fOk = txdb.WriteBlockIndexSnapshot();
+    txdb.Close();
+    return fOk;
+}
+
+static bool WriteGenesisIndex(int64 nMint)
+{
+    pindexGenesisBlock->nMint = nMint;
+    CTxDB txdb;
+    bool fOk = txdb.WriteBlockIndex(CDiskBlockIndex(pindexGenesisBlock));
+    txdb.Close();
+    return fOk;
+}
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(txdb_batch_commit)
+{
+    uint256 hashTx = GetRandHash(), txidProposal = GetRandHash();
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 4), txindexRead;
+    CVoteProposal proposal = TestProposal(), proposalRead;
+
+    CTxDB txdb;
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(!txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hashTx, txindex));
+    {
+        CVoteDB voteDB("cr+");
+        voteDB.JoinBatch(txdb);
+        BOOST_CHECK(voteDB.WriteProposal(txidProposal, proposal));
+    }
+
+    // the transaction sees its own tx index changes, nobody sees anything else yet
+    BOOST_CHECK(txdb.ReadTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(txindexRead == txindex);
+    BOOST_CHECK(!CTxDB("r").ReadTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(!CVoteDB("cr+").ReadProposal(txidProposal, proposalRead));
+
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(txindexRead == txindex);
+    BOOST_CHECK(CVoteDB("cr+").ReadProposal(txidProposal, proposalRead));
+    BOOST_CHECK(proposalRead.GetHash() == proposal.GetHash());
+
+    // and on to disk
+    BOOST_CHECK(FlushCoinsCache(true));
+    CCoinsViewDB viewDisk;
+    BOOST_CHECK(viewDisk.GetTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(txindexRead == txindex);
+}
+
+BOOST_AUTO_TEST_CASE(txdb_batch_abort)
+{
+    uint256 hashTx = GetRandHash(), txidProposal = GetRandHash();
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 4), txindexRead;
+    CVoteProposal proposalRead;
+
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.UpdateTxIndex(hashTx, txindex));
+        CVoteDB voteDB("cr+");
+        voteDB.JoinBatch(txdb);
+        BOOST_CHECK(voteDB.WriteProposal(txidProposal, TestProposal()));
+        BOOST_CHECK(txdb.TxnAbort());
+        BOOST_CHECK(!txdb.ReadTxIndex(hashTx, txindexRead));
+    }
+
+    // a handle closed with its batch open drops it too
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.UpdateTxIndex(hashTx, txindex));
+    }
+
+    BOOST_CHECK(!CTxDB("r").ReadTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(!CVoteDB("cr+").ReadProposal(txidProposal, proposalRead));
+}
+
+// A proposal and the votes for it connected in one batch, as when a
+// reorganisation connects several blocks
+BOOST_AUTO_TEST_CASE(txdb_batch_proposal_vote)
+{
+    bool fTestNetOld = fTestNet;
+    fTestNet = true;
+
+    VoteLocation location(7, 6);
+    CVoteProposal proposal("batchvote", 2, 5, "voted on in its own batch", location), proposalRead;
+    uint256 txid = GetRandHash();
+
+    // every block votes yes
+    vector<CBlockIndex> vIndex(4);
+    vector<uint256> vHash(vIndex.size());
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        vHash[i] = GetRandHash();
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nVersion = CBlock::VOTING_VERSION | (1 << location.GetShift());
+    }
+
+    CTxDB txdb;
+    BOOST_CHECK(txdb.TxnBegin());
+    CVoteDB voteDB("cr+");
+    voteDB.JoinBatch(txdb);
+    BOOST_CHECK(voteDB.WriteProposal(txid, proposal));
+    mapProposals[txid] = proposal.GetHash();
+    BOOST_CHECK(proposalManager.Add(proposal));
+
+    // the proposal is only in the batch, yet the tally finds it there
+    BOOST_CHECK(voteDB.ReadProposal(txid, proposalRead));
+    BOOST_CHECK(!CVoteDB("r").ReadProposal(txid, proposalRead));
+    CVoteTallyIndex index;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        BOOST_CHECK(index.Connect(&vIndex[i], voteDB));
+
+    CVoteSummary summary;
+    CVoteTally tally;
+    BOOST_CHECK(index.Find(&vIndex[3], tally));
+    BOOST_CHECK(tally.GetSummary(proposal.GetHash(), summary));
+    BOOST_CHECK_EQUAL(summary.nYesTally, 2U);
+
+    BOOST_CHECK(txdb.TxnAbort());
+    proposalManager.Remove(proposal.GetHash());
+    mapProposals.erase(txid);
+    fTestNet = fTestNetOld;
+}
+
+BOOST_AUTO_TEST_CASE(txdb_txindex_cache)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(4);
+    uint256 hashTx = tx.GetHash();
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 4), txindexRead;
+    bool fFound = false;
+
+    // a miss is remembered as one
+    BOOST_CHECK(!CTxDB("r").ReadTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(txindexCache.Get(hashTx, txindexRead, fFound) && !fFound);
+
+    // what pcoinsTip flushes is written through
+    BOOST_CHECK(CTxDB().AddTxIndex(tx, txindex.pos, 1));
+    BOOST_CHECK(FlushCoinsCache(true));
+    BOOST_CHECK(txindexCache.Get(hashTx, txindexRead, fFound) && fFound && txindexRead == txindex);
+
+    // a spend undone, as when a reorganization fails, leaves the cache as
+    // the disk is
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        CTxIndex txindexSpent = txindex;
+        txindexSpent.vSpent[0] = CDiskTxPos(5, 6, 7);
+        BOOST_CHECK(txdb.UpdateTxIndex(hashTx, txindexSpent));
+        BOOST_CHECK(txdb.ReadTxIndex(hashTx, txindexRead) && txindexRead == txindexSpent);
+        BOOST_CHECK(txdb.TxnAbort());
+    }
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hashTx, txindexRead) && txindexRead == txindex);
+
+    // a disconnect committed reaches it when flushed
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.EraseTxIndex(tx));
+        BOOST_CHECK(txdb.TxnCommit());
+    }
+    BOOST_CHECK(txindexCache.Get(hashTx, txindexRead, fFound) && fFound);
+    BOOST_CHECK(!CTxDB("r").ReadTxIndex(hashTx, txindexRead));
+    BOOST_CHECK(FlushCoinsCache(true));
+    BOOST_CHECK(txindexCache.Get(hashTx, txindexRead, fFound) && !fFound);
+}
+
+BOOST_AUTO_TEST_CASE(txdb_block_undo)
+{
+    CTestChain chain(3, 5);
+    BOOST_REQUIRE(chain.Fund());
+    BOOST_REQUIRE(chain.ConnectAll());
+
+    // the undo record holds what connecting replaced: the two funding
+    // transactions spent from as they were, and the block's six as absent
+    CBlockUndo undo;
+    BOOST_CHECK(CTxDB("r").ReadBlockUndo(chain.vBlockHash[0], undo));
+    BOOST_CHECK_EQUAL(undo.vPrior.size(), 2U + 6U);
+    BOOST_FOREACH(const CTxIndexUndo& prior, undo.vPrior)
+        if (prior.fExisted)
+            BOOST_CHECK(prior.txindex.vSpent[0].IsNull());
+
+    BOOST_CHECK(chain.DisconnectAll());
+    chain.CheckDisconnected();
+
+    // blocks connected without undo records are disconnected from their
+    // transactions to the same state
+    BOOST_REQUIRE(chain.ConnectAll());
+    chain.EraseUndo();
+    BOOST_CHECK(chain.DisconnectAll());
+    chain.CheckDisconnected();
+}
+
+BOOST_AUTO_TEST_CASE(block_index_snapshot)
+{
+    LOCK(cs_main);
+    boost::filesystem::path path = GetDataDir() / "blkindex.snapshot";
+    boost::filesystem::path pathOld = GetDataDir() / "blkindex.snapshot.old";
+    const int64 nMint = pindexGenesisBlock->nMint;
+    unsigned int nEntries = mapBlockIndex.size();
+
+    // in the snapshot only, so seen only when the snapshot is loaded
+    BOOST_REQUIRE(WriteSnapshot(nMint + 1));
+    BOOST_CHECK_EQUAL(ReloadBlockIndex(), nMint + 1);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+
+    // a record written after the snapshot is read over it
+    BOOST_REQUIRE(WriteGenesisIndex(nMint + 2));
+    BOOST_CHECK_EQUAL(ReloadBlockIndex(), nMint + 2);
+    BOOST_REQUIRE(WriteGenesisIndex(nMint));
+    BOOST_CHECK_EQUAL(ReloadBlockIndex(), nMint);
+
+    // a snapshot the database has moved on from is passed over
+    BOOST_REQUIRE(WriteSnapshot(nMint + 3));
+    boost::filesystem::remove(pathOld);
+    boost::filesystem::copy_file(path, pathOld);
+    BOOST_REQUIRE(WriteSnapshot(nMint));
+    boost::filesystem::remove(path);
+    boost::filesystem::copy_file(pathOld, path);
+    BOOST_CHECK_EQUAL(ReloadBlockIndex(), nMint);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+
+    // and so is a damaged one
+    BOOST_REQUIRE(WriteSnapshot(nMint + 4));
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    long nPos = boost::filesystem::file_size(path) / 2;
+    int c = (fseek(file, nPos, SEEK_SET) == 0) ? fgetc(file) : EOF;
+    BOOST_REQUIRE(c != EOF);
+    fseek(file, nPos, SEEK_SET);
+    fputc(c ^ 0xff, file);
+    fclose(file);
+    BOOST_CHECK_EQUAL(ReloadBlockIndex(), nMint);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+
+    // turned off, the snapshot is dropped with its id
+    BOOST_REQUIRE(WriteSnapshot(nMint + 5));
+    mapArgs["-blockindexsnapshot"] = "0";
+    BOOST_CHECK_EQUAL(ReloadBlockIndex(), nMint);
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    mapArgs.erase("-blockindexsnapshot");
+
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(pathOld);
+}
+
+// A 10 block reorganization: disconnected and connected again
+BOOST_AUTO_TEST_CASE(reorg_bench)
+{
+    // measures rather than checks; only runs when HYPERSTAKE_BENCH is set
+    if (!getenv("HYPERSTAKE_BENCH"))
+        return;
+
+    const int nBlocks = 10, nTxPerBlock = 200, nRounds = 5;
+    CTestChain chain(nBlocks, nTxPerBlock);
+    BOOST_REQUIRE(chain.Fund());
+
+    for (int fUndo = 1; fUndo >= 0; fUndo--)
+    {
+        int64 nDisconnectTime = 0, nConnectTime = 0;
+        for (int n = 0; n < nRounds; n++)
+        {
+            int64 nStart = GetTimeMicros();
+            BOOST_REQUIRE(chain.ConnectAll());
+            nConnectTime += GetTimeMicros() - nStart;
+            if (!fUndo)
+                chain.EraseUndo();
+
+            // from the disk, as a reorganization usually finds them
+            BOOST_CHECK(FlushCoinsCache(true));
+            nStart = GetTimeMicros();
+            BOOST_REQUIRE(chain.DisconnectAll());
+            nDisconnectTime += GetTimeMicros() - nStart;
+        }
+        chain.CheckDisconnected();
+        printf("reorg of %d blocks of %d transactions, %s: %.2fms disconnect, %.2fms connect\n", nBlocks, nTxPerBlock,
+            fUndo ? "undo records" : "disconnecting inputs", nDisconnectTime / 1000.0 / nRounds, nConnectTime / 1000.0 / nRounds);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
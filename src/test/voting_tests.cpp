@@ -174,6 +174,105 @@ BOOST_AUTO_TEST_CASE(proposal_serialization)
 
 //}
 
+BOOST_AUTO_TEST_CASE(proposal_interval_tree)
+{
+    std::cout << "testing the proposal interval tree\n";
+
+    map<uint256, CProposalMetaData> mapProposalData;
+    for (int i = 0; i < 300; i++)
+    {
+        CProposalMetaData data;
+        data.hash = GetRandHash();
+        data.nHeightStart = GetRandInt(10000);
+        data.nHeightEnd = data.nHeightStart + GetRandInt(500);
+        mapProposalData[data.hash] = data;
+    }
+
+    CProposalIntervalTree tree;
+    BOOST_CHECK(tree.GetOverlapping(0, 20000).empty());
+    tree.Rebuild(mapProposalData);
+
+    // the same proposals as looking at every one of them
+    for (int i = 0; i < 200; i++)
+    {
+        int nStart = GetRandInt(10500);
+        int nEnd = nStart + (i % 2 ? 0 : GetRandInt(300));
+        set<uint256> setExpected, setFound;
+        for (const auto& it : mapProposalData)
+            if ((int)it.second.nHeightStart <= nEnd && (int)it.second.nHeightEnd >= nStart)
+                setExpected.insert(it.first);
+        for (const CProposalMetaData* pdata : tree.GetOverlapping(nStart, nEnd))
+            BOOST_CHECK(setFound.insert(pdata->hash).second);
+        BOOST_CHECK(setFound == setExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(vote_tally_snapshots)
+{
+    std::cout << "testing vote tally sharing and snapshots\n";
+
+    bool fTestNetOld = fTestNet;
+    fTestNet = true;
+
+    // a proposal voted on from height 2 to 21
+    VoteLocation location(7, 6);
+    CVoteProposal proposal("tally", 2, 20, "tally snapshots", location);
+    uint256 txid = GetRandHash();
+    BOOST_CHECK(CVoteDB("cr+").WriteProposal(txid, proposal));
+    mapProposals[txid] = proposal.GetHash();
+    BOOST_CHECK(proposalManager.Add(proposal));
+
+    // every block votes yes
+    const int nBlocks = 700;
+    vector<CBlockIndex> vIndex(nBlocks);
+    vector<uint256> vHash(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        vHash[i] = GetRandHash();
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nVersion = CBlock::VOTING_VERSION | (1 << location.GetShift());
+    }
+
+    CVoteTallyIndex index;
+    {
+        CVoteDB voteDB("cr+");
+        for (int i = 0; i < nBlocks; i++)
+            BOOST_CHECK(index.Connect(&vIndex[i], voteDB));
+    }
+
+    // only the tallies near the tip are kept
+    BOOST_CHECK(index.size() <= (unsigned int)TALLY_CACHE_DEPTH);
+
+    CVoteSummary summary;
+    CVoteTally tally = index.Get(&vIndex[nBlocks - 1]);
+    BOOST_CHECK(tally.GetSummary(proposal.GetHash(), summary));
+    BOOST_CHECK_EQUAL(summary.nYesTally, 21U);
+    BOOST_CHECK_EQUAL(summary.nNoTally, 0U);
+
+    // once voting is over consecutive tallies are the same maps
+    BOOST_CHECK(tally.SharesVotes(index.Get(&vIndex[nBlocks - 2])));
+
+    // an old block's tally comes back from the snapshot before it
+    tally = index.Get(&vIndex[10]);
+    BOOST_CHECK(tally.GetSummary(proposal.GetHash(), summary));
+    BOOST_CHECK_EQUAL(summary.nYesTally, 9U);
+
+    // and so does the tip's after a restart
+    index.clear();
+    CVoteTally tallySnapshot;
+    BOOST_CHECK(CVoteDB("r").ReadTally(vHash[600], tallySnapshot));
+    tally = index.Get(&vIndex[nBlocks - 1]);
+    BOOST_CHECK(tally.GetSummary(proposal.GetHash(), summary));
+    BOOST_CHECK_EQUAL(summary.nYesTally, 21U);
+    BOOST_CHECK(index.size() <= (unsigned int)TALLY_SNAPSHOT_INTERVAL);
+
+    proposalManager.Remove(proposal.GetHash());
+    mapProposals.erase(txid);
+    fTestNet = fTestNetOld;
+}
+
 BOOST_AUTO_TEST_CASE(vote_charset)
 {
         std::cout << "testing proposal manager functionality and GetCombinedVotes()" << endl;
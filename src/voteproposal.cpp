@@ -45,6 +45,7 @@ bool CVoteProposal::ConstructTransaction (CTransaction& tx) const
     CTxOut out;
     out.scriptPubKey = scriptProposal;
     out.nValue = 0;
+    tx.InvalidateHash();
     tx.vout.push_back(out);
 
     if (tx.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE) {
@@ -53,22 +53,19 @@ bool CVoteProposalManager::Add(const CVoteProposal& proposal)
     newProposal.nHeightEnd = newProposal.nHeightStart + proposal.GetCheckSpan();
 
     //Check if any of the existing proposals are using the same bits during the same time
-    for (auto it : mapProposalData) {
-        CProposalMetaData existingProposal = it.second;
+    for (const CProposalMetaData* pexisting : treeProposals.GetOverlapping(newProposal.nHeightStart, newProposal.nHeightEnd)) {
         //Clear of any conflicts, starts after the existing proposal ends
-        if (newProposal.location.nMostSignificantBit < existingProposal.location.nLeastSignificantBit)
+        if (newProposal.location.nMostSignificantBit < pexisting->location.nLeastSignificantBit)
             continue;
         //Clear of any conflicts, ends before the existing proposal starts
-        if (newProposal.location.nLeastSignificantBit > existingProposal.location.nMostSignificantBit)
-            continue;
-        //Clear of any conflicts, there is not overlap in the voting period
-        if (newProposal.nHeightStart > existingProposal.nHeightEnd || newProposal.nHeightEnd < existingProposal.nHeightStart)
+        if (newProposal.location.nLeastSignificantBit > pexisting->location.nMostSignificantBit)
             continue;
 
         return error("%s: Proposal position is already occupied during the block span requested", __func__);
     }
 
     mapProposalData.insert(make_pair(newProposal.hash, newProposal));
+    treeProposals.Rebuild(mapProposalData);
     printf("%s: added proposal %s\n", __func__, newProposal.hash.GetHex().c_str());
     return true;
 }
@@ -77,23 +74,75 @@ bool CVoteProposalManager::Add(const CVoteProposal& proposal)
 void CVoteProposalManager::Remove(const uint256& hashProposal)
 {
     auto it = mapProposalData.find(hashProposal);
-    if (it != mapProposalData.end())
+    if (it != mapProposalData.end()) {
         mapProposalData.erase(it);
+        treeProposals.Rebuild(mapProposalData);
+    }
 }
 
 //! Get proposals that are actively being voted on
 map<uint256, VoteLocation> CVoteProposalManager::GetActive(int nHeight)
 {
     map<uint256, VoteLocation> mapActive;
-    for (auto it : mapProposalData) {
-        CProposalMetaData data = it.second;
-        if ((int)data.nHeightStart <= nHeight && (int)data.nHeightEnd >= nHeight)
-            mapActive.insert(make_pair(data.hash, data.location));
-    }
+    for (const CProposalMetaData* pdata : treeProposals.GetOverlapping(nHeight, nHeight))
+        mapActive.insert(make_pair(pdata->hash, pdata->location));
 
     return mapActive;
 }
 
+void CProposalIntervalTree::Rebuild(const map<uint256, CProposalMetaData>& mapProposalData)
+{
+    vProposals.clear();
+    vProposals.reserve(mapProposalData.size());
+    for (const auto& it : mapProposalData)
+        vProposals.push_back(it.second);
+    sort(vProposals.begin(), vProposals.end(), [](const CProposalMetaData& a, const CProposalMetaData& b) {
+        return a.nHeightStart < b.nHeightStart;
+    });
+
+    vMaxEnd.assign(vProposals.size(), 0);
+    Build(0, vProposals.size());
+}
+
+//! The subtree over [nBegin, nEnd) is rooted at its middle element
+unsigned int CProposalIntervalTree::Build(int nBegin, int nEnd)
+{
+    if (nBegin >= nEnd)
+        return 0;
+
+    int nMid = (nBegin + nEnd) / 2;
+    vMaxEnd[nMid] = max(vProposals[nMid].nHeightEnd, max(Build(nBegin, nMid), Build(nMid + 1, nEnd)));
+    return vMaxEnd[nMid];
+}
+
+void CProposalIntervalTree::Find(int nBegin, int nEnd, int nStart, int nEndHeight, vector<const CProposalMetaData*>& vFound) const
+{
+    if (nBegin >= nEnd)
+        return;
+
+    // everything below here is over before the span begins
+    int nMid = (nBegin + nEnd) / 2;
+    if ((int)vMaxEnd[nMid] < nStart)
+        return;
+
+    Find(nBegin, nMid, nStart, nEndHeight, vFound);
+
+    // this one and all to its right start after the span
+    if ((int)vProposals[nMid].nHeightStart > nEndHeight)
+        return;
+
+    if ((int)vProposals[nMid].nHeightEnd >= nStart)
+        vFound.push_back(&vProposals[nMid]);
+    Find(nMid + 1, nEnd, nStart, nEndHeight, vFound);
+}
+
+vector<const CProposalMetaData*> CProposalIntervalTree::GetOverlapping(int nStart, int nEnd) const
+{
+    vector<const CProposalMetaData*> vFound;
+    Find(0, vProposals.size(), nStart, nEnd, vFound);
+    return vFound;
+}
+
 namespace
 {
     //An Event is either the beginning or end of a vote proposal span.
@@ -215,16 +264,7 @@ namespace
 bool CVoteProposalManager::GetNextLocation(int nBitCount, int nStartHeight, int nCheckSpan, VoteLocation& location)
 {
     //Conflicts for block range
-    vector<CProposalMetaData> vConflictingTime;
-    for (auto it : mapProposalData) {
-        CProposalMetaData data = it.second;
-        int nEndHeight = nStartHeight + nCheckSpan;
-        if ((int)data.nHeightEnd < nStartHeight)
-            continue;
-        if ((int)data.nHeightStart > nEndHeight)
-            continue;
-        vConflictingTime.emplace_back(data);
-    }
+    vector<const CProposalMetaData*> vConflictingTime = treeProposals.GetOverlapping(nStartHeight, nStartHeight + nCheckSpan);
 
     //Find an open location for the new proposal, return left most bits
     if (vConflictingTime.empty()) {
@@ -237,8 +277,8 @@ bool CVoteProposalManager::GetNextLocation(int nBitCount, int nStartHeight, int
     vector<int> vAvailable(28, 1);
 
     //remove spots that are already taken
-    for (auto data : vConflictingTime) {
-        for (int i = data.location.nMostSignificantBit; i >= data.location.nLeastSignificantBit; i--) {
+    for (const CProposalMetaData* pdata : vConflictingTime) {
+        for (int i = pdata->location.nMostSignificantBit; i >= pdata->location.nLeastSignificantBit; i--) {
             vAvailable.at(i) = 0;
         }
     }
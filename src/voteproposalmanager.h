@@ -5,7 +5,9 @@
 #ifndef HYPERSTAKE_VOTEPROPOSALMANAGER_H
 #define HYPERSTAKE_VOTEPROPOSALMANAGER_H
 
+#include <map>
 #include <set>
+#include <vector>
 #include "voteobject.h"
 
 class CVoteProposal;
@@ -18,10 +20,33 @@ struct CProposalMetaData
     unsigned int nHeightEnd;
 };
 
+/** Proposals by the span of heights they are voted on. They are sorted by
+ * start height and searched as a balanced tree in which each node knows the
+ * latest end height below it, so finding the proposals that overlap a span
+ * never looks at the ones that end before it or start after it. Rebuilt
+ * whenever a proposal comes or goes, which is rare next to the lookups
+ * made for every block.
+ */
+class CProposalIntervalTree
+{
+private:
+    std::vector<CProposalMetaData> vProposals; // by nHeightStart
+    std::vector<unsigned int> vMaxEnd;         // latest nHeightEnd in the subtree under each
+
+    unsigned int Build(int nBegin, int nEnd);
+    void Find(int nBegin, int nEnd, int nStart, int nEndHeight, std::vector<const CProposalMetaData*>& vFound) const;
+
+public:
+    void Rebuild(const std::map<uint256, CProposalMetaData>& mapProposalData);
+    // proposals voted on at any height from nStart to nEnd
+    std::vector<const CProposalMetaData*> GetOverlapping(int nStart, int nEnd) const;
+};
+
 class CVoteProposalManager
 {
 private:
     std::map<uint256, CProposalMetaData> mapProposalData;
+    CProposalIntervalTree treeProposals;
 public:
     bool Add(const CVoteProposal& proposal);
     void Remove(const uint256& hashProposal);
@@ -2,6 +2,7 @@
 #include "util.h"
 #include "db.h"
 #include "voteobject.h"
+#include "main.h"
 
 #define VOTEMASK 0x0FFFFFFF
 
@@ -21,30 +22,68 @@ string PrintBinary(uint32_t n)
     return result;
 }
 
+CVoteTally CVoteTallyIndex::Next(const CBlockIndex* pindex, const CVoteTally& tallyPrev, CVoteDB& voteDB)
+{
+    CVoteTally tally;
+    if (fTestNet || pindex->nHeight >= (int)VOTING_START)
+        tally = tallyPrev;
+    std::map<uint256, VoteLocation> mapActive = proposalManager.GetActive(pindex->nHeight);
+    tally.SetNewPositions(mapActive, voteDB);
+    tally.ProcessNewVotes(static_cast<uint32_t>(pindex->nVersion));
+    return tally;
+}
+
 CVoteTally::CVoteTally(CVoteTally* tallyPrev)
 {
     this->nHeight = tallyPrev->nHeight + 1;
-    this->mapVotes = tallyPrev->GetVotes();
+    this->pvotes = tallyPrev->pvotes;
+    this->plocations.reset(new LocationMap());
     RemoveStaleSummaries();
 }
 
+//! The summaries, copied first if another tally shares them
+CVoteTally::VoteMap& CVoteTally::WriteVotes()
+{
+    if (!pvotes.unique())
+        pvotes.reset(new VoteMap(*pvotes));
+    return const_cast<VoteMap&>(*pvotes);
+}
+
 void CVoteTally::RemoveStaleSummaries()
 {
-    for (auto it : mapVotes) {
-        //If the vote has ended, then remove it from the new Tally
-        if (it.second.nBlockStart + it.second.nCheckSpan <= this->nHeight) {
-            mapLocations.erase(it.first);
-            mapVotes.erase(it.first);
+    //If the vote has ended, then remove it from the new Tally
+    for (VoteMap::const_iterator it = pvotes->begin(); it != pvotes->end(); ++it) {
+        if (it->second.nBlockStart + it->second.nCheckSpan <= this->nHeight) {
+            VoteMap& mapVotes = WriteVotes();
+            for (VoteMap::iterator mi = mapVotes.begin(); mi != mapVotes.end(); ) {
+                if (mi->second.nBlockStart + mi->second.nCheckSpan <= this->nHeight)
+                    mapVotes.erase(mi++);
+                else
+                    ++mi;
+            }
+            return;
         }
     }
 }
 
-//! Proposal Manager will give a set of new positions if any start this block
-bool CVoteTally::SetNewPositions(std::map<uint256, VoteLocation> &mapNewLocations)
+static bool IsSameLocation(const std::pair<const uint256, VoteLocation>& a, const std::pair<const uint256, VoteLocation>& b)
+{
+    return a.first == b.first && a.second.nMostSignificantBit == b.second.nMostSignificantBit &&
+           a.second.nLeastSignificantBit == b.second.nLeastSignificantBit;
+}
+
+//! Proposal Manager will give a set of new positions if any start this block.
+//! Proposals are read through voteDB, so one written in the same batch is seen.
+bool CVoteTally::SetNewPositions(std::map<uint256, VoteLocation> &mapNewLocations, CVoteDB& voteDB)
 {
-    mapLocations.clear();
+    // usually the same proposals are active as in the block before
+    if (mapNewLocations.size() != plocations->size() ||
+            !std::equal(mapNewLocations.begin(), mapNewLocations.end(), plocations->begin(), IsSameLocation))
+        plocations.reset(new LocationMap(mapNewLocations));
+
     for (auto it : mapNewLocations) {
-        if (mapLocations.count(it.first))
+        // already being counted
+        if (pvotes->count(it.first))
             continue;
 
         uint256 txid = 0;
@@ -52,19 +91,14 @@ bool CVoteTally::SetNewPositions(std::map<uint256, VoteLocation> &mapNewLocation
             return error("%s: could not find transaction ID for proposal %s", __func__, it.first.GetHex().c_str());
 
         CVoteProposal proposal;
-        CVoteDB votedb("r");
-        if (!votedb.ReadProposal(txid, proposal))
+        if (!voteDB.ReadProposal(txid, proposal))
             return error("%s: failed to read proposal from DB for %s", __func__, it.first.GetHex().c_str());
 
-        //Map the proposal to this bit range
-        VoteLocation locationNew = it.second;
-        mapLocations.insert(make_pair(it.first, locationNew));
-
         //Start a new summary object that will track the votes for this proposal
         CVoteSummary summary;
         summary.nBlockStart = proposal.GetStartHeight();
         summary.nCheckSpan = proposal.GetCheckSpan();
-        mapVotes.insert(make_pair(it.first, summary));
+        WriteVotes().insert(make_pair(it.first, summary));
     }
 
     return true;
@@ -73,13 +107,13 @@ bool CVoteTally::SetNewPositions(std::map<uint256, VoteLocation> &mapNewLocation
 //! Record votes that were in the block header
 void CVoteTally::ProcessNewVotes(const uint32_t& nVersion)
 {
-    for (auto it : mapVotes) {
-        if (!mapLocations.count(it.first))
+    for (const auto& it : *plocations) {
+        if (!pvotes->count(it.first))
             continue;
 
         printf("%s processing vote for %s\n", __func__, it.first.GetHex().c_str());
 
-        VoteLocation location = mapLocations.at(it.first);
+        VoteLocation location = it.second;
         int32_t nVote = nVersion;
         nVote &= VOTEMASK; // remove version bits
         nVote >>= location.GetShift(); //shift it over to the starting position
@@ -92,22 +126,96 @@ void CVoteTally::ProcessNewVotes(const uint32_t& nVersion)
 
         //Count the vote if it is yes or no
         if (nVote == 1) {
-            mapVotes.at(it.first).nYesTally++;
+            WriteVotes().at(it.first).nYesTally++;
         } else if (nVote == 2)
-            mapVotes.at(it.first).nNoTally++;
+            WriteVotes().at(it.first).nNoTally++;
         printf("%s: nVote=%d\n", __func__, nVote);
     }
 }
 
 bool CVoteTally::GetSummary(const uint256& hashProposal, CVoteSummary& summary)
 {
-    auto it = mapVotes.find(hashProposal);
-    if (it == mapVotes.end())
+    auto it = pvotes->find(hashProposal);
+    if (it == pvotes->end())
         return false;
 
     summary = it->second;
     return true;
 }
 
+CVoteTallyIndex voteTallyIndex;
 
+void CVoteTallyIndex::Add(const CBlockIndex* pindex, const CVoteTally& tally)
+{
+    if (pindex->nHeight > nHeightBest - TALLY_CACHE_DEPTH)
+        mapTallies[std::make_pair(pindex->nHeight, pindex)] = tally;
+}
 
+bool CVoteTallyIndex::Connect(const CBlockIndex* pindex, CVoteDB& voteDB)
+{
+    if (!pindex->pprev)
+        return true;
+
+    CVoteTally tally = Next(pindex, Get(pindex->pprev, voteDB), voteDB);
+    nHeightBest = pindex->nHeight;
+    Add(pindex, tally);
+
+    // forget the tallies that have dropped far enough below the tip
+    mapTallies.erase(mapTallies.begin(), mapTallies.lower_bound(std::make_pair(nHeightBest - TALLY_CACHE_DEPTH + 1, (const CBlockIndex*)NULL)));
+
+    if ((fTestNet || pindex->nHeight >= (int)VOTING_START) && pindex->nHeight % TALLY_SNAPSHOT_INTERVAL == 0)
+        return voteDB.WriteTally(pindex->GetBlockHash(), tally);
+    return true;
+}
+
+bool CVoteTallyIndex::Find(const CBlockIndex* pindex, CVoteTally& tally) const
+{
+    std::map<std::pair<int, const CBlockIndex*>, CVoteTally>::const_iterator mi = mapTallies.find(std::make_pair(pindex->nHeight, pindex));
+    if (mi == mapTallies.end())
+        return false;
+    tally = mi->second;
+    return true;
+}
+
+CVoteTally CVoteTallyIndex::Get(const CBlockIndex* pindex)
+{
+    CVoteDB voteDB("r");
+    return Get(pindex, voteDB);
+}
+
+CVoteTally CVoteTallyIndex::Get(const CBlockIndex* pindex, CVoteDB& voteDB)
+{
+    std::map<std::pair<int, const CBlockIndex*>, CVoteTally>::iterator mi = mapTallies.find(std::make_pair(pindex->nHeight, pindex));
+    if (mi != mapTallies.end())
+        return mi->second;
+
+    // Walk back to a block whose tally is known, or to before voting, where
+    // a tally starts from nothing
+    std::vector<const CBlockIndex*> vMissing;
+    CVoteTally tally;
+    for (; pindex->pprev; pindex = pindex->pprev)
+    {
+        if (!fTestNet && pindex->nHeight < (int)VOTING_START)
+        {
+            vMissing.push_back(pindex);
+            break;
+        }
+        mi = mapTallies.find(std::make_pair(pindex->nHeight, pindex));
+        if (mi != mapTallies.end())
+        {
+            tally = mi->second;
+            break;
+        }
+        if (pindex->nHeight % TALLY_SNAPSHOT_INTERVAL == 0 && voteDB.ReadTally(pindex->GetBlockHash(), tally))
+            break;
+        vMissing.push_back(pindex);
+    }
+
+    // and bring it forward
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = vMissing.rbegin(); it != vMissing.rend(); ++it)
+    {
+        tally = Next(*it, tally, voteDB);
+        Add(*it, tally);
+    }
+    return tally;
+}
@@ -2,10 +2,16 @@
 #define VOTING_VOTETALLY_H
 
 #include <map>
+#include <boost/shared_ptr.hpp>
 #include "serialize.h"
 #include "uint256.h"
+#include "voteobject.h"
 
-class VoteLocation;
+class CBlockIndex;
+class CVoteDB;
+
+static const int TALLY_SNAPSHOT_INTERVAL = 100; // blocks between tallies written to CVoteDB
+static const int TALLY_CACHE_DEPTH = 500;       // blocks below the tip whose tallies stay in memory
 
 class CVoteSummary
 {
@@ -34,20 +40,29 @@ public:
 
 //typedef std::pair<uint8_t, uint8_t> VoteLocation;  //start bit, end bit
 
+/** Votes counted up to a block. Copies share their maps, and a map is only
+ * copied when a tally about to change it shares it, so consecutive blocks
+ * cost little more than the summaries that actually changed.
+ */
 class CVoteTally
 {
 private:
+    typedef std::map<uint256, CVoteSummary> VoteMap;
+    typedef std::map<uint256, VoteLocation> LocationMap;
+
     unsigned int nHeight;
-    std::map<uint256, CVoteSummary> mapVotes;
-    std::map<uint256, VoteLocation> mapLocations; //Where each vote is located in the header
+    boost::shared_ptr<const VoteMap> pvotes;
+    boost::shared_ptr<const LocationMap> plocations; //Where each vote is located in the header
+
+    VoteMap& WriteVotes();
     void RemoveStaleSummaries();
     bool IsLocationOccupied(const VoteLocation& location);
 public:
     void SetNull()
     {
         nHeight = 0;
-        mapVotes.clear();
-        mapLocations.clear();
+        pvotes.reset(new VoteMap());
+        plocations.reset(new LocationMap());
     }
 
     CVoteTally()
@@ -55,19 +70,84 @@ public:
         SetNull();
     }
 
+    bool IsNull() const
+    {
+        return nHeight == 0 && pvotes->empty() && plocations->empty();
+    }
+
     explicit CVoteTally(CVoteTally* tallyPrev);
-    bool SetNewPositions(std::map<uint256, VoteLocation>& mapNewLocations);
+    bool SetNewPositions(std::map<uint256, VoteLocation>& mapNewLocations, CVoteDB& voteDB);
     void ProcessNewVotes(const uint32_t& nVersion);
     bool GetSummary(const uint256& hashProposal, CVoteSummary& summary);
-    std::map<uint256, CVoteSummary> GetVotes() { return mapVotes; }
+    std::map<uint256, CVoteSummary> GetVotes() { return *pvotes; }
+
+    // whether this tally and tally share their summaries
+    bool SharesVotes(const CVoteTally& tally) const { return pvotes == tally.pvotes; }
 
     IMPLEMENT_SERIALIZE
     (
         READWRITE(nHeight);
-        READWRITE(mapVotes);
-        READWRITE(mapLocations);
+        if (fRead)
+        {
+            VoteMap mapVotes;
+            LocationMap mapLocations;
+            READWRITE(mapVotes);
+            READWRITE(mapLocations);
+            CVoteTally* pthis = const_cast<CVoteTally*>(this);
+            pthis->pvotes.reset(new VoteMap(mapVotes));
+            pthis->plocations.reset(new LocationMap(mapLocations));
+        }
+        else
+        {
+            // never read into, as they may be shared
+            READWRITE(const_cast<VoteMap&>(*pvotes));
+            READWRITE(const_cast<LocationMap&>(*plocations));
+        }
     )
 };
 
-#endif //VOTING_VOTETALLY_H
+/** Vote tallies by block. Those of the blocks near the tip are kept in
+ * memory, sharing what did not change with their parent's; every
+ * TALLY_SNAPSHOT_INTERVAL blocks one is written to CVoteDB as well, so the
+ * tally of an older block, or of any block after a restart, is brought
+ * forward from the snapshot before it instead of from the start of voting.
+ *
+ * Callers hold cs_main.
+ */
+class CVoteTallyIndex
+{
+private:
+    // by height first so that the old ones can be dropped in one go
+    std::map<std::pair<int, const CBlockIndex*>, CVoteTally> mapTallies;
+    int nHeightBest;
+
+    void Add(const CBlockIndex* pindex, const CVoteTally& tally);
+    // pindex's tally from its parent's, reading new proposals through voteDB
+    static CVoteTally Next(const CBlockIndex* pindex, const CVoteTally& tallyPrev, CVoteDB& voteDB);
+    CVoteTally Get(const CBlockIndex* pindex, CVoteDB& voteDB);
 
+public:
+    CVoteTallyIndex() : nHeightBest(0) {}
+
+    // Work out the tally of a block being connected, writing it to voteDB
+    // if it is due a snapshot
+    bool Connect(const CBlockIndex* pindex, CVoteDB& voteDB);
+    CVoteTally Get(const CBlockIndex* pindex);
+    // pindex's tally if it is in memory, without working it out otherwise
+    bool Find(const CBlockIndex* pindex, CVoteTally& tally) const;
+
+    void clear()
+    {
+        mapTallies.clear();
+        nHeightBest = 0;
+    }
+
+    unsigned int size() const
+    {
+        return mapTallies.size();
+    }
+};
+
+extern CVoteTallyIndex voteTallyIndex;
+
+#endif //VOTING_VOTETALLY_H
@@ -351,6 +351,8 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                 else if (!wtx.IsSpent(txin.prevout.n) && IsMine(wtx.vout[txin.prevout.n]))
                 {
                     printf("WalletUpdateSpent found spent coin %s HYP %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                    mapStakeKernelCache.erase(txin.prevout);
+                    stakeCoinIndex.Remove(txin.prevout);
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
@@ -454,6 +456,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
 
+        if (fInsertedNew || fUpdated)
+            UpdateStakeCoinIndex(wtx);
+
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -526,6 +531,10 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            for (unsigned int i = 0; i < (*mi).second.vout.size(); i++)
+                stakeCoinIndex.Remove(COutPoint(hash, i));
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1299,10 +1308,100 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
     return true;
 }
 
-bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins, int64 nTargetAmount) const
+void CStakeCoinIndex::Add(const COutPoint& outpoint, int64 nMatureTime)
+{
+    Remove(outpoint);
+    if (nMatureTime <= nWheelTime)
+    {
+        setStakeable.insert(outpoint);
+        return;
+    }
+    mapPending[outpoint] = nMatureTime;
+    vWheel[nMatureTime % WHEEL_SLOTS].push_back(make_pair(nMatureTime, outpoint));
+}
+
+void CStakeCoinIndex::Remove(const COutPoint& outpoint)
+{
+    // the wheel entry is left behind and skipped when its slot comes round
+    setStakeable.erase(outpoint);
+    mapPending.erase(outpoint);
+}
+
+void CStakeCoinIndex::Advance(int64 nTime)
+{
+    if (nTime <= nWheelTime)
+        return;
+
+    // visit every slot passed since the last advance, each slot once at most
+    int64 nFirst = max(nWheelTime + 1, nTime - (int64)WHEEL_SLOTS + 1);
+    for (int64 nSlotTime = nFirst; nSlotTime <= nTime; nSlotTime++)
+    {
+        vector<pair<int64, COutPoint> >& vSlot = vWheel[nSlotTime % WHEEL_SLOTS];
+        unsigned int nKept = 0;
+        for (unsigned int i = 0; i < vSlot.size(); i++)
+        {
+            map<COutPoint, int64>::iterator mi = mapPending.find(vSlot[i].second);
+            if (mi == mapPending.end() || mi->second != vSlot[i].first)
+                continue; // removed or re-added since
+            if (vSlot[i].first > nTime)
+            {
+                vSlot[nKept++] = vSlot[i]; // matures on a later turn of the wheel
+                continue;
+            }
+            setStakeable.insert(vSlot[i].second);
+            mapPending.erase(mi);
+        }
+        vSlot.resize(nKept);
+    }
+    nWheelTime = nTime;
+}
+
+void CStakeCoinIndex::clear()
+{
+    setStakeable.clear();
+    mapPending.clear();
+    for (unsigned int i = 0; i < vWheel.size(); i++)
+        vWheel[i].clear();
+    nWheelTime = 0;
+}
+
+void CWallet::LoadStakeCoinIndex()
+{
+    stakeCoinIndex.clear();
+    fStakeCoinIndexLoaded = true;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateStakeCoinIndex((*it).second);
+}
+
+// Re-file the outputs of wtx after it was added, changed or spent from
+void CWallet::UpdateStakeCoinIndex(const CWalletTx& wtx)
+{
+    if (!fStakeCoinIndexLoaded)
+        return;
+
+    int64 nMatureTime = wtx.GetTxTime() + (fTestNet ? nStakeMinAge : nStakeMinAgeV2) + 1;
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]) && wtx.vout[i].nValue > 0)
+            stakeCoinIndex.Add(COutPoint(hash, i), nMatureTime);
+        else
+            stakeCoinIndex.Remove(COutPoint(hash, i));
+    }
+}
+
+// The checks of AvailableCoins that depend on the chain rather than the wallet
+bool CWallet::IsStakeableCoin(const CWalletTx* pcoin, unsigned int nOut) const
+{
+    if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
+        return false;
+    if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+    return nOut < pcoin->vout.size() && !pcoin->IsSpent(nOut) && IsMine(pcoin->vout[nOut]) && pcoin->vout[nOut].nValue > 0;
+}
+
+bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins, int64 nTargetAmount)
 {
-	vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
 	int64 nAmountSelected = 0;
 
     bool fStakeFromAddress = false;
@@ -1312,24 +1411,31 @@ bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*,unsigned int>
         addressStake = CBitcoinAddress(mapArgs.at("-stakeaddress"));
         fStakeFromAddress = addressStake.IsValid();
     }
-	
-	BOOST_FOREACH(const COutput& out, vCoins)
+
+    LOCK(cs_wallet);
+    if (!fStakeCoinIndexLoaded)
+        LoadStakeCoinIndex();
+    stakeCoinIndex.Advance(GetTime());
+
+	BOOST_FOREACH(const COutPoint& outpoint, stakeCoinIndex.GetStakeable())
 	{
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end() || !IsStakeableCoin(&(*mi).second, outpoint.n))
+            continue;
+        const CWalletTx* pcoin = &(*mi).second;
+
 		if (fStakeFromAddress) {
             CTxDestination dest;
-            if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, dest))
+            if (!ExtractDestination(pcoin->vout[outpoint.n].scriptPubKey, dest))
                 continue;
             if (CBitcoinAddress(dest).ToString() != addressStake.ToString())
                 continue;
         }
 
-        if (nAmountSelected + out.tx->vout[out.i].nValue < nTargetAmount)
+        if (nAmountSelected + pcoin->vout[outpoint.n].nValue < nTargetAmount)
 		{
-			if(GetTime() - out.tx->GetTxTime() > (fTestNet ? nStakeMinAge : nStakeMinAgeV2))
-			{
-				setCoins.insert(make_pair(out.tx, out.i));
-				nAmountSelected += out.tx->vout[out.i].nValue;
-			}
+			setCoins.insert(make_pair(pcoin, outpoint.n));
+			nAmountSelected += pcoin->vout[outpoint.n].nValue;
 		}
 	}
 
@@ -1349,13 +1455,16 @@ bool CWallet::MintableCoins()
         return error("MintableCoins() : invalid reserve balance amount");
     if (nBalance <= nReserveBalance)
         return false;
-	
-	vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
-	
-	BOOST_FOREACH(const COutput& out, vCoins)
+
+    LOCK(cs_wallet);
+    if (!fStakeCoinIndexLoaded)
+        LoadStakeCoinIndex();
+    stakeCoinIndex.Advance(GetTime());
+
+	BOOST_FOREACH(const COutPoint& outpoint, stakeCoinIndex.GetStakeable())
 	{
-		if(GetTime() - out.tx->GetTxTime() > (fTestNet? nStakeMinAge : nStakeMinAgeV2))
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi != mapWallet.end() && IsStakeableCoin(&(*mi).second, outpoint.n))
 			return true;
 	}	
 	
@@ -1405,6 +1514,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
             nFeeRet = nTransactionFee;
 			if(fSplitBlock)
 				nFeeRet = COIN / 1000;
+            wtxNew.InvalidateHash();
             while (true)
             {
                 wtxNew.vin.clear();
@@ -1662,6 +1772,47 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint
     return true;
 }
 
+// Look up the kernel inputs of a stakeable output, reading them from disk
+// and resolving the stake modifier only on a cache miss
+bool CWallet::GetStakeKernelContext(const CWalletTx* pcoin, unsigned int nOut, CStakeKernelContext& context)
+{
+    COutPoint prevout(pcoin->GetHash(), nOut);
+    {
+        LOCK(cs_wallet);
+        map<COutPoint, CStakeKernelContext>::const_iterator mi = mapStakeKernelCache.find(prevout);
+        if (mi != mapStakeKernelCache.end())
+        {
+            context = mi->second;
+            return true;
+        }
+    }
+
+    LOCK2(cs_main, cs_wallet);
+    CTxDB txdb("r");
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(prevout.hash, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    // The modifier cannot be resolved until a selection interval has passed
+    // since the coin's block; leave the coin uncached and retry next round
+    if (!::GetStakeKernelContext(block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin, prevout, context))
+        return false;
+
+    mapStakeKernelCache[prevout] = context;
+    return true;
+}
+
+void CWallet::ClearStakeKernelCache()
+{
+    LOCK(cs_wallet);
+    mapStakeKernelCache.clear();
+}
+
 // ppcoin: create coin stake transaction
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64 nSearchInterval, CTransaction& txNew)
 {
@@ -1676,6 +1827,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 	if(pIndex0->pprev)
 		nCombineThreshold = GetProofOfWorkReward(pIndex0->nHeight, MIN_TX_FEE, pIndex0->pprev->GetBlockHash()) / 3;
 
+    txNew.InvalidateHash();
     txNew.vin.clear();
     txNew.vout.clear();
 
@@ -1692,131 +1844,122 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance <= nReserveBalance)
         return false;
 
-    // presstab HyperStake - Initialize as static and don't update the set on every run of CreateCoinStake() in order to lighten resource use
-	static std::set<pair<const CWalletTx*,unsigned int> > setStakeCoins;
-	static int64 nLastStakeSetUpdate = 0;
-
-    if(GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime)
-	{
-		setStakeCoins.clear();
-		if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
-			return false;
-		nLastStakeSetUpdate = GetTime();
-	}
+    // the stake coin index is kept current, so selecting from it each time is cheap
+	std::set<pair<const CWalletTx*,unsigned int> > setStakeCoins;
+	if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
+		return false;
 
     //update mintable outputs count
     nMintableOutputs = setStakeCoins.size();
 	if (setStakeCoins.empty())
         return false;
 
-    bnStakeWeightCached = 0;
 	vector<const CWalletTx*> vwtxPrev;
 	
     int64 nCredit = 0;
     CScript scriptPubKeyKernel;
-	CTxDB txdb("r");
+
+    // Block time, tx offset and stake modifier come from the kernel cache,
+    // so only coins seen for the first time touch the disk
+    vector<pair<const CWalletTx*, unsigned int> > vSearchCoins;
+    CStakeKernelSearch search(nBits, txNew.nTime, nHashDrift);
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins)
     {
-        CTxIndex txindex;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-				continue;
-		}
-
-        // Read block header
-        CBlock block;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-				continue;
-		}
+        CStakeKernelContext kernelContext;
+        if (!GetStakeKernelContext(pcoin.first, pcoin.second, kernelContext))
+            continue;
+        vSearchCoins.push_back(pcoin);
+        search.Add(COutPoint(pcoin.first->GetHash(), pcoin.second), kernelContext);
+    }
 
-        bool fKernelFound = false;
-        uint256 hashProofOfStake = 0;
-		COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-		unsigned int txNewTime = txNew.nTime;
+    // Search for a kernel with the -stakethreads workers
+    bool fKernelFound = search.Run(GetStakeSearchThreads());
+    bnStakeWeightCached = search.bnWeight;
+    if (search.size())
+    {
+        mapHashedBlocks.clear();
+        mapHashedBlocks[nBestHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+    }
+    {
+        LOCK(cs_wallet);
+        if (vStakeThreadHashes.size() != search.vHashes.size())
+            vStakeThreadHashes.assign(search.vHashes.size(), 0);
+        for (unsigned int i = 0; i < search.vHashes.size(); i++)
+            vStakeThreadHashes[i] += search.vHashes[i];
+    }
 
-        CBigNum bnCoinWeight = 0;
-        bool foundKernel = CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNewTime, nHashDrift, false, hashProofOfStake, bnCoinWeight);
-		bnStakeWeightCached += bnCoinWeight;
+    if (fKernelFound && !fShutdown)
+    {
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vSearchCoins[search.nKernel];
+        unsigned int txNewTime = search.nTimeKernel;
+		if (fDebug && GetBoolArg("-printcoinstake"))
+			printf("CreateCoinStake : kernel found\n");
 
-        if (foundKernel)
+		vector<valtype> vSolutions;
+		txnouttype whichType;
+		CScript scriptPubKeyOut;
+		scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+		if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
 		{
 			if (fDebug && GetBoolArg("-printcoinstake"))
-				printf("CreateCoinStake : kernel found\n");
+				printf("CreateCoinStake : failed to parse kernel\n");
+			return false;
+		}
 
-			vector<valtype> vSolutions;
-			txnouttype whichType;
-			CScript scriptPubKeyOut;
-			scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-			if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-			{
-				if (fDebug && GetBoolArg("-printcoinstake"))
-					printf("CreateCoinStake : failed to parse kernel\n");
-				break;
-			}
+        if (fDebug && GetBoolArg("-printcoinstake"))
+			printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
 
-            if (fDebug && GetBoolArg("-printcoinstake"))
-				printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+		if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+		{
+			if (fDebug && GetBoolArg("-printcoinstake"))
+				printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+			return false;  // only support pay to public key and pay to address
+		}
 
-			if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-			{
+		if (whichType == TX_PUBKEYHASH) // pay to address type
+		{
+			// convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
 				if (fDebug && GetBoolArg("-printcoinstake"))
-					printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-				break;  // only support pay to public key and pay to address
-			}
-
-			if (whichType == TX_PUBKEYHASH) // pay to address type
-			{
-				// convert to pay to public key type
-                CKey key;
-                if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                {
-					if (fDebug && GetBoolArg("-printcoinstake"))
-						printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-					break;  // unable to find corresponding public key
-				}
-				scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+					printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+				return false;  // unable to find corresponding public key
 			}
-			else
-				scriptPubKeyOut = scriptPubKeyKernel;
-			
-            txNew.nTime = txNewTime; 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-			nCredit += pcoin.first->vout[pcoin.second].nValue;
-			vwtxPrev.push_back(pcoin.first);
-			txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+			scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+		}
+		else
+			scriptPubKeyOut = scriptPubKeyKernel;
+		
+        txNew.nTime = txNewTime; 
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+		nCredit += pcoin.first->vout[pcoin.second].nValue;
+		vwtxPrev.push_back(pcoin.first);
+		txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+		
+		//presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
+		uint64 nCoinAge;
+		CTxDB txdb("r");
+		const CBlockIndex* pIndex0 = GetLastBlockIndex(pindexBest, false);
+		if (!txNew.GetCoinAge(txdb, nCoinAge))
+			return error("CreateCoinStake : failed to calculate coin age");
+		uint64 nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetProofOfStakeReward(nCoinAge, nBits, txNew.nTime, pIndex0->nHeight);
 			
-			//presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
-			uint64 nCoinAge;
-			CTxDB txdb("r");
-			const CBlockIndex* pIndex0 = GetLastBlockIndex(pindexBest, false);
-			if (!txNew.GetCoinAge(txdb, nCoinAge))
-				return error("CreateCoinStake : failed to calculate coin age");
-			uint64 nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetProofOfStakeReward(nCoinAge, nBits, txNew.nTime, pIndex0->nHeight);
-				
-			//presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
-			if(fMultiSend && fMultiSendCoinStake)
+		//presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
+		if(fMultiSend && fMultiSendCoinStake)
+		{
+			for(unsigned int i = 0; i < vMultiSend.size(); i++)
 			{
-				for(unsigned int i = 0; i < vMultiSend.size(); i++)
-				{
-					CScript scriptPubKeyMultiSend;
-					scriptPubKeyMultiSend.SetDestination(CBitcoinAddress(vMultiSend[i].first).Get());
-					txNew.vout.push_back(CTxOut(0, scriptPubKeyMultiSend));
-				}
+				CScript scriptPubKeyMultiSend;
+				scriptPubKeyMultiSend.SetDestination(CBitcoinAddress(vMultiSend[i].first).Get());
+				txNew.vout.push_back(CTxOut(0, scriptPubKeyMultiSend));
 			}
-			else if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
-				txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-			
-			if (fDebug && GetBoolArg("-printcoinstake"))
-				printf("CreateCoinStake : added kernel type=%d\n", whichType);
-			fKernelFound = true;
-			break;
 		}
-        if (fKernelFound || fShutdown)
-			break; // if kernel is found stop searching
-            
+		else if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
+			txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+		
+		if (fDebug && GetBoolArg("-printcoinstake"))
+			printf("CreateCoinStake : added kernel type=%d\n", whichType);
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
@@ -1916,7 +2059,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     }
 
     // Successfully generated coinstake
-	nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
     return true;
 }
 
@@ -1933,6 +2075,7 @@ bool CWallet::FinalizeProposal(CTransaction& txProposal)
     //! Select one of the addresses to send the change to, and add inputs to the proposal tx
     CScript scriptChange;
     nValueIn = 0;
+    txProposal.InvalidateHash();
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins) {
         scriptChange = pcoin.first->vout[pcoin.second].scriptPubKey;
         txProposal.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
@@ -1974,6 +2117,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                mapStakeKernelCache.erase(txin.prevout);
+                stakeCoinIndex.Remove(txin.prevout);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -2501,11 +2646,15 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, int&
                 {
                     fUpdated = true;
                     pcoin->MarkSpent(n);
+                    mapStakeKernelCache.erase(COutPoint(hash, n));
                     pcoin->WriteToDisk();
                 }
             }
             if (fUpdated)
+            {
+                UpdateStakeCoinIndex(*pcoin);
                 NotifyTransactionChanged(this, hash, CT_UPDATED);
+            }
         }
 
         if((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetDepthInMainChain() <= 0)
@@ -2538,6 +2687,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateStakeCoinIndex(prev);
             }
         }
     }
@@ -2564,6 +2714,7 @@ bool CWallet::SendProposal(const CVoteProposal& proposal, uint256& txid)
         return error("%s: Insufficient funds", __func__);
 
     //! Fill vin
+    wtx.InvalidateHash();
     for (pair<const CWalletTx*,unsigned int> coin : setCoins)
         wtx.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
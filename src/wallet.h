@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -63,6 +64,45 @@ public:
     )
 };
 
+/** Outputs the wallet can stake with. Outputs younger than the stake min age
+ * wait in a timing wheel, one slot per second, and move into the stakeable
+ * set once the wheel is advanced to the second they mature.
+ */
+class CStakeCoinIndex
+{
+private:
+    static const unsigned int WHEEL_SLOTS = 4096;
+
+    std::set<COutPoint> setStakeable;
+    std::map<COutPoint, int64> mapPending; // second each waiting output matures
+    std::vector<std::vector<std::pair<int64, COutPoint> > > vWheel;
+    int64 nWheelTime; // the wheel has been advanced up to this second
+
+public:
+    CStakeCoinIndex()
+    {
+        vWheel.resize(WHEEL_SLOTS);
+        nWheelTime = 0;
+    }
+
+    // outpoint can stake from nMatureTime on
+    void Add(const COutPoint& outpoint, int64 nMatureTime);
+    void Remove(const COutPoint& outpoint);
+    // move everything that has matured by nTime into the stakeable set
+    void Advance(int64 nTime);
+    void clear();
+
+    const std::set<COutPoint>& GetStakeable() const
+    {
+        return setStakeable;
+    }
+
+    unsigned int GetPendingCount() const
+    {
+        return mapPending.size();
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -70,7 +110,7 @@ class CWallet : public CCryptoKeyStore
 {
 private:
     bool SelectCoins(int64 nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
-	bool SelectStakeCoins(std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64 nTargetAmount) const;
+	bool SelectStakeCoins(std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64 nTargetAmount);
     CWalletDB *pwalletdbEncryption;
 
     // the current wallet version: clients below this version are not able to load the wallet
@@ -82,6 +122,16 @@ private:
     //how many UTXO's are eligible to be staked
     unsigned int nMintableOutputs;
 
+    // kernel inputs of outputs we stake with, dropped when spent or on reorg
+    std::map<COutPoint, CStakeKernelContext> mapStakeKernelCache;
+
+    // outputs we can stake with, kept up to date as transactions come and go
+    CStakeCoinIndex stakeCoinIndex;
+    bool fStakeCoinIndexLoaded;
+    void LoadStakeCoinIndex();
+    void UpdateStakeCoinIndex(const CWalletTx& wtx);
+    bool IsStakeableCoin(const CWalletTx* pcoin, unsigned int nOut) const;
+
 public:
 	bool MintableCoins();
     mutable CCriticalSection cs_wallet;
@@ -93,6 +143,7 @@ public:
     unsigned int nMasterKeyMaxID;
 	bool fWalletUnlockMintOnly;
     CBigNum bnStakeWeightCached;
+    std::vector<uint64> vStakeThreadHashes; // kernel hashes tried by each -stakethreads worker
 
 	//SplitBlock
 	bool fSplitBlock;
@@ -110,7 +161,6 @@ public:
 	unsigned int nHashDrift;
 	unsigned int nHashInterval;
 	uint64 nStakeSplitThreshold;
-	int nStakeSetUpdateTime;
 	bool fCombineDust;
 	
 	// DisableStake
@@ -135,6 +185,7 @@ public:
 		fSplitBlock = false;
         bnStakeWeightCached = 0;
         nMintableOutputs = 0;
+        fStakeCoinIndexLoaded = false;
 		
 		//DisableStake
 		fDisableStake = false;
@@ -147,7 +198,6 @@ public:
 		nHashDrift = 45;
 		nStakeSplitThreshold = 2000;
 		nHashInterval = 22;
-		nStakeSetUpdateTime = 300; // 5 minutes
 		fCombineDust = true;
 		
 		//MultiSend
@@ -172,6 +222,7 @@ public:
 		fSplitBlock = false;
         bnStakeWeightCached = 0;
         nMintableOutputs = 0;
+        fStakeCoinIndexLoaded = false;
 		
 		//DisableStake
 		fDisableStake = false;
@@ -184,7 +235,6 @@ public:
 		nHashDrift = 45;
 		nStakeSplitThreshold = 10000;
 		nHashInterval = 22;
-		nStakeSetUpdateTime = 300; // 5 minutes
 		fCombineDust = true;
 		
 		//MultiSend
@@ -268,6 +318,8 @@ public:
     bool FinalizeProposal(CTransaction& txProposal);
     bool GetStakeWeight(const CKeyStore& keystore, uint64& nMinWeight, uint64& nMaxWeight, uint64& nWeight, uint64& nAmount);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64 nSearchInterval, CTransaction& txNew);
+    bool GetStakeKernelContext(const CWalletTx* pcoin, unsigned int nOut, CStakeKernelContext& context);
+    void ClearStakeKernelCache();
 	bool GetStakeWeightFromValue(const int64& nTime, const int64& nValue, uint64& nWeight);
     uint64 GetTimeToNextMaturity();
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false, bool fAllowStakeForCharity=false);